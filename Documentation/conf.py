@@ -56,6 +56,7 @@ man_pages = [
     ('btrfs-select-super', 'btrfs-select-super', 'overwrite primary superblock with a backup copy', '', 8),
     ('btrfstune', 'btrfstune', 'tune various filesystem parameters', '', 8),
     ('fsck.btrfs', 'fsck.btrfs', 'do nothing, successfully', '', 8),
+    ('btrfs-send-stream', 'btrfs-send-stream', 'work with send streams stored in files', '', 8),
     ('btrfs-send', 'btrfs-send', 'generate a stream of changes between two subvolume snapshots', '', 8),
     ('btrfs-scrub', 'btrfs-scrub', 'scrub btrfs filesystem, verify block checksums', '', 8),
     ('btrfs-restore', 'btrfs-restore', 'try to restore files from a damaged filesystem image', '', 8),
@@ -22,6 +22,8 @@
 #include <getopt.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/ctree.h"
@@ -29,9 +31,11 @@
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/tree-checker.h"
+#include "crypto/hash.h"
 #include "common/box.h"
 #include "common/extent-cache.h"
 #include "common/help.h"
+#include "common/internal.h"
 #include "common/messages.h"
 #include "common/string-utils.h"
 #include "cmds/commands.h"
@@ -79,7 +83,42 @@ struct btrfs_find_root_filter {
 int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
 			   struct btrfs_find_root_filter *filter,
 			   struct cache_tree *result,
-			   struct cache_extent **match);
+			   struct cache_extent **match, int nr_threads);
+
+/* Metadata block groups are read in windows of this size */
+#define FIND_ROOT_WINDOW_SIZE		(SZ_8M)
+
+/*
+ * One window of a metadata block group, scanned by one of the threads.
+ *
+ * The threads only read the raw data and check the tree block headers and
+ * checksums, the blocks passing the checks are read again by
+ * read_tree_block() and added to the result by the main thread, in the order
+ * of the windows.
+ */
+struct find_root_window {
+	u64 start;
+	u64 len;
+	/* Logical addresses of tree blocks passing the header checks */
+	u64 *candidates;
+	u32 nr_candidates;
+	u32 alloced;
+	/* The window could not be read as a whole, check block by block */
+	bool read_failed;
+	bool done;
+};
+
+struct find_root_scan {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct btrfs_fs_info *fs_info;
+	const struct btrfs_find_root_filter *filter;
+	struct find_root_window *windows;
+	u32 nr_windows;
+	u32 next_window;
+	bool verify_csum;
+	bool stop;
+};
 
 static void btrfs_find_root_free(struct cache_tree *result)
 {
@@ -166,26 +205,169 @@ static int add_eb_to_result(struct extent_buffer *eb,
 	return ret;
 }
 
+/* Return value is the same as btrfs_find_root_search(). */
+static int add_block_to_result(struct btrfs_fs_info *fs_info, u64 bytenr,
+			       struct cache_tree *result,
+			       struct btrfs_find_root_filter *filter,
+			       struct cache_extent **match)
+{
+	struct btrfs_tree_parent_check check = { 0 };
+	struct extent_buffer *eb;
+	int ret;
+
+	eb = read_tree_block(fs_info, bytenr, &check);
+	if (!eb || IS_ERR(eb))
+		return 0;
+	ret = add_eb_to_result(eb, result, fs_info->nodesize, filter, match);
+	free_extent_buffer(eb);
+	return ret;
+}
+
+static int add_window_candidate(struct find_root_window *win, u64 bytenr)
+{
+	if (win->nr_candidates == win->alloced) {
+		u32 alloced = max(win->alloced * 2, 4U);
+		u64 *tmp;
+
+		tmp = realloc(win->candidates, alloced * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		win->candidates = tmp;
+		win->alloced = alloced;
+	}
+	win->candidates[win->nr_candidates++] = bytenr;
+	return 0;
+}
+
 /*
- * Return 0 if iterating all the metadata extents.
- * Return 1 if found root with given gen/level and set *match to it.
- * Return <0 if error happens
+ * Check the copy of the block at @bytenr in @block.  Return 1 if it's a tree
+ * block of the searched tree, 0 if it's a block of another tree and -EIO if
+ * its header or checksum is wrong.  Only the cheap header checks done by
+ * add_eb_to_result() are done first, the checksum only for the blocks passing
+ * them.
  */
-int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
+static int check_window_block(const struct find_root_scan *scan,
+			      const char *block, u64 bytenr)
+{
+	struct btrfs_fs_info *fs_info = scan->fs_info;
+	const struct btrfs_find_root_filter *filter = scan->filter;
+	const struct btrfs_header *header = (const struct btrfs_header *)block;
+	u8 result[BTRFS_CSUM_SIZE];
+
+	if (le64_to_cpu(header->bytenr) != bytenr)
+		return -EIO;
+	if (le64_to_cpu(header->owner) != filter->objectid ||
+	    header->level < filter->level ||
+	    le64_to_cpu(header->generation) < filter->generation)
+		return 0;
+	if (scan->verify_csum) {
+		btrfs_csum_data(fs_info->csum_type,
+				(const u8 *)block + BTRFS_CSUM_SIZE, result,
+				fs_info->nodesize - BTRFS_CSUM_SIZE);
+		if (memcmp(result, header->csum, fs_info->csum_size))
+			return -EIO;
+	}
+	return 1;
+}
+
+/*
+ * Read the whole window and record the blocks that look like tree blocks of
+ * the searched tree.  Blocks with a bad header or checksum are read again
+ * from the other mirrors, like read_tree_block() does, into @block_buf.
+ */
+static void scan_one_window(struct find_root_scan *scan,
+			    struct find_root_window *win, char *buf,
+			    char *block_buf)
+{
+	struct btrfs_fs_info *fs_info = scan->fs_info;
+	const u32 nodesize = fs_info->nodesize;
+	int num_copies;
+	u64 cur = 0;
+	int ret;
+
+	while (cur < win->len) {
+		u64 read_len = win->len - cur;
+
+		ret = read_data_from_disk(fs_info, buf + cur, win->start + cur,
+					  &read_len, 0);
+		if (ret < 0 || read_len == 0) {
+			win->read_failed = true;
+			return;
+		}
+		cur += read_len;
+	}
+
+	num_copies = btrfs_num_copies(fs_info, win->start, win->len);
+	for (u64 offset = 0; offset + nodesize <= win->len; offset += nodesize) {
+		const u64 bytenr = win->start + offset;
+
+		ret = check_window_block(scan, buf + offset, bytenr);
+		for (int mirror = 2; ret == -EIO && mirror <= num_copies;
+		     mirror++) {
+			u64 read_len = nodesize;
+
+			ret = read_data_from_disk(fs_info, block_buf, bytenr,
+						  &read_len, mirror);
+			if (ret < 0 || read_len != nodesize) {
+				ret = -EIO;
+				continue;
+			}
+			ret = check_window_block(scan, block_buf, bytenr);
+		}
+		if (ret <= 0)
+			continue;
+		if (add_window_candidate(win, bytenr) < 0) {
+			/* Let the main thread check the window block by block */
+			win->read_failed = true;
+			return;
+		}
+	}
+}
+
+static void *find_root_scan_thread(void *arg)
+{
+	struct find_root_scan *scan = arg;
+	char *buf;
+	char *block_buf;
+
+	buf = malloc(FIND_ROOT_WINDOW_SIZE);
+	block_buf = malloc(scan->fs_info->nodesize);
+	while (1) {
+		struct find_root_window *win;
+
+		pthread_mutex_lock(&scan->lock);
+		if (scan->stop || scan->next_window >= scan->nr_windows) {
+			pthread_mutex_unlock(&scan->lock);
+			break;
+		}
+		win = &scan->windows[scan->next_window++];
+		pthread_mutex_unlock(&scan->lock);
+
+		if (buf && block_buf)
+			scan_one_window(scan, win, buf, block_buf);
+		else
+			win->read_failed = true;
+
+		pthread_mutex_lock(&scan->lock);
+		win->done = true;
+		pthread_cond_broadcast(&scan->cond);
+		pthread_mutex_unlock(&scan->lock);
+	}
+	free(block_buf);
+	free(buf);
+	return NULL;
+}
+
+/* Split all metadata (or system) block groups into windows */
+static int collect_windows(struct btrfs_fs_info *fs_info,
 			   struct btrfs_find_root_filter *filter,
-			   struct cache_tree *result,
-			   struct cache_extent **match)
+			   struct find_root_scan *scan)
 {
-	struct extent_buffer *eb;
 	u64 chunk_offset = 0;
 	u64 chunk_size = 0;
-	u64 offset = 0;
-	u32 nodesize = btrfs_super_nodesize(fs_info->super_copy);
-	int suppress_errors = 0;
-	int ret = 0;
+	u32 alloced = 0;
+	int ret;
 
-	suppress_errors = fs_info->suppress_check_block_errors;
-	fs_info->suppress_check_block_errors = 1;
 	while (1) {
 		if (filter->objectid != BTRFS_CHUNK_TREE_OBJECTID)
 			ret = btrfs_next_bg_metadata(fs_info,
@@ -200,22 +382,122 @@ int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
 				ret = 0;
 			break;
 		}
-		for (offset = chunk_offset;
+		for (u64 offset = chunk_offset;
 		     offset < chunk_offset + chunk_size;
-		     offset += nodesize) {
-			struct btrfs_tree_parent_check check = { 0 };
+		     offset += FIND_ROOT_WINDOW_SIZE) {
+			struct find_root_window *win;
 
-			eb = read_tree_block(fs_info, offset, &check);
-			if (!eb || IS_ERR(eb))
-				continue;
-			ret = add_eb_to_result(eb, result, nodesize, filter,
-					       match);
-			free_extent_buffer(eb);
+			if (scan->nr_windows == alloced) {
+				alloced = max(alloced * 2, 64U);
+				win = realloc(scan->windows,
+					      alloced * sizeof(*win));
+				if (!win)
+					return -ENOMEM;
+				scan->windows = win;
+			}
+			win = &scan->windows[scan->nr_windows++];
+			memset(win, 0, sizeof(*win));
+			win->start = offset;
+			win->len = min_t(u64, FIND_ROOT_WINDOW_SIZE,
+					 chunk_offset + chunk_size - offset);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Return 0 if iterating all the metadata extents.
+ * Return 1 if found root with given gen/level and set *match to it.
+ * Return <0 if error happens
+ *
+ * The metadata is read in large windows by @nr_threads threads, the results
+ * are merged in the order of the logical addresses, the same as a scan
+ * of one block after another.
+ */
+int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
+			   struct btrfs_find_root_filter *filter,
+			   struct cache_tree *result,
+			   struct cache_extent **match, int nr_threads)
+{
+	struct find_root_scan scan = { 0 };
+	pthread_t *threads = NULL;
+	u32 nodesize = btrfs_super_nodesize(fs_info->super_copy);
+	int nr_started = 0;
+	int suppress_errors = 0;
+	int ret = 0;
+
+	suppress_errors = fs_info->suppress_check_block_errors;
+	fs_info->suppress_check_block_errors = 1;
+
+	scan.fs_info = fs_info;
+	scan.filter = filter;
+	/* The checksums are verified again by read_tree_block() anyway */
+	scan.verify_csum = CRYPTO_HASH_THREAD_SAFE ||
+			   fs_info->csum_type == BTRFS_CSUM_TYPE_CRC32 ||
+			   fs_info->csum_type == BTRFS_CSUM_TYPE_XXHASH;
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+
+	ret = collect_windows(fs_info, filter, &scan);
+	if (ret < 0)
+		goto out;
+
+	nr_threads = max(nr_threads, 1);
+	nr_threads = min_t(u32, nr_threads, scan.nr_windows);
+	threads = calloc(nr_threads + 1, sizeof(*threads));
+	if (!threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, find_root_scan_thread, &scan))
+			break;
+		nr_started++;
+	}
+
+	for (u32 i = 0; i < scan.nr_windows; i++) {
+		struct find_root_window *win = &scan.windows[i];
+
+		/* Without any thread, scan everything block by block */
+		if (nr_started == 0) {
+			win->read_failed = true;
+		} else {
+			pthread_mutex_lock(&scan.lock);
+			while (!win->done)
+				pthread_cond_wait(&scan.cond, &scan.lock);
+			pthread_mutex_unlock(&scan.lock);
+		}
+
+		if (win->read_failed) {
+			for (u64 offset = win->start;
+			     offset < win->start + win->len;
+			     offset += nodesize) {
+				ret = add_block_to_result(fs_info, offset,
+							  result, filter, match);
+				if (ret)
+					goto out;
+			}
+			continue;
+		}
+		for (u32 j = 0; j < win->nr_candidates; j++) {
+			ret = add_block_to_result(fs_info, win->candidates[j],
+						  result, filter, match);
 			if (ret)
 				goto out;
 		}
 	}
 out:
+	pthread_mutex_lock(&scan.lock);
+	scan.stop = true;
+	pthread_mutex_unlock(&scan.lock);
+	for (int i = 0; i < nr_started; i++)
+		pthread_join(threads[i], NULL);
+	for (u32 i = 0; i < scan.nr_windows; i++)
+		free(scan.windows[i].candidates);
+	free(scan.windows);
+	free(threads);
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
 	fs_info->suppress_check_block_errors = suppress_errors;
 	return ret;
 }
@@ -328,6 +610,7 @@ static const char * const btrfs_find_root_usage[] = {
 	OPTLINE("-o OBJECTID", "filter by the tree's object id"),
 	OPTLINE("-l LEVEL", "filter by tree level, (default: 0)"),
 	OPTLINE("-g GENERATION", "filter by tree generation"),
+	OPTLINE("-j JOBS", "number of threads reading the metadata (default: number of CPUs)"),
 	NULL
 };
 
@@ -342,6 +625,7 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 	struct cache_tree result;
 	struct cache_extent *found;
 	struct open_ctree_args oca = { 0 };
+	int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
 	int ret;
 
 	/* Default to search root tree */
@@ -354,7 +638,7 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
 			{ NULL, 0, NULL, 0 }
 		};
-		int c = getopt_long(argc, argv, "al:o:g:", long_options, NULL);
+		int c = getopt_long(argc, argv, "al:o:g:j:", long_options, NULL);
 
 		if (c < 0)
 			break;
@@ -372,6 +656,13 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 		case 'l':
 			filter.level = arg_strtou64(optarg);
 			break;
+		case 'j':
+			nr_threads = arg_strtou64(optarg);
+			if (nr_threads < 1) {
+				error("number of jobs must be at least 1");
+				return 1;
+			}
+			break;
 		case GETOPT_VAL_HELP:
 			usage(&btrfs_find_root_cmd, 0);
 			return 0;
@@ -395,7 +686,8 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 
 	get_root_gen_and_level(filter.objectid, fs_info,
 			       &filter.match_gen, &filter.match_level);
-	ret = btrfs_find_root_search(fs_info, &filter, &result, &found);
+	ret = btrfs_find_root_search(fs_info, &filter, &result, &found,
+				     nr_threads);
 	if (ret < 0) {
 		errno = -ret;
 		error("fail to search the tree root: %m");
@@ -278,7 +278,7 @@ int main(int argc, char **argv)
 
 	cache_tree_init(&root_cache);
 
-	root = open_ctree(dev, 0, 0);
+	root = open_ctree(dev, 0, OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if (!root) {
 		error("open ctree failed");
 		free(output_file);
@@ -408,6 +408,7 @@ static const struct cmd_group btrfs_cmd_group = {
 		&cmd_struct_restore,
 		&cmd_struct_scrub,
 		&cmd_struct_send,
+		&cmd_struct_send_stream,
 		&cmd_struct_subvolume,
 
 		/* Help and version stay last */
@@ -68,6 +68,7 @@
 #include "check/mode-original.h"
 #include "check/mode-lowmem.h"
 #include "check/qgroup-verify.h"
+#include "check/stats.h"
 
 /* Global context variables */
 struct btrfs_fs_info *gfs_info;
@@ -10593,6 +10594,8 @@ static const char * const cmd_check_usage[] = {
 	OPTLINE("-Q|--qgroup-report", "print a report on qgroup consistency"),
 	OPTLINE("-E|--subvol-extents <subvolid>", "print subvolume extents and sharing state"),
 	OPTLINE("-p|--progress", "indicate progress"),
+	OPTLINE("--stats-file <file>", "write time and IO statistics of the check phases as JSON to file"),
+	OPTLINE("--stats-interval <seconds>", "also update the statistics file periodically"),
 	"",
 	"Deprecated or moved options:",
 	OPTLINE("--clear-space-cache v1|v2", "clear space cache for v1 or v2 (moved to 'rescue' group)"),
@@ -10619,6 +10622,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	int clear_space_cache = 0;
 	int qgroups_repaired = 0;
 	int qgroup_verify_ret;
+	const char *stats_file = NULL;
+	unsigned int stats_interval = 0;
 	unsigned ctree_flags = OPEN_CTREE_EXCLUSIVE |
 			       OPEN_CTREE_ALLOW_TRANSID_MISMATCH |
 			       OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS;
@@ -10629,7 +10634,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_INIT_EXTENT, GETOPT_VAL_CHECK_CSUM,
 			GETOPT_VAL_READONLY, GETOPT_VAL_CHUNK_TREE,
 			GETOPT_VAL_MODE, GETOPT_VAL_CLEAR_SPACE_CACHE,
-			GETOPT_VAL_FORCE };
+			GETOPT_VAL_FORCE, GETOPT_VAL_STATS_FILE,
+			GETOPT_VAL_STATS_INTERVAL };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, GETOPT_VAL_REPAIR },
@@ -10652,6 +10658,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "clear-space-cache", required_argument, NULL,
 				GETOPT_VAL_CLEAR_SPACE_CACHE},
 			{ "force", no_argument, NULL, GETOPT_VAL_FORCE },
+			{ "stats-file", required_argument, NULL,
+				GETOPT_VAL_STATS_FILE },
+			{ "stats-interval", required_argument, NULL,
+				GETOPT_VAL_STATS_INTERVAL },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -10735,6 +10745,17 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			case GETOPT_VAL_FORCE:
 				force = true;
 				break;
+			case GETOPT_VAL_STATS_FILE:
+				stats_file = optarg;
+				break;
+			case GETOPT_VAL_STATS_INTERVAL:
+				num = arg_strtou64(optarg);
+				if (num == 0 || num > UINT_MAX) {
+					error("invalid statistics interval: %s", optarg);
+					exit(1);
+				}
+				stats_interval = num;
+				break;
 			case '?':
 			case 'h':
 				usage_unknown_option(cmd, argv);
@@ -10744,6 +10765,20 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	if (check_argc_exact(argc - optind, 1))
 		return 1;
 
+	if (stats_interval && !stats_file) {
+		error("--stats-interval requires --stats-file");
+		exit(1);
+	}
+	if (stats_file) {
+		ret = check_stats_init(stats_file, stats_interval,
+				       &g_task_ctx.item_count);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to start statistics collection: %m");
+			exit(1);
+		}
+	}
+
 	if (g_task_ctx.progress_enabled) {
 		g_task_ctx.tp = TASK_NOTHING;
 		g_task_ctx.info = task_init(print_status_check, print_status_return, &g_task_ctx);
@@ -10815,6 +10850,7 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	oca.root_tree_bytenr = tree_root_bytenr;
 	oca.chunk_tree_bytenr = chunk_root_bytenr;
 	oca.flags = ctree_flags;
+	check_stats_start(CHECK_PHASE_OPEN);
 	gfs_info = open_ctree_fs_info(&oca);
 	if (!gfs_info) {
 		error("cannot open file system");
@@ -10822,6 +10858,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		err |= !!ret;
 		goto err_out;
 	}
+	check_stats_set_fs_info(gfs_info);
+	check_stats_end(CHECK_PHASE_OPEN);
 
 	root = gfs_info->fs_root;
 	uuid_unparse(gfs_info->super_copy->fsid, uuidbuf);
@@ -10947,7 +10985,9 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 
 	if (gfs_info->log_root_tree) {
 		fprintf(stderr, "[1/8] checking log\n");
+		check_stats_start(CHECK_PHASE_LOG);
 		ret = check_log(&root_cache);
+		check_stats_end(CHECK_PHASE_LOG);
 
 		if (ret)
 			error("errors found in log");
@@ -10965,8 +11005,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			task_start(g_task_ctx.info, &g_task_ctx.start_time,
 				   &g_task_ctx.item_count);
 		}
+		check_stats_start(CHECK_PHASE_ROOT_ITEMS);
 		ret = repair_root_items();
 		task_stop(g_task_ctx.info);
+		check_stats_end(CHECK_PHASE_ROOT_ITEMS);
 		if (ret < 0) {
 			err = !!ret;
 			errno = -ret;
@@ -11003,8 +11045,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		g_task_ctx.tp = TASK_EXTENTS;
 		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
 	}
+	check_stats_start(CHECK_PHASE_EXTENTS);
 	ret = do_check_chunks_and_extents();
 	task_stop(g_task_ctx.info);
+	check_stats_end(CHECK_PHASE_EXTENTS);
 	err |= !!ret;
 	if (ret)
 		error("errors found in extent allocation tree or chunk allocation");
@@ -11024,8 +11068,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
 	}
 
+	check_stats_start(CHECK_PHASE_FREE_SPACE);
 	ret = validate_free_space_cache(root, &g_task_ctx);
 	task_stop(g_task_ctx.info);
+	check_stats_end(CHECK_PHASE_FREE_SPACE);
 	err |= !!ret;
 
 	/*
@@ -11042,8 +11088,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
 	}
 
+	check_stats_start(CHECK_PHASE_FS_ROOTS);
 	ret = do_check_fs_roots(&root_cache);
 	task_stop(g_task_ctx.info);
+	check_stats_end(CHECK_PHASE_FS_ROOTS);
 	if (found_free_ino_cache)
 		pr_verbose(LOG_DEFAULT,
 			   "deprecated inode cache can be removed by 'btrfs rescue clear-ino-cache'\n");
@@ -11064,8 +11112,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
 	}
 
+	check_stats_start(CHECK_PHASE_CSUMS);
 	ret = check_csums();
 	task_stop(g_task_ctx.info);
+	check_stats_end(CHECK_PHASE_CSUMS);
 	/*
 	 * Data csum error is not fatal, and it may indicate more serious
 	 * corruption, continue checking.
@@ -11083,8 +11133,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
 		}
 
+		check_stats_start(CHECK_PHASE_ROOT_REFS);
 		ret = check_root_refs(root, &root_cache);
 		task_stop(g_task_ctx.info);
+		check_stats_end(CHECK_PHASE_ROOT_REFS);
 		err |= !!ret;
 		if (ret) {
 			error("errors found in root refs");
@@ -11129,8 +11181,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			g_task_ctx.tp = TASK_QGROUPS;
 			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
 		}
+		check_stats_start(CHECK_PHASE_QGROUPS);
 		qgroup_verify_ret = qgroup_verify_all(gfs_info);
 		task_stop(g_task_ctx.info);
+		check_stats_end(CHECK_PHASE_QGROUPS);
 		if (qgroup_verify_ret < 0) {
 			error("failed to check quota groups");
 			err |= !!qgroup_verify_ret;
@@ -11172,8 +11226,10 @@ out:
 	free_qgroup_counts();
 	free_root_recs_tree(&root_cache);
 close_out:
+	check_stats_finish();
 	close_ctree(root);
 err_out:
+	check_stats_finish();
 	if (g_task_ctx.progress_enabled)
 		task_deinit(g_task_ctx.info);
 
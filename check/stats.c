@@ -0,0 +1,414 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Performance statistics of btrfs check
+ *
+ * The time, CPU time and IO of each phase are written as a JSON document to a
+ * file at the end of the check, and optionally at a given interval while the
+ * check is running. The file is replaced atomically so it always contains a
+ * complete document.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "kernel-lib/list.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/volumes.h"
+#include "common/messages.h"
+#include "common/utils.h"
+#include "check/stats.h"
+
+#define NSEC_PER_SEC	(1000000000ULL)
+
+enum phase_state {
+	PHASE_NOT_RUN,
+	PHASE_RUNNING,
+	PHASE_DONE,
+};
+
+/* Counters, either absolute or accumulated for a phase */
+struct stats_counters {
+	u64 wall_ns;
+	u64 cpu_ns;
+	u64 tree_block_reads;
+	u64 tree_block_cache_hits;
+	u64 bytes_read;
+	u64 items;
+};
+
+struct phase_stats {
+	enum phase_state state;
+	/* Counters at the start of the phase */
+	struct stats_counters start;
+	/* Accumulated counters of finished runs of the phase */
+	struct stats_counters total;
+};
+
+static const char * const phase_names[CHECK_PHASE_NR] = {
+	[CHECK_PHASE_OPEN]		= "open",
+	[CHECK_PHASE_LOG]		= "log",
+	[CHECK_PHASE_ROOT_ITEMS]	= "root-items",
+	[CHECK_PHASE_EXTENTS]		= "extents",
+	[CHECK_PHASE_FREE_SPACE]	= "free-space",
+	[CHECK_PHASE_FS_ROOTS]		= "fs-roots",
+	[CHECK_PHASE_CSUMS]		= "csums",
+	[CHECK_PHASE_ROOT_REFS]		= "root-refs",
+	[CHECK_PHASE_QGROUPS]		= "qgroups",
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool thread_running;
+	bool stop;
+	char *filename;
+	char *tmpname;
+	unsigned int interval;
+	const u64 *item_count;
+	struct btrfs_fs_info *fs_info;
+	struct stats_counters start;
+	struct phase_stats phases[CHECK_PHASE_NR];
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static u64 timeval_to_ns(const struct timeval *tv)
+{
+	return (u64)tv->tv_sec * NSEC_PER_SEC + (u64)tv->tv_usec * 1000;
+}
+
+static u64 bytes_read(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	u64 total = 0;
+
+	if (!fs_info)
+		return 0;
+	for (fs_devices = fs_info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed) {
+		list_for_each_entry(device, &fs_devices->devices, dev_list)
+			total += device->bytes_read;
+	}
+	return total;
+}
+
+static void read_counters(struct stats_counters *c)
+{
+	struct rusage usage = { 0 };
+
+	getrusage(RUSAGE_SELF, &usage);
+	c->wall_ns = get_monotonic_ns();
+	c->cpu_ns = timeval_to_ns(&usage.ru_utime) + timeval_to_ns(&usage.ru_stime);
+	c->tree_block_reads = stats.fs_info ? stats.fs_info->tree_block_reads : 0;
+	c->tree_block_cache_hits = stats.fs_info ? stats.fs_info->tree_block_cache_hits : 0;
+	c->bytes_read = bytes_read(stats.fs_info);
+	c->items = stats.item_count ? *stats.item_count : 0;
+}
+
+/* Add @now - @start to @total */
+static void add_counters(struct stats_counters *total,
+			 const struct stats_counters *start,
+			 const struct stats_counters *now)
+{
+	total->wall_ns += now->wall_ns - start->wall_ns;
+	total->cpu_ns += now->cpu_ns - start->cpu_ns;
+	total->tree_block_reads += now->tree_block_reads - start->tree_block_reads;
+	total->tree_block_cache_hits += now->tree_block_cache_hits -
+					start->tree_block_cache_hits;
+	total->bytes_read += now->bytes_read - start->bytes_read;
+	/* The item counter is reset by the progress output, at the start only */
+	if (now->items >= start->items)
+		total->items += now->items - start->items;
+}
+
+static double ns_to_sec(u64 ns)
+{
+	return (double)ns / NSEC_PER_SEC;
+}
+
+static double cache_hit_ratio(const struct stats_counters *c)
+{
+	const u64 lookups = c->tree_block_reads + c->tree_block_cache_hits;
+
+	if (!lookups)
+		return 0.0;
+	return (double)c->tree_block_cache_hits / lookups;
+}
+
+static void print_json_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static void print_counters(FILE *out, const struct stats_counters *c,
+			   const char *indent)
+{
+	fprintf(out, "%s\"wall_sec\": %.3f,\n", indent, ns_to_sec(c->wall_ns));
+	fprintf(out, "%s\"cpu_sec\": %.3f,\n", indent, ns_to_sec(c->cpu_ns));
+	fprintf(out, "%s\"tree_block_reads\": %llu,\n", indent, c->tree_block_reads);
+	fprintf(out, "%s\"tree_block_cache_hits\": %llu,\n", indent,
+		c->tree_block_cache_hits);
+	fprintf(out, "%s\"cache_hit_ratio\": %.4f,\n", indent, cache_hit_ratio(c));
+	fprintf(out, "%s\"bytes_read\": %llu,\n", indent, c->bytes_read);
+	fprintf(out, "%s\"items\": %llu,\n", indent, c->items);
+	fprintf(out, "%s\"items_per_sec\": %.1f", indent,
+		c->wall_ns ? c->items / ns_to_sec(c->wall_ns) : 0.0);
+}
+
+static void print_devices(FILE *out)
+{
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	bool first = true;
+
+	fprintf(out, "  \"devices\": [");
+	for (fs_devices = stats.fs_info ? stats.fs_info->fs_devices : NULL;
+	     fs_devices; fs_devices = fs_devices->seed) {
+		list_for_each_entry(device, &fs_devices->devices, dev_list) {
+			fprintf(out, "%s\n    {\n", first ? "" : ",");
+			fprintf(out, "      \"devid\": %llu,\n", device->devid);
+			fprintf(out, "      \"path\": ");
+			if (device->name)
+				print_json_string(out, device->name);
+			else
+				fprintf(out, "null");
+			fprintf(out, ",\n      \"bytes_read\": %llu,\n",
+				device->bytes_read);
+			fprintf(out, "      \"ios\": %llu\n    }", device->total_ios);
+			first = false;
+		}
+	}
+	fprintf(out, "%s],\n", first ? "" : "\n  ");
+}
+
+/* Must be called with stats.lock held */
+static int write_stats(bool complete)
+{
+	static const char * const state_names[] = {
+		[PHASE_NOT_RUN]	= "not-run",
+		[PHASE_RUNNING]	= "running",
+		[PHASE_DONE]	= "done",
+	};
+	struct stats_counters phases[CHECK_PHASE_NR];
+	struct stats_counters now;
+	struct stats_counters total = { 0 };
+	struct rusage usage = { 0 };
+	FILE *out;
+	int ret;
+
+	read_counters(&now);
+	add_counters(&total, &stats.start, &now);
+	/* The item counter is per phase, the total is the sum */
+	total.items = 0;
+	for (int i = 0; i < CHECK_PHASE_NR; i++) {
+		phases[i] = stats.phases[i].total;
+		/* Include the current run of a running phase */
+		if (stats.phases[i].state == PHASE_RUNNING)
+			add_counters(&phases[i], &stats.phases[i].start, &now);
+		total.items += phases[i].items;
+	}
+	getrusage(RUSAGE_SELF, &usage);
+
+	out = fopen(stats.tmpname, "w");
+	if (!out)
+		return -errno;
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"version\": 1,\n");
+	fprintf(out, "  \"complete\": %s,\n", complete ? "true" : "false");
+	print_counters(out, &total, "  ");
+	fprintf(out, ",\n  \"peak_rss_bytes\": %llu,\n",
+		(unsigned long long)usage.ru_maxrss * 1024);
+	print_devices(out);
+	fprintf(out, "  \"phases\": [\n");
+	for (int i = 0; i < CHECK_PHASE_NR; i++) {
+		fprintf(out, "    {\n");
+		fprintf(out, "      \"name\": \"%s\",\n", phase_names[i]);
+		fprintf(out, "      \"state\": \"%s\",\n",
+			state_names[stats.phases[i].state]);
+		print_counters(out, &phases[i], "      ");
+		fprintf(out, "\n    }%s\n", i < CHECK_PHASE_NR - 1 ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+
+	ret = ferror(out) ? -EIO : 0;
+	if (fclose(out) && !ret)
+		ret = -errno;
+	if (!ret && rename(stats.tmpname, stats.filename) < 0)
+		ret = -errno;
+	if (ret)
+		unlink(stats.tmpname);
+	return ret;
+}
+
+static void *stats_thread(void *arg)
+{
+	struct timespec deadline;
+	int ret;
+
+	pthread_mutex_lock(&stats.lock);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	while (!stats.stop) {
+		deadline.tv_sec += stats.interval;
+		ret = pthread_cond_timedwait(&stats.cond, &stats.lock, &deadline);
+		if (stats.stop)
+			break;
+		if (ret != ETIMEDOUT)
+			continue;
+		ret = write_stats(false);
+		if (ret < 0) {
+			errno = -ret;
+			warning("cannot write check statistics to %s: %m",
+				stats.filename);
+		}
+	}
+	pthread_mutex_unlock(&stats.lock);
+	return NULL;
+}
+
+/*
+ * Start collecting the statistics, to be written to @filename at the end and
+ * every @interval seconds if not zero. The processed items are read from
+ * @item_count.
+ */
+int check_stats_init(const char *filename, unsigned int interval,
+		     const u64 *item_count)
+{
+	int ret;
+
+	stats.filename = strdup(filename);
+	stats.tmpname = malloc(strlen(filename) + strlen(".tmp") + 1);
+	if (!stats.filename || !stats.tmpname) {
+		free(stats.filename);
+		free(stats.tmpname);
+		stats.filename = NULL;
+		stats.tmpname = NULL;
+		return -ENOMEM;
+	}
+	sprintf(stats.tmpname, "%s.tmp", filename);
+	stats.interval = interval;
+	stats.item_count = item_count;
+	read_counters(&stats.start);
+
+	if (interval) {
+		ret = pthread_create(&stats.thread, NULL, stats_thread, NULL);
+		if (ret)
+			return -ret;
+		stats.thread_running = true;
+	}
+	return 0;
+}
+
+/* The IO counters are read from @fs_info from now on */
+void check_stats_set_fs_info(struct btrfs_fs_info *fs_info)
+{
+	if (!stats.filename)
+		return;
+	pthread_mutex_lock(&stats.lock);
+	stats.fs_info = fs_info;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+void check_stats_start(enum check_stats_phase phase)
+{
+	if (!stats.filename)
+		return;
+	pthread_mutex_lock(&stats.lock);
+	read_counters(&stats.phases[phase].start);
+	stats.phases[phase].state = PHASE_RUNNING;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+void check_stats_end(enum check_stats_phase phase)
+{
+	struct stats_counters now;
+
+	if (!stats.filename)
+		return;
+	pthread_mutex_lock(&stats.lock);
+	if (stats.phases[phase].state == PHASE_RUNNING) {
+		read_counters(&now);
+		add_counters(&stats.phases[phase].total,
+			     &stats.phases[phase].start, &now);
+		stats.phases[phase].state = PHASE_DONE;
+	}
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/*
+ * Write the final statistics, must be called before the filesystem is closed.
+ * Calling it again does nothing.
+ */
+void check_stats_finish(void)
+{
+	int ret;
+
+	if (!stats.filename)
+		return;
+
+	if (stats.thread_running) {
+		pthread_mutex_lock(&stats.lock);
+		stats.stop = true;
+		pthread_cond_signal(&stats.cond);
+		pthread_mutex_unlock(&stats.lock);
+		pthread_join(stats.thread, NULL);
+		stats.thread_running = false;
+	}
+
+	pthread_mutex_lock(&stats.lock);
+	for (int i = 0; i < CHECK_PHASE_NR; i++) {
+		if (stats.phases[i].state == PHASE_RUNNING) {
+			struct stats_counters now;
+
+			read_counters(&now);
+			add_counters(&stats.phases[i].total,
+				     &stats.phases[i].start, &now);
+			stats.phases[i].state = PHASE_DONE;
+		}
+	}
+	ret = write_stats(true);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot write check statistics to %s: %m", stats.filename);
+	}
+	stats.fs_info = NULL;
+	pthread_mutex_unlock(&stats.lock);
+	free(stats.filename);
+	free(stats.tmpname);
+	stats.filename = NULL;
+	stats.tmpname = NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_STATS_H__
+#define __BTRFS_CHECK_STATS_H__
+
+#include "kerncompat.h"
+
+struct btrfs_fs_info;
+
+enum check_stats_phase {
+	CHECK_PHASE_OPEN,
+	CHECK_PHASE_LOG,
+	CHECK_PHASE_ROOT_ITEMS,
+	CHECK_PHASE_EXTENTS,
+	CHECK_PHASE_FREE_SPACE,
+	CHECK_PHASE_FS_ROOTS,
+	CHECK_PHASE_CSUMS,
+	CHECK_PHASE_ROOT_REFS,
+	CHECK_PHASE_QGROUPS,
+	CHECK_PHASE_NR,
+};
+
+int check_stats_init(const char *filename, unsigned int interval,
+		     const u64 *item_count);
+void check_stats_set_fs_info(struct btrfs_fs_info *fs_info);
+void check_stats_start(enum check_stats_phase phase);
+void check_stats_end(enum check_stats_phase phase);
+void check_stats_finish(void);
+
+#endif
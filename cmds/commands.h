@@ -145,6 +145,7 @@ DECLARE_COMMAND(inspect_dump_tree);
 DECLARE_COMMAND(inspect_tree_stats);
 DECLARE_COMMAND(property);
 DECLARE_COMMAND(send);
+DECLARE_COMMAND(send_stream);
 DECLARE_COMMAND(receive);
 DECLARE_COMMAND(reflink);
 DECLARE_COMMAND(quota);
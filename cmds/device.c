@@ -153,7 +153,7 @@ static int cmd_device_add(const struct cmd_struct *cmd,
 		res = btrfs_prepare_device(devfd, argv[i], &dev_block_count, 0,
 				PREP_DEVICE_ZERO_END | PREP_DEVICE_VERBOSE |
 				(discard ? PREP_DEVICE_DISCARD : 0) |
-				(zoned ? PREP_DEVICE_ZONED : 0));
+				(zoned ? PREP_DEVICE_ZONED : 0), NULL);
 		close(devfd);
 		if (res) {
 			ret++;
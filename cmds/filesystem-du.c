@@ -34,6 +34,11 @@
 #include "kernel-lib/rbtree_types.h"
 #include "kernel-lib/interval_tree_generic.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "common/internal.h"
 #include "common/utils.h"
 #include "common/open-utils.h"
 #include "common/units.h"
@@ -564,11 +569,449 @@ out:
 	return ret;
 }
 
+/*
+ * Offline mode: the usage is calculated from the EXTENT_DATA items of all
+ * subvolumes of an unmounted filesystem instead of FIEMAP on each file.
+ *
+ * The referenced ranges are collected into a flat array, sorted by the disk
+ * extent and then merged in one pass. A disk extent is shared if it has more
+ * than one owner, i.e. a different subvolume, inode or file offset of the
+ * extent start in the data backref, the same as FIEMAP_EXTENT_SHARED for files
+ * on a mounted filesystem. An extent split into several items of one file
+ * (e.g. by a partial overwrite or a punched hole) has the same owner for all
+ * of them and is not shared. The set shared value is the union of the shared
+ * ranges of a subvolume.
+ */
+struct du_extent_ref {
+	/* Logical address of the disk extent */
+	u64 bytenr;
+	/* Start of the referenced range, bytenr + offset of the file extent */
+	u64 start;
+	u64 len;
+	u64 ino;
+	/* Offset of the data backref, file offset minus extent offset */
+	u64 backref_offset;
+	/* Index to du_offline_ctx::subvols */
+	u32 subvol;
+};
+
+struct du_subvol {
+	u64 rootid;
+	u64 total;
+	u64 shared;
+	u64 set_shared;
+	/* End of the shared ranges counted so far */
+	u64 shared_end;
+};
+
+struct du_offline_ctx {
+	struct du_extent_ref *refs;
+	size_t nr_refs;
+	size_t alloced_refs;
+	struct du_subvol *subvols;
+	u32 nr_subvols;
+};
+
+static int du_add_extent_ref(struct du_offline_ctx *ctx, u64 bytenr, u64 start,
+			     u64 len, u64 ino, u64 backref_offset, u32 subvol)
+{
+	struct du_extent_ref *ref;
+
+	if (ctx->nr_refs == ctx->alloced_refs) {
+		size_t alloced = max_t(size_t, 1024, ctx->alloced_refs * 2);
+		struct du_extent_ref *tmp;
+
+		tmp = realloc(ctx->refs, alloced * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		ctx->refs = tmp;
+		ctx->alloced_refs = alloced;
+	}
+	ref = &ctx->refs[ctx->nr_refs++];
+	ref->bytenr = bytenr;
+	ref->start = start;
+	ref->len = len;
+	ref->ino = ino;
+	ref->backref_offset = backref_offset;
+	ref->subvol = subvol;
+	return 0;
+}
+
+static int du_collect_subvol(struct du_offline_ctx *ctx, struct btrfs_root *root,
+			     u32 subvol)
+{
+	struct btrfs_path tree_path = { 0 };
+	struct btrfs_key key = { 0 };
+	int ret;
+
+	ret = btrfs_search_slot(NULL, root, &key, &tree_path, 0, 0);
+	if (ret < 0)
+		return ret;
+
+	while (1) {
+		struct extent_buffer *leaf = tree_path.nodes[0];
+		struct btrfs_file_extent_item *fi;
+		int slot = tree_path.slots[0];
+		u64 bytenr;
+		u64 extent_offset;
+		u8 type;
+
+		if (slot >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &tree_path);
+			if (ret)
+				break;
+			continue;
+		}
+		tree_path.slots[0]++;
+
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		if (key.type != BTRFS_EXTENT_DATA_KEY)
+			continue;
+
+		/* Inline extents and holes do not take data space */
+		fi = btrfs_item_ptr(leaf, slot, struct btrfs_file_extent_item);
+		type = btrfs_file_extent_type(leaf, fi);
+		if (type == BTRFS_FILE_EXTENT_INLINE)
+			continue;
+		bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+		if (bytenr == 0)
+			continue;
+
+		extent_offset = btrfs_file_extent_offset(leaf, fi);
+		ret = du_add_extent_ref(ctx, bytenr, bytenr + extent_offset,
+				btrfs_file_extent_num_bytes(leaf, fi), key.objectid,
+				key.offset - extent_offset, subvol);
+		if (ret < 0)
+			break;
+	}
+	btrfs_release_path(&tree_path);
+	return ret < 0 ? ret : 0;
+}
+
+static int du_collect_subvols(struct du_offline_ctx *ctx,
+			      struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_root *tree_root = fs_info->tree_root;
+	struct btrfs_path tree_path = { 0 };
+	struct btrfs_key key = {
+		.objectid = BTRFS_FS_TREE_OBJECTID,
+		.type = BTRFS_ROOT_ITEM_KEY,
+		.offset = 0,
+	};
+	int ret;
+
+	ret = btrfs_search_slot(NULL, tree_root, &key, &tree_path, 0, 0);
+	if (ret < 0)
+		return ret;
+
+	while (1) {
+		struct extent_buffer *leaf = tree_path.nodes[0];
+		struct btrfs_root_item *ri;
+		struct du_subvol *tmp;
+		int slot = tree_path.slots[0];
+
+		if (slot >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &tree_path);
+			if (ret)
+				break;
+			continue;
+		}
+		tree_path.slots[0]++;
+
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		if (key.objectid > BTRFS_LAST_FREE_OBJECTID)
+			break;
+		if (key.type != BTRFS_ROOT_ITEM_KEY || !is_fstree(key.objectid))
+			continue;
+
+		/* Deleted subvolumes waiting for cleanup are not accessible */
+		ri = btrfs_item_ptr(leaf, slot, struct btrfs_root_item);
+		if (btrfs_disk_root_refs(leaf, ri) == 0)
+			continue;
+
+		tmp = realloc(ctx->subvols, (ctx->nr_subvols + 1) * sizeof(*tmp));
+		if (!tmp) {
+			ret = -ENOMEM;
+			break;
+		}
+		ctx->subvols = tmp;
+		memset(&ctx->subvols[ctx->nr_subvols], 0, sizeof(*tmp));
+		ctx->subvols[ctx->nr_subvols++].rootid = key.objectid;
+	}
+	btrfs_release_path(&tree_path);
+	if (ret < 0)
+		return ret;
+
+	for (u32 i = 0; i < ctx->nr_subvols; i++) {
+		struct btrfs_root *root;
+
+		key.objectid = ctx->subvols[i].rootid;
+		key.type = BTRFS_ROOT_ITEM_KEY;
+		key.offset = (u64)-1;
+		root = btrfs_read_fs_root(fs_info, &key);
+		if (IS_ERR(root)) {
+			ret = PTR_ERR(root);
+			errno = -ret;
+			error("cannot read subvolume %llu: %m", key.objectid);
+			return ret;
+		}
+		ret = du_collect_subvol(ctx, root, i);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot read extents of subvolume %llu: %m",
+			      key.objectid);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static bool du_same_owner(const struct du_extent_ref *ra,
+			  const struct du_extent_ref *rb)
+{
+	return ra->subvol == rb->subvol && ra->ino == rb->ino &&
+	       ra->backref_offset == rb->backref_offset;
+}
+
+/* Sort by the disk extent, then by the owner of the reference */
+static int cmp_du_extent_ref(const void *a, const void *b)
+{
+	const struct du_extent_ref *ra = a;
+	const struct du_extent_ref *rb = b;
+
+	if (ra->bytenr != rb->bytenr)
+		return ra->bytenr < rb->bytenr ? -1 : 1;
+	if (ra->subvol != rb->subvol)
+		return ra->subvol < rb->subvol ? -1 : 1;
+	if (ra->ino != rb->ino)
+		return ra->ino < rb->ino ? -1 : 1;
+	if (ra->backref_offset != rb->backref_offset)
+		return ra->backref_offset < rb->backref_offset ? -1 : 1;
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+static int cmp_du_extent_ref_start(const void *a, const void *b)
+{
+	const struct du_extent_ref *ra = a;
+	const struct du_extent_ref *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Add the part of the range not yet covered up to @end, the ranges are added
+ * in the order of their start.
+ */
+static u64 du_add_shared_range(u64 *end, u64 start, u64 len)
+{
+	u64 added;
+
+	if (start + len <= *end)
+		return 0;
+	added = start + len - max(start, *end);
+	*end = start + len;
+	return added;
+}
+
+static void du_merge_extent_refs(struct du_offline_ctx *ctx, u64 *ret_shared_end,
+				 u64 *ret_set_shared)
+{
+	size_t i = 0;
+
+	qsort(ctx->refs, ctx->nr_refs, sizeof(ctx->refs[0]), cmp_du_extent_ref);
+
+	while (i < ctx->nr_refs) {
+		const u64 bytenr = ctx->refs[i].bytenr;
+		size_t next = i + 1;
+		bool shared = false;
+
+		while (next < ctx->nr_refs && ctx->refs[next].bytenr == bytenr) {
+			if (!du_same_owner(&ctx->refs[next - 1], &ctx->refs[next]))
+				shared = true;
+			next++;
+		}
+		/* The shared ranges are added in the order of their start */
+		if (shared)
+			qsort(&ctx->refs[i], next - i, sizeof(ctx->refs[0]),
+			      cmp_du_extent_ref_start);
+
+		for (; i < next; i++) {
+			const struct du_extent_ref *ref = &ctx->refs[i];
+			struct du_subvol *sv = &ctx->subvols[ref->subvol];
+
+			sv->total += ref->len;
+			if (!shared)
+				continue;
+			sv->shared += ref->len;
+			sv->set_shared += du_add_shared_range(&sv->shared_end,
+							      ref->start, ref->len);
+			*ret_set_shared += du_add_shared_range(ret_shared_end,
+							       ref->start, ref->len);
+		}
+	}
+}
+
+/* Prepend "/name" to the path that starts at @pos in @buf */
+static int du_path_prepend(char *buf, int *pos, const char *name, int len)
+{
+	if (*pos < len + 1)
+		return -ENAMETOOLONG;
+	*pos -= len;
+	memcpy(buf + *pos, name, len);
+	buf[--(*pos)] = '/';
+	return 0;
+}
+
+/*
+ * Resolve the path of a subvolume from the top level subvolume by the root
+ * backrefs and the inode refs of the directories in the parent subvolumes.
+ */
+static int du_subvol_path(struct btrfs_fs_info *fs_info, u64 rootid, char *buf)
+{
+	struct btrfs_path tree_path = { 0 };
+	struct btrfs_key key;
+	char name[BTRFS_NAME_LEN];
+	int pos = PATH_MAX - 1;
+	int ret = 0;
+
+	buf[pos] = 0;
+	while (rootid != BTRFS_FS_TREE_OBJECTID) {
+		struct btrfs_root_ref *ref;
+		struct btrfs_root *parent;
+		u64 parent_id;
+		u64 ino;
+		int len;
+
+		ret = btrfs_find_item(fs_info->tree_root, &tree_path, rootid, 0,
+				      BTRFS_ROOT_BACKREF_KEY, &key);
+		if (ret)
+			goto out;
+		ref = btrfs_item_ptr(tree_path.nodes[0], tree_path.slots[0],
+				     struct btrfs_root_ref);
+		len = min_t(int, btrfs_root_ref_name_len(tree_path.nodes[0], ref),
+			    BTRFS_NAME_LEN);
+		read_extent_buffer(tree_path.nodes[0], name, (unsigned long)(ref + 1),
+				   len);
+		ino = btrfs_root_ref_dirid(tree_path.nodes[0], ref);
+		parent_id = key.offset;
+		btrfs_release_path(&tree_path);
+		ret = du_path_prepend(buf, &pos, name, len);
+		if (ret < 0)
+			goto out;
+
+		key.objectid = parent_id;
+		key.type = BTRFS_ROOT_ITEM_KEY;
+		key.offset = (u64)-1;
+		parent = btrfs_read_fs_root(fs_info, &key);
+		if (IS_ERR(parent)) {
+			ret = PTR_ERR(parent);
+			goto out;
+		}
+		while (ino != BTRFS_FIRST_FREE_OBJECTID) {
+			struct btrfs_inode_ref *iref;
+
+			ret = btrfs_find_item(parent, &tree_path, ino, 0,
+					      BTRFS_INODE_REF_KEY, &key);
+			if (ret)
+				goto out;
+			iref = btrfs_item_ptr(tree_path.nodes[0], tree_path.slots[0],
+					      struct btrfs_inode_ref);
+			len = min_t(int, btrfs_inode_ref_name_len(tree_path.nodes[0], iref),
+				    BTRFS_NAME_LEN);
+			read_extent_buffer(tree_path.nodes[0], name,
+					   (unsigned long)(iref + 1), len);
+			btrfs_release_path(&tree_path);
+			ret = du_path_prepend(buf, &pos, name, len);
+			if (ret < 0)
+				goto out;
+			ino = key.offset;
+		}
+		rootid = parent_id;
+	}
+out:
+	btrfs_release_path(&tree_path);
+	if (ret)
+		return ret < 0 ? ret : -ENOENT;
+	/* Skip the leading slash */
+	memmove(buf, buf + pos + 1, PATH_MAX - pos - 1);
+	return 0;
+}
+
+static void du_print_line(u64 total, u64 shared, u64 set_shared,
+			  const char *name)
+{
+	pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+		   pretty_size_mode(total, unit_mode),
+		   pretty_size_mode(total - shared, unit_mode),
+		   pretty_size_mode(set_shared, unit_mode), name);
+}
+
+static int du_offline(const char *device)
+{
+	struct open_ctree_args oca = { 0 };
+	struct btrfs_fs_info *fs_info;
+	struct du_offline_ctx ctx = { 0 };
+	u64 total = 0;
+	u64 shared = 0;
+	u64 shared_end = 0;
+	u64 set_shared = 0;
+	int ret;
+
+	ret = check_mounted(device);
+	if (ret < 0) {
+		errno = -ret;
+		warning("unable to check mount status of: %m");
+	} else if (ret) {
+		warning("%s already mounted, the numbers may be inaccurate", device);
+	}
+
+	oca.filename = device;
+	oca.flags = OPEN_CTREE_PARTIAL | OPEN_CTREE_NO_BLOCK_GROUPS;
+	fs_info = open_ctree_fs_info(&oca);
+	if (!fs_info)
+		return -EIO;
+
+	ret = du_collect_subvols(&ctx, fs_info);
+	if (ret < 0)
+		goto out;
+
+	du_merge_extent_refs(&ctx, &shared_end, &set_shared);
+
+	for (u32 i = 0; i < ctx.nr_subvols; i++) {
+		struct du_subvol *sv = &ctx.subvols[i];
+		char name[PATH_MAX];
+
+		total += sv->total;
+		shared += sv->shared;
+		if (summarize)
+			continue;
+
+		if (sv->rootid == BTRFS_FS_TREE_OBJECTID)
+			strcpy(name, "<FS_TREE>");
+		else if (du_subvol_path(fs_info, sv->rootid, name) < 0)
+			snprintf(name, sizeof(name), "<subvol %llu>", sv->rootid);
+		du_print_line(sv->total, sv->shared, sv->set_shared, name);
+	}
+	du_print_line(total, shared, set_shared, device);
+
+out:
+	free(ctx.refs);
+	free(ctx.subvols);
+	close_ctree_fs_info(fs_info);
+	return ret;
+}
+
 static const char * const cmd_filesystem_du_usage[] = {
 	"btrfs filesystem du [options] <path> [<path>..]",
 	"Summarize disk usage of each file.",
 	"",
 	OPTLINE("-s|--summarize", "display only a total for each argument"),
+	OPTLINE("--offline", "the arguments are unmounted devices or images, calculate "
+		"the usage of each subvolume from the file extent items"),
 	HELPINFO_UNITS_LONG,
 	NULL
 };
@@ -579,13 +1022,16 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	int ret = 0, err = 0;
 	int i;
 	u32 kernel_version;
+	bool offline = false;
 
 	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
 
 	optind = 0;
 	while (1) {
+		enum { GETOPT_VAL_OFFLINE = GETOPT_VAL_FIRST };
 		static const struct option long_options[] = {
 			{ "summarize", no_argument, NULL, 's'},
+			{ "offline", no_argument, NULL, GETOPT_VAL_OFFLINE },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "s", long_options, NULL);
@@ -596,6 +1042,9 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 		case 's':
 			summarize = true;
 			break;
+		case GETOPT_VAL_OFFLINE:
+			offline = true;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -604,6 +1053,20 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (offline) {
+		pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n", "Total",
+			   "Exclusive", "Set shared", "Subvolume");
+		for (i = optind; i < argc; i++) {
+			ret = du_offline(argv[i]);
+			if (ret) {
+				errno = -ret;
+				error("cannot check space of '%s': %m", argv[i]);
+				err = 1;
+			}
+		}
+		return err;
+	}
+
 	kernel_version = get_running_kernel_version();
 
 	if (kernel_version < KERNEL_VERSION(2,6,33)) {
@@ -19,6 +19,7 @@
 #include <sys/stat.h>
 #include <linux/version.h>
 #include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <pthread.h>
+#include <time.h>
 #include <mntent.h>
 #include <getopt.h>
 #include <limits.h>
@@ -846,7 +849,8 @@ static int cmd_filesystem_show(const struct cmd_struct *cmd,
 
 devs_only:
 	if (type == BTRFS_ARG_REG) {
-		root = open_ctree(search, btrfs_sb_offset(0), 0);
+		root = open_ctree(search, btrfs_sb_offset(0),
+				  OPEN_CTREE_LAZY_BLOCK_GROUPS);
 		if (root)
 			ret = 0;
 		else
@@ -955,6 +959,9 @@ static const char * const cmd_filesystem_defrag_usage[] = {
 	OPTLINE("-l len", "defragment only up to len bytes"),
 	OPTLINE("-t size", "target extent size hint (default: 32M)"),
 	OPTLINE("--step SIZE", "process the range in given steps, flush after each one"),
+	OPTLINE("-j|--jobs N", "defragment up to N files in parallel with -r (default: 1)"),
+	OPTLINE("--bwlimit RATE", "limit the defragmented bytes per second, size suffixes are accepted"),
+	OPTLINE("--min-extents N", "skip files with less than N extents, unless compressing"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
@@ -969,14 +976,107 @@ static const char * const cmd_filesystem_defrag_usage[] = {
 static struct btrfs_ioctl_defrag_range_args defrag_global_range;
 static int defrag_global_errors;
 static u64 defrag_global_step;
+static int defrag_global_jobs = 1;
+static u64 defrag_global_bwlimit;
+static u64 defrag_global_min_extents;
+
+/* Progress of the defragmentation, shared by the recursive workers */
+static struct {
+	pthread_mutex_t lock;
+	u64 start_ns;
+	/* Bytes of the ranges passed to the defrag ioctl */
+	u64 bytes;
+	u64 files;
+	u64 skipped;
+	/* Set on the first ENOTTY, no more files are processed */
+	bool stop;
+} defrag_state = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Files found by nftw waiting for the workers */
+struct defrag_work {
+	struct list_head list;
+	struct stat st;
+	char path[];
+};
+
+#define DEFRAG_QUEUE_MAX	1024
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t space_cond;
+	struct list_head works;
+	int nr_works;
+	bool done;
+} defrag_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.space_cond = PTHREAD_COND_INITIALIZER,
+	.works = LIST_HEAD_INIT(defrag_queue.works),
+};
+
+static void defrag_add_error(void)
+{
+	pthread_mutex_lock(&defrag_state.lock);
+	defrag_global_errors++;
+	pthread_mutex_unlock(&defrag_state.lock);
+}
+
+static bool defrag_stopped(void)
+{
+	bool stop;
+
+	pthread_mutex_lock(&defrag_state.lock);
+	stop = defrag_state.stop;
+	pthread_mutex_unlock(&defrag_state.lock);
+	return stop;
+}
+
+/*
+ * Account the bytes of the next ioctl and with a bandwidth limit wait until
+ * all the bytes submitted before fit into the limit since the start.
+ */
+static void defrag_throttle(const struct btrfs_ioctl_defrag_range_args *range,
+			    const struct stat *st)
+{
+	const u64 limit = defrag_global_bwlimit;
+	u64 submitted;
+	u64 bytes = 0;
+	u64 due;
+	u64 now;
+
+	if (range->start < (u64)st->st_size)
+		bytes = min_t(u64, range->len, st->st_size - range->start);
+
+	pthread_mutex_lock(&defrag_state.lock);
+	submitted = defrag_state.bytes;
+	defrag_state.bytes += bytes;
+	pthread_mutex_unlock(&defrag_state.lock);
+
+	if (!limit)
+		return;
+	due = defrag_state.start_ns + submitted / limit * 1000000000ULL +
+	      submitted % limit * 1000000000ULL / limit;
+	now = get_monotonic_ns();
+	if (due > now) {
+		struct timespec ts = {
+			.tv_sec = (due - now) / 1000000000ULL,
+			.tv_nsec = (due - now) % 1000000000ULL,
+		};
+
+		nanosleep(&ts, NULL);
+	}
+}
 
 static int defrag_range_in_steps(int fd, const struct stat *st) {
 	int ret = 0;
 	u64 end;
 	struct btrfs_ioctl_defrag_range_args range;
 
-	if (defrag_global_step == 0)
+	if (defrag_global_step == 0) {
+		defrag_throttle(&defrag_global_range, st);
 		return ioctl(fd, BTRFS_IOC_DEFRAG_RANGE, &defrag_global_range);
+	}
 
 	/*
 	 * If start is set but length is not within or beyond the u64 range,
@@ -993,6 +1093,7 @@ static int defrag_range_in_steps(int fd, const struct stat *st) {
 		range.len = defrag_global_step;
 		pr_verbose(LOG_VERBOSE, "defrag range step: start=%llu len=%llu step=%llu\n",
 			   range.start, range.len, defrag_global_step);
+		defrag_throttle(&range, st);
 		ret = ioctl(fd, BTRFS_IOC_DEFRAG_RANGE, &range);
 		if (ret < 0)
 			return ret;
@@ -1010,35 +1111,181 @@ static int defrag_range_in_steps(int fd, const struct stat *st) {
 	return ret;
 }
 
-static int defrag_callback(const char *fpath, const struct stat *sb,
-		int typeflag, struct FTW *ftwbuf)
+/*
+ * Check if the file has less extents than requested by --min-extents, the
+ * number of extents is obtained by FIEMAP without copying the extents.
+ */
+static bool defrag_skip_file(int fd)
 {
-	int ret = 0;
-	int fd = 0;
+	struct fiemap fiemap = { 0 };
 
-	if ((typeflag == FTW_F) && S_ISREG(sb->st_mode)) {
-		pr_verbose(LOG_INFO, "%s\n", fpath);
-		fd = open(fpath, defrag_open_mode);
-		if (fd < 0) {
-			goto error;
-		}
-		ret = defrag_range_in_steps(fd, sb);
+	if (!defrag_global_min_extents)
+		return false;
+	/* Compression or decompression rewrites the extents anyway */
+	if (defrag_global_range.flags &
+	    (BTRFS_DEFRAG_RANGE_COMPRESS | BTRFS_DEFRAG_RANGE_NOCOMPRESS))
+		return false;
+
+	fiemap.fm_length = ~0ULL;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fiemap) < 0)
+		return false;
+	return fiemap.fm_mapped_extents < defrag_global_min_extents;
+}
+
+static int defrag_one_file(const char *fpath, const struct stat *sb)
+{
+	int ret;
+	int fd;
+
+	pr_verbose(LOG_INFO, "%s\n", fpath);
+	fd = open(fpath, defrag_open_mode);
+	if (fd < 0)
+		goto error;
+	if (defrag_skip_file(fd)) {
 		close(fd);
-		if (ret && errno == ENOTTY) {
+		pthread_mutex_lock(&defrag_state.lock);
+		defrag_state.skipped++;
+		pthread_mutex_unlock(&defrag_state.lock);
+		return 0;
+	}
+	ret = defrag_range_in_steps(fd, sb);
+	close(fd);
+	if (ret && errno == ENOTTY) {
+		bool first;
+
+		pthread_mutex_lock(&defrag_state.lock);
+		first = !defrag_state.stop;
+		defrag_state.stop = true;
+		defrag_global_errors++;
+		pthread_mutex_unlock(&defrag_state.lock);
+		if (first)
 			error(
 "defrag range ioctl not supported in this kernel version, 2.6.33 and newer is required");
-			defrag_global_errors++;
-			return ENOTTY;
-		}
-		if (ret) {
-			goto error;
-		}
+		return ENOTTY;
 	}
+	if (ret)
+		goto error;
+
+	pthread_mutex_lock(&defrag_state.lock);
+	defrag_state.files++;
+	pthread_mutex_unlock(&defrag_state.lock);
 	return 0;
 
 error:
 	error("defrag failed on %s: %m", fpath);
-	defrag_global_errors++;
+	defrag_add_error();
+	return 0;
+}
+
+static int defrag_queue_file(const char *fpath, const struct stat *sb)
+{
+	struct defrag_work *work;
+
+	if (defrag_stopped())
+		return ENOTTY;
+
+	work = malloc(sizeof(*work) + strlen(fpath) + 1);
+	if (!work) {
+		error_mem(NULL);
+		defrag_add_error();
+		return 0;
+	}
+	work->st = *sb;
+	strcpy(work->path, fpath);
+
+	pthread_mutex_lock(&defrag_queue.lock);
+	while (defrag_queue.nr_works >= DEFRAG_QUEUE_MAX)
+		pthread_cond_wait(&defrag_queue.space_cond, &defrag_queue.lock);
+	list_add_tail(&work->list, &defrag_queue.works);
+	defrag_queue.nr_works++;
+	pthread_cond_signal(&defrag_queue.work_cond);
+	pthread_mutex_unlock(&defrag_queue.lock);
+	return 0;
+}
+
+static void *defrag_worker(void *arg)
+{
+	while (1) {
+		struct defrag_work *work;
+
+		pthread_mutex_lock(&defrag_queue.lock);
+		while (list_empty(&defrag_queue.works) && !defrag_queue.done)
+			pthread_cond_wait(&defrag_queue.work_cond, &defrag_queue.lock);
+		if (list_empty(&defrag_queue.works)) {
+			pthread_mutex_unlock(&defrag_queue.lock);
+			break;
+		}
+		work = list_first_entry(&defrag_queue.works, struct defrag_work, list);
+		list_del(&work->list);
+		defrag_queue.nr_works--;
+		pthread_cond_signal(&defrag_queue.space_cond);
+		pthread_mutex_unlock(&defrag_queue.lock);
+
+		/* Drain the queue after ENOTTY */
+		if (!defrag_stopped())
+			defrag_one_file(work->path, &work->st);
+		free(work);
+	}
+	return NULL;
+}
+
+static int defrag_callback(const char *fpath, const struct stat *sb,
+		int typeflag, struct FTW *ftwbuf)
+{
+	if ((typeflag == FTW_F) && S_ISREG(sb->st_mode)) {
+		if (defrag_global_jobs > 1)
+			return defrag_queue_file(fpath, sb);
+		return defrag_one_file(fpath, sb);
+	}
+	return 0;
+}
+
+/*
+ * Defragment files in the directory, with more jobs the files found by nftw
+ * are processed by a pool of threads.
+ */
+static int defrag_recursive(const char *path)
+{
+	pthread_t *threads = NULL;
+	int nr_threads = 0;
+	int ret;
+
+	if (defrag_global_jobs > 1) {
+		threads = calloc(defrag_global_jobs, sizeof(pthread_t));
+		if (!threads) {
+			error_mem(NULL);
+			return -ENOMEM;
+		}
+		defrag_queue.done = false;
+		for (; nr_threads < defrag_global_jobs; nr_threads++) {
+			ret = pthread_create(&threads[nr_threads], NULL,
+					     defrag_worker, NULL);
+			if (ret) {
+				errno = ret;
+				error("cannot start defrag thread: %m");
+				break;
+			}
+		}
+		if (nr_threads == 0) {
+			free(threads);
+			return -ret;
+		}
+	}
+
+	ret = nftw(path, defrag_callback, 10, FTW_MOUNT | FTW_PHYS);
+
+	if (threads) {
+		pthread_mutex_lock(&defrag_queue.lock);
+		defrag_queue.done = true;
+		pthread_cond_broadcast(&defrag_queue.work_cond);
+		pthread_mutex_unlock(&defrag_queue.lock);
+		for (int i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+	if (defrag_stopped())
+		return ENOTTY;
+	/* Other errors are handled in the callback */
 	return 0;
 }
 
@@ -1088,16 +1335,20 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 	defrag_global_errors = 0;
 	optind = 0;
 	while(1) {
-		enum { GETOPT_VAL_STEP = GETOPT_VAL_FIRST, GETOPT_VAL_NOCOMP };
+		enum { GETOPT_VAL_STEP = GETOPT_VAL_FIRST, GETOPT_VAL_NOCOMP,
+		       GETOPT_VAL_BWLIMIT, GETOPT_VAL_MIN_EXTENTS };
 		static const struct option long_options[] = {
 			{ "level", required_argument, NULL, 'L' },
 			{ "step", required_argument, NULL, GETOPT_VAL_STEP },
 			{ "nocomp", no_argument, NULL, GETOPT_VAL_NOCOMP },
+			{ "jobs", required_argument, NULL, 'j' },
+			{ "bwlimit", required_argument, NULL, GETOPT_VAL_BWLIMIT },
+			{ "min-extents", required_argument, NULL, GETOPT_VAL_MIN_EXTENTS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "vrc::L:fs:l:t:", long_options, NULL);
+		c = getopt_long(argc, argv, "vrc::L:fs:l:t:j:", long_options, NULL);
 		if (c < 0)
 			break;
 
@@ -1166,6 +1417,22 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 				defrag_global_step = SZ_256K;
 			}
 			break;
+		case 'j': {
+			u64 jobs = arg_strtou64(optarg);
+
+			if (jobs == 0 || jobs > 1024) {
+				error("invalid number of jobs: %s", optarg);
+				return 1;
+			}
+			defrag_global_jobs = jobs;
+			break;
+		}
+		case GETOPT_VAL_BWLIMIT:
+			defrag_global_bwlimit = arg_strtou64_with_suffix(optarg);
+			break;
+		case GETOPT_VAL_MIN_EXTENTS:
+			defrag_global_min_extents = arg_strtou64(optarg);
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -1221,6 +1488,7 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 		}
 	}
 
+	defrag_state.start_ns = get_monotonic_ns();
 	for (i = optind; i < argc; i++) {
 		struct stat st;
 		int defrag_err = 0;
@@ -1244,14 +1512,13 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 			goto next;
 		}
 		if (recursive && S_ISDIR(st.st_mode)) {
-			ret = nftw(argv[i], defrag_callback, 10,
-						FTW_MOUNT | FTW_PHYS);
+			ret = defrag_recursive(argv[i]);
 			if (ret == ENOTTY)
 				exit(1);
-			/* errors are handled in the callback */
-			ret = 0;
 		} else {
 			pr_verbose(LOG_INFO, "%s\n", argv[i]);
+			if (defrag_skip_file(fd))
+				goto next;
 			ret = defrag_range_in_steps(fd, &st);
 			defrag_err = errno;
 			if (ret && defrag_err == ENOTTY) {
@@ -1273,6 +1540,17 @@ next:
 		close(fd);
 	}
 
+	if (recursive) {
+		const u64 bytes = defrag_state.bytes;
+		u64 msecs = (get_monotonic_ns() - defrag_state.start_ns) / 1000000;
+
+		msecs = max_t(u64, msecs, 1);
+		pr_verbose(LOG_INFO,
+		"defragmented %llu files, skipped %llu, %s in %llu.%03llus, %s/s\n",
+			   defrag_state.files, defrag_state.skipped,
+			   pretty_size(bytes), msecs / 1000, msecs % 1000,
+			   pretty_size(bytes / msecs * 1000 + bytes % msecs * 1000 / msecs));
+	}
 	if (defrag_global_errors)
 		pr_stderr(LOG_DEFAULT, "total %d failures\n", defrag_global_errors);
 
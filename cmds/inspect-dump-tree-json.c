@@ -0,0 +1,876 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Json output of dump-tree, one line per leaf item (NDJSON) so the output can
+ * be processed as a stream without loading the whole dump.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/file-item.h"
+#include "kernel-shared/print-tree.h"
+#include "kernel-shared/tree-checker.h"
+#include "common/messages.h"
+#include "common/parse-utils.h"
+#include "common/format-output.h"
+#include "cmds/inspect-dump-tree.h"
+
+static const struct rowspec dump_tree_rowspec[] = {
+	/* Common for all items */
+	{ .key = "tree", .fmt = "%llu", .out_json = "tree" },
+	{ .key = "block", .fmt = "%llu", .out_json = "block" },
+	{ .key = "level", .fmt = "%llu", .out_json = "level" },
+	{ .key = "slot", .fmt = "%llu", .out_json = "slot" },
+	{ .key = "objectid", .fmt = "%llu", .out_json = "objectid" },
+	{ .key = "type", .fmt = "str", .out_json = "type" },
+	{ .key = "offset", .fmt = "%llu", .out_json = "offset" },
+	{ .key = "item_size", .fmt = "%llu", .out_json = "item_size" },
+	/* Node pointers */
+	{ .key = "blockptr", .fmt = "%llu", .out_json = "blockptr" },
+	/* Item specific */
+	{ .key = "generation", .fmt = "%llu", .out_json = "generation" },
+	{ .key = "transid", .fmt = "%llu", .out_json = "transid" },
+	{ .key = "size", .fmt = "%llu", .out_json = "size" },
+	{ .key = "nbytes", .fmt = "%llu", .out_json = "nbytes" },
+	{ .key = "nlink", .fmt = "%llu", .out_json = "nlink" },
+	{ .key = "uid", .fmt = "%llu", .out_json = "uid" },
+	{ .key = "gid", .fmt = "%llu", .out_json = "gid" },
+	{ .key = "mode", .fmt = "%llu", .out_json = "mode" },
+	{ .key = "flags", .fmt = "%llu", .out_json = "flags" },
+	{ .key = "index", .fmt = "%llu", .out_json = "index" },
+	{ .key = "parent", .fmt = "%llu", .out_json = "parent" },
+	{ .key = "name", .fmt = "str", .out_json = "name" },
+	{ .key = "names", .fmt = "list", .out_json = "names" },
+	{ .key = "location", .fmt = "map", .out_json = "location" },
+	{ .key = "ftype", .fmt = "%llu", .out_json = "ftype" },
+	{ .key = "data_len", .fmt = "%llu", .out_json = "data_len" },
+	{ .key = "extent_type", .fmt = "str", .out_json = "extent_type" },
+	{ .key = "compression", .fmt = "%llu", .out_json = "compression" },
+	{ .key = "ram_bytes", .fmt = "%llu", .out_json = "ram_bytes" },
+	{ .key = "disk_bytenr", .fmt = "%llu", .out_json = "disk_bytenr" },
+	{ .key = "disk_num_bytes", .fmt = "%llu", .out_json = "disk_num_bytes" },
+	{ .key = "extent_offset", .fmt = "%llu", .out_json = "extent_offset" },
+	{ .key = "num_bytes", .fmt = "%llu", .out_json = "num_bytes" },
+	{ .key = "inline_size", .fmt = "%llu", .out_json = "inline_size" },
+	{ .key = "refs", .fmt = "%llu", .out_json = "refs" },
+	{ .key = "inline_refs", .fmt = "list", .out_json = "inline_refs" },
+	{ .key = "root", .fmt = "%llu", .out_json = "root" },
+	{ .key = "count", .fmt = "%llu", .out_json = "count" },
+	{ .key = "used", .fmt = "%llu", .out_json = "used" },
+	{ .key = "chunk_objectid", .fmt = "%llu", .out_json = "chunk_objectid" },
+	{ .key = "chunk_tree", .fmt = "%llu", .out_json = "chunk_tree" },
+	{ .key = "chunk_offset", .fmt = "%llu", .out_json = "chunk_offset" },
+	{ .key = "length", .fmt = "%llu", .out_json = "length" },
+	{ .key = "owner", .fmt = "%llu", .out_json = "owner" },
+	{ .key = "stripe_len", .fmt = "%llu", .out_json = "stripe_len" },
+	{ .key = "chunk_type", .fmt = "%llu", .out_json = "chunk_type" },
+	{ .key = "num_stripes", .fmt = "%llu", .out_json = "num_stripes" },
+	{ .key = "sub_stripes", .fmt = "%llu", .out_json = "sub_stripes" },
+	{ .key = "stripes", .fmt = "list", .out_json = "stripes" },
+	{ .key = "devid", .fmt = "%llu", .out_json = "devid" },
+	{ .key = "total_bytes", .fmt = "%llu", .out_json = "total_bytes" },
+	{ .key = "bytes_used", .fmt = "%llu", .out_json = "bytes_used" },
+	{ .key = "uuid", .fmt = "uuid", .out_json = "uuid" },
+	{ .key = "bytenr", .fmt = "%llu", .out_json = "bytenr" },
+	{ .key = "last_snapshot", .fmt = "%llu", .out_json = "last_snapshot" },
+	{ .key = "dirid", .fmt = "%llu", .out_json = "dirid" },
+	{ .key = "sequence", .fmt = "%llu", .out_json = "sequence" },
+	{ .key = "csums", .fmt = "%llu", .out_json = "csums" },
+	{ .key = "extent_count", .fmt = "%llu", .out_json = "extent_count" },
+	ROWSPEC_END
+};
+
+struct dump_json_ctx {
+	struct btrfs_fs_info *fs_info;
+	const struct dump_tree_filter *filter;
+	struct format_ctx fctx;
+	/* Number of items and key pointers printed */
+	u64 items;
+};
+
+void dump_tree_filter_init(struct dump_tree_filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->max_objectid = (u64)-1;
+}
+
+static int parse_key_type(const char *str)
+{
+	u64 num;
+
+	if (parse_u64(str, &num) == 0) {
+		if (num > 255)
+			return -ERANGE;
+		return num;
+	}
+	for (int i = 0; i < 256; i++) {
+		const char *name = btrfs_key_type_name(i);
+
+		if (name && strcasecmp(name, str) == 0)
+			return i;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Parse filter specification, comma separated list of:
+ *
+ * - type=<NAME|number> - key type, can be repeated
+ * - objectid=<number>  - exact key objectid
+ * - objectid=<a..b>    - inclusive range of key objectids, a or b can be
+ *                        omitted
+ *
+ * Can be called repeatedly, the conditions accumulate.
+ */
+int dump_tree_parse_filter(const char *str, struct dump_tree_filter *filter)
+{
+	char *copy;
+	char *tmp;
+	char *token;
+	int ret = 0;
+
+	copy = strdup(str);
+	if (!copy)
+		return -ENOMEM;
+
+	for (token = strtok_r(copy, ",", &tmp); token;
+	     token = strtok_r(NULL, ",", &tmp)) {
+		char *value = strchr(token, '=');
+
+		if (!value) {
+			error("invalid filter, expected key=value: %s", token);
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = 0;
+		if (strcmp(token, "type") == 0) {
+			int type = parse_key_type(value);
+
+			if (type < 0) {
+				error("unknown key type in filter: %s", value);
+				ret = -EINVAL;
+				break;
+			}
+			filter->types[type] = true;
+			filter->has_types = true;
+		} else if (strcmp(token, "objectid") == 0) {
+			u64 start;
+			u64 end;
+
+			if (parse_range_u64(value, &start, &end) == 0) {
+				filter->min_objectid = start;
+				filter->max_objectid = end;
+			} else if (parse_u64(value, &start) == 0) {
+				filter->min_objectid = start;
+				filter->max_objectid = start;
+			} else {
+				error("invalid objectid in filter: %s", value);
+				ret = -EINVAL;
+				break;
+			}
+		} else {
+			error("unknown filter: %s", token);
+			ret = -EINVAL;
+			break;
+		}
+	}
+	free(copy);
+	return ret;
+}
+
+static bool filter_match(const struct dump_tree_filter *filter,
+			 const struct btrfs_key *key)
+{
+	if (key->objectid < filter->min_objectid ||
+	    key->objectid > filter->max_objectid)
+		return false;
+	if (filter->has_types && !filter->types[key->type])
+		return false;
+	return true;
+}
+
+static void print_key_fields(struct dump_json_ctx *ctx, const struct btrfs_key *key)
+{
+	const char *name;
+	char buf[32];
+
+	name = btrfs_key_type_name(key->type);
+	if (key->type == 0 && key->objectid == BTRFS_FREE_SPACE_OBJECTID) {
+		name = "UNTYPED";
+	} else if (!name) {
+		snprintf(buf, sizeof(buf), "UNKNOWN.%u", key->type);
+		name = buf;
+	}
+	fmt_print(&ctx->fctx, "objectid", key->objectid);
+	fmt_print(&ctx->fctx, "type", name);
+	fmt_print(&ctx->fctx, "offset", key->offset);
+}
+
+/* Print name stored in the item, or HIDDEN if requested by --hide-names */
+static void print_name(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+		       unsigned long ptr, u32 len)
+{
+	char name[BTRFS_NAME_LEN + 1];
+
+	if (ctx->fs_info->hide_names) {
+		fmt_print(&ctx->fctx, "name", "HIDDEN");
+		return;
+	}
+	len = min_t(u32, len, BTRFS_NAME_LEN);
+	read_extent_buffer(eb, name, ptr, len);
+	name[len] = 0;
+	fmt_print(&ctx->fctx, "name", name);
+}
+
+static void print_inode_item(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			     int slot)
+{
+	struct btrfs_inode_item *ii = btrfs_item_ptr(eb, slot, struct btrfs_inode_item);
+
+	fmt_print(&ctx->fctx, "generation", btrfs_inode_generation(eb, ii));
+	fmt_print(&ctx->fctx, "transid", btrfs_inode_transid(eb, ii));
+	fmt_print(&ctx->fctx, "size", btrfs_inode_size(eb, ii));
+	fmt_print(&ctx->fctx, "nbytes", btrfs_inode_nbytes(eb, ii));
+	fmt_print(&ctx->fctx, "nlink", (u64)btrfs_inode_nlink(eb, ii));
+	fmt_print(&ctx->fctx, "uid", (u64)btrfs_inode_uid(eb, ii));
+	fmt_print(&ctx->fctx, "gid", (u64)btrfs_inode_gid(eb, ii));
+	fmt_print(&ctx->fctx, "mode", (u64)btrfs_inode_mode(eb, ii));
+	fmt_print(&ctx->fctx, "flags", btrfs_inode_flags(eb, ii));
+}
+
+static void print_inode_refs(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			     int slot)
+{
+	u32 total = btrfs_item_size(eb, slot);
+	unsigned long ptr = btrfs_item_ptr_offset(eb, slot);
+	u32 cur = 0;
+
+	fmt_print(&ctx->fctx, "names");
+	while (cur + sizeof(struct btrfs_inode_ref) <= total) {
+		struct btrfs_inode_ref *ref = (struct btrfs_inode_ref *)(ptr + cur);
+		u32 name_len = btrfs_inode_ref_name_len(eb, ref);
+
+		fmt_print_start_group(&ctx->fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&ctx->fctx, "index", btrfs_inode_ref_index(eb, ref));
+		print_name(ctx, eb, (unsigned long)(ref + 1),
+			   min_t(u32, name_len, total - cur - sizeof(*ref)));
+		fmt_print_end_group(&ctx->fctx, NULL);
+		cur += sizeof(*ref) + name_len;
+	}
+	fmt_print_end_group(&ctx->fctx, "names");
+}
+
+static void print_inode_extrefs(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+				int slot)
+{
+	u32 total = btrfs_item_size(eb, slot);
+	unsigned long ptr = btrfs_item_ptr_offset(eb, slot);
+	u32 cur = 0;
+
+	fmt_print(&ctx->fctx, "names");
+	while (cur + sizeof(struct btrfs_inode_extref) <= total) {
+		struct btrfs_inode_extref *extref;
+		u32 name_len;
+
+		extref = (struct btrfs_inode_extref *)(ptr + cur);
+		name_len = btrfs_inode_extref_name_len(eb, extref);
+		fmt_print_start_group(&ctx->fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&ctx->fctx, "index", btrfs_inode_extref_index(eb, extref));
+		fmt_print(&ctx->fctx, "parent", btrfs_inode_extref_parent(eb, extref));
+		print_name(ctx, eb, (unsigned long)&extref->name,
+			   min_t(u32, name_len, total - cur - sizeof(*extref)));
+		fmt_print_end_group(&ctx->fctx, NULL);
+		cur += sizeof(*extref) + name_len;
+	}
+	fmt_print_end_group(&ctx->fctx, "names");
+}
+
+static void print_dir_items(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			    int slot)
+{
+	u32 total = btrfs_item_size(eb, slot);
+	unsigned long ptr = btrfs_item_ptr_offset(eb, slot);
+	u32 cur = 0;
+
+	fmt_print(&ctx->fctx, "names");
+	while (cur + sizeof(struct btrfs_dir_item) <= total) {
+		struct btrfs_dir_item *di = (struct btrfs_dir_item *)(ptr + cur);
+		struct btrfs_key location;
+		u32 name_len = btrfs_dir_name_len(eb, di);
+		u32 data_len = btrfs_dir_data_len(eb, di);
+
+		btrfs_dir_item_key_to_cpu(eb, di, &location);
+		fmt_print_start_group(&ctx->fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&ctx->fctx, "location");
+		print_key_fields(ctx, &location);
+		fmt_print_end_group(&ctx->fctx, "location");
+		fmt_print(&ctx->fctx, "transid", btrfs_dir_transid(eb, di));
+		fmt_print(&ctx->fctx, "ftype", (u64)btrfs_dir_ftype(eb, di));
+		fmt_print(&ctx->fctx, "data_len", (u64)data_len);
+		print_name(ctx, eb, (unsigned long)(di + 1),
+			   min_t(u32, name_len, total - cur - sizeof(*di)));
+		fmt_print_end_group(&ctx->fctx, NULL);
+		cur += sizeof(*di) + name_len + data_len;
+	}
+	fmt_print_end_group(&ctx->fctx, "names");
+}
+
+static void print_file_extent(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			      int slot)
+{
+	struct btrfs_file_extent_item *fi;
+	u32 item_size = btrfs_item_size(eb, slot);
+	u8 type;
+
+	if (item_size < BTRFS_FILE_EXTENT_INLINE_DATA_START)
+		return;
+
+	fi = btrfs_item_ptr(eb, slot, struct btrfs_file_extent_item);
+	type = btrfs_file_extent_type(eb, fi);
+	fmt_print(&ctx->fctx, "generation", btrfs_file_extent_generation(eb, fi));
+	fmt_print(&ctx->fctx, "ram_bytes", btrfs_file_extent_ram_bytes(eb, fi));
+	fmt_print(&ctx->fctx, "compression",
+		  (u64)btrfs_file_extent_compression(eb, fi));
+	if (type == BTRFS_FILE_EXTENT_INLINE) {
+		fmt_print(&ctx->fctx, "extent_type", "inline");
+		fmt_print(&ctx->fctx, "inline_size",
+			  (u64)btrfs_file_extent_inline_item_len(eb, slot));
+		return;
+	}
+	if (type == BTRFS_FILE_EXTENT_REG)
+		fmt_print(&ctx->fctx, "extent_type", "regular");
+	else if (type == BTRFS_FILE_EXTENT_PREALLOC)
+		fmt_print(&ctx->fctx, "extent_type", "prealloc");
+	else
+		fmt_print(&ctx->fctx, "extent_type", "unknown");
+	if (item_size < sizeof(*fi))
+		return;
+	fmt_print(&ctx->fctx, "disk_bytenr", btrfs_file_extent_disk_bytenr(eb, fi));
+	fmt_print(&ctx->fctx, "disk_num_bytes",
+		  btrfs_file_extent_disk_num_bytes(eb, fi));
+	fmt_print(&ctx->fctx, "extent_offset", btrfs_file_extent_offset(eb, fi));
+	fmt_print(&ctx->fctx, "num_bytes", btrfs_file_extent_num_bytes(eb, fi));
+}
+
+static void print_extent_item_refs(struct dump_json_ctx *ctx,
+				   struct extent_buffer *eb, int slot, bool metadata)
+{
+	struct btrfs_extent_item *ei;
+	unsigned long ptr;
+	unsigned long end;
+	u32 item_size = btrfs_item_size(eb, slot);
+	u64 flags;
+
+	if (item_size < sizeof(*ei))
+		return;
+
+	ei = btrfs_item_ptr(eb, slot, struct btrfs_extent_item);
+	flags = btrfs_extent_flags(eb, ei);
+	fmt_print(&ctx->fctx, "refs", btrfs_extent_refs(eb, ei));
+	fmt_print(&ctx->fctx, "generation", btrfs_extent_generation(eb, ei));
+	fmt_print(&ctx->fctx, "flags", flags);
+
+	ptr = (unsigned long)(ei + 1);
+	if ((flags & BTRFS_EXTENT_FLAG_TREE_BLOCK) && !metadata)
+		ptr += sizeof(struct btrfs_tree_block_info);
+	end = (unsigned long)ei + item_size;
+
+	fmt_print(&ctx->fctx, "inline_refs");
+	while (ptr + sizeof(struct btrfs_extent_inline_ref) <= end) {
+		struct btrfs_extent_inline_ref *iref;
+		struct btrfs_extent_data_ref *dref;
+		struct btrfs_shared_data_ref *sref;
+		const char *name;
+		u64 offset;
+		int type;
+
+		iref = (struct btrfs_extent_inline_ref *)ptr;
+		type = btrfs_extent_inline_ref_type(eb, iref);
+		name = btrfs_key_type_name(type);
+		if (!name || btrfs_extent_inline_ref_size(type) == 0 ||
+		    ptr + btrfs_extent_inline_ref_size(type) > end)
+			break;
+		offset = btrfs_extent_inline_ref_offset(eb, iref);
+
+		fmt_print_start_group(&ctx->fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&ctx->fctx, "type", name);
+		switch (type) {
+		case BTRFS_TREE_BLOCK_REF_KEY:
+		case BTRFS_EXTENT_OWNER_REF_KEY:
+			fmt_print(&ctx->fctx, "root", offset);
+			break;
+		case BTRFS_SHARED_BLOCK_REF_KEY:
+			fmt_print(&ctx->fctx, "parent", offset);
+			break;
+		case BTRFS_EXTENT_DATA_REF_KEY:
+			dref = (struct btrfs_extent_data_ref *)(&iref->offset);
+			fmt_print(&ctx->fctx, "root",
+				  btrfs_extent_data_ref_root(eb, dref));
+			fmt_print(&ctx->fctx, "objectid",
+				  btrfs_extent_data_ref_objectid(eb, dref));
+			fmt_print(&ctx->fctx, "offset",
+				  btrfs_extent_data_ref_offset(eb, dref));
+			fmt_print(&ctx->fctx, "count",
+				  (u64)btrfs_extent_data_ref_count(eb, dref));
+			break;
+		case BTRFS_SHARED_DATA_REF_KEY:
+			sref = (struct btrfs_shared_data_ref *)(iref + 1);
+			fmt_print(&ctx->fctx, "parent", offset);
+			fmt_print(&ctx->fctx, "count",
+				  (u64)btrfs_shared_data_ref_count(eb, sref));
+			break;
+		}
+		fmt_print_end_group(&ctx->fctx, NULL);
+		ptr += btrfs_extent_inline_ref_size(type);
+	}
+	fmt_print_end_group(&ctx->fctx, "inline_refs");
+}
+
+static void print_chunk(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			int slot)
+{
+	struct btrfs_chunk *chunk = btrfs_item_ptr(eb, slot, struct btrfs_chunk);
+	u32 item_size = btrfs_item_size(eb, slot);
+	u16 num_stripes;
+
+	if (item_size < sizeof(*chunk))
+		return;
+
+	num_stripes = btrfs_chunk_num_stripes(eb, chunk);
+	fmt_print(&ctx->fctx, "length", btrfs_chunk_length(eb, chunk));
+	fmt_print(&ctx->fctx, "owner", btrfs_chunk_owner(eb, chunk));
+	fmt_print(&ctx->fctx, "stripe_len", btrfs_chunk_stripe_len(eb, chunk));
+	fmt_print(&ctx->fctx, "chunk_type", btrfs_chunk_type(eb, chunk));
+	fmt_print(&ctx->fctx, "num_stripes", (u64)num_stripes);
+	fmt_print(&ctx->fctx, "sub_stripes",
+		  (u64)btrfs_chunk_sub_stripes(eb, chunk));
+	if (num_stripes == 0 || item_size < btrfs_chunk_item_size(num_stripes))
+		return;
+	fmt_print(&ctx->fctx, "stripes");
+	for (int i = 0; i < num_stripes; i++) {
+		fmt_print_start_group(&ctx->fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&ctx->fctx, "devid", btrfs_stripe_devid_nr(eb, chunk, i));
+		fmt_print(&ctx->fctx, "offset", btrfs_stripe_offset_nr(eb, chunk, i));
+		fmt_print_end_group(&ctx->fctx, NULL);
+	}
+	fmt_print_end_group(&ctx->fctx, "stripes");
+}
+
+static void print_root_item(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			    int slot)
+{
+	struct btrfs_root_item ri;
+	u32 len = min_t(u32, btrfs_item_size(eb, slot), sizeof(ri));
+
+	memset(&ri, 0, sizeof(ri));
+	read_extent_buffer(eb, &ri, btrfs_item_ptr_offset(eb, slot), len);
+	fmt_print(&ctx->fctx, "generation", btrfs_root_generation(&ri));
+	fmt_print(&ctx->fctx, "bytenr", btrfs_root_bytenr(&ri));
+	fmt_print(&ctx->fctx, "level", (u64)btrfs_root_level(&ri));
+	fmt_print(&ctx->fctx, "refs", (u64)btrfs_root_refs(&ri));
+	fmt_print(&ctx->fctx, "flags", btrfs_root_flags(&ri));
+	fmt_print(&ctx->fctx, "last_snapshot", btrfs_root_last_snapshot(&ri));
+	fmt_print(&ctx->fctx, "uuid", ri.uuid);
+}
+
+static void print_item_data(struct dump_json_ctx *ctx, struct extent_buffer *eb,
+			    int slot, const struct btrfs_key *key)
+{
+	u32 item_size = btrfs_item_size(eb, slot);
+
+	switch (key->type) {
+	case BTRFS_INODE_ITEM_KEY:
+		if (item_size >= sizeof(struct btrfs_inode_item))
+			print_inode_item(ctx, eb, slot);
+		break;
+	case BTRFS_INODE_REF_KEY:
+		print_inode_refs(ctx, eb, slot);
+		break;
+	case BTRFS_INODE_EXTREF_KEY:
+		print_inode_extrefs(ctx, eb, slot);
+		break;
+	case BTRFS_DIR_ITEM_KEY:
+	case BTRFS_DIR_INDEX_KEY:
+	case BTRFS_XATTR_ITEM_KEY:
+		print_dir_items(ctx, eb, slot);
+		break;
+	case BTRFS_EXTENT_DATA_KEY:
+		print_file_extent(ctx, eb, slot);
+		break;
+	case BTRFS_EXTENT_ITEM_KEY:
+		print_extent_item_refs(ctx, eb, slot, false);
+		break;
+	case BTRFS_METADATA_ITEM_KEY:
+		print_extent_item_refs(ctx, eb, slot, true);
+		break;
+	case BTRFS_EXTENT_CSUM_KEY:
+		fmt_print(&ctx->fctx, "csums",
+			  (u64)(item_size / ctx->fs_info->csum_size));
+		break;
+	case BTRFS_BLOCK_GROUP_ITEM_KEY: {
+		struct btrfs_block_group_item *bgi;
+
+		if (item_size < sizeof(*bgi))
+			break;
+		bgi = btrfs_item_ptr(eb, slot, struct btrfs_block_group_item);
+		fmt_print(&ctx->fctx, "used", btrfs_block_group_used(eb, bgi));
+		fmt_print(&ctx->fctx, "chunk_objectid",
+			  btrfs_block_group_chunk_objectid(eb, bgi));
+		fmt_print(&ctx->fctx, "flags", btrfs_block_group_flags(eb, bgi));
+		break;
+	}
+	case BTRFS_CHUNK_ITEM_KEY:
+		print_chunk(ctx, eb, slot);
+		break;
+	case BTRFS_DEV_ITEM_KEY: {
+		struct btrfs_dev_item *dev;
+		u8 uuid[BTRFS_UUID_SIZE];
+
+		if (item_size < sizeof(*dev))
+			break;
+		dev = btrfs_item_ptr(eb, slot, struct btrfs_dev_item);
+		read_extent_buffer(eb, uuid, btrfs_device_uuid(dev), BTRFS_UUID_SIZE);
+		fmt_print(&ctx->fctx, "devid", btrfs_device_id(eb, dev));
+		fmt_print(&ctx->fctx, "total_bytes", btrfs_device_total_bytes(eb, dev));
+		fmt_print(&ctx->fctx, "bytes_used", btrfs_device_bytes_used(eb, dev));
+		fmt_print(&ctx->fctx, "uuid", uuid);
+		break;
+	}
+	case BTRFS_DEV_EXTENT_KEY: {
+		struct btrfs_dev_extent *de;
+
+		if (item_size < sizeof(*de))
+			break;
+		de = btrfs_item_ptr(eb, slot, struct btrfs_dev_extent);
+		fmt_print(&ctx->fctx, "chunk_tree",
+			  btrfs_dev_extent_chunk_tree(eb, de));
+		fmt_print(&ctx->fctx, "chunk_objectid",
+			  btrfs_dev_extent_chunk_objectid(eb, de));
+		fmt_print(&ctx->fctx, "chunk_offset",
+			  btrfs_dev_extent_chunk_offset(eb, de));
+		fmt_print(&ctx->fctx, "length", btrfs_dev_extent_length(eb, de));
+		break;
+	}
+	case BTRFS_ROOT_ITEM_KEY:
+		print_root_item(ctx, eb, slot);
+		break;
+	case BTRFS_ROOT_REF_KEY:
+	case BTRFS_ROOT_BACKREF_KEY: {
+		struct btrfs_root_ref *ref;
+
+		if (item_size < sizeof(*ref))
+			break;
+		ref = btrfs_item_ptr(eb, slot, struct btrfs_root_ref);
+		fmt_print(&ctx->fctx, "dirid", btrfs_root_ref_dirid(eb, ref));
+		fmt_print(&ctx->fctx, "sequence", btrfs_root_ref_sequence(eb, ref));
+		print_name(ctx, eb, (unsigned long)(ref + 1),
+			   min_t(u32, btrfs_root_ref_name_len(eb, ref),
+				 item_size - sizeof(*ref)));
+		break;
+	}
+	case BTRFS_FREE_SPACE_INFO_KEY: {
+		struct btrfs_free_space_info *info;
+
+		if (item_size < sizeof(*info))
+			break;
+		info = btrfs_item_ptr(eb, slot, struct btrfs_free_space_info);
+		fmt_print(&ctx->fctx, "extent_count",
+			  (u64)btrfs_free_space_extent_count(eb, info));
+		fmt_print(&ctx->fctx, "flags", (u64)btrfs_free_space_flags(eb, info));
+		break;
+	}
+	}
+}
+
+static void print_leaf_json(struct dump_json_ctx *ctx, struct extent_buffer *eb)
+{
+	const u32 leaf_data_size = __BTRFS_LEAF_DATA_SIZE(eb->len);
+	const u32 nr = btrfs_header_nritems(eb);
+	const u64 owner = btrfs_header_owner(eb);
+
+	for (int i = 0; i < nr; i++) {
+		struct btrfs_key key;
+		u32 item_size;
+
+		/* Same as for the text output, don't read outside of the leaf */
+		if (btrfs_item_offset(eb, i) > leaf_data_size ||
+		    btrfs_item_size(eb, i) + btrfs_item_offset(eb, i) >
+		    leaf_data_size) {
+			error(
+"leaf %llu slot %u pointer invalid, offset %u size %u leaf data limit %u",
+			      btrfs_header_bytenr(eb), i,
+			      btrfs_item_offset(eb, i),
+			      btrfs_item_size(eb, i), leaf_data_size);
+			error("skip remaining slots");
+			break;
+		}
+
+		btrfs_item_key_to_cpu(eb, &key, i);
+		if (!filter_match(ctx->filter, &key))
+			continue;
+
+		item_size = btrfs_item_size(eb, i);
+		fmt_start_line(&ctx->fctx, dump_tree_rowspec);
+		fmt_print(&ctx->fctx, "tree", owner);
+		fmt_print(&ctx->fctx, "block", eb->start);
+		fmt_print(&ctx->fctx, "slot", (u64)i);
+		print_key_fields(ctx, &key);
+		fmt_print(&ctx->fctx, "item_size", (u64)item_size);
+		print_item_data(ctx, eb, i, &key);
+		fmt_end_line(&ctx->fctx);
+		ctx->items++;
+	}
+}
+
+static void print_node_json(struct dump_json_ctx *ctx, struct extent_buffer *eb)
+{
+	const u32 nr = btrfs_header_nritems(eb);
+
+	for (int i = 0; i < nr; i++) {
+		struct btrfs_key key;
+
+		btrfs_node_key_to_cpu(eb, &key, i);
+		if (!filter_match(ctx->filter, &key))
+			continue;
+
+		fmt_start_line(&ctx->fctx, dump_tree_rowspec);
+		fmt_print(&ctx->fctx, "tree", btrfs_header_owner(eb));
+		fmt_print(&ctx->fctx, "block", eb->start);
+		fmt_print(&ctx->fctx, "level", (u64)btrfs_header_level(eb));
+		fmt_print(&ctx->fctx, "slot", (u64)i);
+		print_key_fields(ctx, &key);
+		fmt_print(&ctx->fctx, "blockptr", btrfs_node_blockptr(eb, i));
+		fmt_print(&ctx->fctx, "generation", btrfs_node_ptr_generation(eb, i));
+		fmt_end_line(&ctx->fctx);
+		ctx->items++;
+	}
+}
+
+/*
+ * Depth-first walk printing leaf items. Child blocks that cannot contain a key
+ * in the filtered objectid range are not read at all, the range of a child is
+ * bounded by its key and the key of the next slot.
+ */
+static int walk_tree_json(struct dump_json_ctx *ctx, struct extent_buffer *eb)
+{
+	const struct dump_tree_filter *filter = ctx->filter;
+	const u32 nr = btrfs_header_nritems(eb);
+	const int level = btrfs_header_level(eb);
+	int ret = 0;
+
+	if (level == 0) {
+		print_leaf_json(ctx, eb);
+		return 0;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		struct btrfs_tree_parent_check check = {
+			.owner_root = btrfs_header_owner(eb),
+			.transid = btrfs_node_ptr_generation(eb, i),
+			.level = level - 1,
+		};
+		struct extent_buffer *next;
+		struct btrfs_key key;
+
+		btrfs_node_key_to_cpu(eb, &key, i);
+		if (key.objectid > filter->max_objectid)
+			break;
+		if (i + 1 < nr) {
+			struct btrfs_key next_key;
+
+			btrfs_node_key_to_cpu(eb, &next_key, i + 1);
+			if (next_key.objectid < filter->min_objectid)
+				continue;
+		}
+
+		next = read_tree_block(ctx->fs_info, btrfs_node_blockptr(eb, i),
+				       &check);
+		if (!extent_buffer_uptodate(next)) {
+			error("failed to read tree block %llu",
+			      btrfs_node_blockptr(eb, i));
+			free_extent_buffer(next);
+			ret = -EIO;
+			continue;
+		}
+		if (btrfs_header_level(next) != level - 1) {
+			warning(
+	"eb corrupted: item %d eb level %d next level %d, skipping the rest",
+				i, level, btrfs_header_level(next));
+			free_extent_buffer(next);
+			return -EUCLEAN;
+		}
+		if (walk_tree_json(ctx, next) < 0)
+			ret = -EIO;
+		free_extent_buffer(next);
+	}
+	return ret;
+}
+
+/*
+ * Print items of one tree block. Nodes print only their key pointers unless
+ * @follow is set, then all leaves reachable from the block are printed. The
+ * number of printed items is returned in @items_ret if not NULL.
+ */
+int dump_tree_json_block(struct btrfs_fs_info *fs_info, struct extent_buffer *eb,
+			 bool follow, const struct dump_tree_filter *filter,
+			 u64 *items_ret)
+{
+	struct dump_json_ctx ctx = { .fs_info = fs_info, .filter = filter };
+	int ret = 0;
+
+	if (btrfs_header_level(eb) > 0 && !follow)
+		print_node_json(&ctx, eb);
+	else
+		ret = walk_tree_json(&ctx, eb);
+	if (items_ret)
+		*items_ret = ctx.items;
+	return ret;
+}
+
+static int dump_root_json(struct dump_json_ctx *ctx, struct btrfs_root *root,
+			  const char *name)
+{
+	if (!root || !extent_buffer_uptodate(root->node)) {
+		error("cannot print %s, invalid pointer", name);
+		return -EIO;
+	}
+	return walk_tree_json(ctx, root->node);
+}
+
+/*
+ * Print all trees referenced by root items in @tree_root, or only the one
+ * with @tree_id if it's not 0.
+ */
+static int dump_root_items_json(struct dump_json_ctx *ctx,
+				struct btrfs_root *tree_root, u64 tree_id)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+	int err = 0;
+
+	if (!extent_buffer_uptodate(tree_root->node))
+		return 0;
+
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read ROOT_ITEM from tree %llu: %m",
+		      tree_root->root_key.objectid);
+		return ret;
+	}
+	while (1) {
+		struct btrfs_tree_parent_check check = { 0 };
+		struct btrfs_root_item ri;
+		struct extent_buffer *leaf;
+		struct extent_buffer *buf;
+		int slot;
+
+		leaf = path.nodes[0];
+		slot = path.slots[0];
+		if (slot >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret != 0)
+				break;
+			leaf = path.nodes[0];
+			slot = path.slots[0];
+		}
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		if (key.type != BTRFS_ROOT_ITEM_KEY ||
+		    (tree_id && key.objectid != tree_id))
+			goto next;
+
+		read_extent_buffer(leaf, &ri, btrfs_item_ptr_offset(leaf, slot),
+				   sizeof(ri));
+		check.owner_root = key.objectid;
+		buf = read_tree_block(ctx->fs_info, btrfs_root_bytenr(&ri), &check);
+		if (!extent_buffer_uptodate(buf)) {
+			error("failed to read root of tree %llu at %llu",
+			      key.objectid, btrfs_root_bytenr(&ri));
+			err = -EIO;
+		} else if (walk_tree_json(ctx, buf) < 0) {
+			err = -EIO;
+		}
+		free_extent_buffer(buf);
+next:
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	if (ret < 0)
+		return ret;
+	return err;
+}
+
+/*
+ * Print items of all trees in the filesystem, or of the tree with @tree_id if
+ * it's not 0. The trees are in the same order as the text output.
+ */
+int dump_tree_json_trees(struct btrfs_fs_info *fs_info, u64 tree_id,
+			 const struct dump_tree_filter *filter)
+{
+	struct dump_json_ctx ctx = { .fs_info = fs_info, .filter = filter };
+	int ret;
+	int err = 0;
+
+	switch (tree_id) {
+	case BTRFS_ROOT_TREE_OBJECTID:
+		return dump_root_json(&ctx, fs_info->tree_root, "root tree");
+	case BTRFS_CHUNK_TREE_OBJECTID:
+		return dump_root_json(&ctx, fs_info->chunk_root, "chunk tree");
+	case BTRFS_TREE_LOG_OBJECTID:
+		return dump_root_json(&ctx, fs_info->log_root_tree, "log root tree");
+	case BTRFS_BLOCK_GROUP_TREE_OBJECTID:
+		return dump_root_json(&ctx, fs_info->block_group_root,
+				      "block group tree");
+	case 0:
+		ret = dump_root_json(&ctx, fs_info->tree_root, "root tree");
+		if (ret < 0)
+			err = ret;
+		ret = dump_root_json(&ctx, fs_info->chunk_root, "chunk tree");
+		if (ret < 0)
+			err = ret;
+		if (fs_info->log_root_tree) {
+			ret = dump_root_json(&ctx, fs_info->log_root_tree,
+					     "log root tree");
+			if (ret < 0)
+				err = ret;
+		}
+		break;
+	}
+
+	ret = dump_root_items_json(&ctx, fs_info->tree_root, tree_id);
+	if (ret < 0)
+		err = ret;
+	if (fs_info->log_root_tree) {
+		ret = dump_root_items_json(&ctx, fs_info->log_root_tree, tree_id);
+		if (ret < 0)
+			err = ret;
+	}
+	return err;
+}
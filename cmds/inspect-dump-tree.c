@@ -17,8 +17,12 @@
  */
 
 #include "kerncompat.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
 #include <getopt.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -39,8 +43,12 @@
 #include "common/help.h"
 #include "common/device-scan.h"
 #include "common/string-utils.h"
+#include "common/path-utils.h"
 #include "common/parse-utils.h"
+#include "common/utils.h"
+#include "common/format-output.h"
 #include "cmds/commands.h"
+#include "cmds/inspect-dump-tree.h"
 
 static void print_extents(struct extent_buffer *eb)
 {
@@ -160,6 +168,13 @@ static const char * const cmd_inspect_dump_tree_usage[] = {
 	OPTLINE("--hide-names", "hide filenames/subvolume/xattrs and other name references"),
 	OPTLINE("--csum-headers", "print node checksums stored in headers (metadata)"),
 	OPTLINE("--csum-items", "print checksums stored in checksum items (data)"),
+	OPTLINE("--output-dir <dir>", "write each tree to a separate file in <dir> and print "
+		"item count and time of each, the trees are dumped in parallel"),
+	OPTLINE("--jobs <N>", "with --output-dir, number of worker processes (default: number of CPUs)"),
+	OPTLINE("--filter <spec>", "with --format json print only items matching the comma "
+		"separated list of type=<NAME|number> and objectid=<number|a..b>"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
 	NULL
 };
 
@@ -195,7 +210,7 @@ static int dump_add_tree_block(struct cache_tree *tree, u64 bytenr)
 }
 
 /*
- * Print all tree blocks recorded.
+ * Print all tree blocks recorded, in json format if @filter is not NULL.
  * All tree block bytenr record will also be freed in this function.
  *
  * Return 0 if nothing wrong happened for *each* tree blocks
@@ -203,7 +218,8 @@ static int dump_add_tree_block(struct cache_tree *tree, u64 bytenr)
  * error.
  */
 static int dump_print_tree_blocks(struct btrfs_fs_info *fs_info,
-				  struct cache_tree *tree, unsigned int mode)
+				  struct cache_tree *tree, unsigned int mode,
+				  const struct dump_tree_filter *filter)
 {
 	struct cache_extent *ce;
 	struct extent_buffer *eb;
@@ -234,7 +250,12 @@ static int dump_print_tree_blocks(struct btrfs_fs_info *fs_info,
 			ret = -EIO;
 			goto next;
 		}
-		btrfs_print_tree(eb, mode);
+		if (filter)
+			dump_tree_json_block(fs_info, eb,
+					     mode & BTRFS_PRINT_TREE_FOLLOW, filter,
+					     NULL);
+		else
+			btrfs_print_tree(eb, mode);
 		free_extent_buffer(eb);
 next:
 		remove_cache_extent(tree, ce);
@@ -244,6 +265,343 @@ next:
 	return ret;
 }
 
+/* One tree to be dumped to a file by --output-dir */
+struct dump_tree_job {
+	u64 objectid;
+	u64 offset;
+	u64 bytenr;
+	int level;
+	char name[64];
+};
+
+/* Sent from the worker processes to the parent, small enough to be atomic */
+struct dump_tree_result {
+	u32 index;
+	int ret;
+	u64 items;
+	u64 elapsed_ns;
+};
+
+static int add_dump_job(struct dump_tree_job **jobs, int *nr, u64 objectid,
+			u64 offset, u64 bytenr, int level)
+{
+	struct dump_tree_job *tmp;
+	struct dump_tree_job *job;
+
+	tmp = realloc(*jobs, (*nr + 1) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	*jobs = tmp;
+	job = &tmp[*nr];
+	job->objectid = objectid;
+	job->offset = offset;
+	job->bytenr = bytenr;
+	job->level = level;
+	if (objectid == BTRFS_TREE_RELOC_OBJECTID)
+		snprintf(job->name, sizeof(job->name), "tree-reloc-%llu", offset);
+	else if (objectid == BTRFS_TREE_LOG_OBJECTID && offset)
+		snprintf(job->name, sizeof(job->name), "tree-log-%llu", offset);
+	else if (objectid == BTRFS_TREE_LOG_OBJECTID)
+		snprintf(job->name, sizeof(job->name), "tree-log");
+	else if (objectid == BTRFS_DATA_RELOC_TREE_OBJECTID)
+		snprintf(job->name, sizeof(job->name), "tree-data-reloc");
+	else if (objectid >= BTRFS_LAST_FREE_OBJECTID)
+		snprintf(job->name, sizeof(job->name), "tree-%lld-%llu",
+			 (long long)objectid, offset);
+	else
+		snprintf(job->name, sizeof(job->name), "tree-%llu", objectid);
+	(*nr)++;
+	return 0;
+}
+
+static int add_root_item_jobs(struct btrfs_root *tree_root, u64 tree_id,
+			      struct dump_tree_job **jobs, int *nr)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	if (!extent_buffer_uptodate(tree_root->node))
+		return 0;
+
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read ROOT_ITEM from tree %llu: %m",
+		      tree_root->root_key.objectid);
+		return ret;
+	}
+	while (1) {
+		struct btrfs_root_item ri;
+		struct extent_buffer *leaf = path.nodes[0];
+		int slot = path.slots[0];
+
+		if (slot >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret != 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		if (key.type == BTRFS_ROOT_ITEM_KEY &&
+		    (!tree_id || key.objectid == tree_id)) {
+			read_extent_buffer(leaf, &ri,
+					   btrfs_item_ptr_offset(leaf, slot),
+					   sizeof(ri));
+			ret = add_dump_job(jobs, nr, key.objectid, key.offset,
+					   btrfs_root_bytenr(&ri),
+					   btrfs_root_level(&ri));
+			if (ret < 0)
+				break;
+		}
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	return ret < 0 ? ret : 0;
+}
+
+/* Larger trees first so they don't end up last on one worker */
+static int cmp_dump_job_level(const void *a, const void *b)
+{
+	const struct dump_tree_job *ja = a;
+	const struct dump_tree_job *jb = b;
+
+	return jb->level - ja->level;
+}
+
+/*
+ * Worker process, dump every nr_workers-th tree starting at @worker, each to
+ * its own file, and send the result of each to @result_fd.
+ */
+static void dump_tree_worker(struct btrfs_fs_info *fs_info,
+			     const struct dump_tree_job *jobs, int nr_jobs,
+			     int worker, int nr_workers, const char *dir,
+			     unsigned int mode, const struct dump_tree_filter *filter,
+			     int result_fd)
+{
+	fflush(stdout);
+	setvbuf(stdout, NULL, _IOFBF, SZ_1M);
+	for (int i = worker; i < nr_jobs; i += nr_workers) {
+		const struct dump_tree_job *job = &jobs[i];
+		struct btrfs_tree_parent_check check = {
+			.owner_root = job->objectid,
+		};
+		struct dump_tree_result result = { .index = i };
+		struct extent_buffer *eb;
+		char path[PATH_MAX];
+		char fname[128];
+		u64 start = get_monotonic_ns();
+		int fd;
+
+		snprintf(fname, sizeof(fname), "%s.%s", job->name,
+			 filter ? "json" : "txt");
+		result.ret = path_cat_out(path, dir, fname);
+		if (result.ret < 0) {
+			error("output path too long: %s/%s", dir, fname);
+			goto send;
+		}
+		/*
+		 * Redirect stdout only after the file is open, a failed
+		 * freopen() would leave stdout closed for the next trees.
+		 */
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			result.ret = -errno;
+			error("cannot create %s: %m", path);
+			goto send;
+		}
+		fflush(stdout);
+		if (dup2(fd, STDOUT_FILENO) < 0) {
+			result.ret = -errno;
+			error("cannot redirect output to %s: %m", path);
+			close(fd);
+			goto send;
+		}
+		close(fd);
+
+		eb = read_tree_block(fs_info, job->bytenr, &check);
+		if (!extent_buffer_uptodate(eb)) {
+			error("failed to read root of tree %s at %llu",
+			      job->name, job->bytenr);
+			result.ret = -EIO;
+		} else {
+			if (filter)
+				dump_tree_json_block(fs_info, eb, true, filter,
+						     &result.items);
+			else
+				result.items = btrfs_print_tree_count(eb,
+						BTRFS_PRINT_TREE_FOLLOW | mode);
+		}
+		free_extent_buffer(eb);
+		if (fflush(stdout)) {
+			result.ret = -errno;
+			error("cannot write %s: %m", path);
+		}
+send:
+		result.elapsed_ns = get_monotonic_ns() - start;
+		if (write(result_fd, &result, sizeof(result)) != sizeof(result))
+			break;
+	}
+	fflush(stdout);
+}
+
+static const struct rowspec dump_tree_summary_rowspec[] = {
+	{ .key = "tree", .fmt = "%llu", .out_json = "tree" },
+	{ .key = "offset", .fmt = "%llu", .out_json = "offset" },
+	{ .key = "name", .fmt = "str", .out_json = "name" },
+	{ .key = "items", .fmt = "%llu", .out_json = "items" },
+	{ .key = "elapsed_ms", .fmt = "%llu", .out_json = "elapsed_ms" },
+	{ .key = "error", .fmt = "bool", .out_json = "error" },
+	ROWSPEC_END
+};
+
+static void print_dump_summary(const struct dump_tree_job *jobs,
+			       const struct dump_tree_result *results, int nr,
+			       bool json, u64 elapsed_ns)
+{
+	struct format_ctx fctx;
+	u64 total = 0;
+
+	if (json) {
+		fmt_start(&fctx, dump_tree_summary_rowspec, 0, 0);
+		fmt_print_start_group(&fctx, "dump-tree", JSON_TYPE_ARRAY);
+		for (int i = 0; i < nr; i++) {
+			fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&fctx, "tree", jobs[i].objectid);
+			fmt_print(&fctx, "offset", jobs[i].offset);
+			fmt_print(&fctx, "name", jobs[i].name);
+			fmt_print(&fctx, "items", results[i].items);
+			fmt_print(&fctx, "elapsed_ms",
+				  results[i].elapsed_ns / 1000000);
+			fmt_print(&fctx, "error", results[i].ret != 0);
+			fmt_print_end_group(&fctx, NULL);
+		}
+		fmt_print_end_group(&fctx, "dump-tree");
+		fmt_end(&fctx);
+		return;
+	}
+
+	pr_verbose(LOG_DEFAULT, "%-24s %14s %12s\n", "Tree", "Items", "Time");
+	for (int i = 0; i < nr; i++) {
+		total += results[i].items;
+		pr_verbose(LOG_DEFAULT, "%-24s %14llu %11.3fs%s\n", jobs[i].name,
+			   results[i].items, results[i].elapsed_ns / 1e9,
+			   results[i].ret ? " (error)" : "");
+	}
+	pr_verbose(LOG_DEFAULT, "%-24s %14llu %11.3fs\n", "total", total,
+		   elapsed_ns / 1e9);
+}
+
+/*
+ * Dump each tree to a separate file in @dir. The trees are distributed among
+ * @nr_workers forked processes, each with a private copy of the extent buffer
+ * cache as it's not safe to share it among threads.
+ */
+static int dump_trees_to_dir(struct btrfs_fs_info *fs_info, const char *dir,
+			     u64 tree_id, unsigned int mode,
+			     const struct dump_tree_filter *filter, int nr_workers)
+{
+	struct dump_tree_job *jobs = NULL;
+	struct dump_tree_result *results = NULL;
+	struct dump_tree_result result;
+	int nr_jobs = 0;
+	int pipefd[2];
+	u64 start = get_monotonic_ns();
+	int ret = 0;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		error("cannot create directory %s: %m", dir);
+		return -errno;
+	}
+
+	if (tree_id == 0 || tree_id == BTRFS_ROOT_TREE_OBJECTID)
+		ret = add_dump_job(&jobs, &nr_jobs, BTRFS_ROOT_TREE_OBJECTID, 0,
+				   fs_info->tree_root->node->start,
+				   btrfs_header_level(fs_info->tree_root->node));
+	if (ret == 0 && (tree_id == 0 || tree_id == BTRFS_CHUNK_TREE_OBJECTID))
+		ret = add_dump_job(&jobs, &nr_jobs, BTRFS_CHUNK_TREE_OBJECTID, 0,
+				   fs_info->chunk_root->node->start,
+				   btrfs_header_level(fs_info->chunk_root->node));
+	if (ret == 0 && fs_info->log_root_tree &&
+	    (tree_id == 0 || tree_id == BTRFS_TREE_LOG_OBJECTID))
+		ret = add_dump_job(&jobs, &nr_jobs, BTRFS_TREE_LOG_OBJECTID, 0,
+				   fs_info->log_root_tree->node->start,
+				   btrfs_header_level(fs_info->log_root_tree->node));
+	if (ret == 0 && tree_id != BTRFS_ROOT_TREE_OBJECTID &&
+	    tree_id != BTRFS_CHUNK_TREE_OBJECTID)
+		ret = add_root_item_jobs(fs_info->tree_root, tree_id, &jobs,
+					 &nr_jobs);
+	if (ret == 0 && fs_info->log_root_tree && tree_id != BTRFS_ROOT_TREE_OBJECTID &&
+	    tree_id != BTRFS_CHUNK_TREE_OBJECTID)
+		ret = add_root_item_jobs(fs_info->log_root_tree, tree_id, &jobs,
+					 &nr_jobs);
+	if (ret < 0)
+		goto out;
+	if (nr_jobs == 0) {
+		error("no tree found");
+		ret = -ENOENT;
+		goto out;
+	}
+	qsort(jobs, nr_jobs, sizeof(*jobs), cmp_dump_job_level);
+
+	results = calloc(nr_jobs, sizeof(*results));
+	if (!results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < nr_jobs; i++)
+		results[i].ret = -ECHILD;
+
+	if (pipe(pipefd) < 0) {
+		ret = -errno;
+		error("cannot create pipe: %m");
+		goto out;
+	}
+	nr_workers = min(nr_workers, nr_jobs);
+	fflush(stdout);
+	fflush(stderr);
+	for (int i = 0; i < nr_workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			/* Trees of the workers not started are reported below */
+			error("cannot start worker process: %m");
+			break;
+		}
+		if (pid == 0) {
+			close(pipefd[0]);
+			dump_tree_worker(fs_info, jobs, nr_jobs, i, nr_workers,
+					 dir, mode, filter, pipefd[1]);
+			_exit(0);
+		}
+	}
+	close(pipefd[1]);
+
+	while (read(pipefd[0], &result, sizeof(result)) == sizeof(result)) {
+		if (result.index < nr_jobs)
+			results[result.index] = result;
+	}
+	close(pipefd[0]);
+	while (wait(NULL) > 0)
+		;
+
+	for (int i = 0; i < nr_jobs; i++) {
+		if (results[i].ret == -ECHILD)
+			error("tree %s not dumped", jobs[i].name);
+		if (results[i].ret)
+			ret = results[i].ret;
+	}
+	print_dump_summary(jobs, results, nr_jobs, filter != NULL,
+			   get_monotonic_ns() - start);
+out:
+	free(results);
+	free(jobs);
+	return ret;
+}
+
 static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 				 int argc, char **argv)
 {
@@ -272,6 +630,11 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	unsigned int follow = 0;
 	unsigned int csum_mode = 0;
 	unsigned int print_mode;
+	struct dump_tree_filter filter;
+	bool json = (bconf.output_format == CMD_FORMAT_JSON);
+	bool has_filter = false;
+	const char *output_dir = NULL;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
 	/*
 	 * For debug-tree, we care nothing about extent tree (it's just backref
@@ -286,6 +649,7 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	oca.flags = OPEN_CTREE_PARTIAL | OPEN_CTREE_NO_BLOCK_GROUPS |
 		    OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS;
 	cache_tree_init(&block_root);
+	dump_tree_filter_init(&filter);
 	optind = 0;
 	while (1) {
 		int c;
@@ -293,6 +657,7 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 			GETOPT_VAL_BFS,
 		       GETOPT_VAL_NOSCAN, GETOPT_VAL_HIDE_NAMES,
 		       GETOPT_VAL_CSUM_HEADERS, GETOPT_VAL_CSUM_ITEMS,
+		       GETOPT_VAL_FILTER, GETOPT_VAL_OUTPUT_DIR, GETOPT_VAL_JOBS,
 		};
 		static const struct option long_options[] = {
 			{ "extents", no_argument, NULL, 'e'},
@@ -309,6 +674,9 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 			{ "hide-names", no_argument, NULL, GETOPT_VAL_HIDE_NAMES },
 			{ "csum-headers", no_argument, NULL, GETOPT_VAL_CSUM_HEADERS },
 			{ "csum-items", no_argument, NULL, GETOPT_VAL_CSUM_ITEMS },
+			{ "filter", required_argument, NULL, GETOPT_VAL_FILTER },
+			{ "output-dir", required_argument, NULL, GETOPT_VAL_OUTPUT_DIR },
+			{ "jobs", required_argument, NULL, GETOPT_VAL_JOBS },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -371,6 +739,25 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 		case GETOPT_VAL_CSUM_ITEMS:
 			csum_mode |= BTRFS_PRINT_TREE_CSUM_ITEMS;
 			break;
+		case GETOPT_VAL_FILTER:
+			if (dump_tree_parse_filter(optarg, &filter) < 0)
+				return 1;
+			has_filter = true;
+			break;
+		case GETOPT_VAL_OUTPUT_DIR:
+			output_dir = optarg;
+			break;
+		case GETOPT_VAL_JOBS: {
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp < 1 || tmp > INT_MAX) {
+				error("number of jobs must be between 1 and %d",
+				      INT_MAX);
+				return 1;
+			}
+			jobs = tmp;
+			break;
+		}
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -379,11 +766,30 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (has_filter && !json) {
+		error("--filter is supported only with --format json");
+		return 1;
+	}
+	if (json && (extent_only || device_only || roots_only || uuid_tree_only ||
+		     csum_mode)) {
+		error("options -e, -d, -r, -R, -u and --csum-* not supported with --format json");
+		return 1;
+	}
+
+	if (output_dir && (extent_only || device_only || roots_only ||
+			   uuid_tree_only || !cache_tree_empty(&block_root))) {
+		error("options -e, -d, -r, -R, -u and -b not supported with --output-dir");
+		return 1;
+	}
+	if (jobs < 1)
+		jobs = 1;
+
 	ret = btrfs_scan_argv_devices(optind, argc, argv);
 	if (ret)
 		return ret;
 
-	pr_verbose(LOG_DEFAULT, "%s\n", PACKAGE_STRING);
+	if (!json && !output_dir)
+		pr_verbose(LOG_DEFAULT, "%s\n", PACKAGE_STRING);
 
 	oca.filename = argv[optind];
 	info = open_ctree_fs_info(&oca);
@@ -394,9 +800,31 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 
 	print_mode = follow | traverse | csum_mode;
 
+	if (output_dir) {
+		root = info->tree_root;
+		ret = dump_trees_to_dir(info, output_dir, tree_id, print_mode,
+					json ? &filter : NULL, jobs);
+		close_ctree(root);
+		return !!ret;
+	}
+
+	if (json) {
+		/* One line per item, avoid flushing after each of them */
+		setvbuf(stdout, NULL, _IOFBF, SZ_1M);
+		if (!cache_tree_empty(&block_root)) {
+			root = info->chunk_root;
+			ret = dump_print_tree_blocks(info, &block_root,
+						     print_mode, &filter);
+		} else {
+			root = info->fs_root;
+			ret = dump_tree_json_trees(info, tree_id, &filter);
+		}
+		goto close_root;
+	}
+
 	if (!cache_tree_empty(&block_root)) {
 		root = info->chunk_root;
-		ret = dump_print_tree_blocks(info, &block_root, print_mode);
+		ret = dump_print_tree_blocks(info, &block_root, print_mode, NULL);
 		goto close_root;
 	}
 
@@ -679,4 +1107,4 @@ close_root:
 out:
 	return !!ret;
 }
-DEFINE_SIMPLE_COMMAND(inspect_dump_tree, "dump-tree");
+DEFINE_COMMAND_WITH_FLAGS(inspect_dump_tree, "dump-tree", CMD_FORMAT_JSON);
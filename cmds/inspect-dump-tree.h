@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __CMDS_INSPECT_DUMP_TREE_H__
+#define __CMDS_INSPECT_DUMP_TREE_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+struct btrfs_fs_info;
+struct extent_buffer;
+
+/* Selection of items for the json output of dump-tree */
+struct dump_tree_filter {
+	/* Set if any type has been selected, otherwise all types match */
+	bool has_types;
+	bool types[256];
+	/* Inclusive range of key objectids */
+	u64 min_objectid;
+	u64 max_objectid;
+};
+
+void dump_tree_filter_init(struct dump_tree_filter *filter);
+int dump_tree_parse_filter(const char *str, struct dump_tree_filter *filter);
+
+int dump_tree_json_block(struct btrfs_fs_info *fs_info, struct extent_buffer *eb,
+			 bool follow, const struct dump_tree_filter *filter,
+			 u64 *items_ret);
+int dump_tree_json_trees(struct btrfs_fs_info *fs_info, u64 tree_id,
+			 const struct dump_tree_filter *filter);
+
+#endif
@@ -492,7 +492,7 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 			"\tchanges unexpectedly, restart if needed or remount read-only", argv[optind]);
 	}
 
-	root = open_ctree(argv[optind], 0, 0);
+	root = open_ctree(argv[optind], 0, OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if (!root) {
 		error("cannot open ctree");
 		exit(1);
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include <zlib.h>
 #if COMPRESSION_LZO
@@ -49,6 +50,7 @@
 #include "common/messages.h"
 #include "common/utils.h"
 #include "common/send-stream.h"
+#include "common/send-index.h"
 #include "common/send-utils.h"
 #include "common/help.h"
 #include "common/path-utils.h"
@@ -56,6 +58,73 @@
 #include "cmds/commands.h"
 #include "cmds/receive-dump.h"
 
+/* Number of cached clone source subvolumes and open files */
+#define CLONE_SUBVOL_CACHE_SIZE		(16)
+#define CLONE_FD_CACHE_SIZE		(64)
+
+struct clone_subvol_entry {
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 ctransid;
+	/* Path of the subvolume as found by the uuid search, NULL if unused */
+	char *path;
+	u64 last_used;
+};
+
+struct clone_fd_entry {
+	/* Path relative to the mount point, NULL if unused */
+	char *path;
+	int fd;
+	u64 last_used;
+};
+
+/* Reuse stream objects for encoded_write decompression fallback */
+struct decompress_stream {
+#if COMPRESSION_ZSTD
+	ZSTD_DStream *zstd_dstream;
+#endif
+	z_stream *zlib_stream;
+};
+
+#define DECOMPRESS_MAX_THREADS		(16)
+#define DECOMPRESS_QUEUE_SIZE		(4 * DECOMPRESS_MAX_THREADS)
+
+/* Encoded write that could not be written directly, with copy of the data */
+struct decompress_job {
+	/* Full path of the file, for waiting on the writes to it */
+	char *path;
+	int fd;
+	char *encoded_data;
+	u64 encoded_len;
+	u64 offset;
+	u64 unencoded_file_len;
+	u64 unencoded_len;
+	u64 unencoded_offset;
+	u32 compression;
+};
+
+/*
+ * Threads decompressing the queued jobs in parallel. The decompressed data
+ * are written in the order of the stream, the commands changing a file
+ * wait for the queued writes to the file first.
+ */
+struct decompress_pool {
+	pthread_mutex_t lock;
+	/* New job queued or stop */
+	pthread_cond_t work_cond;
+	/* Job written */
+	pthread_cond_t done_cond;
+	struct decompress_job jobs[DECOMPRESS_QUEUE_SIZE];
+	/* Sequence numbers, the job is in jobs[seq % DECOMPRESS_QUEUE_SIZE] */
+	u64 nr_submitted;
+	u64 next_start;
+	u64 next_write;
+	/* First error of any job */
+	int error;
+	bool stop;
+	int nr_threads;
+	pthread_t threads[DECOMPRESS_MAX_THREADS];
+};
+
 struct btrfs_receive
 {
 	int mnt_fd;
@@ -82,13 +151,74 @@ struct btrfs_receive
 
 	bool force_decompress;
 
-#if COMPRESSION_ZSTD
-	/* Reuse stream objects for encoded_write decompression fallback */
-	ZSTD_DStream *zstd_dstream;
-#endif
-	z_stream *zlib_stream;
+	struct decompress_stream dstream;
+	struct decompress_pool *decompress_pool;
+	/* Set after the pool could not be created, don't retry */
+	bool decompress_sync;
+
+	/*
+	 * Least recently used caches of clone sources, streams with many
+	 * clones reference the same few files.
+	 */
+	struct clone_subvol_entry clone_subvols[CLONE_SUBVOL_CACHE_SIZE];
+	struct clone_fd_entry clone_fds[CLONE_FD_CACHE_SIZE];
+	u64 clone_cache_tick;
+
+	/* Index written while receiving, or used to receive only some paths */
+	const char *write_index;
+	struct btrfs_send_index *index;
+	char **select_paths;
+	int nr_select_paths;
 };
 
+static bool job_matches(const struct decompress_job *job, const char *path,
+			u64 offset, u64 len)
+{
+	size_t path_len = strlen(path);
+
+	if (strncmp(job->path, path, path_len) != 0)
+		return false;
+	/* Whole directories are waited for by rename */
+	if (job->path[path_len] == '/')
+		return true;
+	if (job->path[path_len] != 0)
+		return false;
+	return job->offset < offset + len &&
+	       offset < job->offset + job->unencoded_file_len;
+}
+
+/*
+ * Wait until the queued writes to the range of @path (or anything below it),
+ * or all writes if @path is NULL, are done. Return the first error of any of
+ * the writes.
+ */
+static int wait_decompress_jobs(struct btrfs_receive *rctx, const char *path,
+				u64 offset, u64 len)
+{
+	struct decompress_pool *pool = rctx->decompress_pool;
+	int ret;
+
+	if (!pool)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		u64 seq;
+
+		for (seq = pool->next_write; seq < pool->nr_submitted; seq++) {
+			if (!path || job_matches(&pool->jobs[seq % DECOMPRESS_QUEUE_SIZE],
+						 path, offset, len))
+				break;
+		}
+		if (seq == pool->nr_submitted)
+			break;
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	ret = pool->error;
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
 static int finish_subvol(struct btrfs_receive *rctx)
 {
 	int ret;
@@ -100,6 +230,25 @@ static int finish_subvol(struct btrfs_receive *rctx)
 	if (rctx->cur_subvol_path[0] == 0)
 		return 0;
 
+	/* All data must be written before the subvolume is made read-only */
+	ret = wait_decompress_jobs(rctx, NULL, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	/*
+	 * With --select only a part of the subvolume has been received. It must
+	 * not be found as the parent of an incremental stream by the received
+	 * UUID, so it's left without it and writable.
+	 */
+	if (rctx->nr_select_paths) {
+		if (bconf.verbose > BTRFS_BCONF_QUIET)
+			fprintf(stderr,
+		"Partially received subvolume %s left writable and without received UUID\n",
+				rctx->cur_subvol_path);
+		ret = 0;
+		goto out;
+	}
+
 	subvol_fd = openat(rctx->mnt_fd, rctx->cur_subvol_path,
 			   O_RDONLY | O_NOATIME);
 	if (subvol_fd < 0) {
@@ -240,6 +389,135 @@ static struct subvol_info *search_source_subvol(int mnt_fd, const u8 *subvol_uui
 	return found;
 }
 
+/*
+ * Find path of the clone source subvolume, cached by uuid and ctransid.
+ * The path is owned by the cache.
+ */
+static int get_clone_subvol_path(struct btrfs_receive *rctx, const u8 *uuid,
+				 u64 ctransid, const char **path)
+{
+	struct clone_subvol_entry *entry = &rctx->clone_subvols[0];
+	struct subvol_info *si;
+
+	for (int i = 0; i < CLONE_SUBVOL_CACHE_SIZE; i++) {
+		struct clone_subvol_entry *cur = &rctx->clone_subvols[i];
+
+		if (cur->path && cur->ctransid == ctransid &&
+		    memcmp(cur->uuid, uuid, BTRFS_UUID_SIZE) == 0) {
+			cur->last_used = ++rctx->clone_cache_tick;
+			*path = cur->path;
+			return 0;
+		}
+		/* Unused or least recently used entry for replacement */
+		if (entry->path && (!cur->path || cur->last_used < entry->last_used))
+			entry = cur;
+	}
+
+	si = search_source_subvol(rctx->mnt_fd, uuid, ctransid);
+	if (IS_ERR_OR_NULL(si))
+		return si ? PTR_ERR(si) : -ENOENT;
+
+	free(entry->path);
+	memcpy(entry->uuid, uuid, BTRFS_UUID_SIZE);
+	entry->ctransid = ctransid;
+	entry->path = si->path;
+	entry->last_used = ++rctx->clone_cache_tick;
+	free(si);
+	*path = entry->path;
+	return 0;
+}
+
+/*
+ * Open file @path relative to the mount point for reading as a clone source.
+ * Return the descriptor owned by the cache or negative errno.
+ */
+static int get_clone_fd(struct btrfs_receive *rctx, const char *path)
+{
+	struct clone_fd_entry *entry = &rctx->clone_fds[0];
+	char *new_path;
+	int fd;
+
+	for (int i = 0; i < CLONE_FD_CACHE_SIZE; i++) {
+		struct clone_fd_entry *cur = &rctx->clone_fds[i];
+
+		if (cur->path && strcmp(cur->path, path) == 0) {
+			cur->last_used = ++rctx->clone_cache_tick;
+			return cur->fd;
+		}
+		if (entry->path && (!cur->path || cur->last_used < entry->last_used))
+			entry = cur;
+	}
+
+	fd = openat(rctx->mnt_fd, path, O_RDONLY | O_NOATIME);
+	if (fd < 0) {
+		int ret = -errno;
+
+		error("cannot open %s: %m", path);
+		return ret;
+	}
+	new_path = strdup(path);
+	if (!new_path) {
+		close(fd);
+		error_mem(NULL);
+		return -ENOMEM;
+	}
+
+	if (entry->path) {
+		free(entry->path);
+		close(entry->fd);
+	}
+	entry->path = new_path;
+	entry->fd = fd;
+	entry->last_used = ++rctx->clone_cache_tick;
+	return fd;
+}
+
+/*
+ * Drop cached clone sources at or below @path of the received subvolume,
+ * after it's been renamed or removed by the stream.
+ */
+static void invalidate_clone_fds(struct btrfs_receive *rctx, const char *path)
+{
+	char full_path[PATH_MAX];
+	size_t len;
+
+	if (path_cat_out(full_path, rctx->cur_subvol_path, path) < 0) {
+		/* Cannot match any cached path, drop everything to be safe */
+		full_path[0] = 0;
+	}
+	len = strlen(full_path);
+
+	for (int i = 0; i < CLONE_FD_CACHE_SIZE; i++) {
+		struct clone_fd_entry *cur = &rctx->clone_fds[i];
+
+		if (!cur->path)
+			continue;
+		if (len && (strncmp(cur->path, full_path, len) != 0 ||
+			    (cur->path[len] != 0 && cur->path[len] != '/')))
+			continue;
+		free(cur->path);
+		cur->path = NULL;
+		close(cur->fd);
+	}
+}
+
+static void free_clone_cache(struct btrfs_receive *rctx)
+{
+	for (int i = 0; i < CLONE_SUBVOL_CACHE_SIZE; i++) {
+		free(rctx->clone_subvols[i].path);
+		rctx->clone_subvols[i].path = NULL;
+	}
+	for (int i = 0; i < CLONE_FD_CACHE_SIZE; i++) {
+		struct clone_fd_entry *cur = &rctx->clone_fds[i];
+
+		if (!cur->path)
+			continue;
+		free(cur->path);
+		cur->path = NULL;
+		close(cur->fd);
+	}
+}
+
 static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 			    const u8 *parent_uuid, u64 parent_ctransid,
 			    void *user)
@@ -563,9 +841,19 @@ static int process_rename(const char *from, const char *to, void *user)
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_from, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+	ret = wait_decompress_jobs(rctx, full_to, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
+	invalidate_clone_fds(rctx, from);
+	invalidate_clone_fds(rctx, to);
+
 	ret = rename(full_from, full_to);
 	if (ret < 0) {
 		ret = -errno;
@@ -595,6 +883,10 @@ static int process_link(const char *path, const char *lnk, void *user)
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_link_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "link %s -> %s\n", path, lnk);
 
@@ -624,6 +916,8 @@ static int process_unlink(const char *path, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "unlink %s\n", path);
 
+	invalidate_clone_fds(rctx, path);
+
 	ret = unlink(full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -649,6 +943,8 @@ static int process_rmdir(const char *path, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rmdir %s\n", path);
 
+	invalidate_clone_fds(rctx, path);
+
 	ret = rmdir(full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -707,6 +1003,10 @@ static int process_write(const char *path, const void *data, u64 offset,
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, offset, len);
+	if (ret < 0)
+		goto out;
+
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		goto out;
@@ -738,11 +1038,11 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	int ret;
 	struct btrfs_receive *rctx = user;
 	struct btrfs_ioctl_clone_range_args clone_args;
-	struct subvol_info *si = NULL;
 	char full_path[PATH_MAX];
 	const char *subvol_path;
+	const char *si_path = NULL;
 	char full_clone_path[PATH_MAX];
-	int clone_fd = -1;
+	int clone_fd;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -750,23 +1050,35 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, offset, len);
+	if (ret < 0)
+		goto out;
+
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		goto out;
 
 	if (memcmp(clone_uuid, rctx->cur_subvol.received_uuid,
 		   BTRFS_UUID_SIZE) == 0) {
+		char full_src_path[PATH_MAX];
+
 		subvol_path = rctx->cur_subvol_path;
+		/* The source could still have queued writes */
+		ret = path_cat_out(full_src_path, rctx->full_subvol_path,
+				   clone_path);
+		if (ret < 0) {
+			error("clone: source path invalid: %s", clone_path);
+			goto out;
+		}
+		ret = wait_decompress_jobs(rctx, full_src_path, clone_offset, len);
+		if (ret < 0)
+			goto out;
 	} else {
-		si = search_source_subvol(rctx->mnt_fd, clone_uuid,
-					  clone_ctransid);
-		if (IS_ERR_OR_NULL(si)) {
+		ret = get_clone_subvol_path(rctx, clone_uuid, clone_ctransid,
+					    &si_path);
+		if (ret < 0) {
 			char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 
-			if (!si)
-				ret = -ENOENT;
-			else
-				ret = PTR_ERR(si);
 			uuid_unparse(clone_uuid, uuid_str);
 			error("clone: cannot find source subvol %s", uuid_str);
 			goto out;
@@ -774,19 +1086,19 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		/* strip the subvolume that we are receiving to from the start of subvol_path */
 		if (rctx->full_root_path) {
 			size_t root_len = strlen(rctx->full_root_path);
-			size_t sub_len = strlen(si->path);
+			size_t sub_len = strlen(si_path);
 
 			if (sub_len > root_len &&
-			    strstr(si->path, rctx->full_root_path) == si->path &&
-			    si->path[root_len] == '/') {
-				subvol_path = si->path + root_len + 1;
+			    strstr(si_path, rctx->full_root_path) == si_path &&
+			    si_path[root_len] == '/') {
+				subvol_path = si_path + root_len + 1;
 			} else {
 				error("clone: source subvol path %s unreachable from %s",
-					si->path, rctx->full_root_path);
+					si_path, rctx->full_root_path);
 				goto out;
 			}
 		} else {
-			subvol_path = si->path;
+			subvol_path = si_path;
 		}
 	}
 
@@ -796,10 +1108,9 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		goto out;
 	}
 
-	clone_fd = openat(rctx->mnt_fd, full_clone_path, O_RDONLY | O_NOATIME);
+	clone_fd = get_clone_fd(rctx, full_clone_path);
 	if (clone_fd < 0) {
-		ret = -errno;
-		error("cannot open %s: %m", full_clone_path);
+		ret = clone_fd;
 		goto out;
 	}
 
@@ -820,12 +1131,6 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	}
 
 out:
-	if (!IS_ERR_OR_NULL(si)) {
-		free(si->path);
-		free(si);
-	}
-	if (clone_fd != -1)
-		close(clone_fd);
 	return ret;
 }
 
@@ -843,6 +1148,10 @@ static int process_set_xattr(const char *path, const char *name,
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3) {
 		fprintf(stderr, "set_xattr %s - name=%s data_len=%d "
 				"data=%.*s\n", path, name, len,
@@ -873,6 +1182,10 @@ static int process_remove_xattr(const char *path, const char *name, void *user)
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3) {
 		fprintf(stderr, "remove_xattr %s - name=%s\n",
 				path, name);
@@ -901,6 +1214,10 @@ static int process_truncate(const char *path, u64 size, void *user)
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "truncate %s size=%llu\n", path, size);
 
@@ -927,6 +1244,10 @@ static int process_chmod(const char *path, u64 mode, void *user)
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
 
@@ -953,6 +1274,10 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
 				uid, gid);
@@ -982,6 +1307,10 @@ static int process_utimes(const char *path, struct timespec *at,
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "utimes %s\n", path);
 
@@ -1012,42 +1341,42 @@ static int process_update_extent(const char *path, u64 offset, u64 len,
 	return 0;
 }
 
-static int decompress_zlib(struct btrfs_receive *rctx, const char *encoded_data,
+static int decompress_zlib(struct decompress_stream *ds, const char *encoded_data,
 			   u64 encoded_len, char *unencoded_data,
 			   u64 unencoded_len)
 {
 	bool init = false;
 	int ret;
 
-	if (!rctx->zlib_stream) {
+	if (!ds->zlib_stream) {
 		init = true;
-		rctx->zlib_stream = malloc(sizeof(z_stream));
-		if (!rctx->zlib_stream) {
+		ds->zlib_stream = malloc(sizeof(z_stream));
+		if (!ds->zlib_stream) {
 			error_mem("zlib stream: %m");
 			return -ENOMEM;
 		}
 	}
-	rctx->zlib_stream->next_in = (void *)encoded_data;
-	rctx->zlib_stream->avail_in = encoded_len;
-	rctx->zlib_stream->next_out = (void *)unencoded_data;
-	rctx->zlib_stream->avail_out = unencoded_len;
+	ds->zlib_stream->next_in = (void *)encoded_data;
+	ds->zlib_stream->avail_in = encoded_len;
+	ds->zlib_stream->next_out = (void *)unencoded_data;
+	ds->zlib_stream->avail_out = unencoded_len;
 
 	if (init) {
-		rctx->zlib_stream->zalloc = Z_NULL;
-		rctx->zlib_stream->zfree = Z_NULL;
-		rctx->zlib_stream->opaque = Z_NULL;
-		ret = inflateInit(rctx->zlib_stream);
+		ds->zlib_stream->zalloc = Z_NULL;
+		ds->zlib_stream->zfree = Z_NULL;
+		ds->zlib_stream->opaque = Z_NULL;
+		ret = inflateInit(ds->zlib_stream);
 	} else {
-		ret = inflateReset(rctx->zlib_stream);
+		ret = inflateReset(ds->zlib_stream);
 	}
 	if (ret != Z_OK) {
 		error("zlib inflate init failed: %d", ret);
 		return -EIO;
 	}
 
-	while (rctx->zlib_stream->avail_in > 0 &&
-	       rctx->zlib_stream->avail_out > 0) {
-		ret = inflate(rctx->zlib_stream, Z_FINISH);
+	while (ds->zlib_stream->avail_in > 0 &&
+	       ds->zlib_stream->avail_out > 0) {
+		ret = inflate(ds->zlib_stream, Z_FINISH);
 		if (ret == Z_STREAM_END) {
 			break;
 		} else if (ret != Z_OK) {
@@ -1059,7 +1388,7 @@ static int decompress_zlib(struct btrfs_receive *rctx, const char *encoded_data,
 }
 
 #if COMPRESSION_ZSTD
-static int decompress_zstd(struct btrfs_receive *rctx, const char *encoded_buf,
+static int decompress_zstd(struct decompress_stream *ds, const char *encoded_buf,
 			   u64 encoded_len, char *unencoded_buf,
 			   u64 unencoded_len)
 {
@@ -1073,20 +1402,20 @@ static int decompress_zstd(struct btrfs_receive *rctx, const char *encoded_buf,
 	};
 	size_t ret;
 
-	if (!rctx->zstd_dstream) {
-		rctx->zstd_dstream = ZSTD_createDStream();
-		if (!rctx->zstd_dstream) {
+	if (!ds->zstd_dstream) {
+		ds->zstd_dstream = ZSTD_createDStream();
+		if (!ds->zstd_dstream) {
 			error("failed to create zstd dstream");
 			return -ENOMEM;
 		}
 	}
-	ret = ZSTD_initDStream(rctx->zstd_dstream);
+	ret = ZSTD_initDStream(ds->zstd_dstream);
 	if (ZSTD_isError(ret)) {
 		error("failed to init zstd stream: %s", ZSTD_getErrorName(ret));
 		return -EIO;
 	}
 	while (in_buf.pos < in_buf.size && out_buf.pos < out_buf.size) {
-		ret = ZSTD_decompressStream(rctx->zstd_dstream, &out_buf, &in_buf);
+		ret = ZSTD_decompressStream(ds->zstd_dstream, &out_buf, &in_buf);
 		if (ret == 0) {
 			break;
 		} else if (ZSTD_isError(ret)) {
@@ -1108,6 +1437,20 @@ static int decompress_zstd(struct btrfs_receive *rctx, const char *encoded_buf,
 }
 #endif
 
+static void free_decompress_stream(struct decompress_stream *ds)
+{
+#if COMPRESSION_ZSTD
+	if (ds->zstd_dstream)
+		ZSTD_freeDStream(ds->zstd_dstream);
+	ds->zstd_dstream = NULL;
+#endif
+	if (ds->zlib_stream) {
+		inflateEnd(ds->zlib_stream);
+		free(ds->zlib_stream);
+		ds->zlib_stream = NULL;
+	}
+}
+
 #if COMPRESSION_LZO
 static int decompress_lzo(const char *encoded_data, u64 encoded_len,
 			  char *unencoded_data, u64 unencoded_len,
@@ -1172,16 +1515,18 @@ static int decompress_lzo(const char *encoded_data, u64 encoded_len,
 }
 #endif
 
-static int decompress_and_write(struct btrfs_receive *rctx,
-				const char *encoded_data, u64 offset,
-				u64 encoded_len, u64 unencoded_file_len,
-				u64 unencoded_len, u64 unencoded_offset,
-				u32 compression)
+/*
+ * Decompress the encoded data to a newly allocated buffer of @unencoded_len
+ * bytes.
+ */
+static int decompress_data(struct decompress_stream *ds,
+			   const char *encoded_data, u64 encoded_len,
+			   u64 unencoded_len, u32 compression,
+			   char **unencoded_ret)
 {
 	int ret = 0;
 	char *unencoded_data;
 	int sector_shift = 0;
-	u64 written = 0;
 
 	unencoded_data = calloc(unencoded_len, 1);
 	if (!unencoded_data) {
@@ -1191,14 +1536,14 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 
 	switch (compression) {
 	case BTRFS_ENCODED_IO_COMPRESSION_ZLIB:
-		ret = decompress_zlib(rctx, encoded_data, encoded_len,
+		ret = decompress_zlib(ds, encoded_data, encoded_len,
 				      unencoded_data, unencoded_len);
 		if (ret)
 			goto out;
 		break;
 	case BTRFS_ENCODED_IO_COMPRESSION_ZSTD:
 #if COMPRESSION_ZSTD
-		ret = decompress_zstd(rctx, encoded_data, encoded_len,
+		ret = decompress_zstd(ds, encoded_data, encoded_len,
 				      unencoded_data, unencoded_len);
 		if (ret)
 			goto out;
@@ -1232,25 +1577,213 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 		goto out;
 	}
 
+out:
+	if (ret)
+		free(unencoded_data);
+	else
+		*unencoded_ret = unencoded_data;
+	return ret;
+}
+
+static int write_unencoded(int fd, const char *unencoded_data, u64 offset,
+			   u64 unencoded_file_len, u64 unencoded_offset)
+{
+	u64 written = 0;
+
 	while (written < unencoded_file_len) {
 		ssize_t w;
 
-		w = pwrite(rctx->write_fd, unencoded_data + unencoded_offset,
+		w = pwrite(fd, unencoded_data + unencoded_offset,
 			   unencoded_file_len - written, offset);
 		if (w < 0) {
-			ret = -errno;
+			int ret = -errno;
+
 			error("writing unencoded data failed: %m");
-			goto out;
+			return ret;
 		}
 		written += w;
 		offset += w;
 		unencoded_offset += w;
 	}
-out:
+	return 0;
+}
+
+static int decompress_and_write(struct btrfs_receive *rctx,
+				const char *encoded_data, u64 offset,
+				u64 encoded_len, u64 unencoded_file_len,
+				u64 unencoded_len, u64 unencoded_offset,
+				u32 compression)
+{
+	char *unencoded_data;
+	int ret;
+
+	ret = decompress_data(&rctx->dstream, encoded_data, encoded_len,
+			      unencoded_len, compression, &unencoded_data);
+	if (ret)
+		return ret;
+	ret = write_unencoded(rctx->write_fd, unencoded_data, offset,
+			      unencoded_file_len, unencoded_offset);
 	free(unencoded_data);
 	return ret;
 }
 
+static void *decompress_thread(void *arg)
+{
+	struct decompress_pool *pool = arg;
+	struct decompress_stream ds = { 0 };
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		struct decompress_job *job;
+		char *unencoded_data = NULL;
+		u64 seq;
+		int ret;
+
+		while (!pool->stop && pool->next_start == pool->nr_submitted)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->next_start == pool->nr_submitted)
+			break;
+		seq = pool->next_start++;
+		job = &pool->jobs[seq % DECOMPRESS_QUEUE_SIZE];
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = decompress_data(&ds, job->encoded_data, job->encoded_len,
+				      job->unencoded_len, job->compression,
+				      &unencoded_data);
+		free(job->encoded_data);
+
+		/* Write in the order of the stream */
+		pthread_mutex_lock(&pool->lock);
+		while (pool->next_write != seq)
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!ret)
+			ret = write_unencoded(job->fd, unencoded_data, job->offset,
+					      job->unencoded_file_len,
+					      job->unencoded_offset);
+		free(unencoded_data);
+		close(job->fd);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret && !pool->error)
+			pool->error = ret;
+		free(job->path);
+		job->path = NULL;
+		pool->next_write++;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free_decompress_stream(&ds);
+	return NULL;
+}
+
+/*
+ * Start the decompression threads, return NULL if there's no point or the
+ * pool cannot be created and the data will be decompressed synchronously.
+ */
+static struct decompress_pool *create_decompress_pool(void)
+{
+	struct decompress_pool *pool;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nr_cpus < 2)
+		return NULL;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	for (int i = 0; i < min_t(long, nr_cpus, DECOMPRESS_MAX_THREADS); i++) {
+		if (pthread_create(&pool->threads[i], NULL, decompress_thread, pool))
+			break;
+		pool->nr_threads++;
+	}
+	if (pool->nr_threads == 0) {
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->work_cond);
+		pthread_cond_destroy(&pool->done_cond);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+static int queue_decompress_job(struct btrfs_receive *rctx, const char *path,
+				const char *encoded_data, u64 offset,
+				u64 encoded_len, u64 unencoded_file_len,
+				u64 unencoded_len, u64 unencoded_offset,
+				u32 compression)
+{
+	struct decompress_pool *pool = rctx->decompress_pool;
+	struct decompress_job *job;
+	char *job_path;
+	char *data;
+	int fd;
+	int ret;
+
+	/* The stream buffer and the write descriptor are reused after return */
+	job_path = strdup(path);
+	data = malloc(encoded_len);
+	fd = dup(rctx->write_fd);
+	if (!job_path || !data || fd < 0) {
+		ret = -errno;
+		error("cannot queue decompression of %s: %m", path);
+		free(job_path);
+		free(data);
+		if (fd >= 0)
+			close(fd);
+		return ret;
+	}
+	memcpy(data, encoded_data, encoded_len);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nr_submitted - pool->next_write >= DECOMPRESS_QUEUE_SIZE)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	ret = pool->error;
+	if (ret) {
+		pthread_mutex_unlock(&pool->lock);
+		free(job_path);
+		free(data);
+		close(fd);
+		return ret;
+	}
+	job = &pool->jobs[pool->nr_submitted % DECOMPRESS_QUEUE_SIZE];
+	job->path = job_path;
+	job->fd = fd;
+	job->encoded_data = data;
+	job->encoded_len = encoded_len;
+	job->offset = offset;
+	job->unencoded_file_len = unencoded_file_len;
+	job->unencoded_len = unencoded_len;
+	job->unencoded_offset = unencoded_offset;
+	job->compression = compression;
+	pool->nr_submitted++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static void free_decompress_pool(struct btrfs_receive *rctx)
+{
+	struct decompress_pool *pool = rctx->decompress_pool;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool);
+	rctx->decompress_pool = NULL;
+}
+
 static int process_encoded_write(const char *path, const void *data, u64 offset,
 				 u64 len, u64 unencoded_file_len,
 				 u64 unencoded_len, u64 unencoded_offset,
@@ -1293,6 +1826,10 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 		return ret;
 
 	if (!rctx->force_decompress) {
+		ret = wait_decompress_jobs(rctx, full_path, offset,
+					   unencoded_file_len);
+		if (ret < 0)
+			return ret;
 		ret = ioctl(rctx->write_fd, BTRFS_IOC_ENCODED_WRITE, &encoded);
 		if (ret >= 0)
 			return 0;
@@ -1308,6 +1845,15 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 				path, errno);
 	}
 
+	if (!rctx->decompress_pool && !rctx->decompress_sync) {
+		rctx->decompress_pool = create_decompress_pool();
+		rctx->decompress_sync = !rctx->decompress_pool;
+	}
+	if (rctx->decompress_pool)
+		return queue_decompress_job(rctx, full_path, data, offset, len,
+					    unencoded_file_len, unencoded_len,
+					    unencoded_offset, compression);
+
 	return decompress_and_write(rctx, data, offset, len, unencoded_file_len,
 				    unencoded_len, unencoded_offset,
 				    compression);
@@ -1330,6 +1876,10 @@ static int process_fallocate(const char *path, int mode, u64 offset, u64 len,
 		error("fallocate: path invalid: %s", path);
 		return ret;
 	}
+
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		return ret;
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		return ret;
@@ -1407,6 +1957,10 @@ static int process_enable_verity(const char *path, u8 algorithm, u32 block_size,
 		goto out;
 	}
 
+	ret = wait_decompress_jobs(rctx, full_path, 0, (u64)-1);
+	if (ret < 0)
+		goto out;
+
 	ioctl_fd = open(full_path, O_RDONLY);
 	if (ioctl_fd < 0) {
 		ret = -errno;
@@ -1470,6 +2024,52 @@ static struct btrfs_send_ops send_ops = {
 	.enable_verity = process_enable_verity,
 };
 
+/*
+ * Process only the commands of the selected paths found in the index, seeking
+ * to them in the stream. Streams without any selected path are skipped, the
+ * received subvolumes are finished if @rctx is set.
+ */
+static int process_selected_streams(struct btrfs_receive *rctx,
+				    struct btrfs_send_reader *reader,
+				    struct btrfs_send_index *index,
+				    char **paths, int nr_paths,
+				    struct btrfs_send_ops *ops, void *user,
+				    u64 max_errors)
+{
+	u32 matched = 0;
+	int ret;
+
+	for (u32 i = 0; i < btrfs_send_index_nr_streams(index); i++) {
+		u64 *offsets;
+		u64 nr;
+		u32 version;
+
+		ret = btrfs_send_index_select(index, i, paths, nr_paths,
+					      &offsets, &nr, &version);
+		if (ret < 0)
+			return ret;
+		if (nr == 0)
+			continue;
+		matched++;
+		ret = btrfs_process_send_stream_cmds(reader, version, offsets,
+						     nr, ops, user, max_errors);
+		free(offsets);
+		if (ret < 0)
+			return ret;
+		if (rctx) {
+			close_inode_for_write(rctx);
+			ret = finish_subvol(rctx);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	if (matched == 0) {
+		error("none of the selected paths found in the index");
+		return -ENOENT;
+	}
+	return 0;
+}
+
 static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 		      char *realmnt, int r_fd, u64 max_errors)
 {
@@ -1477,6 +2077,10 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	int ret;
 	char *dest_dir_full_path;
 	char root_subvol_path[PATH_MAX];
+	struct btrfs_send_reader *reader = NULL;
+	struct btrfs_send_index_writer *iw = NULL;
+	struct btrfs_send_ops *ops = &send_ops;
+	void *user = rctx;
 	bool end = false;
 	int iterations = 0;
 
@@ -1572,9 +2176,33 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 			rctx->dest_dir_path++;
 	}
 
+	reader = btrfs_send_reader_alloc(r_fd);
+	if (!reader) {
+		ret = -errno;
+		error_mem("send stream reader");
+		goto out;
+	}
+
+	if (rctx->index) {
+		ret = process_selected_streams(rctx, reader, rctx->index,
+					       rctx->select_paths,
+					       rctx->nr_select_paths,
+					       &send_ops, rctx, max_errors);
+		goto out;
+	}
+	if (rctx->write_index) {
+		iw = btrfs_send_index_writer_alloc(rctx->write_index, reader,
+						   &send_ops, rctx);
+		if (!iw) {
+			ret = -EINVAL;
+			goto out;
+		}
+		ops = &btrfs_send_index_ops;
+		user = iw;
+	}
+
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops,
-							 rctx,
+		ret = btrfs_read_and_process_send_stream(reader, ops, user,
 							 rctx->honor_end_cmd,
 							 max_errors);
 		if (ret < 0) {
@@ -1601,8 +2229,13 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 		iterations++;
 	}
 	ret = 0;
+	if (iw)
+		ret = btrfs_send_index_writer_finish(iw);
 
 out:
+	btrfs_send_index_writer_free(iw);
+	btrfs_send_reader_free(reader);
+	free_clone_cache(rctx);
 	if (rctx->write_fd != -1) {
 		close(rctx->write_fd);
 		rctx->write_fd = -1;
@@ -1621,14 +2254,8 @@ out:
 		close(rctx->dest_dir_fd);
 		rctx->dest_dir_fd = -1;
 	}
-#if COMPRESSION_ZSTD
-	if (rctx->zstd_dstream)
-		ZSTD_freeDStream(rctx->zstd_dstream);
-#endif
-	if (rctx->zlib_stream) {
-		inflateEnd(rctx->zlib_stream);
-		free(rctx->zlib_stream);
-	}
+	free_decompress_pool(rctx);
+	free_decompress_stream(&rctx->dstream);
 
 	return ret;
 }
@@ -1662,6 +2289,13 @@ static const char * const cmd_receive_usage[] = {
 		"decompress it instead of writing it with encoded I/O"),
 	OPTLINE("--dump", "dump stream metadata, one line per operation, "
 		"does not require the MOUNT parameter"),
+	OPTLINE("--write-index FILE", "write index of the stream to FILE while "
+		"receiving or dumping it"),
+	OPTLINE("--index FILE", "use index FILE of the stream given by -f to "
+		"receive or dump only the commands of paths selected by --select"),
+	OPTLINE("--select PATH", "receive only PATH relative to the subvolume, "
+		"a file or directory with all its contents, can be used "
+		"repeatedly, requires --index"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
@@ -1692,6 +2326,7 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 	int receive_fd = fileno(stdin);
 	u64 max_errors = 1;
 	bool dump = false;
+	const char *index_file = NULL;
 	int ret = 0;
 
 	memset(&rctx, 0, sizeof(rctx));
@@ -1720,6 +2355,9 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		enum {
 			GETOPT_VAL_DUMP = GETOPT_VAL_FIRST,
 			GETOPT_VAL_FORCE_DECOMPRESS,
+			GETOPT_VAL_WRITE_INDEX,
+			GETOPT_VAL_INDEX,
+			GETOPT_VAL_SELECT,
 		};
 		static const struct option long_opts[] = {
 			{ "max-errors", required_argument, NULL, 'E' },
@@ -1727,6 +2365,9 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "dump", no_argument, NULL, GETOPT_VAL_DUMP },
 			{ "quiet", no_argument, NULL, 'q' },
 			{ "force-decompress", no_argument, NULL, GETOPT_VAL_FORCE_DECOMPRESS },
+			{ "write-index", required_argument, NULL, GETOPT_VAL_WRITE_INDEX },
+			{ "index", required_argument, NULL, GETOPT_VAL_INDEX },
+			{ "select", required_argument, NULL, GETOPT_VAL_SELECT },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -1772,6 +2413,26 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		case GETOPT_VAL_FORCE_DECOMPRESS:
 			rctx.force_decompress = true;
 			break;
+		case GETOPT_VAL_WRITE_INDEX:
+			rctx.write_index = optarg;
+			break;
+		case GETOPT_VAL_INDEX:
+			index_file = optarg;
+			break;
+		case GETOPT_VAL_SELECT: {
+			char **tmp;
+
+			tmp = realloc(rctx.select_paths, (rctx.nr_select_paths + 1) *
+				      sizeof(*tmp));
+			if (!tmp) {
+				error_mem(NULL);
+				ret = 1;
+				goto out;
+			}
+			rctx.select_paths = tmp;
+			rctx.select_paths[rctx.nr_select_paths++] = optarg;
+			break;
+		}
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -1784,6 +2445,29 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 
 	tomnt = argv[optind];
 
+	if (!!index_file != !!rctx.nr_select_paths) {
+		error("options --index and --select must be used together");
+		ret = 1;
+		goto out;
+	}
+	if (index_file && rctx.write_index) {
+		error("options --index and --write-index cannot be used together");
+		ret = 1;
+		goto out;
+	}
+	if (index_file) {
+		if (!fromfile[0]) {
+			error("the indexed stream must be read from a file given by -f");
+			ret = 1;
+			goto out;
+		}
+		rctx.index = btrfs_send_index_open(index_file);
+		if (!rctx.index) {
+			ret = 1;
+			goto out;
+		}
+	}
+
 	if (fromfile[0]) {
 		int flags = O_RDONLY;
 
@@ -1799,13 +2483,40 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 
 	if (dump) {
 		struct btrfs_dump_send_args dump_args;
+		struct btrfs_send_reader *reader;
 
 		dump_args.root_path[0] = '.';
 		dump_args.root_path[1] = '\0';
 		dump_args.full_subvol_path[0] = '.';
 		dump_args.full_subvol_path[1] = '\0';
-		ret = btrfs_read_and_process_send_stream(receive_fd,
-			&btrfs_print_send_ops, &dump_args, 0, max_errors);
+		reader = btrfs_send_reader_alloc(receive_fd);
+		if (!reader) {
+			ret = -errno;
+			error_mem("send stream reader");
+		} else if (rctx.index) {
+			ret = process_selected_streams(NULL, reader, rctx.index,
+				rctx.select_paths, rctx.nr_select_paths,
+				&btrfs_print_send_ops, &dump_args, max_errors);
+			btrfs_send_reader_free(reader);
+		} else if (rctx.write_index) {
+			struct btrfs_send_index_writer *iw;
+
+			iw = btrfs_send_index_writer_alloc(rctx.write_index,
+				reader, &btrfs_print_send_ops, &dump_args);
+			if (!iw)
+				ret = -EINVAL;
+			else
+				ret = btrfs_read_and_process_send_stream(reader,
+					&btrfs_send_index_ops, iw, 0, max_errors);
+			if (ret == 0)
+				ret = btrfs_send_index_writer_finish(iw);
+			btrfs_send_index_writer_free(iw);
+			btrfs_send_reader_free(reader);
+		} else {
+			ret = btrfs_read_and_process_send_stream(reader,
+				&btrfs_print_send_ops, &dump_args, 0, max_errors);
+			btrfs_send_reader_free(reader);
+		}
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to dump the send stream: %m");
@@ -1817,6 +2528,8 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 	if (receive_fd != fileno(stdin))
 		close(receive_fd);
 out:
+	btrfs_send_index_close(rctx.index);
+	free(rctx.select_paths);
 
 	return !!ret;
 }
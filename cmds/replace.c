@@ -307,7 +307,7 @@ static int cmd_replace_start(const struct cmd_struct *cmd,
 	ret = btrfs_prepare_device(fddstdev, dstdev, &dstdev_block_count, 0,
 			PREP_DEVICE_ZERO_END | PREP_DEVICE_VERBOSE |
 			(discard ? PREP_DEVICE_DISCARD : 0) |
-			(zoned ? PREP_DEVICE_ZONED : 0));
+			(zoned ? PREP_DEVICE_ZONED : 0), NULL);
 	if (ret)
 		goto leave_with_error;
 
@@ -16,14 +16,19 @@
 
 #include "kerncompat.h"
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/backref.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/file-item.h"
+#include "kernel-shared/extent_io.h"
 #include "common/messages.h"
 #include "common/open-utils.h"
+#include "common/internal.h"
+#include "crypto/hash.h"
 #include "cmds/rescue.h"
 
 /*
@@ -83,14 +88,15 @@ static int add_corrupted_block(struct btrfs_fs_info *fs_info, u64 logical,
 	/* The last entry is the same, just set update the error mirror bitmap. */
 	if (last->logical == logical) {
 		UASSERT(last->error_mirror_bitmap);
-		set_bit(mirror, last->error_mirror_bitmap);
+		set_bit(mirror - 1, last->error_mirror_bitmap);
 		return 0;
 	}
 add:
 	last = calloc(1, sizeof(*last));
 	if (!last)
 		return -ENOMEM;
-	last->error_mirror_bitmap = calloc(1, BITS_TO_LONGS(num_mirrors));
+	last->error_mirror_bitmap = calloc(BITS_TO_LONGS(num_mirrors),
+					   sizeof(unsigned long));
 	if (!last->error_mirror_bitmap) {
 		free(last);
 		return -ENOMEM;
@@ -103,86 +109,260 @@ add:
 	return 0;
 }
 
+/* Largest read of contiguous data blocks, per mirror */
+#define VERIFY_RANGE_SIZE	(SZ_1M)
+/* Number of ranges verified by the threads before the results are merged */
+#define VERIFY_BATCH		(256)
+#define VERIFY_MAX_THREADS	(32)
+
 /*
- * Verify all mirrors for @logical.
+ * A range of contiguous data blocks covered by checksum items.
  *
- * If something critical happened, return <0 and should end the run immediately.
- * Otherwise return 0, including data checksum mismatch or read failure.
+ * All mirrors of the range are read and verified by one thread, the results
+ * are added to the corrupted blocks by the main thread in logical order.
  */
-static int verify_one_data_block(struct btrfs_fs_info *fs_info,
-				 struct extent_buffer *leaf,
-				 unsigned long leaf_offset, u64 logical,
-				 unsigned int num_mirrors)
+struct verify_range {
+	u64 logical;
+	u32 nr_sectors;
+	unsigned int num_mirrors;
+	/* Expected checksums of all the sectors. */
+	u8 *csums;
+	/* Bit (mirror - 1) * nr_sectors + sector is set for a corrupted block. */
+	unsigned long *bad;
+	int ret;
+};
+
+struct verify_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct btrfs_fs_info *fs_info;
+	struct verify_range ranges[VERIFY_BATCH];
+	/* Ranges being filled from the csum tree. */
+	u32 nr_ranges;
+	/* Ranges handed over to the threads, protected by @lock. */
+	u32 nr_queued;
+	u32 next_range;
+	u32 nr_done;
+	bool stop;
+};
+
+static void verify_sectors(struct btrfs_fs_info *fs_info,
+			   struct verify_range *range, unsigned int mirror,
+			   const u8 *buf, u32 first, u32 nr)
 {
-	const u32 blocksize = fs_info->sectorsize;
+	const u32 sectorsize = fs_info->sectorsize;
 	const u32 csum_size = fs_info->csum_size;
-	u8 *buf;
 	u8 csum[BTRFS_CSUM_SIZE];
-	u8 csum_expected[BTRFS_CSUM_SIZE];
-	int ret = 0;
 
-	buf = malloc(blocksize);
-	if (!buf)
-		return -ENOMEM;
+	for (u32 i = first; i < first + nr; i++) {
+		btrfs_csum_data(fs_info->csum_type, buf + i * sectorsize, csum,
+				sectorsize);
+		if (memcmp(range->csums + i * csum_size, csum, csum_size) != 0)
+			set_bit((mirror - 1) * range->nr_sectors + i, range->bad);
+	}
+}
 
-	for (int mirror = 1; mirror <= num_mirrors; mirror++) {
-		u64 read_len = blocksize;
+/*
+ * Verify all mirrors of @range.
+ *
+ * Each mirror is read in one go if possible, if that fails the remaining
+ * blocks are read one by one to find the exact blocks with IO errors.
+ */
+static void verify_one_range(struct btrfs_fs_info *fs_info,
+			     struct verify_range *range, u8 *buf)
+{
+	const u32 sectorsize = fs_info->sectorsize;
+	const u64 len = (u64)range->nr_sectors * sectorsize;
 
-		ret = read_data_from_disk(fs_info, buf, logical, &read_len, mirror);
-		if (ret < 0) {
-			/* IO error, add one record. */
-			ret = add_corrupted_block(fs_info, logical, mirror, num_mirrors);
+	for (unsigned int mirror = 1; mirror <= range->num_mirrors; mirror++) {
+		u64 cur = 0;
+		int ret;
+
+		while (cur < len) {
+			u64 read_len = len - cur;
+
+			ret = read_data_from_disk(fs_info, buf + cur,
+						  range->logical + cur, &read_len,
+						  mirror);
 			if (ret < 0)
 				break;
+			cur += read_len;
 		}
-		/* Verify the data checksum. */
-		btrfs_csum_data(fs_info->csum_type, buf, csum, blocksize);
-		read_extent_buffer(leaf, csum_expected, leaf_offset, csum_size);
-		if (memcmp(csum_expected, csum, csum_size) != 0) {
-			ret = add_corrupted_block(fs_info, logical, mirror, num_mirrors);
-			if (ret < 0)
-				break;
+		verify_sectors(fs_info, range, mirror, buf, 0, cur / sectorsize);
+
+		for (u32 i = cur / sectorsize; i < range->nr_sectors; i++) {
+			u64 read_len = sectorsize;
+
+			ret = read_data_from_disk(fs_info, buf + i * sectorsize,
+						  range->logical + i * sectorsize,
+						  &read_len, mirror);
+			if (ret < 0) {
+				/* IO error, the block is corrupted. */
+				set_bit((mirror - 1) * range->nr_sectors + i,
+					range->bad);
+				continue;
+			}
+			verify_sectors(fs_info, range, mirror, buf, i, 1);
 		}
 	}
+}
+
+static void *verify_thread(void *arg)
+{
+	struct verify_ctx *ctx = arg;
+	u8 *buf;
+
+	buf = malloc(VERIFY_RANGE_SIZE);
+	while (true) {
+		struct verify_range *range;
 
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->stop && ctx->next_range >= ctx->nr_queued)
+			pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+		if (ctx->stop) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		range = &ctx->ranges[ctx->next_range++];
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (buf)
+			verify_one_range(ctx->fs_info, range, buf);
+		else
+			range->ret = -ENOMEM;
+
+		pthread_mutex_lock(&ctx->lock);
+		if (++ctx->nr_done == ctx->nr_queued)
+			pthread_cond_signal(&ctx->done_cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
 	free(buf);
-	return ret;
+	return NULL;
 }
 
-static int iterate_one_csum_item(struct btrfs_fs_info *fs_info, struct btrfs_path *path)
+/*
+ * Verify all the filled ranges by the threads and record the corrupted
+ * blocks, in the same order as they would be found block by block.
+ */
+static int verify_ranges(struct verify_ctx *ctx)
 {
-	struct btrfs_key key;
-	const unsigned long item_ptr_off = btrfs_item_ptr_offset(path->nodes[0],
-								 path->slots[0]);
-	const u32 blocksize = fs_info->sectorsize;
-	int num_mirrors;
-	u64 data_size;
-	u64 cur;
-	char *buf;
 	int ret = 0;
 
-	buf = malloc(blocksize);
-	if (!buf)
-		return -ENOMEM;
+	if (ctx->nr_ranges == 0)
+		return 0;
 
-	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
-	data_size = btrfs_item_size(path->nodes[0], path->slots[0]) /
-		    fs_info->csum_size * blocksize;
-	num_mirrors = btrfs_num_copies(fs_info, key.offset, data_size);
+	for (u32 i = 0; i < ctx->nr_ranges; i++) {
+		struct verify_range *range = &ctx->ranges[i];
 
-	for (cur = 0; cur < data_size; cur += blocksize) {
-		const unsigned long leaf_offset = item_ptr_off +
-			cur / blocksize * fs_info->csum_size;
+		range->ret = 0;
+		range->bad = calloc(BITS_TO_LONGS(range->nr_sectors * range->num_mirrors),
+				    sizeof(unsigned long));
+		if (!range->bad) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
 
-		ret = verify_one_data_block(fs_info, path->nodes[0], leaf_offset,
-					    key.offset + cur, num_mirrors);
-		if (ret < 0)
-			break;
+	pthread_mutex_lock(&ctx->lock);
+	ctx->next_range = 0;
+	ctx->nr_done = 0;
+	ctx->nr_queued = ctx->nr_ranges;
+	pthread_cond_broadcast(&ctx->work_cond);
+	while (ctx->nr_done < ctx->nr_queued)
+		pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+	ctx->nr_queued = 0;
+	ctx->next_range = 0;
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (u32 i = 0; i < ctx->nr_ranges; i++) {
+		struct verify_range *range = &ctx->ranges[i];
+
+		if (range->ret < 0) {
+			ret = range->ret;
+			goto out;
+		}
+		for (u32 sector = 0; sector < range->nr_sectors; sector++) {
+			const u64 logical = range->logical +
+					    (u64)sector * ctx->fs_info->sectorsize;
+
+			for (unsigned int mirror = 1; mirror <= range->num_mirrors;
+			     mirror++) {
+				if (!test_bit((mirror - 1) * range->nr_sectors + sector,
+					      range->bad))
+					continue;
+				ret = add_corrupted_block(ctx->fs_info, logical,
+							  mirror, range->num_mirrors);
+				if (ret < 0)
+					goto out;
+			}
+		}
 	}
-	free(buf);
+out:
+	for (u32 i = 0; i < ctx->nr_ranges; i++) {
+		free(ctx->ranges[i].bad);
+		ctx->ranges[i].bad = NULL;
+	}
+	ctx->nr_ranges = 0;
 	return ret;
 }
 
+/*
+ * Split the csum item at @path into ranges, merged with the previous range
+ * if the data is contiguous, and verify the ranges once a batch is full.
+ */
+static int iterate_one_csum_item(struct verify_ctx *ctx, struct btrfs_path *path)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct extent_buffer *leaf = path->nodes[0];
+	const unsigned long item_ptr_off = btrfs_item_ptr_offset(leaf,
+								 path->slots[0]);
+	const u32 blocksize = fs_info->sectorsize;
+	const u32 csum_size = fs_info->csum_size;
+	const u32 max_sectors = VERIFY_RANGE_SIZE / blocksize;
+	struct btrfs_key key;
+	unsigned int num_mirrors;
+	u32 nr_sectors;
+	u32 cur = 0;
+	int ret;
+
+	btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+	nr_sectors = btrfs_item_size(leaf, path->slots[0]) / csum_size;
+	num_mirrors = btrfs_num_copies(fs_info, key.offset,
+				       (u64)nr_sectors * blocksize);
+
+	while (cur < nr_sectors) {
+		const u64 logical = key.offset + (u64)cur * blocksize;
+		struct verify_range *range = NULL;
+		u32 nr;
+
+		if (ctx->nr_ranges) {
+			range = &ctx->ranges[ctx->nr_ranges - 1];
+			if (range->logical + (u64)range->nr_sectors * blocksize != logical ||
+			    range->num_mirrors != num_mirrors ||
+			    range->nr_sectors >= max_sectors)
+				range = NULL;
+		}
+		if (!range) {
+			if (ctx->nr_ranges == VERIFY_BATCH) {
+				ret = verify_ranges(ctx);
+				if (ret < 0)
+					return ret;
+			}
+			range = &ctx->ranges[ctx->nr_ranges++];
+			range->logical = logical;
+			range->nr_sectors = 0;
+			range->num_mirrors = num_mirrors;
+		}
+		nr = min(nr_sectors - cur, max_sectors - range->nr_sectors);
+		read_extent_buffer(leaf, range->csums + range->nr_sectors * csum_size,
+				   item_ptr_off + cur * csum_size, nr * csum_size);
+		range->nr_sectors += nr;
+		cur += nr;
+	}
+	return 0;
+}
+
 static int print_filenames(u64 ino, u64 offset, u64 rootid, void *ctx)
 {
 	struct btrfs_fs_info *fs_info = ctx;
@@ -227,12 +407,59 @@ out:
 	return ret;
 }
 
+/*
+ * Verify all data blocks with checksums.
+ *
+ * The csum items are split into ranges of contiguous blocks, the ranges are
+ * read with large reads and verified by several threads.
+ */
 static int iterate_csum_root(struct btrfs_fs_info *fs_info, struct btrfs_root *csum_root)
 {
 	struct btrfs_path path = { 0 };
 	struct btrfs_key key;
+	struct verify_ctx *ctx;
+	pthread_t threads[VERIFY_MAX_THREADS];
+	const u32 max_csums_size = VERIFY_RANGE_SIZE / fs_info->sectorsize *
+				   fs_info->csum_size;
+	int nr_threads = 0;
+	int max_threads;
 	int ret;
 
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->work_cond, NULL);
+	pthread_cond_init(&ctx->done_cond, NULL);
+	ctx->fs_info = fs_info;
+	for (int i = 0; i < VERIFY_BATCH; i++) {
+		ctx->ranges[i].csums = malloc(max_csums_size);
+		if (!ctx->ranges[i].csums) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* The main thread does not hash while the threads are running. */
+	if (CRYPTO_HASH_THREAD_SAFE ||
+	    fs_info->csum_type == BTRFS_CSUM_TYPE_CRC32 ||
+	    fs_info->csum_type == BTRFS_CSUM_TYPE_XXHASH)
+		max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	else
+		max_threads = 1;
+	max_threads = clamp(max_threads, 1, VERIFY_MAX_THREADS);
+	for (nr_threads = 0; nr_threads < max_threads; nr_threads++) {
+		ret = pthread_create(&threads[nr_threads], NULL, verify_thread, ctx);
+		if (ret) {
+			if (nr_threads)
+				break;
+			ret = -ret;
+			errno = -ret;
+			error("failed to create verification thread: %m");
+			goto out;
+		}
+	}
+
 	key.objectid = 0;
 	key.type = 0;
 	key.offset = 0;
@@ -241,14 +468,14 @@ static int iterate_csum_root(struct btrfs_fs_info *fs_info, struct btrfs_root *c
 	if (ret < 0) {
 		errno = -ret;
 		error("failed to get the first tree block of csum tree: %m");
-		return ret;
+		goto out;
 	}
 	UASSERT(ret > 0);
 	while (true) {
 		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
 		if (key.type != BTRFS_EXTENT_CSUM_KEY)
 			goto next;
-		ret = iterate_one_csum_item(fs_info, &path);
+		ret = iterate_one_csum_item(ctx, &path);
 		if (ret < 0)
 			break;
 next:
@@ -260,9 +487,25 @@ next:
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to get next csum item: %m");
+			break;
 		}
 	}
 	btrfs_release_path(&path);
+	if (ret == 0)
+		ret = verify_ranges(ctx);
+out:
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stop = true;
+	pthread_cond_broadcast(&ctx->work_cond);
+	pthread_mutex_unlock(&ctx->lock);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	for (int i = 0; i < VERIFY_BATCH; i++)
+		free(ctx->ranges[i].csums);
+	pthread_cond_destroy(&ctx->done_cond);
+	pthread_cond_destroy(&ctx->work_cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
 	return ret;
 }
 
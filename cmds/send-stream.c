@@ -0,0 +1,1044 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kernel-lib/rbtree.h"
+#include "kernel-shared/send.h"
+#include "crypto/crc32c.h"
+#include "common/help.h"
+#include "common/send-index.h"
+#include "common/send-stream.h"
+#include "common/messages.h"
+#include "common/rbtree-utils.h"
+#include "common/units.h"
+#include "cmds/commands.h"
+
+static const char * const send_stream_cmd_group_usage[] = {
+	"btrfs send-stream <command> [<args>]",
+	NULL
+};
+
+/* The command is not written to the output */
+#define CMD_DROP		(1U << 0)
+/* The command is appended to the previous kept one */
+#define CMD_MERGED		(1U << 1)
+/* The write data or clone length differ from the input */
+#define CMD_MODIFIED		(1U << 2)
+/* Not a command but the stream header */
+#define CMD_STREAM_HEADER	(1U << 3)
+
+struct stream_cmd {
+	/* Offset of the command header (or stream header) in the input */
+	u64 pos;
+	u32 len;
+	u16 cmd;
+	u8 version;
+	u8 flags;
+	/* PATH attribute, and PATH_TO of rename or PATH_LINK of link */
+	const char *path;
+	const char *path2;
+	u16 path_len;
+	u16 path2_len;
+	union {
+		struct {
+			u64 offset;
+			/* Offset of the data in the input and current length */
+			u64 data_pos;
+			u32 data_len;
+		} write;
+		struct {
+			u64 offset;
+			u64 len;
+			u64 src_offset;
+			u64 src_ctransid;
+			/* Offset of the CLONE_LEN value in the input */
+			u64 len_pos;
+			const u8 *src_uuid;
+			const char *src_path;
+			u16 src_path_len;
+		} clone;
+		u64 size;
+	};
+};
+
+/* Commands on one path since the path was last renamed or removed */
+struct path_state {
+	struct rb_node node;
+	const char *path;
+	u16 len;
+	/* Index of the last command of the type, or -1 */
+	s64 last_chmod;
+	s64 last_chown;
+	s64 last_utimes;
+	/* Indexes of the writes that could be cut by a later truncate */
+	u64 *writes;
+	u32 nr_writes;
+	u32 alloc_writes;
+};
+
+struct compact_stats {
+	u64 in_cmds;
+	u64 out_cmds;
+	u64 in_bytes;
+	u64 out_bytes;
+	u64 dropped_writes;
+	u64 trimmed_writes;
+	u64 merged_writes;
+	u64 merged_clones;
+	u64 dropped_chmod;
+	u64 dropped_chown;
+	u64 dropped_utimes;
+};
+
+struct compact_ctx {
+	const u8 *map;
+	u64 size;
+	struct stream_cmd *cmds;
+	u64 nr_cmds;
+	u64 alloc_cmds;
+	u32 max_cmd_len;
+	struct rb_root paths;
+	struct compact_stats stats;
+
+	int out_fd;
+	char *out_buf;
+	size_t out_len;
+};
+
+#define COMPACT_OUT_BUF_SIZE		(SZ_1M)
+/* Size of the command buffer of the kernel, merged writes must fit in it */
+#define COMPACT_MAX_CMD_SIZE_V1		(SZ_64K)
+#define COMPACT_MAX_CMD_SIZE_V2		(SZ_16K + SZ_128K)
+
+static int compare_path(const char *path1, u16 len1, const char *path2, u16 len2)
+{
+	int ret;
+
+	ret = memcmp(path1, path2, min(len1, len2));
+	if (ret)
+		return ret;
+	return (int)len1 - (int)len2;
+}
+
+static int path_state_comp_nodes(const struct rb_node *node1,
+				 const struct rb_node *node2)
+{
+	const struct path_state *ps1 = rb_entry(node1, struct path_state, node);
+	const struct path_state *ps2 = rb_entry(node2, struct path_state, node);
+
+	return compare_path(ps2->path, ps2->len, ps1->path, ps1->len);
+}
+
+struct path_key {
+	const char *path;
+	u16 len;
+};
+
+static int path_state_comp_key(const struct rb_node *node, const void *data)
+{
+	const struct path_state *ps = rb_entry(node, struct path_state, node);
+	const struct path_key *key = data;
+
+	return compare_path(key->path, key->len, ps->path, ps->len);
+}
+
+static void free_path_state(struct rb_node *node)
+{
+	struct path_state *ps = rb_entry(node, struct path_state, node);
+
+	free(ps->writes);
+	free(ps);
+}
+FREE_RB_BASED_TREE(path_state, free_path_state);
+
+static struct path_state *get_path_state(struct compact_ctx *cctx,
+					 const char *path, u16 len)
+{
+	struct path_key key = { .path = path, .len = len };
+	struct rb_node *node;
+	struct path_state *ps;
+
+	node = rb_search(&cctx->paths, &key, path_state_comp_key, NULL);
+	if (node)
+		return rb_entry(node, struct path_state, node);
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return NULL;
+	ps->path = path;
+	ps->len = len;
+	ps->last_chmod = -1;
+	ps->last_chown = -1;
+	ps->last_utimes = -1;
+	rb_insert(&cctx->paths, &ps->node, path_state_comp_nodes);
+	return ps;
+}
+
+/*
+ * Forget the path and everything below it, the name refers to something else
+ * from now on.
+ */
+static void invalidate_path(struct compact_ctx *cctx, const char *path, u16 len)
+{
+	struct path_key key = { .path = path, .len = len };
+	struct rb_node *node;
+	struct rb_node *next = NULL;
+
+	node = rb_search(&cctx->paths, &key, path_state_comp_key, &next);
+	if (node) {
+		next = rb_next(node);
+		rb_erase(node, &cctx->paths);
+		free_path_state(node);
+	}
+
+	/* The entries with "path/" prefix follow in the sorted order */
+	while (next) {
+		struct path_state *ps = rb_entry(next, struct path_state, node);
+
+		if (ps->len <= len || memcmp(ps->path, path, len) != 0)
+			break;
+		if (ps->path[len] < '/')
+			goto skip;
+		if (ps->path[len] > '/')
+			break;
+		node = next;
+		next = rb_next(next);
+		rb_erase(node, &cctx->paths);
+		free_path_state(node);
+		continue;
+skip:
+		next = rb_next(next);
+	}
+}
+
+/* The file data can be read by a command, writes must not be cut anymore */
+static void forget_writes(struct compact_ctx *cctx)
+{
+	struct rb_node *node;
+
+	for (node = rb_first(&cctx->paths); node; node = rb_next(node)) {
+		struct path_state *ps = rb_entry(node, struct path_state, node);
+
+		ps->nr_writes = 0;
+	}
+}
+
+static int add_write(struct path_state *ps, u64 index)
+{
+	if (ps->nr_writes == ps->alloc_writes) {
+		u32 alloc = max(16U, ps->alloc_writes * 2);
+		u64 *tmp;
+
+		tmp = realloc(ps->writes, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		ps->writes = tmp;
+		ps->alloc_writes = alloc;
+	}
+	ps->writes[ps->nr_writes++] = index;
+	return 0;
+}
+
+/* Drop or shorten the writes beyond the new size of the file */
+static void truncate_writes(struct compact_ctx *cctx, struct path_state *ps,
+			    u64 size)
+{
+	u32 nr = 0;
+
+	for (u32 i = 0; i < ps->nr_writes; i++) {
+		struct stream_cmd *sc = &cctx->cmds[ps->writes[i]];
+
+		if (sc->write.offset >= size) {
+			sc->flags |= CMD_DROP;
+			cctx->stats.dropped_writes++;
+			continue;
+		}
+		if (sc->write.offset + sc->write.data_len > size) {
+			sc->write.data_len = size - sc->write.offset;
+			if (!(sc->flags & CMD_MODIFIED))
+				cctx->stats.trimmed_writes++;
+			sc->flags |= CMD_MODIFIED;
+		}
+		ps->writes[nr++] = ps->writes[i];
+	}
+	ps->nr_writes = nr;
+}
+
+/* Keep only the last of the commands of the same type on the path */
+static void supersede(struct compact_ctx *cctx, s64 *last, u64 index,
+		      u64 *counter)
+{
+	if (*last >= 0) {
+		cctx->cmds[*last].flags |= CMD_DROP;
+		(*counter)++;
+	}
+	*last = index;
+}
+
+static int track_cmd(struct compact_ctx *cctx, u64 index)
+{
+	struct stream_cmd *sc = &cctx->cmds[index];
+	struct path_state *ps = NULL;
+
+	switch (sc->cmd) {
+	case BTRFS_SEND_C_WRITE:
+	case BTRFS_SEND_C_TRUNCATE:
+	case BTRFS_SEND_C_CHMOD:
+	case BTRFS_SEND_C_CHOWN:
+	case BTRFS_SEND_C_UTIMES:
+		ps = get_path_state(cctx, sc->path, sc->path_len);
+		if (!ps)
+			return -ENOMEM;
+		break;
+	}
+
+	switch (sc->cmd) {
+	case BTRFS_SEND_C_WRITE:
+		return add_write(ps, index);
+	case BTRFS_SEND_C_TRUNCATE:
+		truncate_writes(cctx, ps, sc->size);
+		break;
+	case BTRFS_SEND_C_CHMOD:
+		supersede(cctx, &ps->last_chmod, index, &cctx->stats.dropped_chmod);
+		break;
+	case BTRFS_SEND_C_CHOWN:
+		supersede(cctx, &ps->last_chown, index, &cctx->stats.dropped_chown);
+		break;
+	case BTRFS_SEND_C_UTIMES:
+		supersede(cctx, &ps->last_utimes, index, &cctx->stats.dropped_utimes);
+		break;
+	case BTRFS_SEND_C_RENAME:
+		invalidate_path(cctx, sc->path, sc->path_len);
+		invalidate_path(cctx, sc->path2, sc->path2_len);
+		break;
+	case BTRFS_SEND_C_LINK:
+	case BTRFS_SEND_C_UNLINK:
+	case BTRFS_SEND_C_RMDIR:
+		invalidate_path(cctx, sc->path, sc->path_len);
+		break;
+	case BTRFS_SEND_C_CLONE:
+	case BTRFS_SEND_C_ENABLE_VERITY:
+		/* Read the data, possibly of a hardlink under another name */
+		forget_writes(cctx);
+		break;
+	case BTRFS_SEND_C_FALLOCATE:
+		ps = get_path_state(cctx, sc->path, sc->path_len);
+		if (!ps)
+			return -ENOMEM;
+		ps->nr_writes = 0;
+		break;
+	case BTRFS_SEND_C_SUBVOL:
+	case BTRFS_SEND_C_SNAPSHOT:
+	case BTRFS_SEND_C_END:
+		free_path_state_tree(&cctx->paths);
+		break;
+	}
+	return 0;
+}
+
+static struct stream_cmd *new_cmd(struct compact_ctx *cctx)
+{
+	struct stream_cmd *sc;
+
+	if (cctx->nr_cmds == cctx->alloc_cmds) {
+		u64 alloc = max_t(u64, 1024, cctx->alloc_cmds * 2);
+		struct stream_cmd *tmp;
+
+		tmp = realloc(cctx->cmds, alloc * sizeof(*tmp));
+		if (!tmp)
+			return NULL;
+		cctx->cmds = tmp;
+		cctx->alloc_cmds = alloc;
+	}
+	sc = &cctx->cmds[cctx->nr_cmds++];
+	memset(sc, 0, sizeof(*sc));
+	return sc;
+}
+
+/* Read the attributes needed for the compaction from the command at @pos */
+static int parse_cmd(struct compact_ctx *cctx, struct stream_cmd *sc)
+{
+	const u8 *data = cctx->map + sc->pos + sizeof(struct btrfs_cmd_header);
+	u32 cmd_len = sc->len - sizeof(struct btrfs_cmd_header);
+	u32 pos = 0;
+
+	while (pos < cmd_len) {
+		u16 tlv_type;
+		u32 tlv_len;
+		const u8 *value;
+
+		if (cmd_len - pos < sizeof(__le16))
+			goto truncated;
+		tlv_type = get_unaligned_le16(data + pos);
+		pos += sizeof(__le16);
+		if (sc->version >= 2 && tlv_type == BTRFS_SEND_A_DATA) {
+			tlv_len = cmd_len - pos;
+		} else {
+			if (cmd_len - pos < sizeof(__le16))
+				goto truncated;
+			tlv_len = get_unaligned_le16(data + pos);
+			pos += sizeof(__le16);
+		}
+		if (cmd_len - pos < tlv_len)
+			goto truncated;
+		value = data + pos;
+
+		switch (tlv_type) {
+		case BTRFS_SEND_A_PATH:
+			sc->path = (const char *)value;
+			sc->path_len = tlv_len;
+			break;
+		case BTRFS_SEND_A_PATH_TO:
+		case BTRFS_SEND_A_PATH_LINK:
+			sc->path2 = (const char *)value;
+			sc->path2_len = tlv_len;
+			break;
+		case BTRFS_SEND_A_FILE_OFFSET:
+			if (tlv_len != sizeof(__le64))
+				goto invalid;
+			if (sc->cmd == BTRFS_SEND_C_WRITE)
+				sc->write.offset = get_unaligned_le64(value);
+			else if (sc->cmd == BTRFS_SEND_C_CLONE)
+				sc->clone.offset = get_unaligned_le64(value);
+			break;
+		case BTRFS_SEND_A_DATA:
+			if (sc->cmd == BTRFS_SEND_C_WRITE) {
+				sc->write.data_pos = value - cctx->map;
+				sc->write.data_len = tlv_len;
+			}
+			break;
+		case BTRFS_SEND_A_SIZE:
+			if (tlv_len != sizeof(__le64))
+				goto invalid;
+			sc->size = get_unaligned_le64(value);
+			break;
+		case BTRFS_SEND_A_CLONE_LEN:
+			if (tlv_len != sizeof(__le64))
+				goto invalid;
+			sc->clone.len = get_unaligned_le64(value);
+			sc->clone.len_pos = value - cctx->map;
+			break;
+		case BTRFS_SEND_A_CLONE_OFFSET:
+			if (tlv_len != sizeof(__le64))
+				goto invalid;
+			sc->clone.src_offset = get_unaligned_le64(value);
+			break;
+		case BTRFS_SEND_A_CLONE_CTRANSID:
+			if (tlv_len != sizeof(__le64))
+				goto invalid;
+			sc->clone.src_ctransid = get_unaligned_le64(value);
+			break;
+		case BTRFS_SEND_A_CLONE_UUID:
+			if (tlv_len != BTRFS_UUID_SIZE)
+				goto invalid;
+			sc->clone.src_uuid = value;
+			break;
+		case BTRFS_SEND_A_CLONE_PATH:
+			sc->clone.src_path = (const char *)value;
+			sc->clone.src_path_len = tlv_len;
+			break;
+		}
+		pos += tlv_len;
+	}
+
+	/* Commands the compaction works with must have all the attributes */
+	switch (sc->cmd) {
+	case BTRFS_SEND_C_WRITE:
+		if (!sc->write.data_pos)
+			goto invalid;
+		fallthrough;
+	case BTRFS_SEND_C_TRUNCATE:
+	case BTRFS_SEND_C_CHMOD:
+	case BTRFS_SEND_C_CHOWN:
+	case BTRFS_SEND_C_UTIMES:
+	case BTRFS_SEND_C_UNLINK:
+	case BTRFS_SEND_C_RMDIR:
+	case BTRFS_SEND_C_FALLOCATE:
+		if (!sc->path)
+			goto invalid;
+		break;
+	case BTRFS_SEND_C_RENAME:
+	case BTRFS_SEND_C_LINK:
+		if (!sc->path || !sc->path2)
+			goto invalid;
+		break;
+	case BTRFS_SEND_C_CLONE:
+		if (!sc->path || !sc->clone.len_pos || !sc->clone.src_uuid ||
+		    !sc->clone.src_path)
+			goto invalid;
+		break;
+	}
+	return 0;
+
+truncated:
+	error("send stream is truncated at offset %llu", sc->pos);
+	return -EINVAL;
+invalid:
+	error("invalid command %u at offset %llu", sc->cmd, sc->pos);
+	return -EINVAL;
+}
+
+/* Parse the whole input and decide what can be removed */
+static int analyze_stream(struct compact_ctx *cctx)
+{
+	u64 pos = 0;
+	u32 version = 0;
+	int ret;
+
+	while (pos < cctx->size) {
+		const struct btrfs_cmd_header *hdr;
+		struct stream_cmd *sc;
+		u32 crc;
+		u32 crc2;
+
+		if (version == 0) {
+			const struct btrfs_stream_header *shdr;
+
+			/* Stream header, possibly of a concatenated stream */
+			if (cctx->size - pos < sizeof(*shdr)) {
+				error("send stream is truncated at offset %llu", pos);
+				return -EINVAL;
+			}
+			shdr = (const struct btrfs_stream_header *)(cctx->map + pos);
+			if (strcmp(shdr->magic, BTRFS_SEND_STREAM_MAGIC)) {
+				error("unexpected header at offset %llu", pos);
+				return -EINVAL;
+			}
+			version = get_unaligned_le32(&shdr->version);
+			if (version == 0 || version > BTRFS_SEND_STREAM_VERSION) {
+				error("stream version %u not supported", version);
+				return -EOPNOTSUPP;
+			}
+			sc = new_cmd(cctx);
+			if (!sc)
+				return -ENOMEM;
+			sc->pos = pos;
+			sc->len = sizeof(*shdr);
+			sc->flags = CMD_STREAM_HEADER;
+			pos += sizeof(*shdr);
+			continue;
+		}
+
+		if (cctx->size - pos < sizeof(*hdr)) {
+			error("send stream is truncated at offset %llu", pos);
+			return -EINVAL;
+		}
+		hdr = (const struct btrfs_cmd_header *)(cctx->map + pos);
+		if (get_unaligned_le32(&hdr->len) > cctx->size - pos - sizeof(*hdr)) {
+			error("send stream is truncated at offset %llu", pos);
+			return -EINVAL;
+		}
+		sc = new_cmd(cctx);
+		if (!sc)
+			return -ENOMEM;
+		sc->pos = pos;
+		sc->len = sizeof(*hdr) + get_unaligned_le32(&hdr->len);
+		sc->cmd = get_unaligned_le16(&hdr->cmd);
+		sc->version = version;
+
+		crc = get_unaligned_le32(&hdr->crc);
+		crc2 = crc32c(0, (const unsigned char *)hdr,
+			      offsetof(struct btrfs_cmd_header, crc));
+		crc2 = crc32c(crc2, (const unsigned char *)"\0\0\0\0", sizeof(u32));
+		crc2 = crc32c(crc2, (const unsigned char *)(hdr + 1),
+			      sc->len - sizeof(*hdr));
+		if (crc != crc2) {
+			error("crc32 mismatch in command at offset %llu", pos);
+			return -EINVAL;
+		}
+
+		ret = parse_cmd(cctx, sc);
+		if (ret < 0)
+			return ret;
+		ret = track_cmd(cctx, cctx->nr_cmds - 1);
+		if (ret < 0)
+			return ret;
+
+		cctx->stats.in_cmds++;
+		cctx->max_cmd_len = max(cctx->max_cmd_len, sc->len);
+		pos += sc->len;
+		if (sc->cmd == BTRFS_SEND_C_END)
+			version = 0;
+	}
+	cctx->stats.in_bytes = cctx->size;
+	free_path_state_tree(&cctx->paths);
+	return 0;
+}
+
+/* Size of the write command with the given data length */
+static u32 write_cmd_size(const struct stream_cmd *sc, u32 data_len)
+{
+	u32 size;
+
+	size = sizeof(struct btrfs_cmd_header);
+	size += 2 * sizeof(__le16) + sc->path_len;
+	size += 2 * sizeof(__le16) + sizeof(__le64);
+	if (sc->version >= 2)
+		size += sizeof(__le16);
+	else
+		size += 2 * sizeof(__le16);
+	return size + data_len;
+}
+
+static u32 max_cmd_size(const struct stream_cmd *sc)
+{
+	if (sc->version >= 2)
+		return COMPACT_MAX_CMD_SIZE_V2;
+	return COMPACT_MAX_CMD_SIZE_V1;
+}
+
+static bool same_clone_source(const struct stream_cmd *sc1,
+			      const struct stream_cmd *sc2)
+{
+	return sc1->clone.src_ctransid == sc2->clone.src_ctransid &&
+	       memcmp(sc1->clone.src_uuid, sc2->clone.src_uuid,
+		      BTRFS_UUID_SIZE) == 0 &&
+	       compare_path(sc1->clone.src_path, sc1->clone.src_path_len,
+			    sc2->clone.src_path, sc2->clone.src_path_len) == 0;
+}
+
+/*
+ * Append the writes and clones continuing the previous command on the same
+ * file to it.
+ */
+static void merge_cmds(struct compact_ctx *cctx)
+{
+	struct stream_cmd *prev = NULL;
+	u64 prev_len = 0;
+
+	for (u64 i = 0; i < cctx->nr_cmds; i++) {
+		struct stream_cmd *sc = &cctx->cmds[i];
+
+		if (sc->flags & CMD_DROP)
+			continue;
+		if (prev && prev->cmd == sc->cmd && prev->version == sc->version &&
+		    compare_path(prev->path, prev->path_len, sc->path,
+				 sc->path_len) == 0) {
+			if (sc->cmd == BTRFS_SEND_C_WRITE &&
+			    prev->write.offset + prev_len == sc->write.offset &&
+			    write_cmd_size(prev, prev_len + sc->write.data_len) <=
+			    max_cmd_size(prev)) {
+				sc->flags |= CMD_MERGED;
+				prev->flags |= CMD_MODIFIED;
+				prev_len += sc->write.data_len;
+				cctx->stats.merged_writes++;
+				continue;
+			}
+			if (sc->cmd == BTRFS_SEND_C_CLONE &&
+			    prev->clone.offset + prev_len == sc->clone.offset &&
+			    prev->clone.src_offset + prev_len == sc->clone.src_offset &&
+			    same_clone_source(prev, sc)) {
+				sc->flags |= CMD_MERGED;
+				prev->flags |= CMD_MODIFIED;
+				prev_len += sc->clone.len;
+				cctx->stats.merged_clones++;
+				continue;
+			}
+		}
+		prev = NULL;
+		if (sc->cmd == BTRFS_SEND_C_WRITE) {
+			prev = sc;
+			prev_len = sc->write.data_len;
+		} else if (sc->cmd == BTRFS_SEND_C_CLONE) {
+			prev = sc;
+			prev_len = sc->clone.len;
+		}
+	}
+}
+
+static int flush_output(struct compact_ctx *cctx)
+{
+	size_t pos = 0;
+
+	while (pos < cctx->out_len) {
+		ssize_t ret;
+
+		ret = write(cctx->out_fd, cctx->out_buf + pos, cctx->out_len - pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			error("cannot write output stream: %m");
+			return ret;
+		}
+		pos += ret;
+	}
+	cctx->out_len = 0;
+	return 0;
+}
+
+static int output(struct compact_ctx *cctx, const void *data, size_t len)
+{
+	cctx->stats.out_bytes += len;
+	while (len) {
+		size_t copy = min(len, COMPACT_OUT_BUF_SIZE - cctx->out_len);
+
+		memcpy(cctx->out_buf + cctx->out_len, data, copy);
+		cctx->out_len += copy;
+		data += copy;
+		len -= copy;
+		if (cctx->out_len == COMPACT_OUT_BUF_SIZE) {
+			int ret = flush_output(cctx);
+
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static void put_tlv_header(u8 **p, u16 type, u16 len)
+{
+	put_unaligned_le16(type, *p);
+	put_unaligned_le16(len, *p + sizeof(__le16));
+	*p += 2 * sizeof(__le16);
+}
+
+/* Write the command in @buf with the header filled */
+static int output_cmd(struct compact_ctx *cctx, u8 *buf, u32 len, u16 cmd)
+{
+	struct btrfs_cmd_header *hdr = (struct btrfs_cmd_header *)buf;
+
+	put_unaligned_le32(len - sizeof(*hdr), &hdr->len);
+	put_unaligned_le16(cmd, &hdr->cmd);
+	put_unaligned_le32(0, &hdr->crc);
+	put_unaligned_le32(crc32c(0, buf, len), &hdr->crc);
+	return output(cctx, buf, len);
+}
+
+/*
+ * Write the write command at @index with its new length and the data of the
+ * merged writes that follow.
+ */
+static int output_write(struct compact_ctx *cctx, u64 index, u8 *buf)
+{
+	const struct stream_cmd *sc = &cctx->cmds[index];
+	u32 data_len = sc->write.data_len;
+	u8 *p = buf + sizeof(struct btrfs_cmd_header);
+	u8 *data;
+
+	for (u64 i = index + 1; i < cctx->nr_cmds; i++) {
+		const struct stream_cmd *next = &cctx->cmds[i];
+
+		if (next->flags & CMD_MERGED)
+			data_len += next->write.data_len;
+		else if (!(next->flags & CMD_DROP))
+			break;
+	}
+
+	put_tlv_header(&p, BTRFS_SEND_A_PATH, sc->path_len);
+	memcpy(p, sc->path, sc->path_len);
+	p += sc->path_len;
+	put_tlv_header(&p, BTRFS_SEND_A_FILE_OFFSET, sizeof(__le64));
+	put_unaligned_le64(sc->write.offset, p);
+	p += sizeof(__le64);
+	if (sc->version >= 2) {
+		/* The data attribute has no length, it's the rest of command */
+		put_unaligned_le16(BTRFS_SEND_A_DATA, p);
+		p += sizeof(__le16);
+	} else {
+		put_tlv_header(&p, BTRFS_SEND_A_DATA, data_len);
+	}
+
+	data = p;
+	memcpy(p, cctx->map + sc->write.data_pos, sc->write.data_len);
+	p += sc->write.data_len;
+	for (u64 i = index + 1; i < cctx->nr_cmds; i++) {
+		const struct stream_cmd *next = &cctx->cmds[i];
+
+		if (next->flags & CMD_MERGED) {
+			memcpy(p, cctx->map + next->write.data_pos,
+			       next->write.data_len);
+			p += next->write.data_len;
+		} else if (!(next->flags & CMD_DROP)) {
+			break;
+		}
+	}
+	UASSERT(p - data == data_len);
+	return output_cmd(cctx, buf, p - buf, sc->cmd);
+}
+
+/* Write the clone command at @index with length of the merged clones */
+static int output_clone(struct compact_ctx *cctx, u64 index, u8 *buf)
+{
+	const struct stream_cmd *sc = &cctx->cmds[index];
+	u64 len = sc->clone.len;
+
+	for (u64 i = index + 1; i < cctx->nr_cmds; i++) {
+		const struct stream_cmd *next = &cctx->cmds[i];
+
+		if (next->flags & CMD_MERGED)
+			len += next->clone.len;
+		else if (!(next->flags & CMD_DROP))
+			break;
+	}
+
+	memcpy(buf, cctx->map + sc->pos, sc->len);
+	put_unaligned_le64(len, buf + sc->clone.len_pos - sc->pos);
+	return output_cmd(cctx, buf, sc->len, sc->cmd);
+}
+
+static int write_stream(struct compact_ctx *cctx)
+{
+	u8 *buf;
+	int ret = 0;
+
+	cctx->out_buf = malloc(COMPACT_OUT_BUF_SIZE);
+	/* Rebuilt commands are never larger than the input or merge limit */
+	buf = malloc(max_t(u64, cctx->max_cmd_len, COMPACT_MAX_CMD_SIZE_V2));
+	if (!cctx->out_buf || !buf) {
+		error_mem(NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (u64 i = 0; i < cctx->nr_cmds && ret == 0; i++) {
+		const struct stream_cmd *sc = &cctx->cmds[i];
+
+		if (sc->flags & (CMD_DROP | CMD_MERGED))
+			continue;
+		if (!(sc->flags & CMD_STREAM_HEADER))
+			cctx->stats.out_cmds++;
+		if (!(sc->flags & CMD_MODIFIED)) {
+			ret = output(cctx, cctx->map + sc->pos, sc->len);
+			continue;
+		}
+
+		if (sc->cmd == BTRFS_SEND_C_WRITE)
+			ret = output_write(cctx, i, buf);
+		else
+			ret = output_clone(cctx, i, buf);
+	}
+	if (ret == 0)
+		ret = flush_output(cctx);
+out:
+	free(buf);
+	free(cctx->out_buf);
+	return ret;
+}
+
+static const char * const cmd_send_stream_compact_usage[] = {
+	"btrfs send-stream compact <input> <output>",
+	"Rewrite a stored send stream to an equivalent one with fewer commands",
+	"Rewrite the send stream (or several concatenated ones) from file <input>",
+	"to <output>, or to the standard output if it's '-'. Writes that a later",
+	"truncate removes are dropped or shortened, only the last chmod, chown and",
+	"utimes of a file are kept and adjacent writes and clones are merged.",
+	"Then the size and command count reduction is printed.",
+	"",
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_QUIET,
+	NULL
+};
+
+static int cmd_send_stream_compact(const struct cmd_struct *cmd,
+				   int argc, char **argv)
+{
+	struct compact_ctx cctx = { 0 };
+	struct compact_stats *stats = &cctx.stats;
+	const char *input;
+	const char *output_name;
+	struct stat st;
+	void *map = MAP_FAILED;
+	bool to_stdout;
+	int in_fd;
+	int ret;
+
+	clean_args_no_options(cmd, argc, argv);
+
+	if (check_argc_exact(argc - optind, 2))
+		return 1;
+
+	input = argv[optind];
+	output_name = argv[optind + 1];
+	to_stdout = strcmp(output_name, "-") == 0;
+	cctx.out_fd = -1;
+
+	in_fd = open(input, O_RDONLY);
+	if (in_fd < 0) {
+		error("cannot open %s: %m", input);
+		return 1;
+	}
+	if (fstat(in_fd, &st) < 0) {
+		error("cannot stat %s: %m", input);
+		ret = -errno;
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		error("input must be a regular file: %s", input);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (st.st_size == 0) {
+		error("empty stream is not considered valid");
+		ret = -EINVAL;
+		goto out;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+	if (map == MAP_FAILED) {
+		error("cannot map %s: %m", input);
+		ret = -errno;
+		goto out;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	cctx.map = map;
+	cctx.size = st.st_size;
+
+	ret = analyze_stream(&cctx);
+	if (ret < 0)
+		goto out;
+	merge_cmds(&cctx);
+
+	if (to_stdout) {
+		cctx.out_fd = STDOUT_FILENO;
+	} else {
+		cctx.out_fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (cctx.out_fd < 0) {
+			error("cannot create %s: %m", output_name);
+			ret = -errno;
+			goto out;
+		}
+	}
+	ret = write_stream(&cctx);
+	if (ret < 0)
+		goto out;
+
+	/* The stream may go to stdout, print the summary elsewhere then */
+	(to_stdout ? pr_stderr : pr_verbose)(LOG_DEFAULT,
+"Input:   %llu commands, %s\n"
+"Output:  %llu commands, %s\n"
+"Removed: %llu commands (%.1f%%), %s (%.1f%%)\n"
+"Writes:  %llu dropped, %llu shortened, %llu merged\n"
+"Clones:  %llu merged\n"
+"Dropped: %llu chmod, %llu chown, %llu utimes\n",
+		stats->in_cmds, pretty_size(stats->in_bytes),
+		stats->out_cmds, pretty_size(stats->out_bytes),
+		stats->in_cmds - stats->out_cmds,
+		stats->in_cmds ? 100.0 * (stats->in_cmds - stats->out_cmds) /
+				 stats->in_cmds : 0.0,
+		pretty_size(stats->in_bytes - stats->out_bytes),
+		100.0 * (stats->in_bytes - stats->out_bytes) / stats->in_bytes,
+		stats->dropped_writes, stats->trimmed_writes,
+		stats->merged_writes, stats->merged_clones,
+		stats->dropped_chmod, stats->dropped_chown,
+		stats->dropped_utimes);
+
+out:
+	if (cctx.out_fd >= 0 && !to_stdout) {
+		if (close(cctx.out_fd) < 0 && ret == 0) {
+			error("cannot write output stream: %m");
+			ret = -errno;
+		}
+		if (ret < 0)
+			unlink(output_name);
+	}
+	free(cctx.cmds);
+	free_path_state_tree(&cctx.paths);
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	close(in_fd);
+	return !!ret;
+}
+static DEFINE_SIMPLE_COMMAND(send_stream_compact, "compact");
+
+static const char * const cmd_send_stream_index_usage[] = {
+	"btrfs send-stream index <stream> <index>",
+	"Create index of a stored send stream",
+	"Read the send stream (or several concatenated ones) from file <stream>",
+	"and write the index of the commands to file <index>. The index can be",
+	"used by 'btrfs receive --index' to receive only selected files without",
+	"reading the whole stream. The index can be also written by",
+	"'btrfs receive --write-index' while receiving the stream.",
+	NULL
+};
+
+static int cmd_send_stream_index(const struct cmd_struct *cmd,
+				 int argc, char **argv)
+{
+	struct btrfs_send_reader *reader = NULL;
+	struct btrfs_send_index_writer *iw = NULL;
+	const char *stream;
+	int iterations = 0;
+	int fd;
+	int ret;
+
+	clean_args_no_options(cmd, argc, argv);
+
+	if (check_argc_exact(argc - optind, 2))
+		return 1;
+
+	stream = argv[optind];
+	fd = open(stream, O_RDONLY);
+	if (fd < 0) {
+		error("cannot open %s: %m", stream);
+		return 1;
+	}
+	reader = btrfs_send_reader_alloc(fd);
+	if (!reader) {
+		ret = -errno;
+		error_mem("send stream reader");
+		goto out;
+	}
+	iw = btrfs_send_index_writer_alloc(argv[optind + 1], reader, NULL, NULL);
+	if (!iw) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	do {
+		ret = btrfs_read_and_process_send_stream(reader,
+				&btrfs_send_index_ops, iw, 0, 1);
+		if (ret == 0)
+			iterations++;
+	} while (ret == 0);
+	if (ret != -ENODATA)
+		goto out;
+	if (iterations == 0) {
+		error("empty stream is not considered valid");
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = btrfs_send_index_writer_finish(iw);
+
+out:
+	btrfs_send_index_writer_free(iw);
+	btrfs_send_reader_free(reader);
+	close(fd);
+	return !!ret;
+}
+static DEFINE_SIMPLE_COMMAND(send_stream_index, "index");
+
+static const char send_stream_cmd_group_info[] =
+"work with send streams stored in files";
+
+static const struct cmd_group send_stream_cmd_group = {
+	send_stream_cmd_group_usage, send_stream_cmd_group_info, {
+		&cmd_struct_send_stream_compact,
+		&cmd_struct_send_stream_index,
+		NULL
+	}
+};
+
+DEFINE_GROUP_COMMAND(send_stream, "send-stream");
@@ -149,6 +149,12 @@ struct root_info {
 
 	char *full_path;
 
+	/*
+	 * State of full_path resolution: 0 if not done yet, 1 if resolved or
+	 * -ENOENT if the path cannot be resolved
+	 */
+	int resolved;
+
 	int deleted;
 };
 
@@ -681,138 +687,179 @@ static void free_root_info(struct rb_node *node)
  * for a given root_info, search through the root_lookup tree to construct
  * the full path name to it.
  *
+ * The parent subvolumes are resolved first and their full_path is reused, so
+ * each subvolume is resolved only once however many subvolumes it contains.
+ *
  * This can't be called until all the root_info->path fields are filled
  * in by lookup_ino_path
  */
 static int resolve_root(struct rb_root *rl, struct root_info *ri,
 		       u64 top_id)
 {
-	char *full_path = NULL;
-	int len = 0;
-	struct root_info *found;
+	struct root_info *parent;
+	u64 next;
+	int ret;
+
+	if (ri->resolved)
+		return ri->resolved < 0 ? ri->resolved : 0;
 
 	/*
-	 * we go backwards from the root_info object and add pathnames
-	 * from parent directories as we go.
+	 * ref_tree = 0 indicates the subvolume
+	 * has been deleted.
 	 */
-	found = ri;
-	while (1) {
-		char *tmp;
-		u64 next;
-		int add_len;
-
-		/*
-		 * ref_tree = 0 indicates the subvolume
-		 * has been deleted.
-		 */
-		if (!found->ref_tree) {
-			free(full_path);
-			return -ENOENT;
-		}
-
-		add_len = strlen(found->path);
+	ri->resolved = -ENOENT;
+	if (!ri->ref_tree)
+		return -ENOENT;
 
-		if (full_path) {
-			/* room for / and for null */
-			tmp = malloc(add_len + 2 + len);
-			if (!tmp) {
-				error_mem(NULL);
-				exit(1);
-			}
-			memcpy(tmp + add_len + 1, full_path, len);
-			tmp[add_len] = '/';
-			memcpy(tmp, found->path, add_len);
-			tmp [add_len + len + 1] = '\0';
-			free(full_path);
-			full_path = tmp;
-			len += add_len + 1;
-		} else {
-			full_path = strdup(found->path);
-			len = add_len;
-		}
-		if (!ri->top_id)
-			ri->top_id = found->ref_tree;
+	if (!ri->top_id)
+		ri->top_id = ri->ref_tree;
 
-		next = found->ref_tree;
-		if (next == top_id)
-			break;
-		/*
-		* if the ref_tree = BTRFS_FS_TREE_OBJECTID,
-		* we are at the top
-		*/
-		if (next == BTRFS_FS_TREE_OBJECTID)
-			break;
-		/*
-		* if the ref_tree wasn't in our tree of roots, the
-		* subvolume was deleted.
-		*/
-		found = root_tree_search(rl, next);
-		if (!found) {
-			free(full_path);
-			return -ENOENT;
+	next = ri->ref_tree;
+	/*
+	 * if the ref_tree = BTRFS_FS_TREE_OBJECTID,
+	 * we are at the top
+	 */
+	if (next == top_id || next == BTRFS_FS_TREE_OBJECTID) {
+		ri->full_path = strdup(ri->path);
+		if (!ri->full_path) {
+			error_mem(NULL);
+			exit(1);
 		}
+		ri->resolved = 1;
+		return 0;
 	}
 
-	ri->full_path = full_path;
+	/*
+	 * if the ref_tree wasn't in our tree of roots, the
+	 * subvolume was deleted.
+	 */
+	parent = root_tree_search(rl, next);
+	if (!parent)
+		return -ENOENT;
+	ret = resolve_root(rl, parent, top_id);
+	if (ret < 0)
+		return ret;
+
+	/* room for / and for null */
+	ri->full_path = malloc(strlen(parent->full_path) + strlen(ri->path) + 2);
+	if (!ri->full_path) {
+		error_mem(NULL);
+		exit(1);
+	}
+	sprintf(ri->full_path, "%s/%s", parent->full_path, ri->path);
+	ri->resolved = 1;
 
 	return 0;
 }
 
+static void set_root_path(struct root_info *ri, const char *dir_path)
+{
+	ri->path = malloc(strlen(dir_path) + strlen(ri->name) + 1);
+	if (!ri->path) {
+		error_mem(NULL);
+		exit(1);
+	}
+	strcpy(ri->path, dir_path);
+	strcat(ri->path, ri->name);
+}
+
 /*
- * for a single root_info, ask the kernel to give us a path name
- * inside it's ref_root for the dir_id where it lives.
+ * for a group of root_info in the same directory, ask the kernel to give us
+ * a path name inside their ref_root for the dir_id where they live.
  *
  * This fills in root_info->path with the path to the directory and and
- * appends this root's name.
+ * appends the root's name.
  */
-static int lookup_ino_path(int fd, struct root_info *ri)
+static int lookup_ino_path(int fd, struct root_info **ris, int nr)
 {
 	struct btrfs_ioctl_ino_lookup_args args;
 	int ret;
-
-	if (ri->path)
-		return 0;
-
-	if (!ri->ref_tree)
-		return -ENOENT;
+	int i;
 
 	memset(&args, 0, sizeof(args));
-	args.treeid = ri->ref_tree;
-	args.objectid = ri->dir_id;
+	args.treeid = ris[0]->ref_tree;
+	args.objectid = ris[0]->dir_id;
 
 	ret = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args);
 	if (ret < 0) {
 		if (errno == ENOENT) {
-			ri->ref_tree = 0;
+			for (i = 0; i < nr; i++)
+				ris[i]->ref_tree = 0;
 			return -ENOENT;
 		}
-		error("failed to lookup path for root %llu: %m", ri->ref_tree);
+		error("failed to lookup path for root %llu: %m", ris[0]->ref_tree);
 		return ret;
 	}
 
-	if (args.name[0]) {
-		/*
-		 * we're in a subdirectory of ref_tree, the kernel ioctl
-		 * puts a / in there for us
-		 */
-		ri->path = malloc(strlen(ri->name) + strlen(args.name) + 1);
-		if (!ri->path) {
-			error_mem(NULL);
-			exit(1);
-		}
-		strcpy(ri->path, args.name);
-		strcat(ri->path, ri->name);
-	} else {
-		/* we're at the root of ref_tree */
-		ri->path = strdup(ri->name);
-		if (!ri->path) {
-			perror("strdup failed");
-			exit(1);
-		}
-	}
+	/*
+	 * If we're in a subdirectory of ref_tree, the kernel ioctl puts a /
+	 * in there for us, otherwise the name is empty.
+	 */
+	for (i = 0; i < nr; i++)
+		set_root_path(ris[i], args.name);
 	return 0;
 }
 
+static int cmp_root_info_dir(const void *a, const void *b)
+{
+	const struct root_info *ra = *(const struct root_info **)a;
+	const struct root_info *rb = *(const struct root_info **)b;
+
+	if (ra->ref_tree != rb->ref_tree)
+		return ra->ref_tree < rb->ref_tree ? -1 : 1;
+	if (ra->dir_id != rb->dir_id)
+		return ra->dir_id < rb->dir_id ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Fill the path of all roots with one lookup for each directory containing
+ * subvolumes, snapshots are typically created in a few directories.
+ */
+static int lookup_all_ino_paths(int fd, struct rb_root *root_lookup)
+{
+	struct root_info **ris;
+	struct rb_node *n;
+	int nr = 0;
+	int ret = 0;
+	int i;
+
+	for (n = rb_first(root_lookup); n; n = rb_next(n))
+		nr++;
+	if (nr == 0)
+		return 0;
+	ris = malloc(nr * sizeof(*ris));
+	if (!ris) {
+		error_mem(NULL);
+		exit(1);
+	}
+
+	nr = 0;
+	for (n = rb_first(root_lookup); n; n = rb_next(n)) {
+		struct root_info *entry = to_root_info(n);
+
+		if (entry->path || !entry->ref_tree)
+			continue;
+		ris[nr++] = entry;
+	}
+	qsort(ris, nr, sizeof(*ris), cmp_root_info_dir);
+
+	i = 0;
+	while (i < nr) {
+		int next = i + 1;
+
+		while (next < nr && cmp_root_info_dir(&ris[i], &ris[next]) == 0)
+			next++;
+		ret = lookup_ino_path(fd, ris + i, next - i);
+		if (ret && ret != -ENOENT)
+			break;
+		ret = 0;
+		i = next;
+	}
+	free(ris);
+	return ret;
+}
+
 static int list_subvol_search(int fd, struct rb_root *root_lookup)
 {
 	int ret;
@@ -1112,6 +1159,10 @@ static void filter_and_sort_subvol(struct rb_root *all_subvols,
 
 	sort_tree->rb_node = NULL;
 
+	/*
+	 * Resolve all paths before filtering, the filters may change the
+	 * full_path that is reused for the nested subvolumes.
+	 */
 	n = rb_last(all_subvols);
 	while (n) {
 		entry = to_root_info(n);
@@ -1131,6 +1182,13 @@ static void filter_and_sort_subvol(struct rb_root *all_subvols,
 				entry->deleted = 0;
 			}
 		}
+		n = rb_prev(n);
+	}
+
+	n = rb_last(all_subvols);
+	while (n) {
+		entry = to_root_info(n);
+
 		ret = filter_root(entry, filter_set);
 		if (ret)
 			sort_tree_insert(sort_tree, entry, comp_set);
@@ -1397,7 +1455,6 @@ next:
 static int btrfs_list_subvols(int fd, struct rb_root *root_lookup)
 {
 	int ret;
-	struct rb_node *n;
 
 	ret = list_subvol_search(fd, root_lookup);
 	if (ret) {
@@ -1409,18 +1466,7 @@ static int btrfs_list_subvols(int fd, struct rb_root *root_lookup)
 	 * now we have an rbtree full of root_info objects, but we need to fill
 	 * in their path names within the subvol that is referencing each one.
 	 */
-	n = rb_first(root_lookup);
-	while (n) {
-		struct root_info *entry;
-
-		entry = to_root_info(n);
-		ret = lookup_ino_path(fd, entry);
-		if (ret && ret != -ENOENT)
-			return ret;
-		n = rb_next(n);
-	}
-
-	return 0;
+	return lookup_all_ino_paths(fd, root_lookup);
 }
 
 static int btrfs_list_subvols_print(int fd, struct btrfs_list_filter_set *filter_set,
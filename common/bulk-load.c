@@ -0,0 +1,401 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Bulk insertion of items past the end of a tree
+ *
+ * Trees that are built in key order, like the ones created by mkfs, only ever
+ * grow on their right edge. Instead of a search from the root, a COW of the
+ * path and a leaf split for each item, the collected items are sorted and
+ * appended to the rightmost leaf. Once it is full a new leaf is started and
+ * linked to its parent, which is in turn extended the same way, so the blocks
+ * are filled completely from the bottom up.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/transaction.h"
+#include "kernel-shared/volumes.h"
+#include "common/bulk-load.h"
+#include "common/messages.h"
+
+void btrfs_bulk_items_init(struct btrfs_bulk_items *bulk)
+{
+	memset(bulk, 0, sizeof(*bulk));
+}
+
+static void bulk_items_reset(struct btrfs_bulk_items *bulk)
+{
+	for (u32 i = 0; i < bulk->nr; i++)
+		free(bulk->items[i].data);
+	bulk->nr = 0;
+	bulk->size = 0;
+}
+
+void btrfs_bulk_items_release(struct btrfs_bulk_items *bulk)
+{
+	bulk_items_reset(bulk);
+	free(bulk->items);
+	btrfs_bulk_items_init(bulk);
+}
+
+/*
+ * Add an item of @size bytes, return its zeroed data to be filled by the
+ * caller or NULL if out of memory.
+ *
+ * Items with the same key are merged into one, with the data in the order
+ * they were added if the key is repeated right away, and in any order
+ * otherwise. That's for names with colliding hashes sharing one dir item,
+ * xattr item or inode ref.
+ */
+void *btrfs_bulk_items_add(struct btrfs_bulk_items *bulk,
+			   const struct btrfs_key *key, u32 size)
+{
+	struct btrfs_bulk_item *item;
+	void *data;
+
+	item = bulk->nr ? &bulk->items[bulk->nr - 1] : NULL;
+	if (item && btrfs_comp_cpu_keys(&item->key, key) == 0) {
+		data = realloc(item->data, item->size + size);
+		if (!data)
+			return NULL;
+		item->data = data;
+		memset(data + item->size, 0, size);
+		item->size += size;
+		bulk->size += size;
+		return data + item->size - size;
+	}
+
+	if (bulk->nr == bulk->nr_alloc) {
+		u32 nr_alloc = max(bulk->nr_alloc * 2, 16U);
+		struct btrfs_bulk_item *items;
+
+		items = realloc(bulk->items, nr_alloc * sizeof(*items));
+		if (!items)
+			return NULL;
+		bulk->items = items;
+		bulk->nr_alloc = nr_alloc;
+	}
+	data = calloc(1, max(size, 1U));
+	if (!data)
+		return NULL;
+	item = &bulk->items[bulk->nr++];
+	item->key = *key;
+	item->size = size;
+	item->data = data;
+	bulk->size += size;
+	return data;
+}
+
+static int bulk_item_compare(const void *a, const void *b)
+{
+	const struct btrfs_bulk_item *item1 = a;
+	const struct btrfs_bulk_item *item2 = b;
+
+	return btrfs_comp_cpu_keys(&item1->key, &item2->key);
+}
+
+/* Merge the sorted items with the same key. */
+static int bulk_items_merge(struct btrfs_bulk_items *bulk)
+{
+	u32 nr = 0;
+
+	for (u32 i = 0; i < bulk->nr; i++) {
+		struct btrfs_bulk_item *item = &bulk->items[i];
+		struct btrfs_bulk_item *prev = nr ? &bulk->items[nr - 1] : NULL;
+		void *data;
+
+		if (!prev || btrfs_comp_cpu_keys(&prev->key, &item->key) != 0) {
+			bulk->items[nr++] = *item;
+			continue;
+		}
+		data = realloc(prev->data, prev->size + item->size);
+		if (!data) {
+			/* Keep all the items to be freed. */
+			memmove(&bulk->items[nr], item,
+				(bulk->nr - i) * sizeof(*item));
+			bulk->nr = nr + bulk->nr - i;
+			return -ENOMEM;
+		}
+		memcpy(data + prev->size, item->data, item->size);
+		prev->data = data;
+		prev->size += item->size;
+		free(item->data);
+	}
+	bulk->nr = nr;
+	return 0;
+}
+
+static struct extent_buffer *bulk_alloc_block(struct btrfs_trans_handle *trans,
+					      struct btrfs_root *root,
+					      struct btrfs_disk_key *disk_key,
+					      int level, u64 hint)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct extent_buffer *eb;
+
+	eb = btrfs_alloc_tree_block(trans, root, 0, root->root_key.objectid,
+				    disk_key, level, hint, 0,
+				    BTRFS_NESTING_NORMAL);
+	if (IS_ERR(eb))
+		return eb;
+
+	memset_extent_buffer(eb, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_level(eb, level);
+	btrfs_set_header_bytenr(eb, eb->start);
+	btrfs_set_header_generation(eb, trans->transid);
+	btrfs_set_header_backref_rev(eb, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(eb, root->root_key.objectid);
+	write_extent_buffer_fsid(eb, fs_info->fs_devices->metadata_uuid);
+	write_extent_buffer_chunk_tree_uuid(eb, fs_info->chunk_tree_uuid);
+	btrfs_set_root_used(&root->root_item,
+			    btrfs_root_used(&root->root_item) + fs_info->nodesize);
+	btrfs_mark_buffer_dirty(eb);
+	return eb;
+}
+
+/* Add a new root at @level, pointing to the current one. */
+static int bulk_grow_root(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, struct btrfs_path *path,
+			  int level)
+{
+	struct extent_buffer *lower = path->nodes[level - 1];
+	struct extent_buffer *eb;
+	struct btrfs_disk_key lower_key;
+
+	UASSERT(lower == root->node);
+
+	if (level == 1)
+		btrfs_item_key(lower, &lower_key, 0);
+	else
+		btrfs_node_key(lower, &lower_key, 0);
+
+	eb = bulk_alloc_block(trans, root, &lower_key, level, lower->start);
+	if (IS_ERR(eb))
+		return PTR_ERR(eb);
+
+	btrfs_set_node_key(eb, &lower_key, 0);
+	btrfs_set_node_blockptr(eb, 0, lower->start);
+	btrfs_set_node_ptr_generation(eb, 0, btrfs_header_generation(lower));
+	btrfs_set_header_nritems(eb, 1);
+
+	/* The root keeps its own reference, the path takes another one. */
+	free_extent_buffer(root->node);
+	root->node = eb;
+	add_root_to_dirty_list(root);
+	extent_buffer_get(eb);
+	path->nodes[level] = eb;
+	path->slots[level] = 0;
+	return 0;
+}
+
+/*
+ * Replace the block at @level of the path, which is the rightmost one of its
+ * level, by a new empty block right of it, starting with @disk_key. Parents
+ * that are full are replaced the same way, and the tree grows a new root if
+ * needed.
+ */
+static int bulk_add_block(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, struct btrfs_path *path,
+			  int level, struct btrfs_disk_key *disk_key)
+{
+	struct extent_buffer *parent;
+	struct extent_buffer *eb;
+	u32 slot;
+	int ret;
+
+	if (level + 1 >= BTRFS_MAX_LEVEL)
+		return -EOVERFLOW;
+
+	if (!path->nodes[level + 1]) {
+		ret = bulk_grow_root(trans, root, path, level + 1);
+		if (ret < 0)
+			return ret;
+	}
+	if (btrfs_header_nritems(path->nodes[level + 1]) >=
+	    BTRFS_NODEPTRS_PER_BLOCK(root->fs_info)) {
+		ret = bulk_add_block(trans, root, path, level + 1, disk_key);
+		if (ret < 0)
+			return ret;
+	}
+	parent = path->nodes[level + 1];
+
+	eb = bulk_alloc_block(trans, root, disk_key, level,
+			      path->nodes[level]->start);
+	if (IS_ERR(eb))
+		return PTR_ERR(eb);
+
+	slot = btrfs_header_nritems(parent);
+	btrfs_set_node_key(parent, disk_key, slot);
+	btrfs_set_node_blockptr(parent, slot, eb->start);
+	btrfs_set_node_ptr_generation(parent, slot, trans->transid);
+	btrfs_set_header_nritems(parent, slot + 1);
+	btrfs_mark_buffer_dirty(parent);
+
+	free_extent_buffer(path->nodes[level]);
+	path->nodes[level] = eb;
+	path->slots[level] = 0;
+	path->slots[level + 1] = slot;
+	return 0;
+}
+
+static int bulk_append_item(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, struct btrfs_path *path,
+			    const struct btrfs_bulk_item *item)
+{
+	struct extent_buffer *leaf = path->nodes[0];
+	struct btrfs_disk_key disk_key;
+	u32 needed = item->size + sizeof(struct btrfs_item);
+	u32 data_end;
+	u32 nritems;
+	int ret;
+
+	if (needed > BTRFS_LEAF_DATA_SIZE(root->fs_info))
+		return -EOVERFLOW;
+
+	btrfs_cpu_key_to_disk(&disk_key, &item->key);
+	if (btrfs_leaf_free_space(leaf) < needed) {
+		ret = bulk_add_block(trans, root, path, 0, &disk_key);
+		if (ret < 0)
+			return ret;
+		leaf = path->nodes[0];
+	}
+
+	nritems = btrfs_header_nritems(leaf);
+	if (nritems)
+		data_end = btrfs_item_offset(leaf, nritems - 1);
+	else
+		data_end = BTRFS_LEAF_DATA_SIZE(root->fs_info);
+
+	btrfs_set_item_key(leaf, &disk_key, nritems);
+	btrfs_set_item_offset(leaf, nritems, data_end - item->size);
+	btrfs_set_item_size(leaf, nritems, item->size);
+	btrfs_set_header_nritems(leaf, nritems + 1);
+	write_extent_buffer(leaf, item->data,
+			    btrfs_item_ptr_offset(leaf, nritems), item->size);
+	btrfs_mark_buffer_dirty(leaf);
+	path->slots[0] = nritems + 1;
+	return 0;
+}
+
+/*
+ * Insert @item in the middle of the tree, or add its data to the end of the
+ * existing item with the same key.
+ */
+static int bulk_insert_item(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    const struct btrfs_bulk_item *item)
+{
+	struct btrfs_path path = { 0 };
+	struct extent_buffer *leaf;
+	u32 old_size;
+	int ret;
+
+	ret = btrfs_insert_item(trans, root, &item->key, item->data,
+				item->size);
+	if (ret != -EEXIST)
+		return ret;
+
+	ret = btrfs_search_slot(trans, root, &item->key, &path, item->size, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret < 0)
+		goto out;
+	leaf = path.nodes[0];
+	old_size = btrfs_item_size(leaf, path.slots[0]);
+	btrfs_extend_item(&path, item->size);
+	write_extent_buffer(leaf, item->data,
+			    btrfs_item_ptr_offset(leaf, path.slots[0]) + old_size,
+			    item->size);
+	btrfs_mark_buffer_dirty(leaf);
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Insert all the collected items into @root and empty @bulk.
+ *
+ * Items with keys past the last key of the tree are appended directly to its
+ * right edge, with a single search. The others, if any, are inserted one by
+ * one, extending the existing items with the same key.
+ */
+int btrfs_bulk_items_insert(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    struct btrfs_bulk_items *bulk)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key = {
+		.objectid = (u64)-1,
+		.type = (u8)-1,
+		.offset = (u64)-1,
+	};
+	struct extent_buffer *leaf;
+	u32 nritems;
+	u32 first = 0;
+	int ret;
+
+	if (!bulk->nr)
+		return 0;
+
+	qsort(bulk->items, bulk->nr, sizeof(*bulk->items), bulk_item_compare);
+	ret = bulk_items_merge(bulk);
+	if (ret < 0)
+		goto out;
+
+	/*
+	 * COW the path to the last item, the slot is past its end. The blocks
+	 * on the right edge are all checked when written out anyway.
+	 */
+	path.skip_check_block = 1;
+	ret = btrfs_search_slot(trans, root, &key, &path, 0, 1);
+	if (ret < 0)
+		goto out;
+
+	leaf = path.nodes[0];
+	nritems = btrfs_header_nritems(leaf);
+	if (nritems) {
+		struct btrfs_key last;
+
+		btrfs_item_key_to_cpu(leaf, &last, nritems - 1);
+		while (first < bulk->nr &&
+		       btrfs_comp_cpu_keys(&bulk->items[first].key, &last) <= 0)
+			first++;
+	}
+
+	for (u32 i = first; i < bulk->nr; i++) {
+		ret = bulk_append_item(trans, root, &path, &bulk->items[i]);
+		if (ret < 0)
+			goto out;
+	}
+	btrfs_release_path(&path);
+
+	for (u32 i = 0; i < first; i++) {
+		ret = bulk_insert_item(trans, root, &bulk->items[i]);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	bulk_items_reset(bulk);
+	return ret;
+}
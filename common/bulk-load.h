@@ -0,0 +1,52 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_BULK_LOAD_H__
+#define __BTRFS_BULK_LOAD_H__
+
+#include "kerncompat.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/ctree.h"
+
+struct btrfs_trans_handle;
+
+struct btrfs_bulk_item {
+	struct btrfs_key key;
+	u32 size;
+	void *data;
+};
+
+/*
+ * Items collected in memory to be inserted into one tree at once, in any
+ * order of the keys.
+ */
+struct btrfs_bulk_items {
+	struct btrfs_bulk_item *items;
+	u32 nr;
+	u32 nr_alloc;
+	/* Total size of the item data */
+	u64 size;
+};
+
+void btrfs_bulk_items_init(struct btrfs_bulk_items *bulk);
+void btrfs_bulk_items_release(struct btrfs_bulk_items *bulk);
+void *btrfs_bulk_items_add(struct btrfs_bulk_items *bulk,
+			   const struct btrfs_key *key, u32 size);
+int btrfs_bulk_items_insert(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    struct btrfs_bulk_items *bulk);
+
+#endif
@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <blkid/blkid.h>
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/disk-io.h"
@@ -80,27 +81,105 @@ int device_discard_blocks(int fd, u64 start, u64 len)
 	return 0;
 }
 
-static void prepare_discard_device(const char *filename, int fd, u64 byte_count, unsigned opflags)
+/* Number of discard requests in flight on a non-rotational device */
+#define DISCARD_WORKERS		4
+
+struct discard_ctx {
+	pthread_mutex_t mutex;
+	int fd;
+	/* Next range to be discarded */
+	u64 cur;
+	u64 end;
+	int ret;
+	struct device_discard_progress *progress;
+};
+
+static void *discard_worker(void *arg)
 {
-	u64 cur = 0;
+	struct discard_ctx *ctx = arg;
 
-	while (cur < byte_count) {
-		/* 1G granularity */
-		u64 chunk_size = (cur == 0) ? SZ_1M : min_t(u64, byte_count - cur, SZ_1G);
+	while (true) {
+		u64 start;
+		u64 len;
 		int ret;
 
-		ret = discard_range(fd, cur, chunk_size);
-		if (ret)
-			return;
-		/*
-		 * The first range discarded successfully, meaning the device supports
-		 * discard.
-		 */
-		if (opflags & PREP_DEVICE_VERBOSE && cur == 0)
-			printf("Performing full device TRIM %s (%s) ...\n",
-			       filename, pretty_size(byte_count));
-		cur += chunk_size;
+		pthread_mutex_lock(&ctx->mutex);
+		if (ctx->ret || ctx->cur >= ctx->end) {
+			pthread_mutex_unlock(&ctx->mutex);
+			break;
+		}
+		/* 1G granularity */
+		start = ctx->cur;
+		len = min_t(u64, ctx->end - start, SZ_1G);
+		ctx->cur += len;
+		pthread_mutex_unlock(&ctx->mutex);
+
+		ret = discard_range(ctx->fd, start, len);
+		if (ret) {
+			pthread_mutex_lock(&ctx->mutex);
+			ctx->ret = ret;
+			pthread_mutex_unlock(&ctx->mutex);
+			break;
+		}
+		if (ctx->progress) {
+			pthread_mutex_lock(&ctx->progress->mutex);
+			ctx->progress->done += len;
+			pthread_mutex_unlock(&ctx->progress->mutex);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Discard the whole device if it's supported. The kernel splits each request
+ * to the device limits and waits for all of them, so several requests are
+ * issued in parallel from threads to keep the device queue busy.
+ */
+static void prepare_discard_device(const char *filename, int fd, u64 byte_count,
+				   unsigned opflags,
+				   struct device_discard_progress *progress)
+{
+	struct discard_ctx ctx = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.fd = fd,
+		.cur = SZ_1M,
+		.end = byte_count,
+		.progress = progress,
+	};
+	pthread_t workers[DISCARD_WORKERS];
+	int nr_workers = 1;
+	int i;
+
+	/*
+	 * The first range discarded successfully, meaning the device supports
+	 * discard.
+	 */
+	if (discard_range(fd, 0, min_t(u64, byte_count, SZ_1M)))
+		return;
+	if (opflags & PREP_DEVICE_VERBOSE)
+		printf("Performing full device TRIM %s (%s) ...\n",
+		       filename, pretty_size(byte_count));
+	if (progress) {
+		pthread_mutex_lock(&progress->mutex);
+		progress->total += byte_count;
+		progress->done += min_t(u64, byte_count, SZ_1M);
+		pthread_mutex_unlock(&progress->mutex);
+	}
+
+	/* Returns true for non-rotational devices */
+	if (device_get_rotational(filename))
+		nr_workers = min_t(u64, DISCARD_WORKERS,
+				   DIV_ROUND_UP(byte_count, SZ_1G));
+
+	for (i = 1; i < nr_workers; i++) {
+		if (pthread_create(&workers[i], NULL, discard_worker, &ctx))
+			break;
 	}
+	/* Also do the work in this thread */
+	discard_worker(&ctx);
+	while (--i > 0)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&ctx.mutex);
 }
 
 /*
@@ -227,7 +306,8 @@ out:
  * - delete end of the device
  */
 int btrfs_prepare_device(int fd, const char *file, u64 *byte_count_ret,
-			 u64 max_byte_count, unsigned opflags)
+			 u64 max_byte_count, unsigned opflags,
+			 struct device_discard_progress *progress)
 {
 	struct btrfs_zoned_device_info *zinfo = NULL;
 	u64 byte_count;
@@ -294,7 +374,7 @@ int btrfs_prepare_device(int fd, const char *file, u64 *byte_count_ret,
 	}
 
 	if (!(opflags & PREP_DEVICE_ZONED) && (opflags & PREP_DEVICE_DISCARD))
-		prepare_discard_device(file, fd, byte_count, opflags);
+		prepare_discard_device(file, fd, byte_count, opflags, progress);
 
 	ret = btrfs_wipe_existing_sb(fd, zinfo);
 	if (ret < 0) {
@@ -20,6 +20,7 @@
 #include "kerncompat.h"
 #include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
 
 struct btrfs_ioctl_dev_info_args;
 struct stat;
@@ -34,6 +35,16 @@ enum {
 	PREP_DEVICE_ZONED	= (1U << 3),
 };
 
+/*
+ * Progress of the device discard in btrfs_prepare_device(), updated from the
+ * discarding threads, read by the caller under @mutex
+ */
+struct device_discard_progress {
+	pthread_mutex_t mutex;
+	u64 total;
+	u64 done;
+};
+
 /* Placeholder to denote no results for the zone_unusable sysfs value */
 #define DEVICE_ZONE_UNUSABLE_UNKNOWN		((u64)-1)
 
@@ -53,7 +64,8 @@ int device_get_info(int fd, u64 devid, struct btrfs_ioctl_dev_info_args *di_args
  * Updates to devices with btrfs-specific changs
  */
 int btrfs_prepare_device(int fd, const char *file, u64 *block_count_ret,
-		u64 max_block_count, unsigned opflags);
+		u64 max_block_count, unsigned opflags,
+		struct device_discard_progress *progress);
 ssize_t btrfs_direct_pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t btrfs_direct_pwrite(int fd, const void *buf, size_t count, off_t offset);
 
@@ -150,7 +150,7 @@ int get_label_unmounted(const char *dev, char *label)
 	/* Open the super_block at the default location
 	 * and as read-only.
 	 */
-	root = open_ctree(dev, 0, 0);
+	root = open_ctree(dev, 0, OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if(!root)
 		return -1;
 
@@ -123,7 +123,11 @@ static void fmt_dec_depth(struct format_ctx *fctx)
 
 static void fmt_separator(struct format_ctx *fctx)
 {
-	if (bconf.output_format == CMD_FORMAT_JSON) {
+	if (bconf.output_format == CMD_FORMAT_JSON && fctx->oneline) {
+		if (fctx->memb[fctx->depth] != 0)
+			putchar(',');
+		fctx->memb[fctx->depth] = 1;
+	} else if (bconf.output_format == CMD_FORMAT_JSON) {
 		/* Check current depth */
 		if (fctx->memb[fctx->depth] == 0) {
 			/* First member, only indent */
@@ -205,13 +209,42 @@ void fmt_end(struct format_ctx *fctx)
 	}
 }
 
+/*
+ * Start an object printed on a single line and without the header, for
+ * outputs that are a stream of objects (NDJSON) instead of one document.
+ * Does nothing for the plain text format.
+ */
+void fmt_start_line(struct format_ctx *fctx, const struct rowspec *spec)
+{
+	memset(fctx, 0, sizeof(*fctx));
+	fctx->rowspec = spec;
+	fctx->depth = 1;
+	fctx->oneline = true;
+
+	if (bconf.output_format & CMD_FORMAT_JSON) {
+		putchar('{');
+		fctx->jtype[fctx->depth] = JSON_TYPE_MAP;
+		fctx->memb[fctx->depth] = 0;
+	}
+}
+
+void fmt_end_line(struct format_ctx *fctx)
+{
+	if (fctx->depth != 1)
+		fprintf(stderr, "WARNING: wrong nesting\n");
+
+	if (bconf.output_format & CMD_FORMAT_JSON)
+		printf("}\n");
+}
+
 void fmt_start_list_value(struct format_ctx *fctx)
 {
 	if (bconf.output_format == CMD_FORMAT_TEXT) {
 		fmt_indent1(fctx->indent);
 	} else if (bconf.output_format == CMD_FORMAT_JSON) {
 		fmt_separator(fctx);
-		fmt_indent2(fctx->depth);
+		if (!fctx->oneline)
+			fmt_indent2(fctx->depth);
 		putchar('"');
 	}
 }
@@ -269,7 +302,7 @@ void fmt_print_start_group(struct format_ctx *fctx, const char *name,
 		fctx->jtype[fctx->depth] = jtype;
 		fctx->memb[fctx->depth] = 0;
 		if (name)
-			printf("\"%s\": ", name);
+			printf(fctx->oneline ? "\"%s\":" : "\"%s\": ", name);
 		if (jtype == JSON_TYPE_MAP)
 			putchar('{');
 		else if (jtype == JSON_TYPE_ARRAY)
@@ -286,8 +319,10 @@ void fmt_print_end_group(struct format_ctx *fctx, const char *name)
 		const enum json_type jtype = fctx->jtype[fctx->depth];
 
 		fmt_dec_depth(fctx);
-		putchar('\n');
-		fmt_indent2(fctx->depth);
+		if (!fctx->oneline) {
+			putchar('\n');
+			fmt_indent2(fctx->depth);
+		}
 		if (jtype == JSON_TYPE_MAP)
 			putchar('}');
 		else if (jtype == JSON_TYPE_ARRAY)
@@ -345,7 +380,8 @@ void fmt_print(struct format_ctx *fctx, const char* key, ...)
 			/* Simple key/values */
 			fmt_separator(fctx);
 			if (row->out_json)
-				printf("\"%s\": ", row->out_json);
+				printf(fctx->oneline ? "\"%s\":" : "\"%s\": ",
+				       row->out_json);
 		}
 	}
 
@@ -80,12 +80,17 @@ struct format_ctx {
 	enum json_type memb[JSON_NESTING_LIMIT];
 	/* Set if the value needs to be printed unquoted */
 	bool unquoted;
+	/* Print the whole object on one line, for streams of objects (NDJSON) */
+	bool oneline;
 };
 
 void fmt_start(struct format_ctx *fctx, const struct rowspec *spec, int width,
 		int indent);
 void fmt_end(struct format_ctx *fctx);
 
+void fmt_start_line(struct format_ctx *fctx, const struct rowspec *spec);
+void fmt_end_line(struct format_ctx *fctx);
+
 void fmt_print(struct format_ctx *fctx, const char* key, ...);
 
 void fmt_start_list_value(struct format_ctx *fctx);
@@ -0,0 +1,1334 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Index of a stored send stream
+ *
+ * The index maps files and directories of the received subvolumes to the
+ * offsets of the commands that create and change them, so the commands
+ * needed for some paths can be applied without parsing the whole stream.
+ *
+ * The stream identifies files only by their current path. The index tracks
+ * the names like a directory tree of objects, an object is created by the
+ * mkfile/mkdir/... commands (or on the first use of a path that existed in
+ * the parent snapshot), keeps the identity over renames and links, and all
+ * commands on any of its names are recorded for it. Object 0 stands for the
+ * commands of the stream itself (subvol, snapshot), object 1 is the top
+ * directory of the subvolume.
+ *
+ * An object depends on the directories it was created in or moved to or
+ * from and on the sources of clones inside the subvolume, the commands of
+ * those are needed too.
+ *
+ * File format, all numbers are little endian, structures are packed:
+ *
+ *   struct index_header
+ *   for each stream in the file:
+ *     struct index_stream_header
+ *     nr_entries * struct index_entry, in the stream order
+ *     nr_deps * struct index_dep, sorted by object
+ *     nr_names * (le32 object, le16 length, path), the paths at the end of
+ *                the stream, relative to the subvolume
+ */
+
+#include "kerncompat.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernel-lib/rbtree.h"
+#include "kernel-shared/uapi/btrfs.h"
+#include "kernel-shared/send.h"
+#include "common/send-index.h"
+#include "common/send-stream.h"
+#include "common/messages.h"
+#include "common/rbtree-utils.h"
+
+#define SEND_INDEX_MAGIC	"btrfs-sendindex"
+#define SEND_INDEX_VERSION	1
+
+#define INDEX_OBJECT_STREAM	0
+#define INDEX_OBJECT_ROOT	1
+
+struct index_header {
+	char magic[sizeof(SEND_INDEX_MAGIC)];
+	__le32 version;
+	__le32 nr_streams;
+	__le64 reserved;
+} __attribute__ ((__packed__));
+
+struct index_stream_header {
+	/* Offset of the stream header in the stream file */
+	__le64 offset;
+	__le32 version;
+	__le32 nr_objects;
+	__le64 nr_entries;
+	__le32 nr_deps;
+	__le32 nr_names;
+} __attribute__ ((__packed__));
+
+struct index_entry {
+	__le64 offset;
+	__le32 object;
+} __attribute__ ((__packed__));
+
+struct index_dep {
+	__le32 object;
+	__le32 depends_on;
+} __attribute__ ((__packed__));
+
+struct index_name {
+	__le32 object;
+	__le16 len;
+	char path[];
+} __attribute__ ((__packed__));
+
+/* Name of an object in a directory */
+struct index_dentry {
+	struct rb_node node;
+	u32 parent;
+	u32 object;
+	char name[];
+};
+
+struct index_object {
+	/* The last name the object got, for building paths of directories */
+	struct index_dentry *dentry;
+	/* The last dependency, most repeat for commands in a row */
+	u32 last_dep;
+};
+
+struct btrfs_send_index_writer {
+	char *filename;
+	FILE *file;
+	struct btrfs_send_reader *reader;
+	struct btrfs_send_ops *ops;
+	void *user;
+
+	u32 nr_streams;
+	bool in_stream;
+	/* Position of the header of the current stream in the index file */
+	off_t stream_pos;
+	struct index_stream_header stream_hdr;
+	u64 nr_entries;
+	u8 subvol_uuid[BTRFS_UUID_SIZE];
+
+	struct rb_root dentries;
+	struct index_object *objects;
+	u32 nr_objects;
+	u32 alloc_objects;
+	struct index_dep *deps;
+	u32 nr_deps;
+	u32 alloc_deps;
+};
+
+struct dentry_key {
+	u32 parent;
+	const char *name;
+	size_t len;
+};
+
+static int compare_dentry(u32 parent1, const char *name1, size_t len1,
+			  u32 parent2, const char *name2, size_t len2)
+{
+	int ret;
+
+	if (parent1 != parent2)
+		return parent1 < parent2 ? -1 : 1;
+	ret = memcmp(name1, name2, min(len1, len2));
+	if (ret)
+		return ret;
+	return len1 < len2 ? -1 : (len1 > len2);
+}
+
+static int dentry_comp_nodes(const struct rb_node *node1,
+			     const struct rb_node *node2)
+{
+	const struct index_dentry *d1 = rb_entry(node1, struct index_dentry, node);
+	const struct index_dentry *d2 = rb_entry(node2, struct index_dentry, node);
+
+	return compare_dentry(d2->parent, d2->name, strlen(d2->name),
+			      d1->parent, d1->name, strlen(d1->name));
+}
+
+static int dentry_comp_key(const struct rb_node *node, const void *data)
+{
+	const struct index_dentry *d = rb_entry(node, struct index_dentry, node);
+	const struct dentry_key *key = data;
+
+	return compare_dentry(key->parent, key->name, key->len,
+			      d->parent, d->name, strlen(d->name));
+}
+
+static void free_dentry(struct rb_node *node)
+{
+	free(rb_entry(node, struct index_dentry, node));
+}
+FREE_RB_BASED_TREE(dentry, free_dentry);
+
+static struct index_dentry *lookup_dentry(struct btrfs_send_index_writer *iw,
+					  u32 parent, const char *name,
+					  size_t len)
+{
+	struct dentry_key key = { .parent = parent, .name = name, .len = len };
+	struct rb_node *node;
+
+	node = rb_search(&iw->dentries, &key, dentry_comp_key, NULL);
+	if (!node)
+		return NULL;
+	return rb_entry(node, struct index_dentry, node);
+}
+
+static void remove_dentry(struct btrfs_send_index_writer *iw,
+			  struct index_dentry *dentry)
+{
+	if (iw->objects[dentry->object].dentry == dentry)
+		iw->objects[dentry->object].dentry = NULL;
+	rb_erase(&dentry->node, &iw->dentries);
+	free(dentry);
+}
+
+static int new_object(struct btrfs_send_index_writer *iw, u32 *object_ret)
+{
+	if (iw->nr_objects == iw->alloc_objects) {
+		u32 alloc = max(1024U, iw->alloc_objects * 2);
+		struct index_object *tmp;
+
+		tmp = realloc(iw->objects, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		iw->objects = tmp;
+		iw->alloc_objects = alloc;
+	}
+	memset(&iw->objects[iw->nr_objects], 0, sizeof(iw->objects[0]));
+	*object_ret = iw->nr_objects++;
+	return 0;
+}
+
+/* Add name @name of @object to directory @parent, replacing the old one */
+static int add_dentry(struct btrfs_send_index_writer *iw, u32 parent,
+		      const char *name, size_t len, u32 object)
+{
+	struct index_dentry *dentry;
+
+	dentry = lookup_dentry(iw, parent, name, len);
+	if (dentry)
+		remove_dentry(iw, dentry);
+
+	dentry = malloc(sizeof(*dentry) + len + 1);
+	if (!dentry)
+		return -ENOMEM;
+	dentry->parent = parent;
+	dentry->object = object;
+	memcpy(dentry->name, name, len);
+	dentry->name[len] = 0;
+	rb_insert(&iw->dentries, &dentry->node, dentry_comp_nodes);
+	iw->objects[object].dentry = dentry;
+	return 0;
+}
+
+/*
+ * Find the directory containing @path and the last component of the path.
+ * The directories not seen in the stream existed in the parent snapshot,
+ * objects are created for them.
+ */
+static int resolve_parent(struct btrfs_send_index_writer *iw, const char *path,
+			  u32 *parent_ret, const char **name_ret,
+			  size_t *len_ret)
+{
+	u32 parent = INDEX_OBJECT_ROOT;
+	const char *name = path;
+
+	while (1) {
+		const char *slash = strchr(name, '/');
+		struct index_dentry *dentry;
+		size_t len;
+		u32 object;
+		int ret;
+
+		if (!slash)
+			break;
+		len = slash - name;
+		if (len == 0 || (len == 1 && name[0] == '.')) {
+			name = slash + 1;
+			continue;
+		}
+		dentry = lookup_dentry(iw, parent, name, len);
+		if (dentry) {
+			object = dentry->object;
+		} else {
+			ret = new_object(iw, &object);
+			if (ret < 0)
+				return ret;
+			ret = add_dentry(iw, parent, name, len, object);
+			if (ret < 0)
+				return ret;
+		}
+		parent = object;
+		name = slash + 1;
+	}
+	*parent_ret = parent;
+	*name_ret = name;
+	*len_ret = strlen(name);
+	return 0;
+}
+
+/* Find the object of @path and the directory it is in */
+static int resolve_path(struct btrfs_send_index_writer *iw, const char *path,
+			u32 *object_ret, u32 *parent_ret)
+{
+	struct index_dentry *dentry;
+	const char *name;
+	size_t len;
+	u32 parent;
+	int ret;
+
+	ret = resolve_parent(iw, path, &parent, &name, &len);
+	if (ret < 0)
+		return ret;
+	*parent_ret = parent;
+	if (len == 0 || (len == 1 && name[0] == '.')) {
+		*object_ret = parent;
+		return 0;
+	}
+	dentry = lookup_dentry(iw, parent, name, len);
+	if (dentry) {
+		*object_ret = dentry->object;
+		return 0;
+	}
+	ret = new_object(iw, object_ret);
+	if (ret < 0)
+		return ret;
+	return add_dentry(iw, parent, name, len, *object_ret);
+}
+
+static int add_dep(struct btrfs_send_index_writer *iw, u32 object, u32 dep)
+{
+	if (object == dep || iw->objects[object].last_dep == dep)
+		return 0;
+	if (iw->nr_deps == iw->alloc_deps) {
+		u32 alloc = max(1024U, iw->alloc_deps * 2);
+		struct index_dep *tmp;
+
+		tmp = realloc(iw->deps, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		iw->deps = tmp;
+		iw->alloc_deps = alloc;
+	}
+	iw->deps[iw->nr_deps].object = cpu_to_le32(object);
+	iw->deps[iw->nr_deps].depends_on = cpu_to_le32(dep);
+	iw->nr_deps++;
+	iw->objects[object].last_dep = dep;
+	return 0;
+}
+
+/* Record the command being processed for @object */
+static int add_entry(struct btrfs_send_index_writer *iw, u32 object)
+{
+	struct index_entry entry;
+
+	if (!iw->in_stream) {
+		error("index: command before start of a subvolume");
+		return -EINVAL;
+	}
+	entry.offset = cpu_to_le64(btrfs_send_reader_cmd_offset(iw->reader));
+	entry.object = cpu_to_le32(object);
+	if (fwrite(&entry, sizeof(entry), 1, iw->file) != 1) {
+		error("cannot write index %s: %m", iw->filename);
+		return -errno;
+	}
+	iw->nr_entries++;
+	return 0;
+}
+
+/* Record a command that changes the object at @path */
+static int index_path(struct btrfs_send_index_writer *iw, const char *path,
+		      u32 *object_ret)
+{
+	u32 object;
+	u32 parent;
+	int ret;
+
+	ret = resolve_path(iw, path, &object, &parent);
+	if (ret < 0)
+		return ret;
+	ret = add_entry(iw, object);
+	if (ret < 0)
+		return ret;
+	if (object_ret)
+		*object_ret = object;
+	if (object == parent)
+		return 0;
+	return add_dep(iw, object, parent);
+}
+
+/* Record a command that creates a new object at @path */
+static int index_create(struct btrfs_send_index_writer *iw, const char *path)
+{
+	const char *name;
+	size_t len;
+	u32 parent;
+	u32 object;
+	int ret;
+
+	ret = resolve_parent(iw, path, &parent, &name, &len);
+	if (ret < 0)
+		return ret;
+	ret = new_object(iw, &object);
+	if (ret < 0)
+		return ret;
+	ret = add_dentry(iw, parent, name, len, object);
+	if (ret < 0)
+		return ret;
+	ret = add_entry(iw, object);
+	if (ret < 0)
+		return ret;
+	return add_dep(iw, object, parent);
+}
+
+/* Record a new name @to of the object at @from, optionally removing @from */
+static int index_new_name(struct btrfs_send_index_writer *iw, const char *from,
+			  const char *to, bool rename)
+{
+	struct index_dentry *dentry;
+	const char *name;
+	size_t len;
+	u32 object;
+	u32 parent;
+	int ret;
+
+	ret = index_path(iw, from, &object);
+	if (ret < 0)
+		return ret;
+	if (rename) {
+		ret = resolve_parent(iw, from, &parent, &name, &len);
+		if (ret < 0)
+			return ret;
+		dentry = lookup_dentry(iw, parent, name, len);
+		if (dentry)
+			remove_dentry(iw, dentry);
+	}
+	ret = resolve_parent(iw, to, &parent, &name, &len);
+	if (ret < 0)
+		return ret;
+	ret = add_dentry(iw, parent, name, len, object);
+	if (ret < 0)
+		return ret;
+	return add_dep(iw, object, parent);
+}
+
+static int index_remove(struct btrfs_send_index_writer *iw, const char *path)
+{
+	struct index_dentry *dentry;
+	const char *name;
+	size_t len;
+	u32 parent;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	ret = resolve_parent(iw, path, &parent, &name, &len);
+	if (ret < 0)
+		return ret;
+	dentry = lookup_dentry(iw, parent, name, len);
+	if (dentry)
+		remove_dentry(iw, dentry);
+	return 0;
+}
+
+static int write_index(struct btrfs_send_index_writer *iw, const void *data,
+		       size_t len)
+{
+	if (fwrite(data, 1, len, iw->file) != len) {
+		error("cannot write index %s: %m", iw->filename);
+		return -errno;
+	}
+	return 0;
+}
+
+static int compare_deps(const void *a, const void *b)
+{
+	const struct index_dep *dep1 = a;
+	const struct index_dep *dep2 = b;
+	u32 obj1 = le32_to_cpu(dep1->object);
+	u32 obj2 = le32_to_cpu(dep2->object);
+
+	if (obj1 != obj2)
+		return obj1 < obj2 ? -1 : 1;
+	obj1 = le32_to_cpu(dep1->depends_on);
+	obj2 = le32_to_cpu(dep2->depends_on);
+	if (obj1 != obj2)
+		return obj1 < obj2 ? -1 : 1;
+	return 0;
+}
+
+/* Build the path of @dentry at the end of @buf, return its start or NULL */
+static char *dentry_path(struct btrfs_send_index_writer *iw,
+			 const struct index_dentry *dentry, char *buf,
+			 size_t size)
+{
+	char *p = buf + size;
+	u32 depth = 0;
+
+	while (1) {
+		size_t len = strlen(dentry->name);
+
+		if (len + 1 > p - buf)
+			return NULL;
+		p -= len;
+		memcpy(p, dentry->name, len);
+		if (dentry->parent == INDEX_OBJECT_ROOT)
+			return p;
+		dentry = iw->objects[dentry->parent].dentry;
+		/* Removed directory, or a loop in a broken stream */
+		if (!dentry || ++depth > PATH_MAX)
+			return NULL;
+		*--p = '/';
+	}
+}
+
+/* Write the rest of the stream section and its header */
+static int finish_stream(struct btrfs_send_index_writer *iw)
+{
+	struct index_stream_header *hdr = &iw->stream_hdr;
+	struct rb_node *node;
+	char buf[PATH_MAX];
+	u32 nr_deps = 0;
+	u32 nr_names = 0;
+	off_t end;
+	int ret;
+
+	qsort(iw->deps, iw->nr_deps, sizeof(iw->deps[0]), compare_deps);
+	for (u32 i = 0; i < iw->nr_deps; i++) {
+		if (i > 0 && compare_deps(&iw->deps[i - 1], &iw->deps[i]) == 0)
+			continue;
+		ret = write_index(iw, &iw->deps[i], sizeof(iw->deps[i]));
+		if (ret < 0)
+			return ret;
+		nr_deps++;
+	}
+
+	for (node = rb_first(&iw->dentries); node; node = rb_next(node)) {
+		struct index_dentry *dentry;
+		struct index_name name;
+		char *path;
+		size_t len;
+
+		dentry = rb_entry(node, struct index_dentry, node);
+		path = dentry_path(iw, dentry, buf, sizeof(buf));
+		if (!path)
+			continue;
+		len = buf + sizeof(buf) - path;
+		name.object = cpu_to_le32(dentry->object);
+		name.len = cpu_to_le16(len);
+		ret = write_index(iw, &name, sizeof(name));
+		if (ret < 0)
+			return ret;
+		ret = write_index(iw, path, len);
+		if (ret < 0)
+			return ret;
+		nr_names++;
+	}
+
+	hdr->nr_objects = cpu_to_le32(iw->nr_objects);
+	hdr->nr_entries = cpu_to_le64(iw->nr_entries);
+	hdr->nr_deps = cpu_to_le32(nr_deps);
+	hdr->nr_names = cpu_to_le32(nr_names);
+	end = ftello(iw->file);
+	if (end < 0 || fseeko(iw->file, iw->stream_pos, SEEK_SET) < 0) {
+		error("cannot seek in index %s: %m", iw->filename);
+		return -errno;
+	}
+	ret = write_index(iw, hdr, sizeof(*hdr));
+	if (ret < 0)
+		return ret;
+	if (fseeko(iw->file, end, SEEK_SET) < 0) {
+		error("cannot seek in index %s: %m", iw->filename);
+		return -errno;
+	}
+	iw->in_stream = false;
+	return 0;
+}
+
+/* Start the section of a new stream, the subvol or snapshot command */
+static int start_stream(struct btrfs_send_index_writer *iw, const u8 *uuid)
+{
+	struct index_stream_header *hdr = &iw->stream_hdr;
+	u64 offset;
+	u32 object;
+	int ret;
+
+	if (iw->in_stream) {
+		ret = finish_stream(iw);
+		if (ret < 0)
+			return ret;
+	}
+
+	free_dentry_tree(&iw->dentries);
+	iw->nr_objects = 0;
+	iw->nr_deps = 0;
+	iw->nr_entries = 0;
+	ret = new_object(iw, &object);
+	if (ret < 0)
+		return ret;
+	ret = new_object(iw, &object);
+	if (ret < 0)
+		return ret;
+	memcpy(iw->subvol_uuid, uuid, BTRFS_UUID_SIZE);
+
+	/* The subvol or snapshot command follows right after the header */
+	offset = btrfs_send_reader_cmd_offset(iw->reader);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->offset = cpu_to_le64(offset - sizeof(struct btrfs_stream_header));
+	hdr->version = cpu_to_le32(btrfs_send_reader_version(iw->reader));
+	iw->stream_pos = ftello(iw->file);
+	if (iw->stream_pos < 0) {
+		error("cannot seek in index %s: %m", iw->filename);
+		return -errno;
+	}
+	/* Written again with the counts when the stream is finished */
+	ret = write_index(iw, hdr, sizeof(*hdr));
+	if (ret < 0)
+		return ret;
+	iw->in_stream = true;
+	iw->nr_streams++;
+	return add_entry(iw, INDEX_OBJECT_STREAM);
+}
+
+static int index_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = start_stream(iw, uuid);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->subvol(path, uuid, ctransid, iw->user) : 0;
+}
+
+static int index_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			  const u8 *parent_uuid, u64 parent_ctransid,
+			  void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = start_stream(iw, uuid);
+	if (ret < 0)
+		return ret;
+	if (!iw->ops)
+		return 0;
+	return iw->ops->snapshot(path, uuid, ctransid, parent_uuid,
+				 parent_ctransid, iw->user);
+}
+
+static int index_mkfile(const char *path, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_create(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->mkfile(path, iw->user) : 0;
+}
+
+static int index_mkdir(const char *path, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_create(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->mkdir(path, iw->user) : 0;
+}
+
+static int index_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_create(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->mknod(path, mode, dev, iw->user) : 0;
+}
+
+static int index_mkfifo(const char *path, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_create(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->mkfifo(path, iw->user) : 0;
+}
+
+static int index_mksock(const char *path, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_create(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->mksock(path, iw->user) : 0;
+}
+
+static int index_symlink(const char *path, const char *lnk, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_create(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->symlink(path, lnk, iw->user) : 0;
+}
+
+static int index_rename(const char *from, const char *to, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_new_name(iw, from, to, true);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->rename(from, to, iw->user) : 0;
+}
+
+static int index_link(const char *path, const char *lnk, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	/* New name @path of the existing file @lnk */
+	ret = index_new_name(iw, lnk, path, false);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->link(path, lnk, iw->user) : 0;
+}
+
+static int index_unlink(const char *path, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_remove(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->unlink(path, iw->user) : 0;
+}
+
+static int index_rmdir(const char *path, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_remove(iw, path);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->rmdir(path, iw->user) : 0;
+}
+
+static int index_write(const char *path, const void *data, u64 offset,
+		       u64 len, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->write(path, data, offset, len, iw->user) : 0;
+}
+
+static int index_clone(const char *path, u64 offset, u64 len,
+		       const u8 *clone_uuid, u64 clone_ctransid,
+		       const char *clone_path, u64 clone_offset, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	u32 object;
+	int ret;
+
+	ret = index_path(iw, path, &object);
+	if (ret < 0)
+		return ret;
+	/* The source in the same subvolume must be received before */
+	if (memcmp(clone_uuid, iw->subvol_uuid, BTRFS_UUID_SIZE) == 0) {
+		u32 src;
+		u32 parent;
+
+		ret = resolve_path(iw, clone_path, &src, &parent);
+		if (ret < 0)
+			return ret;
+		ret = add_dep(iw, object, src);
+		if (ret < 0)
+			return ret;
+	}
+	if (!iw->ops)
+		return 0;
+	return iw->ops->clone(path, offset, len, clone_uuid, clone_ctransid,
+			      clone_path, clone_offset, iw->user);
+}
+
+static int index_set_xattr(const char *path, const char *name,
+			   const void *data, int len, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->set_xattr(path, name, data, len, iw->user) : 0;
+}
+
+static int index_remove_xattr(const char *path, const char *name, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->remove_xattr(path, name, iw->user) : 0;
+}
+
+static int index_truncate(const char *path, u64 size, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->truncate(path, size, iw->user) : 0;
+}
+
+static int index_chmod(const char *path, u64 mode, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->chmod(path, mode, iw->user) : 0;
+}
+
+static int index_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->chown(path, uid, gid, iw->user) : 0;
+}
+
+static int index_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->utimes(path, at, mt, ct, iw->user) : 0;
+}
+
+static int index_update_extent(const char *path, u64 offset, u64 len,
+			       void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->update_extent(path, offset, len, iw->user) : 0;
+}
+
+static int index_encoded_write(const char *path, const void *data, u64 offset,
+			       u64 len, u64 unencoded_file_len,
+			       u64 unencoded_len, u64 unencoded_offset,
+			       u32 compression, u32 encryption, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	if (!iw->ops)
+		return 0;
+	return iw->ops->encoded_write(path, data, offset, len,
+				      unencoded_file_len, unencoded_len,
+				      unencoded_offset, compression,
+				      encryption, iw->user);
+}
+
+static int index_fallocate(const char *path, int mode, u64 offset, u64 len,
+			   void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->fallocate(path, mode, offset, len, iw->user) : 0;
+}
+
+static int index_fileattr(const char *path, u64 attr, void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	return iw->ops ? iw->ops->fileattr(path, attr, iw->user) : 0;
+}
+
+static int index_enable_verity(const char *path, u8 algorithm, u32 block_size,
+			       int salt_len, char *salt, int sig_len, char *sig,
+			       void *user)
+{
+	struct btrfs_send_index_writer *iw = user;
+	int ret;
+
+	ret = index_path(iw, path, NULL);
+	if (ret < 0)
+		return ret;
+	if (!iw->ops)
+		return 0;
+	return iw->ops->enable_verity(path, algorithm, block_size, salt_len,
+				      salt, sig_len, sig, iw->user);
+}
+
+struct btrfs_send_ops btrfs_send_index_ops = {
+	.subvol = index_subvol,
+	.snapshot = index_snapshot,
+	.mkfile = index_mkfile,
+	.mkdir = index_mkdir,
+	.mknod = index_mknod,
+	.mkfifo = index_mkfifo,
+	.mksock = index_mksock,
+	.symlink = index_symlink,
+	.rename = index_rename,
+	.link = index_link,
+	.unlink = index_unlink,
+	.rmdir = index_rmdir,
+	.write = index_write,
+	.clone = index_clone,
+	.set_xattr = index_set_xattr,
+	.remove_xattr = index_remove_xattr,
+	.truncate = index_truncate,
+	.chmod = index_chmod,
+	.chown = index_chown,
+	.utimes = index_utimes,
+	.update_extent = index_update_extent,
+	.encoded_write = index_encoded_write,
+	.fallocate = index_fallocate,
+	.fileattr = index_fileattr,
+	.enable_verity = index_enable_verity,
+};
+
+/*
+ * Create index file @filename for the stream read by @reader. The commands
+ * are passed to @ops with @user, or only indexed if @ops is NULL.
+ *
+ * Return NULL on error, the error is printed.
+ */
+struct btrfs_send_index_writer *btrfs_send_index_writer_alloc(
+		const char *filename, struct btrfs_send_reader *reader,
+		struct btrfs_send_ops *ops, void *user)
+{
+	struct btrfs_send_index_writer *iw;
+	struct index_header hdr = { 0 };
+
+	iw = calloc(1, sizeof(*iw));
+	if (!iw) {
+		error_mem(NULL);
+		return NULL;
+	}
+	iw->filename = strdup(filename);
+	if (!iw->filename) {
+		error_mem(NULL);
+		free(iw);
+		return NULL;
+	}
+	iw->reader = reader;
+	iw->ops = ops;
+	iw->user = user;
+	iw->dentries = RB_ROOT;
+
+	iw->file = fopen(filename, "w");
+	if (!iw->file) {
+		error("cannot create index %s: %m", filename);
+		free(iw->filename);
+		free(iw);
+		return NULL;
+	}
+	/* Written again with the number of streams at the end */
+	if (write_index(iw, &hdr, sizeof(hdr)) < 0) {
+		btrfs_send_index_writer_free(iw);
+		return NULL;
+	}
+	return iw;
+}
+
+/* Write the rest of the index after the whole stream has been read */
+int btrfs_send_index_writer_finish(struct btrfs_send_index_writer *iw)
+{
+	struct index_header hdr = { 0 };
+	int ret;
+
+	if (iw->in_stream) {
+		ret = finish_stream(iw);
+		if (ret < 0)
+			return ret;
+	}
+
+	memcpy(hdr.magic, SEND_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(SEND_INDEX_VERSION);
+	hdr.nr_streams = cpu_to_le32(iw->nr_streams);
+	if (fseeko(iw->file, 0, SEEK_SET) < 0) {
+		error("cannot seek in index %s: %m", iw->filename);
+		return -errno;
+	}
+	ret = write_index(iw, &hdr, sizeof(hdr));
+	if (ret < 0)
+		return ret;
+
+	ret = fclose(iw->file);
+	iw->file = NULL;
+	if (ret) {
+		error("cannot write index %s: %m", iw->filename);
+		return -errno;
+	}
+	return 0;
+}
+
+/* Free the writer, the index file is deleted unless it has been finished */
+void btrfs_send_index_writer_free(struct btrfs_send_index_writer *iw)
+{
+	if (!iw)
+		return;
+	if (iw->file) {
+		fclose(iw->file);
+		unlink(iw->filename);
+	}
+	free_dentry_tree(&iw->dentries);
+	free(iw->objects);
+	free(iw->deps);
+	free(iw->filename);
+	free(iw);
+}
+
+struct index_stream {
+	u32 version;
+	u32 nr_objects;
+	u64 nr_entries;
+	u32 nr_deps;
+	u32 nr_names;
+	const struct index_entry *entries;
+	const struct index_dep *deps;
+	const u8 *names;
+};
+
+struct btrfs_send_index {
+	void *map;
+	size_t size;
+	u32 nr_streams;
+	struct index_stream *streams;
+};
+
+/* Check the structure of the index and find where the streams start */
+static int parse_index(struct btrfs_send_index *index)
+{
+	const struct index_header *hdr = index->map;
+	const u8 *p = index->map;
+	const u8 *end = p + index->size;
+
+	if (index->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, SEND_INDEX_MAGIC, sizeof(hdr->magic)) != 0) {
+		error("not a send stream index");
+		return -EINVAL;
+	}
+	if (le32_to_cpu(hdr->version) != SEND_INDEX_VERSION) {
+		error("unsupported send stream index version %u",
+		      le32_to_cpu(hdr->version));
+		return -EOPNOTSUPP;
+	}
+	index->nr_streams = le32_to_cpu(hdr->nr_streams);
+	index->streams = calloc(index->nr_streams, sizeof(index->streams[0]));
+	if (!index->streams && index->nr_streams) {
+		error_mem(NULL);
+		return -ENOMEM;
+	}
+
+	p += sizeof(*hdr);
+	for (u32 i = 0; i < index->nr_streams; i++) {
+		const struct index_stream_header *shdr;
+		struct index_stream *stream = &index->streams[i];
+
+		if (end - p < sizeof(*shdr))
+			goto corrupted;
+		shdr = (const struct index_stream_header *)p;
+		p += sizeof(*shdr);
+		stream->version = le32_to_cpu(shdr->version);
+		stream->nr_objects = le32_to_cpu(shdr->nr_objects);
+		stream->nr_entries = le64_to_cpu(shdr->nr_entries);
+		stream->nr_deps = le32_to_cpu(shdr->nr_deps);
+		stream->nr_names = le32_to_cpu(shdr->nr_names);
+
+		if ((end - p) / sizeof(struct index_entry) < stream->nr_entries)
+			goto corrupted;
+		stream->entries = (const struct index_entry *)p;
+		p += stream->nr_entries * sizeof(struct index_entry);
+
+		if ((end - p) / sizeof(struct index_dep) < stream->nr_deps)
+			goto corrupted;
+		stream->deps = (const struct index_dep *)p;
+		p += stream->nr_deps * sizeof(struct index_dep);
+
+		stream->names = p;
+		for (u32 n = 0; n < stream->nr_names; n++) {
+			const struct index_name *name;
+
+			if (end - p < sizeof(*name))
+				goto corrupted;
+			name = (const struct index_name *)p;
+			p += sizeof(*name);
+			if (end - p < le16_to_cpu(name->len))
+				goto corrupted;
+			p += le16_to_cpu(name->len);
+		}
+	}
+	return 0;
+
+corrupted:
+	error("send stream index is truncated or corrupted");
+	return -EINVAL;
+}
+
+/* Open index file @filename, return NULL on error, the error is printed */
+struct btrfs_send_index *btrfs_send_index_open(const char *filename)
+{
+	struct btrfs_send_index *index;
+	struct stat st;
+	int fd;
+
+	index = calloc(1, sizeof(*index));
+	if (!index) {
+		error_mem(NULL);
+		return NULL;
+	}
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		error("cannot open index %s: %m", filename);
+		goto fail;
+	}
+	if (fstat(fd, &st) < 0) {
+		error("cannot stat index %s: %m", filename);
+		close(fd);
+		goto fail;
+	}
+	index->size = st.st_size;
+	index->map = MAP_FAILED;
+	if (index->size)
+		index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (index->map == MAP_FAILED) {
+		if (index->size)
+			error("cannot map index %s: %m", filename);
+		else
+			error("not a send stream index");
+		index->map = NULL;
+		goto fail;
+	}
+	if (parse_index(index) < 0)
+		goto fail;
+	return index;
+
+fail:
+	btrfs_send_index_close(index);
+	return NULL;
+}
+
+void btrfs_send_index_close(struct btrfs_send_index *index)
+{
+	if (!index)
+		return;
+	if (index->map)
+		munmap(index->map, index->size);
+	free(index->streams);
+	free(index);
+}
+
+u32 btrfs_send_index_nr_streams(const struct btrfs_send_index *index)
+{
+	return index->nr_streams;
+}
+
+/* Does the final path of an object match the selected path or is under it */
+static bool path_selected(const char *path, size_t len, const char *sel,
+			  size_t sel_len)
+{
+	if (sel_len == 0)
+		return true;
+	if (len < sel_len || memcmp(path, sel, sel_len) != 0)
+		return false;
+	return len == sel_len || path[sel_len] == '/';
+}
+
+/* Index of the first dependency of @object */
+static u32 first_dep(const struct index_stream *stream, u32 object)
+{
+	u32 lo = 0;
+	u32 hi = stream->nr_deps;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (le32_to_cpu(stream->deps[mid].object) < object)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Find offsets of the commands of stream @stream needed to receive the paths
+ * (files, or directories with all their contents) in @paths, relative to the
+ * subvolume. The offsets are returned in the stream order in a newly
+ * allocated array, with zero count if no path matched.
+ */
+int btrfs_send_index_select(const struct btrfs_send_index *index, u32 stream_nr,
+			    char * const *paths, int nr_paths,
+			    u64 **offsets_ret, u64 *nr_ret, u32 *version_ret)
+{
+	const struct index_stream *stream = &index->streams[stream_nr];
+	const u8 *p = stream->names;
+	bool *selected;
+	u32 *queue;
+	u32 nr_queued = 0;
+	u64 *offsets;
+	u64 nr = 0;
+	int ret = 0;
+
+	*offsets_ret = NULL;
+	*nr_ret = 0;
+	*version_ret = stream->version;
+	selected = calloc(stream->nr_objects, sizeof(*selected));
+	queue = malloc(stream->nr_objects * sizeof(*queue));
+	if (!selected || !queue) {
+		error_mem(NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (u32 n = 0; n < stream->nr_names; n++) {
+		const struct index_name *name = (const struct index_name *)p;
+		u32 object = le32_to_cpu(name->object);
+		size_t len = le16_to_cpu(name->len);
+
+		p += sizeof(*name) + len;
+		if (object >= stream->nr_objects || selected[object])
+			continue;
+		for (int i = 0; i < nr_paths; i++) {
+			const char *sel = paths[i];
+			size_t sel_len;
+
+			while (*sel == '/')
+				sel++;
+			if (sel[0] == '.' && (sel[1] == '/' || sel[1] == 0))
+				sel++;
+			while (*sel == '/')
+				sel++;
+			sel_len = strlen(sel);
+			while (sel_len > 0 && sel[sel_len - 1] == '/')
+				sel_len--;
+			if (path_selected(name->path, len, sel, sel_len)) {
+				selected[object] = true;
+				queue[nr_queued++] = object;
+				break;
+			}
+		}
+	}
+	if (nr_queued == 0)
+		goto out;
+
+	/* Add everything the selected objects need */
+	while (nr_queued > 0) {
+		u32 object = queue[--nr_queued];
+
+		for (u32 i = first_dep(stream, object); i < stream->nr_deps; i++) {
+			const struct index_dep *dep = &stream->deps[i];
+			u32 dep_object = le32_to_cpu(dep->depends_on);
+
+			if (le32_to_cpu(dep->object) != object)
+				break;
+			if (dep_object >= stream->nr_objects || selected[dep_object])
+				continue;
+			selected[dep_object] = true;
+			queue[nr_queued++] = dep_object;
+		}
+	}
+	selected[INDEX_OBJECT_STREAM] = true;
+
+	for (u64 i = 0; i < stream->nr_entries; i++) {
+		u32 object = le32_to_cpu(stream->entries[i].object);
+
+		if (object < stream->nr_objects && selected[object])
+			nr++;
+	}
+	offsets = malloc(nr * sizeof(*offsets));
+	if (!offsets) {
+		error_mem(NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+	nr = 0;
+	for (u64 i = 0; i < stream->nr_entries; i++) {
+		u32 object = le32_to_cpu(stream->entries[i].object);
+
+		if (object < stream->nr_objects && selected[object])
+			offsets[nr++] = le64_to_cpu(stream->entries[i].offset);
+	}
+	*offsets_ret = offsets;
+	*nr_ret = nr;
+out:
+	free(selected);
+	free(queue);
+	return ret;
+}
@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SEND_INDEX_H__
+#define __BTRFS_SEND_INDEX_H__
+
+#include "kerncompat.h"
+#include "common/send-stream.h"
+
+struct btrfs_send_reader;
+struct btrfs_send_index_writer;
+struct btrfs_send_index;
+
+/*
+ * Callbacks recording the commands to the index writer passed as the user
+ * data, and forwarding them to the ops given at allocation of the writer.
+ */
+extern struct btrfs_send_ops btrfs_send_index_ops;
+
+struct btrfs_send_index_writer *btrfs_send_index_writer_alloc(
+		const char *filename, struct btrfs_send_reader *reader,
+		struct btrfs_send_ops *ops, void *user);
+int btrfs_send_index_writer_finish(struct btrfs_send_index_writer *iw);
+void btrfs_send_index_writer_free(struct btrfs_send_index_writer *iw);
+
+struct btrfs_send_index *btrfs_send_index_open(const char *filename);
+void btrfs_send_index_close(struct btrfs_send_index *index);
+u32 btrfs_send_index_nr_streams(const struct btrfs_send_index *index);
+int btrfs_send_index_select(const struct btrfs_send_index *index, u32 stream,
+			    char * const *paths, int nr_paths,
+			    u64 **offsets_ret, u64 *nr_ret, u32 *version_ret);
+
+#endif
@@ -17,6 +17,8 @@
  */
 
 #include "kerncompat.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -28,6 +30,34 @@
 #include "crypto/crc32c.h"
 #include "common/send-stream.h"
 #include "common/messages.h"
+#include "common/internal.h"
+
+/* Size of the window read from a stream that is not mapped */
+#define SEND_READER_BUF_SIZE	(SZ_4M)
+
+/*
+ * Buffered reader of the stream.
+ *
+ * Regular files are mapped as a whole, other files are read in large windows.
+ * The commands are parsed in place and the data passed to the callbacks point
+ * to the buffer, valid until the next command is read.
+ */
+struct btrfs_send_reader {
+	int fd;
+	char *buf;
+	/* Size of the allocated buffer, or of the mapping */
+	size_t buf_size;
+	/* The unconsumed data are buf[start, end) */
+	size_t start;
+	size_t end;
+	/* Stream offset of buf[0], zero for a mapped file */
+	u64 offset;
+	/* Stream offset of the last command read, for the index */
+	u64 cmd_offset;
+	/* Version of the last stream header read */
+	u32 version;
+	bool mapped;
+};
 
 struct btrfs_send_attribute {
 	u16 tlv_type;
@@ -40,63 +70,148 @@ struct btrfs_send_attribute {
 };
 
 struct btrfs_send_stream {
-	char *read_buf;
-	size_t read_buf_size;
-	int fd;
+	struct btrfs_send_reader *reader;
 
 	int cmd;
 	struct btrfs_send_attribute cmd_attrs[__BTRFS_SEND_A_MAX + 1];
 	u32 version;
 
-	/*
-	 * end of last successful read, equivalent to start of current
-	 * malformed part of block
-	 */
-	size_t stream_pos;
-
 	struct btrfs_send_ops *ops;
 	void *user;
 } __attribute__((aligned(64)));
 
 /*
- * Read len bytes to buf.
+ * Set up reading of send streams from @fd, starting at the current position.
+ *
+ * Return NULL and set errno on error.
+ */
+struct btrfs_send_reader *btrfs_send_reader_alloc(int fd)
+{
+	struct btrfs_send_reader *reader;
+	struct stat st;
+	off_t pos;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+	reader->fd = fd;
+
+	/* Mapping of the whole file needs the 64bit address space */
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (sizeof(size_t) >= sizeof(u64) && pos >= 0 && fstat(fd, &st) == 0 &&
+	    S_ISREG(st.st_mode) && st.st_size > pos) {
+		void *map;
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			reader->buf = map;
+			reader->buf_size = st.st_size;
+			reader->start = pos;
+			reader->end = st.st_size;
+			reader->mapped = true;
+			return reader;
+		}
+	}
+
+	reader->buf = malloc(SEND_READER_BUF_SIZE);
+	if (!reader->buf) {
+		free(reader);
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->buf_size = SEND_READER_BUF_SIZE;
+	/* Offsets of a pipe are counted from the start of reading */
+	if (pos > 0)
+		reader->offset = pos;
+	return reader;
+}
+
+/*
+ * Free the reader. The position of a mapped file is set after the last
+ * consumed command, data read ahead from other files are lost.
+ */
+void btrfs_send_reader_free(struct btrfs_send_reader *reader)
+{
+	if (!reader)
+		return;
+	if (reader->mapped) {
+		lseek(reader->fd, reader->start, SEEK_SET);
+		munmap(reader->buf, reader->buf_size);
+	} else {
+		free(reader->buf);
+	}
+	free(reader);
+}
+
+/*
+ * Make sure there are @len bytes of unconsumed data in the buffer after the
+ * first @skip bytes, which the caller has already checked to be present,
+ * reading as much as fits in the buffer.
+ *
  * Return:
- *   0 - success
+ *   0 - success, the data start at reader->buf + reader->start + @skip
  * < 0 - negative errno in case of error
- * > 0 - no data read, EOF
+ * > 0 - no data at all after @skip, EOF
  */
-static int read_buf(struct btrfs_send_stream *sctx, char *buf, size_t len)
+static int reader_fill(struct btrfs_send_reader *reader, size_t skip, size_t len)
 {
-	int ret;
-	size_t pos = 0;
+	size_t avail = reader->end - reader->start;
+
+	len += skip;
+
+	if (avail >= len)
+		return 0;
+	if (reader->mapped)
+		goto out_eof;
+
+	/* Move the partial command to the beginning, grow for large ones */
+	if (len > reader->buf_size) {
+		char *new_buf;
+		size_t new_size = max_t(size_t, len, reader->buf_size * 2);
+
+		new_buf = malloc(new_size);
+		if (!new_buf) {
+			errno = ENOMEM;
+			error_mem("read buffer for command");
+			return -ENOMEM;
+		}
+		memcpy(new_buf, reader->buf + reader->start, avail);
+		free(reader->buf);
+		reader->buf = new_buf;
+		reader->buf_size = new_size;
+	} else if (reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start, avail);
+	}
+	reader->offset += reader->start;
+	reader->start = 0;
+	reader->end = avail;
 
-	while (pos < len) {
+	while (reader->end < len) {
 		ssize_t rbytes;
 
-		rbytes = read(sctx->fd, buf + pos, len - pos);
+		rbytes = read(reader->fd, reader->buf + reader->end,
+			      reader->buf_size - reader->end);
 		if (rbytes < 0) {
-			ret = -errno;
+			if (errno == EINTR)
+				continue;
 			error("read from stream failed: %m");
-			goto out;
+			return -errno;
 		}
-		if (rbytes == 0) {
-			ret = 1;
-			goto out_eof;
-		}
-		pos += rbytes;
+		if (rbytes == 0)
+			break;
+		reader->end += rbytes;
 	}
-	ret = 0;
+	avail = reader->end;
+	if (avail >= len)
+		return 0;
 
 out_eof:
-	if (0 < pos && pos < len) {
-		error("short read from stream: expected %zu read %zu", len, pos);
-		ret = -EIO;
-	} else {
-		sctx->stream_pos += pos;
-	}
-
-out:
-	return ret;
+	if (avail == skip)
+		return 1;
+	error("short read from stream: expected %zu read %zu", len - skip,
+	      avail - skip);
+	return -EIO;
 }
 
 /*
@@ -109,6 +224,7 @@ out:
  */
 static int read_cmd(struct btrfs_send_stream *sctx)
 {
+	struct btrfs_send_reader *reader = sctx->reader;
 	int ret;
 	u16 cmd;
 	u32 cmd_len;
@@ -116,12 +232,11 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 	u32 pos;
 	u32 crc;
 	u32 crc2;
-	struct btrfs_cmd_header *cmd_hdr;
-	size_t buf_len;
+	struct btrfs_cmd_header cmd_hdr;
 
 	memset(sctx->cmd_attrs, 0, sizeof(sctx->cmd_attrs));
 
-	ret = read_buf(sctx, sctx->read_buf, sizeof(*cmd_hdr));
+	ret = reader_fill(reader, 0, sizeof(cmd_hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -130,28 +245,11 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		goto out;
 	}
 
-	/* The read_buf does not guarantee any alignment for any structures. */
-	cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	cmd_len = get_unaligned_le32(&cmd_hdr->len);
-	cmd = get_unaligned_le16(&cmd_hdr->cmd);
-	buf_len = sizeof(*cmd_hdr) + cmd_len;
-	if (sctx->read_buf_size < buf_len) {
-		void *new_read_buf;
-
-		new_read_buf = realloc(sctx->read_buf, buf_len);
-		if (!new_read_buf) {
-			ret = -ENOMEM;
-			errno = -ret;
-			error_mem("read buffer for command");
-			goto out;
-		}
-		sctx->read_buf = new_read_buf;
-		sctx->read_buf_size = buf_len;
-		/* We need to reset cmd_hdr after realloc of sctx->read_buf */
-		cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	}
-	data = sctx->read_buf + sizeof(*cmd_hdr);
-	ret = read_buf(sctx, data, cmd_len);
+	/* The buffer does not guarantee any alignment for any structures. */
+	memcpy(&cmd_hdr, reader->buf + reader->start, sizeof(cmd_hdr));
+	cmd_len = get_unaligned_le32(&cmd_hdr.len);
+	cmd = get_unaligned_le16(&cmd_hdr.cmd);
+	ret = reader_fill(reader, sizeof(cmd_hdr), cmd_len);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -159,13 +257,19 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		error("unexpected EOF in stream");
 		goto out;
 	}
+	data = reader->buf + reader->start + sizeof(cmd_hdr);
+	reader->cmd_offset = reader->offset + reader->start;
+	/* The command is consumed now, data stay valid until the next one */
+	reader->start += sizeof(cmd_hdr) + cmd_len;
 
-	crc = get_unaligned_le32(&cmd_hdr->crc);
-	/* In send, CRC is computed with header crc = 0, replicate that */
-	put_unaligned_le32(0, &cmd_hdr->crc);
-
-	crc2 = crc32c(0, (unsigned char*)sctx->read_buf,
-			sizeof(*cmd_hdr) + cmd_len);
+	crc = get_unaligned_le32(&cmd_hdr.crc);
+	/*
+	 * In send, CRC is computed with header crc = 0, replicate that on the
+	 * copy of the header so the command can stay in the read-only mapping.
+	 */
+	put_unaligned_le32(0, &cmd_hdr.crc);
+	crc2 = crc32c(0, (unsigned char *)&cmd_hdr, sizeof(cmd_hdr));
+	crc2 = crc32c(crc2, (unsigned char *)data, cmd_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -592,7 +696,7 @@ out:
  * callbacks in btrfs_send_ops structure returns an error. If greater than
  * zero, stop after max_errors errors happened.
  */
-int btrfs_read_and_process_send_stream(int fd,
+int btrfs_read_and_process_send_stream(struct btrfs_send_reader *reader,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
 				       u64 max_errors)
@@ -603,18 +707,19 @@ int btrfs_read_and_process_send_stream(int fd,
 	u64 errors = 0;
 	int last_err = 0;
 
-	sctx.fd = fd;
+	sctx.reader = reader;
 	sctx.ops = ops;
 	sctx.user = user;
-	sctx.stream_pos = 0;
 
-	ret = read_buf(&sctx, (char*)&hdr, sizeof(hdr));
+	ret = reader_fill(reader, 0, sizeof(hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
 		ret = -ENODATA;
 		goto out;
 	}
+	memcpy(&hdr, reader->buf + reader->start, sizeof(hdr));
+	reader->start += sizeof(hdr);
 
 	if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
 		ret = -EINVAL;
@@ -629,14 +734,7 @@ int btrfs_read_and_process_send_stream(int fd,
 				sctx.version);
 		goto out;
 	}
-
-	sctx.read_buf = malloc(BTRFS_SEND_BUF_SIZE_V1);
-	if (!sctx.read_buf) {
-		ret = -ENOMEM;
-		error_mem("send stream read buffer");
-		goto out;
-	}
-	sctx.read_buf_size = BTRFS_SEND_BUF_SIZE_V1;
+	reader->version = sctx.version;
 
 	while (1) {
 		ret = read_and_process_cmd(&sctx);
@@ -651,7 +749,6 @@ int btrfs_read_and_process_send_stream(int fd,
 			break;
 		}
 	}
-	free(sctx.read_buf);
 
 out:
 	if (last_err && !ret)
@@ -659,3 +756,90 @@ out:
 
 	return ret;
 }
+
+/* Stream offset of the command passed to the last callback */
+u64 btrfs_send_reader_cmd_offset(const struct btrfs_send_reader *reader)
+{
+	return reader->cmd_offset;
+}
+
+/* Version of the stream being read */
+u32 btrfs_send_reader_version(const struct btrfs_send_reader *reader)
+{
+	return reader->version;
+}
+
+/*
+ * Move to stream offset @offset, forward or backward. Only a mapped file or a
+ * seekable file can go before the data that have been already read.
+ */
+static int reader_seek(struct btrfs_send_reader *reader, u64 offset)
+{
+	off_t pos;
+
+	if (offset >= reader->offset && offset <= reader->offset + reader->end) {
+		reader->start = offset - reader->offset;
+		return 0;
+	}
+	if (reader->mapped) {
+		error("offset %llu is beyond the end of stream", offset);
+		return -EINVAL;
+	}
+	pos = lseek(reader->fd, offset, SEEK_SET);
+	if (pos < 0) {
+		error("cannot seek to offset %llu in stream: %m", offset);
+		return -errno;
+	}
+	reader->offset = offset;
+	reader->start = 0;
+	reader->end = 0;
+	return 0;
+}
+
+/*
+ * Process only the commands at the given stream offsets, in the order of the
+ * array, e.g. as selected from an index of the stream. The offsets must point
+ * to commands of one stream of the given version. Errors are handled like in
+ * btrfs_read_and_process_send_stream().
+ */
+int btrfs_process_send_stream_cmds(struct btrfs_send_reader *reader,
+				   u32 version, const u64 *offsets, u64 nr,
+				   struct btrfs_send_ops *ops, void *user,
+				   u64 max_errors)
+{
+	struct btrfs_send_stream sctx;
+	u64 errors = 0;
+	int last_err = 0;
+	int ret = 0;
+
+	if (version > BTRFS_SEND_STREAM_VERSION) {
+		error("stream version %d not supported, please use newer version",
+		      version);
+		return -EINVAL;
+	}
+	sctx.reader = reader;
+	sctx.ops = ops;
+	sctx.user = user;
+	sctx.version = version;
+	reader->version = version;
+
+	for (u64 i = 0; i < nr; i++) {
+		ret = reader_seek(reader, offsets[i]);
+		if (ret < 0)
+			break;
+		ret = read_and_process_cmd(&sctx);
+		if (ret < 0) {
+			last_err = ret;
+			errors++;
+			if (max_errors > 0 && errors >= max_errors)
+				break;
+		} else if (ret > 0) {
+			ret = 0;
+			break;
+		}
+	}
+	if (last_err && !ret)
+		ret = last_err;
+
+	return ret;
+}
@@ -22,6 +22,7 @@
 #include "kerncompat.h"
 
 struct timespec;
+struct btrfs_send_reader;
 
 struct btrfs_send_ops {
 	int (*subvol)(const char *path, const u8 *uuid, u64 ctransid,
@@ -67,9 +68,17 @@ struct btrfs_send_ops {
 			     int sig_len, char *sig, void *user);
 };
 
-int btrfs_read_and_process_send_stream(int fd,
+struct btrfs_send_reader *btrfs_send_reader_alloc(int fd);
+void btrfs_send_reader_free(struct btrfs_send_reader *reader);
+int btrfs_read_and_process_send_stream(struct btrfs_send_reader *reader,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
 				       u64 max_errors);
+int btrfs_process_send_stream_cmds(struct btrfs_send_reader *reader,
+				   u32 version, const u64 *offsets, u64 nr,
+				   struct btrfs_send_ops *ops, void *user,
+				   u64 max_errors);
+u64 btrfs_send_reader_cmd_offset(const struct btrfs_send_reader *reader);
+u32 btrfs_send_reader_version(const struct btrfs_send_reader *reader);
 
 #endif
@@ -34,6 +34,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <strings.h>
+#include <time.h>
 #include "kernel-lib/list.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/ctree.h"
@@ -995,6 +996,18 @@ unsigned long total_memory(void)
         return si.totalram * si.mem_unit;       /* bytes */
 }
 
+/*
+ * Return the monotonic clock in nanoseconds, suitable for measuring elapsed
+ * time of an operation.
+ */
+u64 get_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void print_device_info(struct btrfs_device *device, char *prefix)
 {
 	if (prefix)
@@ -82,6 +82,7 @@ int count_digits(u64 num);
 u64 div_factor(u64 num, int factor);
 
 unsigned long total_memory(void);
+u64 get_monotonic_ns(void);
 
 void print_device_info(struct btrfs_device *device, char *prefix);
 void print_all_devices(struct list_head *devices);
@@ -145,15 +145,36 @@ static void *print_copied_inodes(void *p)
 	struct task_ctx *priv = p;
 	const char work_indicator[] = { '.', 'o', 'O', 'o' };
 	u64 count = 0;
+	u64 last_read = 0;
+	u64 last_copy = 0;
+	u64 last_ns = get_monotonic_ns();
 
 	task_period_start(priv->info, 1000 /* 1s */);
 	while (1) {
+		u64 now = get_monotonic_ns();
+		u64 elapsed = max_t(u64, now - last_ns, 1);
+		u64 cur_read;
+		u64 cur_copy;
+
 		count++;
 		pthread_mutex_lock(&priv->mutex);
-		printf("Copy inodes [%c] [%10llu/%10llu]\r",
-		       work_indicator[count % 4],
-		       priv->cur_copy_inodes, priv->max_copy_inodes);
+		cur_read = priv->cur_read_inodes;
+		cur_copy = priv->cur_copy_inodes;
+		if (cur_read)
+			printf(
+		"Copy inodes [%c] [%10llu/%10llu] read %8llu/s insert %8llu/s\r",
+			       work_indicator[count % 4], cur_copy,
+			       priv->max_copy_inodes,
+			       (cur_read - last_read) * 1000000000ULL / elapsed,
+			       (cur_copy - last_copy) * 1000000000ULL / elapsed);
+		else
+			printf("Copy inodes [%c] [%10llu/%10llu]\r",
+			       work_indicator[count % 4], cur_copy,
+			       priv->max_copy_inodes);
 		pthread_mutex_unlock(&priv->mutex);
+		last_read = cur_read;
+		last_copy = cur_copy;
+		last_ns = now;
 		fflush(stdout);
 		task_period_wait(priv->info);
 	}
@@ -186,39 +207,196 @@ static inline int convert_check_state(struct btrfs_convert_context *cctx)
 	return cctx->convert_ops->check_state(cctx);
 }
 
+/* Data of the old filesystem is read and checksummed in windows of this size */
+#define CSUM_WINDOW_SIZE		(SZ_8M)
+#define CSUM_MAX_THREADS		(16)
+/* Smaller windows are not worth spreading over threads */
+#define CSUM_SECTORS_PER_THREAD		(256)
+
+struct csum_window {
+	char *data;
+	u8 *csums;
+	u64 start;
+	u32 nr_sectors;
+};
+
+struct csum_worker {
+	pthread_t tid;
+	bool started;
+	u16 csum_type;
+	u16 csum_size;
+	u32 sectorsize;
+	const char *data;
+	u8 *csums;
+	u32 nr_sectors;
+};
+
+struct csum_hasher {
+	struct csum_worker workers[CSUM_MAX_THREADS];
+	int max_threads;
+};
+
+static void *csum_worker_fn(void *arg)
+{
+	struct csum_worker *worker = arg;
+	u8 result[BTRFS_CSUM_SIZE];
+
+	/* btrfs_csum_data() clears the whole BTRFS_CSUM_SIZE of the output */
+	for (u32 i = 0; i < worker->nr_sectors; i++) {
+		btrfs_csum_data(worker->csum_type,
+				(const u8 *)worker->data + (size_t)i * worker->sectorsize,
+				result, worker->sectorsize);
+		memcpy(worker->csums + i * worker->csum_size, result,
+		       worker->csum_size);
+	}
+	return NULL;
+}
+
+static void csum_hasher_init(struct csum_hasher *hasher,
+			     struct btrfs_fs_info *fs_info)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	hasher->max_threads = 1;
+	if (CRYPTO_HASH_THREAD_SAFE ||
+	    fs_info->csum_type == BTRFS_CSUM_TYPE_CRC32 ||
+	    fs_info->csum_type == BTRFS_CSUM_TYPE_XXHASH)
+		hasher->max_threads = clamp(nr_cpus, 1L, (long)CSUM_MAX_THREADS);
+
+	for (int i = 0; i < CSUM_MAX_THREADS; i++) {
+		hasher->workers[i].csum_type = fs_info->csum_type;
+		hasher->workers[i].csum_size = fs_info->csum_size;
+		hasher->workers[i].sectorsize = fs_info->sectorsize;
+	}
+}
+
+/*
+ * Start calculating checksums of the window, split among threads.  Small
+ * windows or failure to start a thread fall back to calculating in place.
+ */
+static void csum_hasher_start(struct csum_hasher *hasher,
+			      struct csum_window *win)
+{
+	const u32 sectorsize = hasher->workers[0].sectorsize;
+	const u16 csum_size = hasher->workers[0].csum_size;
+	int nr_threads = win->nr_sectors / CSUM_SECTORS_PER_THREAD;
+	u32 per_thread;
+	u32 cur = 0;
+
+	nr_threads = clamp(nr_threads, 1, hasher->max_threads);
+	per_thread = DIV_ROUND_UP(win->nr_sectors, nr_threads);
+	for (int i = 0; i < nr_threads && cur < win->nr_sectors; i++) {
+		struct csum_worker *worker = &hasher->workers[i];
+
+		worker->data = win->data + (size_t)cur * sectorsize;
+		worker->csums = win->csums + cur * csum_size;
+		worker->nr_sectors = min(per_thread, win->nr_sectors - cur);
+		cur += worker->nr_sectors;
+
+		worker->started = false;
+		if (nr_threads > 1 &&
+		    pthread_create(&worker->tid, NULL, csum_worker_fn, worker) == 0)
+			worker->started = true;
+		else
+			csum_worker_fn(worker);
+	}
+}
+
+static void csum_hasher_wait(struct csum_hasher *hasher)
+{
+	for (int i = 0; i < CSUM_MAX_THREADS; i++) {
+		if (hasher->workers[i].started)
+			pthread_join(hasher->workers[i].tid, NULL);
+		hasher->workers[i].started = false;
+	}
+}
+
+static int read_csum_window(struct btrfs_fs_info *fs_info,
+			    struct csum_window *win, u64 start, u64 len)
+{
+	u64 cur = 0;
+	int ret;
+
+	while (cur < len) {
+		u64 read_len = len - cur;
+
+		ret = read_data_from_disk(fs_info, win->data + cur, start + cur,
+					  &read_len, 0);
+		if (ret)
+			return ret;
+		if (read_len == 0) {
+			error("failed to read logical bytenr %llu", start + cur);
+			return -EIO;
+		}
+		cur += read_len;
+	}
+	win->start = start;
+	win->nr_sectors = len / fs_info->sectorsize;
+	return 0;
+}
+
+/*
+ * Checksum the range of the old filesystem, reading it sequentially in large
+ * windows.  While one window is hashed by the worker threads the next one is
+ * read, so the time is bounded by the read of the range.
+ */
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
-	u32 blocksize = fs_info->sectorsize;
+	const u64 window_size = min_t(u64, num_bytes, CSUM_WINDOW_SIZE);
+	struct csum_window win[2] = { 0 };
+	struct csum_hasher hasher;
 	u64 offset;
-	char *buffer;
+	int cur = 0;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
-	if (!buffer)
-		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		u64 read_len = blocksize;
+	for (int i = 0; i < 2; i++) {
+		win[i].data = malloc(window_size);
+		win[i].csums = malloc(window_size / fs_info->sectorsize *
+				      fs_info->csum_size);
+		if (!win[i].data || !win[i].csums) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	csum_hasher_init(&hasher, fs_info);
+
+	ret = read_csum_window(fs_info, &win[cur], disk_bytenr, window_size);
+	if (ret)
+		goto out;
+	offset = window_size;
+
+	while (win[cur].nr_sectors) {
+		struct csum_window *next = &win[!cur];
+
+		next->nr_sectors = 0;
+		csum_hasher_start(&hasher, &win[cur]);
+		if (offset < num_bytes) {
+			u64 len = min(num_bytes - offset, window_size);
 
-		ret = read_data_from_disk(fs_info, buffer,
-					  disk_bytenr + offset, &read_len, 0);
+			ret = read_csum_window(fs_info, next, disk_bytenr + offset,
+					       len);
+			offset += len;
+		}
+		csum_hasher_wait(&hasher);
 		if (ret)
 			break;
-		if (read_len == 0) {
-			error("failed to read logical bytenr %llu",
-			      disk_bytenr + offset);
-			ret = -EIO;
-			break;
-		}
-		ret = btrfs_csum_file_block(trans, disk_bytenr + offset,
-					    BTRFS_EXTENT_CSUM_OBJECTID,
-					    fs_info->csum_type, buffer);
+
+		ret = btrfs_insert_data_csums(trans, win[cur].start,
+					      BTRFS_EXTENT_CSUM_OBJECTID,
+					      fs_info->csum_type, win[cur].csums,
+					      win[cur].nr_sectors);
 		if (ret)
 			break;
+		cur = !cur;
+	}
+out:
+	for (int i = 0; i < 2; i++) {
+		free(win[i].data);
+		free(win[i].csums);
 	}
-	free(buffer);
 	return ret;
 }
 
@@ -1322,6 +1500,7 @@ static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 	}
 	ctx.max_copy_inodes = (cctx.inodes_count - cctx.free_inodes_count);
 	ctx.cur_copy_inodes = 0;
+	ctx.cur_read_inodes = 0;
 
 	if (progress) {
 		ctx.info = task_init(print_copied_inodes, after_copied_inodes,
@@ -25,16 +25,37 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/file-item.h"
 #include "common/extent-cache.h"
+#include "common/internal.h"
 #include "common/messages.h"
 #include "common/string-utils.h"
 #include "convert/common.h"
 #include "convert/source-fs.h"
 #include "convert/source-ext2.h"
 
+/*
+ * An inode read and decoded by the reader threads of ext2_copy_inodes(), all
+ * the data needed from the ext2 metadata to create the btrfs items.
+ */
+struct ext2_decoded_inode {
+	ext2_ino_t ino;
+	/* The whole on-disk inode, including extra timestamps and inline xattrs */
+	struct ext2_inode_large *inode;
+	/* Leaf extents of an extent mapped file or symlink */
+	struct ext2fs_extent *extents;
+	u32 nr_extents;
+	/* Packed copies of the directory entries, see ext2_collect_dirent_proc() */
+	char *dirents;
+	u32 dirents_len;
+	u32 dirents_size;
+	/* Content of the xattr block, if there is one and xattrs are copied */
+	char *xattr_block;
+};
+
 /*
  * Open Ext2fs in readonly mode, read block allocation bitmap and
  * inode bitmap into memory.
@@ -260,10 +281,10 @@ static int ext2_dir_iterate_proc(ext2_ino_t dir, int entry,
 static int ext2_create_dir_entries(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
-			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
+			      struct ext2_decoded_inode *di)
 {
 	int ret;
-	errcode_t err;
+	u32 cur = 0;
 	struct dir_iterate_data data = {
 		.trans		= trans,
 		.root		= root,
@@ -274,19 +295,20 @@ static int ext2_create_dir_entries(struct btrfs_trans_handle *trans,
 		.errcode	= 0,
 	};
 
-	err = ext2fs_dir_iterate2(ext2_fs, ext2_ino, 0, NULL,
-				  ext2_dir_iterate_proc, &data);
-	if (err)
-		goto error;
+	while (cur < di->dirents_len) {
+		struct ext2_dir_entry *dirent;
+
+		dirent = (struct ext2_dir_entry *)(di->dirents + cur);
+		if (ext2_dir_iterate_proc(di->ino, 0, dirent, cur, 0, NULL, &data))
+			break;
+		cur += dirent->rec_len;
+	}
 	ret = data.errcode;
 	if (ret == 0 && data.parent == objectid) {
 		ret = btrfs_insert_inode_ref(trans, root, "..", 2,
 					     objectid, objectid, 0);
 	}
 	return ret;
-error:
-	error("ext2fs_dir_iterate2: %s", error_message(err));
-	return -1;
 }
 
 static int ext2_block_iterate_proc(ext2_filsys fs, blk_t *blocknr,
@@ -331,32 +353,34 @@ static int iterate_one_file_extent(struct blk_iterate_data *data, u64 filepos,
 	return 0;
 }
 
-static int iterate_file_extents(struct blk_iterate_data *data, ext2_filsys ext2fs,
-				ext2_ino_t ext2_ino, u32 convert_flags)
+/*
+ * Read the leaf extents of an extent mapped inode, called by the reader
+ * threads so the copy only has to walk the array.
+ */
+static int ext2_decode_file_extents(ext2_filsys ext2_fs,
+				    struct ext2_decoded_inode *di)
 {
 	ext2_extent_handle_t handle = NULL;
 	struct ext2fs_extent extent;
-	const int sectorsize = data->trans->fs_info->sectorsize;
-	const int sectorbits = ilog2(sectorsize);
 	int op = EXT2_EXTENT_ROOT;
+	u32 alloced = 0;
 	errcode_t errcode;
 	int ret = 0;
 
-	errcode = ext2fs_extent_open(ext2fs, ext2_ino, &handle);
+	errcode = ext2fs_extent_open2(ext2_fs, di->ino,
+				      (struct ext2_inode *)di->inode, &handle);
 	if (errcode) {
-		error("failed to open ext2 inode %u: %s", ext2_ino, error_message(errcode));
+		error("failed to open ext2 inode %u: %s", di->ino,
+		      error_message(errcode));
 		return -EIO;
 	}
 	while (1) {
-		u64 disk_bytenr;
-		u64 filepos;
-		u64 len;
-
 		errcode = ext2fs_extent_get(handle, op, &extent);
 		if (errcode == EXT2_ET_EXTENT_NO_NEXT)
 			break;
 		if (errcode) {
-			data->errcode = errcode;
+			error("failed to read extents of ext2 inode %u: %s",
+			      di->ino, error_message(errcode));
 			ret = -EIO;
 			goto out;
 		}
@@ -367,34 +391,59 @@ static int iterate_file_extents(struct blk_iterate_data *data, ext2_filsys ext2f
 		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
 			continue;
 
-		filepos = extent.e_lblk << sectorbits;
-		len = extent.e_len << sectorbits;
-		disk_bytenr = extent.e_pblk << sectorbits;
+		if (di->nr_extents == alloced) {
+			struct ext2fs_extent *tmp;
 
-		ret = iterate_one_file_extent(data, filepos, len, disk_bytenr,
-					      extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT);
-		if (ret < 0)
-			goto out;
+			alloced = max(alloced * 2, 8U);
+			tmp = realloc(di->extents, alloced * sizeof(*tmp));
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			di->extents = tmp;
+		}
+		di->extents[di->nr_extents++] = extent;
 	}
 out:
 	ext2fs_extent_free(handle);
 	return ret;
 }
 
+static int iterate_file_extents(struct blk_iterate_data *data,
+				struct ext2_decoded_inode *di)
+{
+	const int sectorsize = data->trans->fs_info->sectorsize;
+	const int sectorbits = ilog2(sectorsize);
+	int ret;
+
+	for (u32 i = 0; i < di->nr_extents; i++) {
+		const struct ext2fs_extent *extent = &di->extents[i];
+		u64 filepos = extent->e_lblk << sectorbits;
+		u64 len = (u64)extent->e_len << sectorbits;
+		u64 disk_bytenr = extent->e_pblk << sectorbits;
+
+		ret = iterate_one_file_extent(data, filepos, len, disk_bytenr,
+					      extent->e_flags & EXT2_EXTENT_FLAGS_UNINIT);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
 /*
  * traverse file's data blocks, record these data blocks as file extents.
  */
 static int ext2_create_file_extents(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       struct btrfs_inode_item *btrfs_inode,
-			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+			       ext2_filsys ext2_fs, struct ext2_decoded_inode *di,
 			       u32 convert_flags)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
+	const ext2_ino_t ext2_ino = di->ino;
 	int ret;
 	char *buffer = NULL;
 	errcode_t err;
-	struct ext2_inode ext2_inode = { 0 };
 	u32 last_block;
 	u32 sectorsize = root->fs_info->sectorsize;
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
@@ -415,18 +464,13 @@ static int ext2_create_file_extents(struct btrfs_trans_handle *trans,
 	init_blk_iterate_data(&data, trans, root, btrfs_inode, objectid,
 			convert_flags & CONVERT_FLAG_DATACSUM);
 
-	err = ext2fs_read_inode(ext2_fs, ext2_ino, &ext2_inode);
-	if (err) {
-		error("failed to read ext2 inode %u: %s", ext2_ino, error_message(err));
-		return -EIO;
-	}
 	/*
 	 * For inodes without extent block maps, go with the older
 	 * ext2fs_block_iterate2().
-	 * Otherwise use ext2fs_extent_*() based solution, as that can provide
-	 * UNINIT extent flags.
+	 * Otherwise use the extents read by ext2fs_extent_*(), as that can
+	 * provide UNINIT extent flags.
 	 */
-	if ((ext2_inode.i_flags & EXT4_EXTENTS_FL) == 0) {
+	if ((di->inode->i_flags & EXT4_EXTENTS_FL) == 0) {
 		err = ext2fs_block_iterate2(ext2_fs, ext2_ino,
 					    BLOCK_FLAG_DATA_ONLY, NULL,
 					    ext2_block_iterate_proc, &data);
@@ -435,7 +479,7 @@ static int ext2_create_file_extents(struct btrfs_trans_handle *trans,
 			return -EIO;
 		}
 	} else {
-		ret = iterate_file_extents(&data, ext2_fs, ext2_ino, convert_flags);
+		ret = iterate_file_extents(&data, di);
 		if (ret < 0)
 			goto fail;
 	}
@@ -484,9 +528,10 @@ fail:
 static int ext2_create_symlink(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
-			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			      struct ext2_inode *ext2_inode)
+			      ext2_filsys ext2_fs, struct ext2_decoded_inode *di)
 {
+	struct ext2_inode *ext2_inode = (struct ext2_inode *)di->inode;
+	const ext2_ino_t ext2_ino = di->ino;
 	int ret;
 	char *pathname;
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
@@ -499,7 +544,7 @@ static int ext2_create_symlink(struct btrfs_trans_handle *trans,
 			return -ENAMETOOLONG;
 		}
 		ret = ext2_create_file_extents(trans, root, objectid,
-				btrfs_inode, ext2_fs, ext2_ino,
+				btrfs_inode, ext2_fs, di,
 				CONVERT_FLAG_DATACSUM |
 				CONVERT_FLAG_INLINE_DATA);
 		return ret;
@@ -677,42 +722,23 @@ out:
 static int ext2_copy_extended_attrs(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       struct btrfs_inode_item *btrfs_inode,
-			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
+			       ext2_filsys ext2_fs, struct ext2_decoded_inode *di)
 {
 	int ret = 0;
 	int inline_ea = 0;
-	errcode_t err;
 	u32 datalen;
 	u32 block_size = ext2_fs->blocksize;
 	u32 inode_size = EXT2_INODE_SIZE(ext2_fs->super);
-	struct ext2_inode_large *ext2_inode;
+	struct ext2_inode_large *ext2_inode = di->inode;
 	struct ext2_ext_attr_entry *entry;
 	void *data;
-	char *buffer = NULL;
-	char inode_buf[EXT2_GOOD_OLD_INODE_SIZE];
+	char *buffer = di->xattr_block;
 
-	if (inode_size <= EXT2_GOOD_OLD_INODE_SIZE) {
-		ext2_inode = (struct ext2_inode_large *)inode_buf;
-	} else {
-		ext2_inode = (struct ext2_inode_large *)malloc(inode_size);
-		if (!ext2_inode)
-		       return -ENOMEM;
-	}
-	err = ext2fs_read_inode_full(ext2_fs, ext2_ino, (void *)ext2_inode,
-				     inode_size);
-	if (err) {
-		error("ext2fs_read_inode_full: %s", error_message(err));
-		ret = -1;
-		goto out;
-	}
-
-	if (ext2_ino > ext2_fs->super->s_first_ino &&
+	if (di->ino > ext2_fs->super->s_first_ino &&
 	    inode_size > EXT2_GOOD_OLD_INODE_SIZE) {
 		if (EXT2_GOOD_OLD_INODE_SIZE +
-		    ext2_inode->i_extra_isize > inode_size) {
-			ret = -EIO;
-			goto out;
-		}
+		    ext2_inode->i_extra_isize > inode_size)
+			return -EIO;
 		if (ext2_inode->i_extra_isize != 0 &&
 		    EXT2_XATTR_IHDR(ext2_inode)->h_magic ==
 		    EXT2_EXT_ATTR_MAGIC) {
@@ -726,58 +752,44 @@ static int ext2_copy_extended_attrs(struct btrfs_trans_handle *trans,
 		total = end - (void *)entry;
 		ret = ext2_xattr_check_names(entry, end);
 		if (ret)
-			goto out;
+			return ret;
 		while (!EXT2_EXT_IS_LAST_ENTRY(entry)) {
 			ret = ext2_xattr_check_entry(entry, total);
 			if (ret)
-				goto out;
+				return ret;
 			data = (void *)EXT2_XATTR_IFIRST(ext2_inode) +
 				entry->e_value_offs;
 			datalen = entry->e_value_size;
 			ret = ext2_copy_single_xattr(trans, root, objectid,
 						entry, data, datalen);
 			if (ret)
-				goto out;
+				return ret;
 			entry = EXT2_EXT_ATTR_NEXT(entry);
 		}
 	}
 
-	if (ext2_inode->i_file_acl == 0)
-		goto out;
+	/* The block has been read by the reader if there is one */
+	if (!buffer)
+		return 0;
 
-	buffer = malloc(block_size);
-	if (!buffer) {
-		ret = -ENOMEM;
-		goto out;
-	}
-	err = ext2fs_read_ext_attr2(ext2_fs, ext2_inode->i_file_acl, buffer);
-	if (err) {
-		error("ext2fs_read_ext_attr2: %s", error_message(err));
-		ret = -1;
-		goto out;
-	}
 	ret = ext2_xattr_check_block(buffer, block_size);
 	if (ret)
-		goto out;
+		return ret;
 
 	entry = EXT2_XATTR_BFIRST(buffer);
 	while (!EXT2_EXT_IS_LAST_ENTRY(entry)) {
 		ret = ext2_xattr_check_entry(entry, block_size);
 		if (ret)
-			goto out;
+			return ret;
 		data = buffer + entry->e_value_offs;
 		datalen = entry->e_value_size;
 		ret = ext2_copy_single_xattr(trans, root, objectid,
 					entry, data, datalen);
 		if (ret)
-			goto out;
+			return ret;
 		entry = EXT2_EXT_ATTR_NEXT(entry);
 	}
-out:
-	free(buffer);
-	if ((void *)ext2_inode != inode_buf)
-		free(ext2_inode);
-	return ret;
+	return 0;
 }
 
 static inline dev_t old_decode_dev(u16 val)
@@ -868,24 +880,10 @@ do {											\
  * Decode and copy i_[cma]time_extra and i_crtime{,_extra} field
  */
 static int ext4_copy_inode_timespec_extra(struct btrfs_inode_item *dst,
-				ext2_ino_t ext2_ino, u32 s_inode_size,
-				ext2_filsys ext2_fs)
+				const struct ext2_inode_large *src,
+				u32 s_inode_size)
 {
-	struct ext2_inode_large *src;
 	u32 inode_size, tv_sec, tv_nsec;
-	int ret, err;
-	ret = 0;
-
-	src = (struct ext2_inode_large *)malloc(s_inode_size);
-	if (!src)
-		return -ENOMEM;
-	err = ext2fs_read_inode_full(ext2_fs, ext2_ino, (void *)src,
-				     s_inode_size);
-	if (err) {
-		error("ext2fs_read_inode_full: %s", error_message(err));
-		ret = -1;
-		goto out;
-	}
 
 	inode_size = EXT2_GOOD_OLD_INODE_SIZE + src->i_extra_isize;
 
@@ -903,16 +901,14 @@ static int ext4_copy_inode_timespec_extra(struct btrfs_inode_item *dst,
 		btrfs_set_stack_timespec_sec(&dst->otime, tv_sec);
 		btrfs_set_stack_timespec_nsec(&dst->otime, 0);
 	}
-out:
-	free(src);
-	return ret;
+	return 0;
 }
 
 #else /* HAVE_EXT4_EPOCH_MASK_DEFINE */
 
 static int ext4_copy_inode_timespec_extra(struct btrfs_inode_item *dst,
-				ext2_ino_t ext2_ino, u32 s_inode_size,
-				ext2_filsys ext2_fs)
+				const struct ext2_inode_large *src,
+				u32 s_inode_size)
 {
 	static int warn = 0;
 
@@ -970,10 +966,10 @@ static void ext2_convert_inode_flags(struct btrfs_inode_item *dst,
  */
 static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root, u64 objectid,
-			     ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			     struct ext2_inode *ext2_inode,
+			     ext2_filsys ext2_fs, struct ext2_decoded_inode *di,
 			     u32 convert_flags)
 {
+	struct ext2_inode *ext2_inode = (struct ext2_inode *)di->inode;
 	int ret;
 	int s_inode_size;
 	struct btrfs_inode_item btrfs_inode;
@@ -990,8 +986,8 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 	ext2_copy_inode_item(&btrfs_inode, ext2_inode, ext2_fs->blocksize);
 	s_inode_size = EXT2_INODE_SIZE(ext2_fs->super);
 	if (s_inode_size > EXT2_GOOD_OLD_INODE_SIZE) {
-		ret = ext4_copy_inode_timespec_extra(&btrfs_inode, ext2_ino,
-				s_inode_size, ext2_fs);
+		ret = ext4_copy_inode_timespec_extra(&btrfs_inode, di->inode,
+				s_inode_size);
 		if (ret)
 			return ret;
 	}
@@ -1026,15 +1022,15 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 	switch (ext2_inode->i_mode & S_IFMT) {
 	case S_IFREG:
 		ret = ext2_create_file_extents(trans, root, objectid,
-			&btrfs_inode, ext2_fs, ext2_ino, convert_flags);
+			&btrfs_inode, ext2_fs, di, convert_flags);
 		break;
 	case S_IFDIR:
 		ret = ext2_create_dir_entries(trans, root, objectid,
-				&btrfs_inode, ext2_fs, ext2_ino);
+				&btrfs_inode, di);
 		break;
 	case S_IFLNK:
 		ret = ext2_create_symlink(trans, root, objectid,
-				&btrfs_inode, ext2_fs, ext2_ino, ext2_inode);
+				&btrfs_inode, ext2_fs, di);
 		break;
 	default:
 		ret = 0;
@@ -1045,7 +1041,7 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 
 	if (convert_flags & CONVERT_FLAG_XATTR) {
 		ret = ext2_copy_extended_attrs(trans, root, objectid,
-				&btrfs_inode, ext2_fs, ext2_ino);
+				&btrfs_inode, ext2_fs, di);
 		if (ret)
 			return ret;
 	}
@@ -1083,83 +1079,438 @@ static bool ext2_is_special_inode(ext2_filsys ext2_fs, ext2_ino_t ino)
 }
 
 /*
- * scan ext2's inode bitmap and copy all used inodes.
+ * Inodes of one block group, read by a reader thread and waiting to be copied
  */
-static int ext2_copy_inodes(struct btrfs_convert_context *cctx,
-			    struct btrfs_root *root,
-			    u32 convert_flags, struct task_ctx *p)
+struct ext2_group_batch {
+	struct ext2_decoded_inode *inodes;
+	u32 nr_inodes;
+	u32 alloced;
+	/* Error of the reader, reported after copying the inodes read before */
+	int ret;
+	bool ready;
+};
+
+/*
+ * Inodes are read and decoded by reader threads one block group at a time,
+ * each thread with its own ext2 filesystem handle as libext2fs is not thread
+ * safe.  A single thread takes the groups in order and inserts the btrfs
+ * items, in the same order as a serial scan of the inode tables.
+ */
+struct ext2_copy_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char *device;
+	u32 convert_flags;
+	struct task_ctx *progress;
+	struct ext2_group_batch *batches;
+	dgrp_t nr_groups;
+	/* Next group to be read */
+	dgrp_t next_group;
+	/* Groups already copied, the readers stay within a window ahead */
+	dgrp_t copied_groups;
+	dgrp_t window;
+	bool stop;
+};
+
+#define EXT2_MAX_READERS		(16)
+#define EXT2_GROUPS_PER_READER		(4)
+
+static void ext2_free_decoded_inode(struct ext2_decoded_inode *di)
 {
-	ext2_filsys ext2_fs = cctx->fs_data;
-	int ret = 0;
+	free(di->inode);
+	free(di->extents);
+	free(di->dirents);
+	free(di->xattr_block);
+}
+
+static void ext2_free_group_batch(struct ext2_group_batch *batch)
+{
+	for (u32 i = 0; i < batch->nr_inodes; i++)
+		ext2_free_decoded_inode(&batch->inodes[i]);
+	free(batch->inodes);
+	batch->inodes = NULL;
+	batch->nr_inodes = 0;
+	batch->alloced = 0;
+}
+
+static int ext2_group_batch_add(struct ext2_group_batch *batch,
+				const struct ext2_decoded_inode *di)
+{
+	if (batch->nr_inodes == batch->alloced) {
+		struct ext2_decoded_inode *tmp;
+		u32 alloced = max(batch->alloced * 2, 64U);
+
+		tmp = realloc(batch->inodes, alloced * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		batch->inodes = tmp;
+		batch->alloced = alloced;
+	}
+	batch->inodes[batch->nr_inodes++] = *di;
+	return 0;
+}
+
+struct ext2_dirent_collect {
+	struct ext2_decoded_inode *di;
+	int ret;
+};
+
+/*
+ * Append a copy of the directory entry to the decoded inode.  The copies are
+ * packed, rec_len is the aligned size of the copy itself.
+ */
+static int ext2_collect_dirent_proc(ext2_ino_t dir, int entry,
+				    struct ext2_dir_entry *dirent,
+				    int offset, int blocksize,
+				    char *buf, void *priv_data)
+{
+	struct ext2_dirent_collect *collect = priv_data;
+	struct ext2_decoded_inode *di = collect->di;
+	const u32 name_len = dirent->name_len & 0xFF;
+	const u32 rec_len = ALIGN(offsetof(struct ext2_dir_entry, name) +
+				  name_len, 4);
+	struct ext2_dir_entry *copy;
+
+	if (di->dirents_len + rec_len > di->dirents_size) {
+		u32 size = max(di->dirents_size * 2, (u32)SZ_4K);
+		char *tmp;
+
+		tmp = realloc(di->dirents, size);
+		if (!tmp) {
+			collect->ret = -ENOMEM;
+			return DIRENT_ABORT;
+		}
+		di->dirents = tmp;
+		di->dirents_size = size;
+	}
+	copy = (struct ext2_dir_entry *)(di->dirents + di->dirents_len);
+	copy->inode = dirent->inode;
+	copy->rec_len = rec_len;
+	copy->name_len = dirent->name_len;
+	memcpy(copy->name, dirent->name, name_len);
+	di->dirents_len += rec_len;
+	return 0;
+}
+
+/*
+ * Read everything the copy of the inode needs besides the inode itself:
+ * extent maps, directory entries and the xattr block.
+ */
+static int ext2_decode_inode(ext2_filsys ext2_fs, struct ext2_decoded_inode *di,
+			     u32 convert_flags)
+{
+	struct ext2_inode *inode = (struct ext2_inode *)di->inode;
 	errcode_t err;
-	ext2_inode_scan ext2_scan;
-	struct ext2_inode ext2_inode;
-	ext2_ino_t ext2_ino;
-	u64 objectid;
-	struct btrfs_trans_handle *trans;
+	int ret;
 
-	trans = btrfs_start_transaction(root, 1);
-	if (IS_ERR(trans))
-		return PTR_ERR(trans);
-	err = ext2fs_open_inode_scan(ext2_fs, 0, &ext2_scan);
+	switch (inode->i_mode & S_IFMT) {
+	case S_IFLNK:
+		/* Fast symlinks have the target in the inode */
+		if (!ext2fs_inode_data_blocks2(ext2_fs, inode))
+			break;
+		fallthrough;
+	case S_IFREG:
+		if (inode->i_flags & EXT4_EXTENTS_FL) {
+			ret = ext2_decode_file_extents(ext2_fs, di);
+			if (ret < 0)
+				return ret;
+		}
+		break;
+	case S_IFDIR: {
+		struct ext2_dirent_collect collect = { .di = di };
+
+		err = ext2fs_dir_iterate2(ext2_fs, di->ino, 0, NULL,
+					  ext2_collect_dirent_proc, &collect);
+		if (err) {
+			error("ext2fs_dir_iterate2: %s", error_message(err));
+			return -EIO;
+		}
+		if (collect.ret < 0)
+			return collect.ret;
+		break;
+	}
+	default:
+		break;
+	}
+
+	if ((convert_flags & CONVERT_FLAG_XATTR) && inode->i_file_acl) {
+		di->xattr_block = malloc(ext2_fs->blocksize);
+		if (!di->xattr_block)
+			return -ENOMEM;
+		err = ext2fs_read_ext_attr2(ext2_fs, inode->i_file_acl,
+					    di->xattr_block);
+		if (err) {
+			error("ext2fs_read_ext_attr2: %s", error_message(err));
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read and decode all inodes of a block group that are going to be copied.
+ * Unused inodes and special inodes are skipped.
+ */
+static int ext2_read_group(ext2_filsys ext2_fs, ext2_inode_scan scan,
+			   dgrp_t group, struct ext2_group_batch *batch,
+			   u32 convert_flags)
+{
+	const u32 inodes_per_group = EXT2_INODES_PER_GROUP(ext2_fs->super);
+	const u64 last_ino = (u64)(group + 1) * inodes_per_group;
+	const int inode_size = EXT2_INODE_SIZE(ext2_fs->super);
+	struct ext2_inode_large *inode = NULL;
+	errcode_t err;
+	int ret = 0;
+
+	/* Nothing is allocated in the group, the scan would skip it anyway */
+	if (ext2fs_has_group_desc_csum(ext2_fs) &&
+	    ext2fs_bg_flags_test(ext2_fs, group, EXT2_BG_INODE_UNINIT))
+		return 0;
+
+	err = ext2fs_inode_scan_goto_blockgroup(scan, group);
 	if (err) {
-		error("ext2fs_open_inode_scan failed: %s", error_message(err));
-		btrfs_commit_transaction(trans, root);
+		error("ext2fs_inode_scan_goto_blockgroup failed: %s",
+		      error_message(err));
 		return -EIO;
 	}
-	while (!(err = ext2fs_get_next_inode(ext2_scan, &ext2_ino,
-					     &ext2_inode))) {
-		/* no more inodes */
-		if (ext2_ino == 0)
+	for (u32 i = 0; i < inodes_per_group; i++) {
+		struct ext2_decoded_inode di = { 0 };
+		ext2_ino_t ext2_ino;
+
+		if (!inode) {
+			inode = malloc(inode_size);
+			if (!inode) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		err = ext2fs_get_next_inode_full(scan, &ext2_ino,
+						 (struct ext2_inode *)inode,
+						 inode_size);
+		if (err) {
+			error("ext2fs_get_next_inode failed: %s",
+			      error_message(err));
+			ret = -EIO;
+			break;
+		}
+		/* No more inodes in this group */
+		if (ext2_ino == 0 || ext2_ino > last_ino)
 			break;
 		if (ext2_is_special_inode(ext2_fs, ext2_ino))
 			continue;
-		objectid = ext2_ino + INO_OFFSET;
-		ret = ext2_copy_single_inode(trans, root,
-					objectid, ext2_fs, ext2_ino,
-					&ext2_inode, convert_flags);
-		pthread_mutex_lock(&p->mutex);
-		p->cur_copy_inodes++;
-		pthread_mutex_unlock(&p->mutex);
+		if (inode->i_links_count == 0)
+			continue;
+
+		di.ino = ext2_ino;
+		di.inode = inode;
+		inode = NULL;
+		ret = ext2_decode_inode(ext2_fs, &di, convert_flags);
+		if (ret == 0)
+			ret = ext2_group_batch_add(batch, &di);
+		if (ret < 0) {
+			error("failed to read ext2 inode %u: %d", ext2_ino, ret);
+			ext2_free_decoded_inode(&di);
+			break;
+		}
+	}
+	free(inode);
+	return ret;
+}
+
+static void *ext2_reader_thread(void *arg)
+{
+	struct ext2_copy_pipeline *pl = arg;
+	ext2_filsys ext2_fs = NULL;
+	ext2_inode_scan scan = NULL;
+	errcode_t err;
+	int open_ret = 0;
+
+	err = ext2fs_open(pl->device,
+			  EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS, 0, 0,
+			  unix_io_manager, &ext2_fs);
+	if (err) {
+		error("ext2fs_open: %s", error_message(err));
+		ext2_fs = NULL;
+		open_ret = -EIO;
+	} else {
+		err = ext2fs_open_inode_scan(ext2_fs, 0, &scan);
+		if (err) {
+			error("ext2fs_open_inode_scan failed: %s",
+			      error_message(err));
+			scan = NULL;
+			open_ret = -EIO;
+		}
+	}
+
+	while (1) {
+		struct ext2_group_batch *batch;
+		dgrp_t group;
+		int ret;
+
+		pthread_mutex_lock(&pl->lock);
+		while (!pl->stop && pl->next_group < pl->nr_groups &&
+		       pl->next_group >= pl->copied_groups + pl->window)
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		if (pl->stop || pl->next_group >= pl->nr_groups) {
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		group = pl->next_group++;
+		pthread_mutex_unlock(&pl->lock);
+
+		batch = &pl->batches[group];
+		ret = open_ret;
+		if (!ret)
+			ret = ext2_read_group(ext2_fs, scan, group, batch,
+					      pl->convert_flags);
+
+		pthread_mutex_lock(&pl->progress->mutex);
+		pl->progress->cur_read_inodes += batch->nr_inodes;
+		pthread_mutex_unlock(&pl->progress->mutex);
+
+		pthread_mutex_lock(&pl->lock);
+		batch->ret = ret;
+		batch->ready = true;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+	}
+
+	if (scan)
+		ext2fs_close_inode_scan(scan);
+	if (ext2_fs)
+		ext2fs_close(ext2_fs);
+	return NULL;
+}
+
+/*
+ * scan ext2's inode tables and copy all used inodes.
+ */
+static int ext2_copy_inodes(struct btrfs_convert_context *cctx,
+			    struct btrfs_root *root,
+			    u32 convert_flags, struct task_ctx *p)
+{
+	ext2_filsys ext2_fs = cctx->fs_data;
+	struct ext2_copy_pipeline pl = { 0 };
+	struct btrfs_trans_handle *trans = NULL;
+	pthread_t *readers = NULL;
+	long nr_readers;
+	int nr_started = 0;
+	int ret = 0;
+
+	pl.device = ext2_fs->device_name;
+	pl.convert_flags = convert_flags;
+	pl.progress = p;
+	pl.nr_groups = ext2_fs->group_desc_count;
+
+	nr_readers = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_readers = max_t(long, nr_readers, 1);
+	nr_readers = min_t(long, nr_readers, EXT2_MAX_READERS);
+	nr_readers = min_t(long, nr_readers, pl.nr_groups);
+	pl.window = nr_readers * EXT2_GROUPS_PER_READER;
+
+	pl.batches = calloc(pl.nr_groups, sizeof(*pl.batches));
+	readers = calloc(nr_readers, sizeof(*readers));
+	if (!pl.batches || !readers) {
+		free(pl.batches);
+		free(readers);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.cond, NULL);
+
+	trans = btrfs_start_transaction(root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		trans = NULL;
+		goto out;
+	}
+
+	for (int i = 0; i < nr_readers; i++) {
+		ret = pthread_create(&readers[i], NULL, ext2_reader_thread, &pl);
 		if (ret) {
-			error("failed to copy ext2 inode %llu: %d",
-					(unsigned long long)ext2_ino, ret);
-			goto out;
+			errno = ret;
+			error("failed to start inode reader thread: %m");
+			ret = -ret;
+			break;
 		}
-		/*
-		 * blocks_used is the number of new tree blocks allocated in
-		 * current transaction.
-		 * Use a small amount of it to workaround a bug where delayed
-		 * ref may fail to locate tree blocks in extent tree.
-		 *
-		 * 2M is the threshold to kick chunk preallocator into work,
-		 * For default (16K) nodesize it will be 128 tree blocks,
-		 * large enough to contain over 300 inlined files or
-		 * around 26k file extents. Which should be good enough.
-		 */
-		if (trans->blocks_used >= SZ_2M / root->fs_info->nodesize) {
-			ret = btrfs_commit_transaction(trans, root);
-			if (ret < 0) {
-				errno = -ret;
-				error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+		nr_started++;
+	}
+	/* Continue with fewer readers, the copy does not depend on the count */
+	if (nr_started == 0)
+		goto out;
+	ret = 0;
+
+	for (dgrp_t group = 0; group < pl.nr_groups; group++) {
+		struct ext2_group_batch *batch = &pl.batches[group];
+
+		pthread_mutex_lock(&pl.lock);
+		while (!batch->ready)
+			pthread_cond_wait(&pl.cond, &pl.lock);
+		pthread_mutex_unlock(&pl.lock);
+
+		for (u32 i = 0; i < batch->nr_inodes; i++) {
+			struct ext2_decoded_inode *di = &batch->inodes[i];
+			u64 objectid = di->ino + INO_OFFSET;
+
+			ret = ext2_copy_single_inode(trans, root, objectid,
+						     ext2_fs, di, convert_flags);
+			pthread_mutex_lock(&p->mutex);
+			p->cur_copy_inodes++;
+			pthread_mutex_unlock(&p->mutex);
+			if (ret) {
+				error("failed to copy ext2 inode %llu: %d",
+				      (unsigned long long)di->ino, ret);
 				goto out;
 			}
-			trans = btrfs_start_transaction(root, 1);
-			if (IS_ERR(trans)) {
-				ret = PTR_ERR(trans);
-				errno = -ret;
-				error_msg(ERROR_MSG_START_TRANS, "%m");
-				trans = NULL;
-				goto out;
+			/*
+			 * blocks_used is the number of new tree blocks allocated in
+			 * current transaction.
+			 * Use a small amount of it to workaround a bug where delayed
+			 * ref may fail to locate tree blocks in extent tree.
+			 *
+			 * 2M is the threshold to kick chunk preallocator into work,
+			 * For default (16K) nodesize it will be 128 tree blocks,
+			 * large enough to contain over 300 inlined files or
+			 * around 26k file extents. Which should be good enough.
+			 */
+			if (trans->blocks_used >= SZ_2M / root->fs_info->nodesize) {
+				ret = btrfs_commit_transaction(trans, root);
+				if (ret < 0) {
+					errno = -ret;
+					error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+					goto out;
+				}
+				trans = btrfs_start_transaction(root, 1);
+				if (IS_ERR(trans)) {
+					ret = PTR_ERR(trans);
+					errno = -ret;
+					error_msg(ERROR_MSG_START_TRANS, "%m");
+					trans = NULL;
+					goto out;
+				}
 			}
 		}
-	}
-	if (err) {
-		error("ext2fs_get_next_inode failed: %s", error_message(err));
-		ret = -EIO;
-		goto out;
+		if (batch->ret) {
+			ret = batch->ret;
+			error("failed to read ext2 inodes of block group %u: %d",
+			      group, ret);
+			goto out;
+		}
+		ext2_free_group_batch(batch);
+
+		pthread_mutex_lock(&pl.lock);
+		pl.copied_groups = group + 1;
+		pthread_cond_broadcast(&pl.cond);
+		pthread_mutex_unlock(&pl.lock);
 	}
 out:
+	pthread_mutex_lock(&pl.lock);
+	pl.stop = true;
+	pthread_cond_broadcast(&pl.cond);
+	pthread_mutex_unlock(&pl.lock);
+	for (int i = 0; i < nr_started; i++)
+		pthread_join(readers[i], NULL);
+
 	if (ret < 0) {
 		if (trans)
 			btrfs_abort_transaction(trans, ret);
@@ -1170,8 +1521,13 @@ out:
 			error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
 		}
 	}
-	ext2fs_close_inode_scan(ext2_scan);
 
+	for (dgrp_t group = 0; group < pl.nr_groups; group++)
+		ext2_free_group_batch(&pl.batches[group]);
+	free(pl.batches);
+	free(readers);
+	pthread_cond_destroy(&pl.cond);
+	pthread_mutex_destroy(&pl.lock);
 	return ret;
 }
 
@@ -36,6 +36,8 @@ struct task_ctx {
 	pthread_mutex_t mutex;
 	u64 max_copy_inodes;
 	u64 cur_copy_inodes;
+	/* Inodes read and decoded ahead of the copy, if the source does so */
+	u64 cur_read_inodes;
 	struct task_info *info;
 };
 
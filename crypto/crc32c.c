@@ -207,9 +207,17 @@ static uint32_t crc32c_ref(uint32_t crc, unsigned char const *data, uint32_t len
 
 uint32_t crc32c_le(uint32_t crc, unsigned char const *data, uint32_t length)
 {
-	/* Use by-byte access for unaligned buffers */
-	if ((unsigned long)data % sizeof(unsigned long))
-		return crc32c_ref(crc, data, length);
+	uint32_t head = (unsigned long)data % sizeof(unsigned long);
+
+	/* Use by-byte access for the unaligned head of the buffer */
+	if (head) {
+		head = sizeof(unsigned long) - head;
+		if (head >= length)
+			return crc32c_ref(crc, data, length);
+		crc = crc32c_ref(crc, data, head);
+		data += head;
+		length -= head;
+	}
 
 	return crc32c_impl(crc, data, length);
 }
@@ -22,6 +22,13 @@
 
 #define CRYPTO_HASH_SIZE_MAX	32
 
+/*
+ * The libkcapi and botan backends keep one static handle for all sha256 and
+ * blake2b calls, these must not be called from several threads at once.
+ * The crc32c and xxhash implementations are always safe.
+ */
+#define CRYPTO_HASH_THREAD_SAFE	(!CRYPTOPROVIDER_LIBKCAPI && !CRYPTOPROVIDER_BOTAN)
+
 int hash_crc32c(const u8 *buf, size_t length, u8 *out);
 int hash_xxhash(const u8 *buf, size_t length, u8 *out);
 int hash_sha256(const u8 *buf, size_t length, u8 *out);
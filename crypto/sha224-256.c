@@ -40,6 +40,7 @@
  *   to hash the final few bits of the input.
  */
 
+#include <string.h>
 #include "crypto/sha.h"
 #include "crypto/sha-private.h"
 #include "common/cpu-utils.h"
@@ -64,13 +65,19 @@
 /*
  * Add "length" to the length.
  * Set Corrupted when overflow has occurred.
+ *
+ * The temporary is local so that independent contexts can be used
+ * from several threads at once.
  */
-static uint32_t addTemp;
-#define SHA224_256AddLength(context, length)               \
-  (addTemp = (context)->Length_Low, (context)->Corrupted = \
-    (((context)->Length_Low += (length)) < addTemp) &&     \
-    (++(context)->Length_High == 0) ? shaInputTooLong :    \
-                                      (context)->Corrupted )
+static inline int SHA224_256AddLength(SHA256Context *context, uint32_t length)
+{
+  uint32_t addTemp = context->Length_Low;
+
+  context->Corrupted =
+    ((context->Length_Low += length) < addTemp) &&
+    (++context->Length_High == 0) ? shaInputTooLong : context->Corrupted;
+  return context->Corrupted;
+}
 
 /* Local Function Prototypes */
 static int SHA224_256Reset(SHA256Context *context, uint32_t *H0);
@@ -259,7 +266,21 @@ int SHA256Input(SHA256Context *context, const uint8_t *message_array,
   if (context->Computed) return context->Corrupted = shaStateError;
   if (context->Corrupted) return context->Corrupted;
 
-  while (length--) {
+  while (length) {
+    /* Process whole blocks directly when the buffer is empty */
+    if (context->Message_Block_Index == 0 &&
+        length >= SHA256_Message_Block_Size) {
+      memcpy(context->Message_Block, message_array,
+             SHA256_Message_Block_Size);
+      if (SHA224_256AddLength(context, SHA256_Message_Block_Size * 8) !=
+          shaSuccess)
+        return context->Corrupted;
+      sha256_process_message_block(context);
+      message_array += SHA256_Message_Block_Size;
+      length -= SHA256_Message_Block_Size;
+      continue;
+    }
+
     context->Message_Block[context->Message_Block_Index++] =
             *message_array;
 
@@ -269,6 +290,7 @@ int SHA256Input(SHA256Context *context, const uint8_t *message_array,
     }
 
     message_array++;
+    length--;
   }
 
   return context->Corrupted;
@@ -111,7 +111,6 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 static void metadump_destroy(struct metadump_struct *md, int num_threads)
 {
 	int i;
-	struct rb_node *n;
 
 	pthread_mutex_lock(&md->mutex);
 	md->done = 1;
@@ -124,15 +123,7 @@ static void metadump_destroy(struct metadump_struct *md, int num_threads)
 	pthread_cond_destroy(&md->cond);
 	pthread_mutex_destroy(&md->mutex);
 
-	while ((n = rb_first(&md->name_tree))) {
-		struct name *name;
-
-		name = rb_entry(n, struct name, n);
-		rb_erase(n, &md->name_tree);
-		free(name->val);
-		free(name->sub);
-		free(name);
-	}
+	free_name_tree(&md->name_tree);
 	extent_io_tree_release(&md->seen);
 }
 
@@ -776,7 +767,8 @@ int create_metadump(const char *input, FILE *out, int num_threads,
 	int err = 0;
 
 	root = open_ctree(input, 0, OPEN_CTREE_ALLOW_TRANSID_MISMATCH |
-			  OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS);
+			  OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS |
+			  OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if (!root) {
 		error("open ctree failed");
 		return -EIO;
@@ -105,85 +105,129 @@ static const u32 crc32c_rev_table[256] = {
  * @current_crc: CRC32C checksum of all bytes before the suffix
  * @desired_crc: the checksum that we want to get after adding the suffix
  *
- * Outputs: @suffix: pointer to where the suffix will be written (4-bytes)
+ * Return the suffix, byte i of the value is the i-th character. The result is
+ * linear in both arguments, so the suffix of xor-ed checksums is the xor of
+ * their suffixes.
  */
-static void find_collision_calc_suffix(unsigned long current_crc,
-				       unsigned long desired_crc,
-				       char *suffix)
+static u32 find_collision_calc_suffix(u32 current_crc, u32 desired_crc)
 {
 	int i;
 
-	for(i = 3; i >= 0; i--) {
+	for (i = 3; i >= 0; i--) {
 		desired_crc = (desired_crc << 8)
 			    ^ crc32c_rev_table[desired_crc >> 24 & 0xFF]
 			    ^ ((current_crc >> i * 8) & 0xFF);
 	}
-	for (i = 0; i < 4; i++)
-		suffix[i] = (desired_crc >> i * 8) & 0xFF;
+	return desired_crc;
 }
 
-/*
- * Check if suffix is valid according to our file name conventions
- */
-static bool find_collision_is_suffix_valid(const char *suffix)
+/* Forward CRC-32C table to update the checksum by one byte */
+static u32 crc32c_byte_table[256];
+/* Suffix contribution of each entry of the forward table */
+static u32 crc32c_suffix_table[256];
+/* Characters allowed in the sanitized names */
+static bool valid_chars[256];
+static bool collision_tables_ready;
+
+static void find_collision_init_tables(void)
 {
 	int i;
-	char c;
 
-	for (i = 0; i < 4; i++) {
-		c = suffix[i];
-		if (c < ' ' || c > 126 || c == '/')
-			return false;
+	if (collision_tables_ready)
+		return;
+	for (i = 0; i < 256; i++) {
+		unsigned char c = i;
+
+		crc32c_byte_table[i] = crc32c(0, &c, 1);
+		crc32c_suffix_table[i] =
+			find_collision_calc_suffix(crc32c_byte_table[i], 0);
+		valid_chars[i] = (c >= ' ' && c <= 126 && c != '/');
 	}
-	return true;
+	collision_tables_ready = true;
+}
+
+/*
+ * Check if suffix is valid according to our file name conventions
+ */
+static bool find_collision_is_suffix_valid(u32 suffix)
+{
+	return valid_chars[suffix & 0xFF] & valid_chars[(suffix >> 8) & 0xFF] &
+	       valid_chars[(suffix >> 16) & 0xFF] & valid_chars[suffix >> 24];
 }
 
+/*
+ * Find a printable name of the same length and CRC32C as @val->val
+ *
+ * The prefix (all but the 4 suffix bytes) is enumerated like an odometer where
+ * the last character changes fastest. The CRC32C of the leading characters is
+ * cached so only the changed characters are rehashed, and as the suffix is
+ * linear in the checksum, the suffixes for all values of the last prefix
+ * character come from one table lookup each. The cost of a candidate thus
+ * does not depend on the name length.
+ */
 static int find_collision_reverse_crc32c(struct name *val, u32 name_len)
 {
-	unsigned long checksum;
-	unsigned long current_checksum;
+	u32 *partial;
+	int prefix_len;
 	int found = 0;
 	int i;
 
 	/* There are no same length collisions of 4 or less bytes */
 	if (name_len <= 4)
 		return 0;
-	checksum = crc32c(~1, val->val, name_len);
-	name_len -= 4;
-	memset(val->sub, ' ', name_len);
+	prefix_len = name_len - 4;
+
+	/* CRC32C of the first i characters of the prefix is in partial[i] */
+	partial = malloc(prefix_len * sizeof(u32));
+	if (!partial) {
+		error_mem("sanitize name");
+		return 0;
+	}
+	find_collision_init_tables();
+	memset(val->sub, ' ', prefix_len);
+	partial[0] = ~1U;
 	i = 0;
 	while (1) {
-		current_checksum = crc32c(~1, val->sub, name_len);
-		find_collision_calc_suffix(current_checksum,
-					   checksum,
-					   val->sub + name_len);
-		if (find_collision_is_suffix_valid(val->sub + name_len) &&
-		    memcmp(val->sub, val->val, val->len)) {
-			found = 1;
-			break;
-		}
+		u32 last_crc;
+		u32 base;
+		int c;
 
-		if (val->sub[i] == 126) {
-			do {
-				i++;
-				if (i >= name_len)
-					break;
-			} while (val->sub[i] == 126);
+		for (; i < prefix_len - 1; i++)
+			partial[i + 1] = (partial[i] >> 8) ^
+				crc32c_byte_table[(partial[i] ^ val->sub[i]) & 0xFF];
 
-			if (i >= name_len)
-				break;
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-			memset(val->sub, ' ', i);
-			i = 0;
-			continue;
-		} else {
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
+		last_crc = partial[prefix_len - 1];
+		base = find_collision_calc_suffix(last_crc >> 8, val->crc);
+		for (c = ' '; c <= 126; c++) {
+			u32 suffix;
+
+			if (c == '/')
+				continue;
+			suffix = base ^ crc32c_suffix_table[(last_crc ^ c) & 0xFF];
+			if (!find_collision_is_suffix_valid(suffix))
+				continue;
+
+			val->sub[prefix_len - 1] = c;
+			put_unaligned_le32(suffix, val->sub + prefix_len);
+			if (memcmp(val->sub, val->val, val->len)) {
+				found = 1;
+				goto out;
+			}
 		}
+
+		/* Advance the characters before the last one */
+		i = prefix_len - 2;
+		while (i >= 0 && val->sub[i] == 126)
+			i--;
+		if (i < 0)
+			break;
+		val->sub[i]++;
+		if (val->sub[i] == '/')
+			val->sub[i]++;
+		memset(val->sub + i + 1, ' ', prefix_len - i - 1);
 	}
+out:
+	free(partial);
 	return found;
 }
 
@@ -233,32 +277,48 @@ static struct rb_node *tree_search(struct rb_root *root,
 	return NULL;
 }
 
+/*
+ * The collision search depends only on the hash and the length of the name, so
+ * the tree is indexed by both and the result is shared by all names with the
+ * same hash and length.
+ */
 static int name_cmp(struct rb_node *a, struct rb_node *b, int fuzz)
 {
 	struct name *entry = rb_entry(a, struct name, n);
 	struct name *ins = rb_entry(b, struct name, n);
-	u32 len;
 
-	len = min(ins->len, entry->len);
-	return memcmp(ins->val, entry->val, len);
+	if (ins->crc != entry->crc)
+		return ins->crc < entry->crc ? -1 : 1;
+	if (ins->len != entry->len)
+		return ins->len < entry->len ? -1 : 1;
+	return 0;
 }
 
 static char *find_collision(struct rb_root *name_tree, char *name,
 			    u32 name_len)
 {
 	struct name *val;
+	struct name *last = NULL;
 	struct rb_node *entry;
 	struct name tmp;
 	int found;
 	int i;
 
-	tmp.val = name;
+	tmp.crc = crc32c(~1, name, name_len);
 	tmp.len = name_len;
 	entry = tree_search(name_tree, &tmp.n, name_cmp, 0);
 	if (entry) {
-		val = rb_entry(entry, struct name, n);
-		free(name);
-		return val->sub;
+		/*
+		 * Use the first substitution that is not the name itself, a
+		 * new one is searched for and queued only if all are.
+		 */
+		for (val = rb_entry(entry, struct name, n); val; val = val->next) {
+			if (memcmp(val->sub, name, name_len)) {
+				free(name);
+				return val->sub;
+			}
+			last = val;
+		}
 	}
 
 	val = malloc(sizeof(struct name));
@@ -272,6 +332,7 @@ static char *find_collision(struct rb_root *name_tree, char *name,
 
 	val->val = name;
 	val->len = name_len;
+	val->crc = tmp.crc;
 	val->sub = malloc(name_len);
 	if (!val->sub) {
 		error_mem("sanitize name");
@@ -295,10 +356,32 @@ static char *find_collision(struct rb_root *name_tree, char *name,
 		}
 	}
 
-	tree_insert(name_tree, &val->n, name_cmp);
+	if (last)
+		last->next = val;
+	else
+		tree_insert(name_tree, &val->n, name_cmp);
 	return val->sub;
 }
 
+void free_name_tree(struct rb_root *name_tree)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(name_tree))) {
+		struct name *name = rb_entry(n, struct name, n);
+
+		rb_erase(n, name_tree);
+		while (name) {
+			struct name *next = name->next;
+
+			free(name->val);
+			free(name->sub);
+			free(name);
+			name = next;
+		}
+	}
+}
+
 static char *generate_garbage(u32 name_len)
 {
 	char *buf = malloc(name_len);
@@ -435,10 +518,12 @@ static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size)
 {
 	struct extent_buffer *eb;
 
-	eb = calloc(1, sizeof(struct extent_buffer) + size);
+	/* The data is filled by the caller, only the used parts are copied */
+	eb = malloc(sizeof(struct extent_buffer) + size);
 	if (!eb)
 		return NULL;
 
+	memset(eb, 0, sizeof(struct extent_buffer));
 	eb->start = bytenr;
 	eb->len = size;
 	return eb;
@@ -451,6 +536,7 @@ void sanitize_name(enum sanitize_mode sanitize, struct rb_root *name_tree,
 	struct extent_buffer *eb;
 	u32 item_ptr_off = btrfs_item_ptr_offset(src, slot);
 	u32 item_ptr_size = btrfs_item_size(src, slot);
+	u32 header_size;
 
 	eb = alloc_dummy_eb(src->start, src->len);
 	if (!eb) {
@@ -458,7 +544,14 @@ void sanitize_name(enum sanitize_mode sanitize, struct rb_root *name_tree,
 		return;
 	}
 
-	memcpy(eb->data, src->data, src->len);
+	/*
+	 * The sanitizers access only the leaf header, the item headers and
+	 * the data of the item, copying the whole leaf for each item would
+	 * dominate the time of dumping with sanitization.
+	 */
+	header_size = btrfs_item_nr_offset(src, btrfs_header_nritems(src));
+	memcpy(eb->data, src->data, header_size);
+	memcpy(eb->data + item_ptr_off, src->data + item_ptr_off, item_ptr_size);
 
 	switch (key->type) {
 	case BTRFS_DIR_ITEM_KEY:
@@ -28,6 +28,10 @@ struct name {
 	char *val;
 	char *sub;
 	u32 len;
+	/* Hash of @val, the names are indexed by the hash and length */
+	u32 crc;
+	/* Next name of the same hash and length, used for names equal to @sub */
+	struct name *next;
 };
 
 /*
@@ -47,5 +51,6 @@ enum sanitize_mode {
 void sanitize_name(enum sanitize_mode sanitize, struct rb_root *name_tree,
 		u8 *dst, struct extent_buffer *src, struct btrfs_key *key,
 		int slot);
+void free_name_tree(struct rb_root *name_tree);
 
 #endif
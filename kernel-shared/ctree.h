@@ -322,6 +322,9 @@ struct btrfs_fs_info {
 	u64 max_cache_size;
 	u64 cache_size;
 	struct list_head lru;
+	/* Tree blocks read by read_tree_block() from disk and from the cache */
+	u64 tree_block_reads;
+	u64 tree_block_cache_hits;
 
 	struct extent_io_tree dirty_buffers;
 	struct extent_io_tree free_space_cache;
@@ -377,6 +380,8 @@ struct btrfs_fs_info {
 	unsigned int skip_leaf_item_checks:1;
 	unsigned int rebuilding_extent_tree:1;
 	unsigned int active_zone_tracking:1;
+	/* Block groups not read yet, see OPEN_CTREE_LAZY_BLOCK_GROUPS */
+	unsigned int block_groups_deferred:1;
 
 	int transaction_aborted;
 
@@ -970,6 +975,7 @@ int update_space_info(struct btrfs_fs_info *info, u64 flags,
 		      struct btrfs_space_info **space_info);
 int btrfs_free_block_groups(struct btrfs_fs_info *info);
 int btrfs_read_block_groups(struct btrfs_fs_info *info);
+int btrfs_read_deferred_block_groups(struct btrfs_fs_info *fs_info);
 int btrfs_try_chunk_alloc(struct btrfs_trans_handle *trans,
 			  struct btrfs_fs_info *fs_info, u64 alloc_bytes,
 			  u64 flags);
@@ -320,6 +320,8 @@ static int read_on_restore(struct extent_buffer *eb)
 
 	ret = btrfs_pread(device->fd, eb->data, eb->len, eb->start,
 			  eb->fs_info->zoned);
+	if (ret > 0)
+		device->bytes_read += ret;
 	if (ret != eb->len)
 		ret = -EIO;
 	else
@@ -457,9 +459,12 @@ struct extent_buffer *read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	if (!eb)
 		return ERR_PTR(-ENOMEM);
 
-	if (btrfs_buffer_uptodate(eb, check->transid, 0))
+	if (btrfs_buffer_uptodate(eb, check->transid, 0)) {
+		fs_info->tree_block_cache_hits++;
 		return eb;
+	}
 
+	fs_info->tree_block_reads++;
 	ret = btrfs_read_extent_buffer(eb, check);
 	if (ret) {
 		/*
@@ -1013,6 +1018,19 @@ static int read_root_or_create_block(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
+/*
+ * Print time spent in one step of opening the filesystem (with --log=debug)
+ * and restart the measurement for the next one.
+ */
+static void report_open_time(const char *what, u64 *start)
+{
+	u64 now = get_monotonic_ns();
+
+	pr_stderr(LOG_DEBUG, "open_ctree: %s: %.3f ms\n", what,
+		  (now - *start) / 1000000.0);
+	*start = now;
+}
+
 static inline bool maybe_load_block_groups(struct btrfs_fs_info *fs_info,
 					   u64 flags)
 {
@@ -1257,6 +1275,7 @@ int btrfs_setup_all_roots(struct btrfs_fs_info *fs_info, u64 root_tree_bytenr,
 	struct btrfs_super_block *sb = fs_info->super_copy;
 	struct btrfs_root *root = fs_info->tree_root;
 	struct btrfs_key key;
+	u64 start;
 	int ret;
 
 	ret = load_important_roots(fs_info, root_tree_bytenr, flags);
@@ -1329,7 +1348,13 @@ int btrfs_setup_all_roots(struct btrfs_fs_info *fs_info, u64 root_tree_bytenr,
 	}
 
 	if (maybe_load_block_groups(fs_info, flags)) {
-		ret = btrfs_read_block_groups(fs_info);
+		start = get_monotonic_ns();
+		ret = 0;
+		/* Read on first use by btrfs_read_deferred_block_groups() */
+		if (flags & OPEN_CTREE_LAZY_BLOCK_GROUPS)
+			fs_info->block_groups_deferred = 1;
+		else
+			ret = btrfs_read_block_groups(fs_info);
 		/*
 		 * If we don't find any blockgroups (ENOENT) we're either
 		 * restoring or creating the filesystem, where it's expected,
@@ -1340,6 +1365,8 @@ int btrfs_setup_all_roots(struct btrfs_fs_info *fs_info, u64 root_tree_bytenr,
 			error("failed to read block groups: %m");
 			return ret;
 		}
+		if (!fs_info->block_groups_deferred)
+			report_open_time("block groups", &start);
 	}
 
 	key.objectid = BTRFS_FS_TREE_OBJECTID;
@@ -1534,6 +1561,7 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 	unsigned sbflags = SBREAD_DEFAULT;
 	unsigned flags = oca->flags;
 	u64 sb_bytenr = oca->sb_bytenr;
+	u64 start = get_monotonic_ns();
 
 	if (sb_bytenr == 0)
 		sb_bytenr = BTRFS_SUPER_INFO_OFFSET;
@@ -1594,6 +1622,7 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 	ret = btrfs_open_devices(fs_info, fs_devices, oflags);
 	if (ret)
 		goto out;
+	report_open_time("devices", &start);
 
 	disk_super = fs_info->super_copy;
 	if (flags & OPEN_CTREE_RECOVER_SUPER)
@@ -1650,6 +1679,7 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 	ret = btrfs_setup_chunk_tree_and_device_map(fs_info, oca->chunk_tree_bytenr);
 	if (ret)
 		goto out_chunk;
+	report_open_time("chunk tree", &start);
 
 	fs_info->zoned = 0;
 
@@ -1688,6 +1718,7 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 	if (ret && !(flags & __OPEN_CTREE_RETURN_CHUNK_ROOT) &&
 	    !fs_info->ignore_chunk_tree_error)
 		goto out_chunk;
+	report_open_time("all roots", &start);
 
 	return fs_info;
 
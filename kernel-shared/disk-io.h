@@ -118,6 +118,12 @@ enum btrfs_open_ctree_flags {
 	 * Use the superblock of the latest device for the transaction commit.
 	 */
 	OPEN_CTREE_USE_LATEST_BDEV		= (1U << 18),
+
+	/*
+	 * Do not read block groups at open time, postpone that until the first
+	 * block group or space info lookup or a transaction start.
+	 */
+	OPEN_CTREE_LAZY_BLOCK_GROUPS		= (1U << 19),
 };
 
 /*
@@ -259,6 +259,8 @@ static struct btrfs_block_group *block_group_cache_tree_search(
 struct btrfs_block_group *btrfs_lookup_first_block_group(
 		struct btrfs_fs_info *info, u64 bytenr)
 {
+	if (btrfs_read_deferred_block_groups(info) < 0)
+		return NULL;
 	return block_group_cache_tree_search(info, bytenr, 1);
 }
 
@@ -268,6 +270,8 @@ struct btrfs_block_group *btrfs_lookup_first_block_group(
 struct btrfs_block_group *btrfs_lookup_block_group(
 		struct btrfs_fs_info *info, u64 bytenr)
 {
+	if (btrfs_read_deferred_block_groups(info) < 0)
+		return NULL;
 	return block_group_cache_tree_search(info, bytenr, 0);
 }
 
@@ -1629,6 +1633,9 @@ struct btrfs_space_info *btrfs_find_space_info(struct btrfs_fs_info *info, u64 f
 {
 	struct btrfs_space_info *found;
 
+	if (btrfs_read_deferred_block_groups(info) < 0)
+		return NULL;
+
 	flags &= BTRFS_BLOCK_GROUP_TYPE_MASK;
 
 	list_for_each_entry(found, &info->space_info, list) {
@@ -2942,6 +2949,100 @@ out:
 	return ret;
 }
 
+/*
+ * Find the block group item of the chunk starting at @chunk_start.
+ *
+ * Return 0 and set up @path if found, >0 if the chunk has no block group
+ * item and <0 for error.
+ */
+static int find_chunk_block_group(struct btrfs_root *root,
+				  struct btrfs_path *path, u64 chunk_start)
+{
+	struct btrfs_key key = {
+		.objectid = chunk_start,
+		.type = BTRFS_BLOCK_GROUP_ITEM_KEY,
+		.offset = 0,
+	};
+	int ret;
+
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		return ret;
+	if (path->slots[0] >= btrfs_header_nritems(path->nodes[0])) {
+		ret = btrfs_next_leaf(root, path);
+		if (ret)
+			return ret;
+	}
+	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+	if (key.objectid != chunk_start ||
+	    key.type != BTRFS_BLOCK_GROUP_ITEM_KEY)
+		return 1;
+	return 0;
+}
+
+/*
+ * Read block group items from the extent tree using the chunk mapping.
+ *
+ * Without the block group tree the items are scattered over the whole extent
+ * tree and the linear search done by read_block_groups_from_root() has to read
+ * every leaf. The chunks are already known and each has one block group item
+ * at the same start, so look them up directly and read only the leaves that
+ * contain them.
+ *
+ * The first pass only goes down to the level 1 nodes and starts readahead of
+ * all the leaves, so the block layer can read them in parallel and the second
+ * pass that inserts the block groups in ascending order finds them cached.
+ */
+static int read_block_groups_from_chunks(struct btrfs_fs_info *fs_info,
+					 struct btrfs_root *root)
+{
+	struct cache_tree *chunks = &fs_info->mapping_tree.cache_tree;
+	struct btrfs_path path = { 0 };
+	struct cache_extent *ce;
+	u64 last_leaf = 0;
+	int ret = 0;
+
+	if (btrfs_header_level(root->node) > 0) {
+		path.lowest_level = 1;
+		for (ce = first_cache_extent(chunks); ce; ce = next_cache_extent(ce)) {
+			struct btrfs_key key = {
+				.objectid = ce->start,
+				.type = BTRFS_BLOCK_GROUP_ITEM_KEY,
+				.offset = 0,
+			};
+			u64 leaf;
+
+			ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+			if (ret < 0)
+				goto out;
+			leaf = btrfs_node_blockptr(path.nodes[1], path.slots[1]);
+			if (leaf != last_leaf)
+				readahead_tree_block(fs_info, leaf,
+					btrfs_node_ptr_generation(path.nodes[1],
+								  path.slots[1]));
+			last_leaf = leaf;
+			btrfs_release_path(&path);
+		}
+		path.lowest_level = 0;
+	}
+
+	for (ce = first_cache_extent(chunks); ce; ce = next_cache_extent(ce)) {
+		ret = find_chunk_block_group(root, &path, ce->start);
+		if (ret < 0)
+			goto out;
+		if (ret == 0) {
+			ret = read_one_block_group(fs_info, &path);
+			if (ret < 0 && ret != -ENOENT)
+				goto out;
+		}
+		btrfs_release_path(&path);
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
 static int read_converting_block_groups(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_root *old_root;
@@ -2988,9 +3089,44 @@ int btrfs_read_block_groups(struct btrfs_fs_info *fs_info)
 		return read_converting_block_groups(fs_info);
 
 	root = btrfs_block_group_root(fs_info);
+	/*
+	 * Chunk recovery needs to see block group items that don't have a
+	 * chunk, the block group tree is compact enough to be read as is.
+	 */
+	if (!fs_info->is_chunk_recover &&
+	    !btrfs_fs_compat_ro(fs_info, BLOCK_GROUP_TREE))
+		return read_block_groups_from_chunks(fs_info, root);
 	return read_block_groups_from_root(fs_info, root);
 }
 
+/*
+ * Read block groups skipped at open time by OPEN_CTREE_LAZY_BLOCK_GROUPS.
+ *
+ * Called from the block group and space info lookups and transaction start,
+ * does nothing if the block groups have been read already.
+ */
+int btrfs_read_deferred_block_groups(struct btrfs_fs_info *fs_info)
+{
+	u64 start;
+	int ret;
+
+	if (!fs_info->block_groups_deferred)
+		return 0;
+
+	/* Reading the items does space info lookups, don't recurse. */
+	fs_info->block_groups_deferred = 0;
+	start = get_monotonic_ns();
+	ret = btrfs_read_block_groups(fs_info);
+	if (ret < 0 && ret != -ENOENT) {
+		errno = -ret;
+		error("failed to read block groups: %m");
+		return ret;
+	}
+	pr_stderr(LOG_DEBUG, "open_ctree: deferred block groups: %.3f ms\n",
+		  (get_monotonic_ns() - start) / 1000000.0);
+	return 0;
+}
+
 /*
  * For extent tree v2 we use the block_group_item->chunk_offset to point at our
  * global root id.  For v1 it's always set to BTRFS_FIRST_CHUNK_TREE_OBJECTID.
@@ -367,6 +367,8 @@ static int read_raid56(struct btrfs_fs_info *fs_info, void *buf, u64 logical,
 		ret = btrfs_pread(multi->stripes[i].dev->fd, pointers[i],
 				  BTRFS_STRIPE_LEN, multi->stripes[i].physical,
 				  fs_info->zoned);
+		if (ret > 0)
+			multi->stripes[i].dev->bytes_read += ret;
 		if (ret < BTRFS_STRIPE_LEN)
 			set_bit(i, failed_stripe_bitmap);
 	}
@@ -457,6 +459,8 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 logical,
 	ret = btrfs_pread(device->fd, buf, read_len,
 			  multi->stripes[0].physical, info->zoned);
 	kfree(multi);
+	if (ret > 0)
+		device->bytes_read += ret;
 	if (ret < 0) {
 		fprintf(stderr, "Error reading %llu, %d\n", logical,
 			ret);
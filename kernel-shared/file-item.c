@@ -306,6 +306,132 @@ fail:
 	return ret;
 }
 
+/*
+ * Append up to @nr_csums checksums to the csum item that ends right at
+ * @logical, as far as the item can grow.
+ *
+ * Return the number of appended checksums, 0 if there's no such item or it's
+ * full, or a negative errno.
+ */
+static int extend_prev_csum_item(struct btrfs_trans_handle *trans,
+				 struct btrfs_root *root, u64 logical,
+				 u64 csum_objectid, u16 csum_size,
+				 const u8 *csums, u32 nr_csums)
+{
+	const u32 sectorsize = trans->fs_info->sectorsize;
+	const u32 max_items = MAX_CSUM_ITEMS(root, csum_size);
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	struct btrfs_key found_key;
+	struct extent_buffer *leaf;
+	u32 item_size;
+	u32 nr;
+	int ret;
+
+	key.objectid = csum_objectid;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = logical;
+
+	/* Find the previous item and how many checksums it can take */
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret <= 0)
+		goto out;
+	ret = btrfs_previous_item(root, &path, csum_objectid,
+				  BTRFS_EXTENT_CSUM_KEY);
+	if (ret) {
+		ret = (ret < 0 ? ret : 0);
+		goto out;
+	}
+	leaf = path.nodes[0];
+	btrfs_item_key_to_cpu(leaf, &found_key, path.slots[0]);
+	item_size = btrfs_item_size(leaf, path.slots[0]);
+	if (found_key.offset + (u64)item_size / csum_size * sectorsize != logical ||
+	    item_size / csum_size >= max_items) {
+		ret = 0;
+		goto out;
+	}
+	nr = min(nr_csums, max_items - item_size / csum_size);
+	btrfs_release_path(&path);
+
+	/* Search again with enough space in the leaf to extend the item */
+	ret = btrfs_search_slot(trans, root, &key, &path, nr * csum_size, 1);
+	if (ret <= 0)
+		goto out;
+	if (path.slots[0] == 0) {
+		ret = 0;
+		goto out;
+	}
+	path.slots[0]--;
+	leaf = path.nodes[0];
+	btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+	if (btrfs_comp_cpu_keys(&key, &found_key) ||
+	    btrfs_item_size(leaf, path.slots[0]) != item_size) {
+		ret = 0;
+		goto out;
+	}
+	btrfs_extend_item(&path, nr * csum_size);
+	write_extent_buffer(leaf, csums,
+			    btrfs_item_ptr_offset(leaf, path.slots[0]) + item_size,
+			    nr * csum_size);
+	btrfs_mark_buffer_dirty(leaf);
+	ret = nr;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Insert already calculated checksums of @nr_csums sectors starting at
+ * @logical, filling each csum item up to its maximum size. A preceding csum
+ * item that ends at @logical is extended first, so ranges inserted one after
+ * another end up in the same items.
+ *
+ * Unlike btrfs_csum_file_block() this does not look for existing items to
+ * overwrite, the range must not have any checksums yet.
+ *
+ * MODIFIED:
+ *  - This function doesn't exist in the kernel.
+ */
+int btrfs_insert_data_csums(struct btrfs_trans_handle *trans, u64 logical,
+			    u64 csum_objectid, u32 csum_type, const u8 *csums,
+			    u32 nr_csums)
+{
+	const u32 sectorsize = trans->fs_info->sectorsize;
+	const u16 csum_size = btrfs_csum_type_size(csum_type);
+	int ret = 0;
+
+	while (nr_csums) {
+		struct btrfs_root *root = btrfs_csum_root(trans->fs_info, logical);
+		struct btrfs_key key;
+		u32 nr;
+
+		ret = extend_prev_csum_item(trans, root, logical, csum_objectid,
+					    csum_size, csums, nr_csums);
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			nr = ret;
+			ret = 0;
+			logical += (u64)nr * sectorsize;
+			csums += nr * csum_size;
+			nr_csums -= nr;
+			continue;
+		}
+		nr = min_t(u32, nr_csums, MAX_CSUM_ITEMS(root, csum_size));
+		key.objectid = csum_objectid;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = logical;
+		ret = btrfs_insert_item(trans, root, &key, (void *)csums,
+					nr * csum_size);
+		if (ret < 0)
+			break;
+		logical += (u64)nr * sectorsize;
+		csums += nr * csum_size;
+		nr_csums -= nr;
+	}
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
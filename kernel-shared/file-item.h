@@ -94,6 +94,9 @@ int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 			     struct btrfs_file_extent_item *stack_fi);
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
 			  u64 csum_objectid, u32 csum_type, const char *data);
+int btrfs_insert_data_csums(struct btrfs_trans_handle *trans, u64 logical,
+			    u64 csum_objectid, u32 csum_type, const u8 *csums,
+			    u32 nr_csums);
 struct btrfs_csum_item *
 btrfs_lookup_csum(struct btrfs_trans_handle *trans,
 		  struct btrfs_root *root,
@@ -727,57 +727,63 @@ static void print_remap_key(struct extent_buffer *leaf, u32 item_size,
 	printf("\t\taddress %llu\n", btrfs_remap_address(leaf, remap));
 }
 
-void print_key_type(FILE *stream, u64 objectid, u8 type)
+static const char * const key_to_str[256] = {
+	[BTRFS_INODE_ITEM_KEY]		= "INODE_ITEM",
+	[BTRFS_INODE_REF_KEY]		= "INODE_REF",
+	[BTRFS_INODE_EXTREF_KEY]	= "INODE_EXTREF",
+	[BTRFS_DIR_ITEM_KEY]		= "DIR_ITEM",
+	[BTRFS_DIR_INDEX_KEY]		= "DIR_INDEX",
+	[BTRFS_DIR_LOG_ITEM_KEY]	= "DIR_LOG_ITEM",
+	[BTRFS_DIR_LOG_INDEX_KEY]	= "DIR_LOG_INDEX",
+	[BTRFS_XATTR_ITEM_KEY]		= "XATTR_ITEM",
+	[BTRFS_VERITY_DESC_ITEM_KEY]	= "VERITY_DESC_ITEM",
+	[BTRFS_VERITY_MERKLE_ITEM_KEY]	= "VERITY_MERKLE_ITEM",
+	[BTRFS_ORPHAN_ITEM_KEY]		= "ORPHAN_ITEM",
+	[BTRFS_ROOT_ITEM_KEY]		= "ROOT_ITEM",
+	[BTRFS_ROOT_REF_KEY]		= "ROOT_REF",
+	[BTRFS_ROOT_BACKREF_KEY]	= "ROOT_BACKREF",
+	[BTRFS_EXTENT_ITEM_KEY]		= "EXTENT_ITEM",
+	[BTRFS_METADATA_ITEM_KEY]	= "METADATA_ITEM",
+	[BTRFS_TREE_BLOCK_REF_KEY]	= "TREE_BLOCK_REF",
+	[BTRFS_SHARED_BLOCK_REF_KEY]	= "SHARED_BLOCK_REF",
+	[BTRFS_EXTENT_DATA_REF_KEY]	= "EXTENT_DATA_REF",
+	[BTRFS_SHARED_DATA_REF_KEY]	= "SHARED_DATA_REF",
+	[BTRFS_EXTENT_REF_V0_KEY]	= "EXTENT_REF_V0",
+	[BTRFS_EXTENT_OWNER_REF_KEY]	= "EXTENT_OWNER_REF",
+	[BTRFS_CSUM_ITEM_KEY]		= "CSUM_ITEM",
+	[BTRFS_EXTENT_CSUM_KEY]		= "EXTENT_CSUM",
+	[BTRFS_EXTENT_DATA_KEY]		= "EXTENT_DATA",
+	[BTRFS_BLOCK_GROUP_ITEM_KEY]	= "BLOCK_GROUP_ITEM",
+	[BTRFS_FREE_SPACE_INFO_KEY]	= "FREE_SPACE_INFO",
+	[BTRFS_FREE_SPACE_EXTENT_KEY]	= "FREE_SPACE_EXTENT",
+	[BTRFS_FREE_SPACE_BITMAP_KEY]	= "FREE_SPACE_BITMAP",
+	[BTRFS_CHUNK_ITEM_KEY]		= "CHUNK_ITEM",
+	[BTRFS_DEV_ITEM_KEY]		= "DEV_ITEM",
+	[BTRFS_DEV_EXTENT_KEY]		= "DEV_EXTENT",
+	[BTRFS_TEMPORARY_ITEM_KEY]	= "TEMPORARY_ITEM",
+	[BTRFS_DEV_REPLACE_KEY]		= "DEV_REPLACE",
+	[BTRFS_STRING_ITEM_KEY]		= "STRING_ITEM",
+	[BTRFS_QGROUP_STATUS_KEY]	= "QGROUP_STATUS",
+	[BTRFS_QGROUP_RELATION_KEY]	= "QGROUP_RELATION",
+	[BTRFS_QGROUP_INFO_KEY]		= "QGROUP_INFO",
+	[BTRFS_QGROUP_LIMIT_KEY]	= "QGROUP_LIMIT",
+	[BTRFS_PERSISTENT_ITEM_KEY]	= "PERSISTENT_ITEM",
+	[BTRFS_UUID_KEY_SUBVOL]		= "UUID_KEY_SUBVOL",
+	[BTRFS_UUID_KEY_RECEIVED_SUBVOL] = "UUID_KEY_RECEIVED_SUBVOL",
+	[BTRFS_RAID_STRIPE_KEY]		= "RAID_STRIPE",
+	[BTRFS_IDENTITY_REMAP_KEY]	= "IDENTITY_REMAP",
+	[BTRFS_REMAP_KEY]		= "REMAP",
+	[BTRFS_REMAP_BACKREF_KEY]	= "REMAP_BACKREF",
+};
+
+/* Return name of the key type or NULL if it's not known */
+const char *btrfs_key_type_name(u8 type)
 {
-	static const char* key_to_str[256] = {
-		[BTRFS_INODE_ITEM_KEY]		= "INODE_ITEM",
-		[BTRFS_INODE_REF_KEY]		= "INODE_REF",
-		[BTRFS_INODE_EXTREF_KEY]	= "INODE_EXTREF",
-		[BTRFS_DIR_ITEM_KEY]		= "DIR_ITEM",
-		[BTRFS_DIR_INDEX_KEY]		= "DIR_INDEX",
-		[BTRFS_DIR_LOG_ITEM_KEY]	= "DIR_LOG_ITEM",
-		[BTRFS_DIR_LOG_INDEX_KEY]	= "DIR_LOG_INDEX",
-		[BTRFS_XATTR_ITEM_KEY]		= "XATTR_ITEM",
-		[BTRFS_VERITY_DESC_ITEM_KEY]	= "VERITY_DESC_ITEM",
-		[BTRFS_VERITY_MERKLE_ITEM_KEY]	= "VERITY_MERKLE_ITEM",
-		[BTRFS_ORPHAN_ITEM_KEY]		= "ORPHAN_ITEM",
-		[BTRFS_ROOT_ITEM_KEY]		= "ROOT_ITEM",
-		[BTRFS_ROOT_REF_KEY]		= "ROOT_REF",
-		[BTRFS_ROOT_BACKREF_KEY]	= "ROOT_BACKREF",
-		[BTRFS_EXTENT_ITEM_KEY]		= "EXTENT_ITEM",
-		[BTRFS_METADATA_ITEM_KEY]	= "METADATA_ITEM",
-		[BTRFS_TREE_BLOCK_REF_KEY]	= "TREE_BLOCK_REF",
-		[BTRFS_SHARED_BLOCK_REF_KEY]	= "SHARED_BLOCK_REF",
-		[BTRFS_EXTENT_DATA_REF_KEY]	= "EXTENT_DATA_REF",
-		[BTRFS_SHARED_DATA_REF_KEY]	= "SHARED_DATA_REF",
-		[BTRFS_EXTENT_REF_V0_KEY]	= "EXTENT_REF_V0",
-		[BTRFS_EXTENT_OWNER_REF_KEY]	= "EXTENT_OWNER_REF",
-		[BTRFS_CSUM_ITEM_KEY]		= "CSUM_ITEM",
-		[BTRFS_EXTENT_CSUM_KEY]		= "EXTENT_CSUM",
-		[BTRFS_EXTENT_DATA_KEY]		= "EXTENT_DATA",
-		[BTRFS_BLOCK_GROUP_ITEM_KEY]	= "BLOCK_GROUP_ITEM",
-		[BTRFS_FREE_SPACE_INFO_KEY]	= "FREE_SPACE_INFO",
-		[BTRFS_FREE_SPACE_EXTENT_KEY]	= "FREE_SPACE_EXTENT",
-		[BTRFS_FREE_SPACE_BITMAP_KEY]	= "FREE_SPACE_BITMAP",
-		[BTRFS_CHUNK_ITEM_KEY]		= "CHUNK_ITEM",
-		[BTRFS_DEV_ITEM_KEY]		= "DEV_ITEM",
-		[BTRFS_DEV_EXTENT_KEY]		= "DEV_EXTENT",
-		[BTRFS_TEMPORARY_ITEM_KEY]	= "TEMPORARY_ITEM",
-		[BTRFS_DEV_REPLACE_KEY]		= "DEV_REPLACE",
-		[BTRFS_STRING_ITEM_KEY]		= "STRING_ITEM",
-		[BTRFS_QGROUP_STATUS_KEY]	= "QGROUP_STATUS",
-		[BTRFS_QGROUP_RELATION_KEY]	= "QGROUP_RELATION",
-		[BTRFS_QGROUP_INFO_KEY]		= "QGROUP_INFO",
-		[BTRFS_QGROUP_LIMIT_KEY]	= "QGROUP_LIMIT",
-		[BTRFS_PERSISTENT_ITEM_KEY]	= "PERSISTENT_ITEM",
-		[BTRFS_UUID_KEY_SUBVOL]		= "UUID_KEY_SUBVOL",
-		[BTRFS_UUID_KEY_RECEIVED_SUBVOL] = "UUID_KEY_RECEIVED_SUBVOL",
-		[BTRFS_RAID_STRIPE_KEY]		= "RAID_STRIPE",
-		[BTRFS_IDENTITY_REMAP_KEY]	= "IDENTITY_REMAP",
-		[BTRFS_REMAP_KEY]		= "REMAP",
-		[BTRFS_REMAP_BACKREF_KEY]	= "REMAP_BACKREF",
-	};
+	return key_to_str[type];
+}
 
+void print_key_type(FILE *stream, u64 objectid, u8 type)
+{
 	if (type == 0 && objectid == BTRFS_FREE_SPACE_OBJECTID) {
 		fprintf(stream, "UNTYPED");
 		return;
@@ -1487,7 +1493,8 @@ static void print_dev_replace_item(struct extent_buffer *eb, struct btrfs_dev_re
 	print_u64_timespec(btrfs_dev_replace_time_started(eb, ptr), "\t\tstop time ");
 }
 
-void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
+/* Print the leaf @eb, return the number of items printed */
+u32 __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 {
 	struct btrfs_disk_key disk_key;
 	u32 leaf_data_size = __BTRFS_LEAF_DATA_SIZE(eb->len);
@@ -1671,6 +1678,7 @@ void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 		};
 		fflush(stdout);
 	}
+	return i;
 }
 
 /* Helper function to reach the leftmost tree block at @path->lowest_level */
@@ -1755,7 +1763,10 @@ static int next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
-static void bfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
+static void print_tree(struct extent_buffer *eb, unsigned int mode, u64 *items);
+
+static void bfs_print_children(struct extent_buffer *root_eb, unsigned int mode,
+			       u64 *items)
 {
 	struct btrfs_fs_info *fs_info = root_eb->fs_info;
 	struct btrfs_path path = { 0 };
@@ -1784,7 +1795,7 @@ static void bfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
 
 		/* Print all sibling tree blocks */
 		while (1) {
-			btrfs_print_tree(path.nodes[cur_level], mode);
+			print_tree(path.nodes[cur_level], mode, items);
 			ret = next_sibling_tree_block(fs_info, &path);
 			if (ret < 0)
 				goto out;
@@ -1799,7 +1810,8 @@ out:
 	return;
 }
 
-static void dfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
+static void dfs_print_children(struct extent_buffer *root_eb, unsigned int mode,
+			       u64 *items)
 {
 	struct btrfs_fs_info *fs_info = root_eb->fs_info;
 	struct extent_buffer *next;
@@ -1834,18 +1846,12 @@ static void dfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
 			free_extent_buffer(next);
 			continue;
 		}
-		btrfs_print_tree(next, mode);
+		print_tree(next, mode, items);
 		free_extent_buffer(next);
 	}
 }
 
-/*
- * Print a tree block (applies to both node and leaf).
- *
- * @eb:		tree block where to start
- * @mode:	bits setting mode of operation, see BTRFS_PRINT_TREE_*
- */
-void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode)
+static void print_tree(struct extent_buffer *eb, unsigned int mode, u64 *items)
 {
 	u32 i;
 	u32 nr;
@@ -1864,7 +1870,10 @@ void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode)
 
 	nr = btrfs_header_nritems(eb);
 	if (btrfs_is_leaf(eb)) {
-		__btrfs_print_leaf(eb, mode);
+		u32 printed = __btrfs_print_leaf(eb, mode);
+
+		if (items)
+			*items += printed;
 		return;
 	}
 	/* We are crossing eb boundary, this node must be corrupted */
@@ -1895,12 +1904,32 @@ void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode)
 	/* Keep non-traversal modes */
 	mode &= ~(BTRFS_PRINT_TREE_DFS | BTRFS_PRINT_TREE_BFS);
 	if (traverse == BTRFS_PRINT_TREE_DFS) {
-		dfs_print_children(eb, mode);
+		dfs_print_children(eb, mode, items);
 	} else {
-		bfs_print_children(eb, mode);
+		bfs_print_children(eb, mode, items);
 	}
 }
 
+/*
+ * Print a tree block (applies to both node and leaf).
+ *
+ * @eb:		tree block where to start
+ * @mode:	bits setting mode of operation, see BTRFS_PRINT_TREE_*
+ */
+void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode)
+{
+	print_tree(eb, mode, NULL);
+}
+
+/* Same as btrfs_print_tree(), and return the number of leaf items printed. */
+u64 btrfs_print_tree_count(struct extent_buffer *eb, unsigned int mode)
+{
+	u64 items = 0;
+
+	print_tree(eb, mode, &items);
+	return items;
+}
+
 static bool is_valid_csum_type(u16 csum_type)
 {
 	switch (csum_type) {
@@ -42,7 +42,8 @@ enum {
 };
 
 void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode);
-void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode);
+u64 btrfs_print_tree_count(struct extent_buffer *eb, unsigned int mode);
+u32 __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode);
 
 static inline void btrfs_print_leaf(struct extent_buffer *eb)
 {
@@ -54,6 +55,7 @@ void print_chunk_item(struct extent_buffer *eb, struct btrfs_chunk *chunk);
 void print_extent_item(struct extent_buffer *eb, int slot, int metadata);
 void print_objectid(FILE *stream, u64 objectid, u8 type);
 void print_key_type(FILE *stream, u64 objectid, u8 type);
+const char *btrfs_key_type_name(u8 type);
 void btrfs_print_superblock(struct btrfs_super_block *sb, int full);
 
 #endif
@@ -119,6 +119,12 @@ struct btrfs_trans_handle *btrfs_start_transaction(struct btrfs_root *root,
 	unsigned int rsv_bytes;
 	bool need_retry = false;
 	u64 profile;
+	int ret;
+
+	/* The allocation profiles are set up by reading the block groups */
+	ret = btrfs_read_deferred_block_groups(fs_info);
+	if (ret < 0)
+		return ERR_PTR(ret);
 
 	if (root->root_key.objectid == BTRFS_CHUNK_TREE_OBJECTID)
 		profile = BTRFS_BLOCK_GROUP_SYSTEM |
@@ -168,8 +174,6 @@ struct btrfs_trans_handle *btrfs_start_transaction(struct btrfs_root *root,
 		return ERR_PTR(PTR_ERR(h));
 
 	if (need_retry) {
-		int ret;
-
 		ret = btrfs_try_chunk_alloc(h, fs_info, rsv_bytes, profile);
 		if (ret < 0) {
 			btrfs_abort_transaction(h, ret);
@@ -1892,6 +1892,58 @@ static enum btrfs_tree_block_status check_leaf_item(struct extent_buffer *leaf,
 	return BTRFS_TREE_BLOCK_CLEAN;
 }
 
+/*
+ * MODIFIED:
+ *  - Fast validation of the item header array, used before the per-slot checks.
+ *
+ * Check that the keys are in ascending order and that the item data are
+ * contiguous from the end of the leaf and don't overlap the item headers.
+ * The loop reads the raw headers and accumulates the result without branches,
+ * so it's cheap for the common case of a valid leaf.  Errors are not
+ * reported, the per-slot checks do that.
+ */
+static bool leaf_item_headers_valid(const struct extent_buffer *leaf, u32 nritems)
+{
+	const u32 leaf_data_size = BTRFS_LEAF_DATA_SIZE(leaf->fs_info);
+	const struct btrfs_item *items;
+	u64 prev_objectid = 0;
+	u64 prev_offset = 0;
+	u8 prev_type = 0;
+	u64 expected_end = leaf_data_size;
+	bool bad = false;
+
+	if (nritems > leaf_data_size / sizeof(struct btrfs_item))
+		return false;
+
+	items = (const struct btrfs_item *)(leaf->data + sizeof(struct btrfs_header));
+	for (u32 i = 0; i < nritems; i++) {
+		const u64 objectid = get_unaligned_le64(&items[i].key.objectid);
+		const u64 offset = get_unaligned_le64(&items[i].key.offset);
+		const u8 type = items[i].key.type;
+		const u32 data_offset = get_unaligned_le32(&items[i].offset);
+		const u32 data_size = get_unaligned_le32(&items[i].size);
+		const bool key_greater = (prev_objectid < objectid) |
+			((prev_objectid == objectid) &
+			 ((prev_type < type) |
+			  ((prev_type == type) & (prev_offset < offset))));
+
+		bad |= !key_greater;
+		bad |= ((u64)data_offset + data_size != expected_end);
+		prev_objectid = objectid;
+		prev_type = type;
+		prev_offset = offset;
+		expected_end = data_offset;
+	}
+
+	/*
+	 * Data offsets are decreasing, so only the last one can overlap with
+	 * the item headers.
+	 */
+	bad |= (expected_end < (u64)nritems * sizeof(struct btrfs_item));
+
+	return !bad;
+}
+
 enum btrfs_tree_block_status __btrfs_check_leaf(struct extent_buffer *leaf)
 {
 	struct btrfs_fs_info *fs_info = leaf->fs_info;
@@ -1901,6 +1953,7 @@ enum btrfs_tree_block_status __btrfs_check_leaf(struct extent_buffer *leaf)
 	u32 nritems = btrfs_header_nritems(leaf);
 	int slot;
 	bool check_item_data = btrfs_header_flag(leaf, BTRFS_HEADER_FLAG_WRITTEN);
+	bool headers_valid;
 
 	if (unlikely(btrfs_header_level(leaf) != 0)) {
 		generic_err(leaf, 0,
@@ -1976,12 +2029,22 @@ enum btrfs_tree_block_status __btrfs_check_leaf(struct extent_buffer *leaf)
 	 * 3) item content
 	 *    If possible, do comprehensive sanity check.
 	 *    NOTE: All checks must only rely on the item data itself.
+	 *
+	 * MODIFIED:
+	 *  - 1) and 2) are checked for all slots at once first, the per-slot
+	 *    checks run only if that fails to find and report the problem.
 	 */
+	headers_valid = leaf_item_headers_valid(leaf, nritems);
+	if (headers_valid && !check_item_data)
+		return BTRFS_TREE_BLOCK_CLEAN;
+
 	for (slot = 0; slot < nritems; slot++) {
 		u32 item_end_expected;
 		u64 item_data_end;
 
 		btrfs_item_key_to_cpu(leaf, &key, slot);
+		if (headers_valid)
+			goto check_item;
 
 		/* Make sure the keys are in the right order */
 		if (unlikely(btrfs_comp_cpu_keys(&prev_key, &key) >= 0)) {
@@ -2035,6 +2098,7 @@ enum btrfs_tree_block_status __btrfs_check_leaf(struct extent_buffer *leaf)
 			return BTRFS_TREE_BLOCK_INVALID_OFFSETS;
 		}
 
+check_item:
 		/*
 		 * We only want to do this if WRITTEN is set, otherwise the leaf
 		 * may be in some intermediate state and won't appear valid.
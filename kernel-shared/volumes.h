@@ -43,6 +43,11 @@ struct btrfs_device {
 	struct cache_tree discard;
 
 	u64 total_ios;
+	/*
+	 * Bytes read from the device, for statistics. Atomic as the device is
+	 * also read from worker threads.
+	 */
+	_Atomic u64 bytes_read;
 
 	int fd;
 
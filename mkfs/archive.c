@@ -0,0 +1,1164 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernel-lib/sizes.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "mkfs/archive.h"
+
+/*
+ * The archive is read strictly sequentially through one large buffer, so it
+ * can come from a pipe. Supported formats are:
+ *
+ * - tar: ustar, GNU (long names and links) and pax (extended headers with
+ *   path, linkpath, size, ids, timestamps, device numbers and SCHILY.xattr
+ *   records)
+ * - cpio: "newc" (070701), "crc" (070702) and portable "odc" (070707)
+ *
+ * Sparse tar formats and the old binary cpio format are not supported.
+ */
+
+#define ARCHIVE_BUF_SIZE		SZ_1M
+/* Upper limit of a GNU long name or a pax extended header */
+#define ARCHIVE_MAX_EXT_SIZE		SZ_16M
+
+#define TAR_BLOCK_SIZE			512
+#define CPIO_NEWC_HDR_SIZE		110
+#define CPIO_ODC_HDR_SIZE		76
+#define CPIO_TRAILER			"TRAILER!!!"
+
+enum archive_format {
+	ARCHIVE_TAR,
+	ARCHIVE_CPIO_NEWC,
+	ARCHIVE_CPIO_ODC,
+};
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	union {
+		/* POSIX ustar */
+		char prefix[155];
+		/* Old GNU format, magic "ustar  " */
+		struct {
+			char atime[12];
+			char ctime[12];
+		} gnu;
+	};
+	char pad[12];
+};
+_Static_assert(sizeof(struct tar_header) == TAR_BLOCK_SIZE,
+	       "tar header must be one block");
+
+/* Values from a pax extended header, overriding the following tar header */
+struct pax_values {
+	char *path;
+	char *link;
+	u64 size;
+	u64 uid;
+	u64 gid;
+	s64 mtime;
+	s64 atime;
+	s64 ctime;
+	u64 devmajor;
+	u64 devminor;
+	bool has_size;
+	bool has_uid;
+	bool has_gid;
+	bool has_mtime;
+	bool has_atime;
+	bool has_ctime;
+	bool has_devmajor;
+	bool has_devminor;
+};
+
+struct mkfs_archive {
+	const char *filename;
+	int fd;
+	bool seekable;
+	bool eof;
+	enum archive_format format;
+
+	/* Read buffer, bytes in [pos, len) are not consumed yet */
+	char *buf;
+	size_t pos;
+	size_t len;
+	/* Archive offset of buf[pos], for messages */
+	u64 offset;
+
+	/* Not consumed data and padding of the current entry */
+	u64 data_left;
+	u32 data_pad;
+
+	struct mkfs_archive_entry entry;
+	char path[PATH_MAX];
+	char link_target[PATH_MAX];
+	int nr_xattrs_alloc;
+
+	/* GNU long name/link and pax values for the next tar entry */
+	char *long_name;
+	char *long_link;
+	struct pax_values pax;
+};
+
+/* Make at least @len bytes available in the buffer, return what's there */
+static ssize_t archive_fill(struct mkfs_archive *ar, size_t len)
+{
+	UASSERT(len <= ARCHIVE_BUF_SIZE);
+
+	if (ar->len - ar->pos >= len)
+		return ar->len - ar->pos;
+	if (ar->pos) {
+		memmove(ar->buf, ar->buf + ar->pos, ar->len - ar->pos);
+		ar->len -= ar->pos;
+		ar->pos = 0;
+	}
+	while (ar->len < len && !ar->eof) {
+		ssize_t ret;
+
+		ret = read(ar->fd, ar->buf + ar->len, ARCHIVE_BUF_SIZE - ar->len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			error("cannot read archive %s: %m", ar->filename);
+			return -errno;
+		}
+		if (ret == 0)
+			ar->eof = true;
+		ar->len += ret;
+	}
+	return ar->len - ar->pos;
+}
+
+static void archive_consume(struct mkfs_archive *ar, size_t len)
+{
+	UASSERT(ar->pos + len <= ar->len);
+	ar->pos += len;
+	ar->offset += len;
+}
+
+static int archive_truncated(struct mkfs_archive *ar)
+{
+	error("unexpected end of archive %s at offset %llu", ar->filename,
+	      ar->offset);
+	return -EIO;
+}
+
+static int archive_read(struct mkfs_archive *ar, void *buf, size_t len)
+{
+	char *dst = buf;
+
+	while (len > 0) {
+		size_t avail = ar->len - ar->pos;
+		size_t copy;
+
+		if (avail == 0) {
+			ssize_t ret;
+
+			/* Large reads bypass the buffer */
+			if (len >= ARCHIVE_BUF_SIZE && !ar->eof) {
+				ret = read(ar->fd, dst, len);
+				if (ret < 0) {
+					if (errno == EINTR)
+						continue;
+					error("cannot read archive %s: %m",
+					      ar->filename);
+					return -errno;
+				}
+				if (ret == 0)
+					return archive_truncated(ar);
+				dst += ret;
+				len -= ret;
+				ar->offset += ret;
+				continue;
+			}
+			ret = archive_fill(ar, 1);
+			if (ret < 0)
+				return ret;
+			if (ret == 0)
+				return archive_truncated(ar);
+			continue;
+		}
+		copy = min(avail, len);
+		memcpy(dst, ar->buf + ar->pos, copy);
+		archive_consume(ar, copy);
+		dst += copy;
+		len -= copy;
+	}
+	return 0;
+}
+
+static int archive_skip(struct mkfs_archive *ar, u64 len)
+{
+	u64 copy = min_t(u64, ar->len - ar->pos, len);
+
+	archive_consume(ar, copy);
+	len -= copy;
+	if (len == 0)
+		return 0;
+
+	if (ar->seekable) {
+		if (lseek(ar->fd, len, SEEK_CUR) < 0) {
+			error("cannot seek in archive %s: %m", ar->filename);
+			return -errno;
+		}
+		ar->offset += len;
+		return 0;
+	}
+	while (len > 0) {
+		ssize_t ret;
+
+		ret = archive_fill(ar, 1);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return archive_truncated(ar);
+		copy = min_t(u64, ret, len);
+		archive_consume(ar, copy);
+		len -= copy;
+	}
+	return 0;
+}
+
+/*
+ * Copy the path to @dst without "." components and redundant slashes.
+ * Paths with ".." components are rejected as they could leave the root.
+ */
+static int normalize_path(const char *src, char *dst, size_t dst_size)
+{
+	size_t len = 0;
+
+	while (*src) {
+		const char *comp;
+		size_t comp_len;
+
+		while (*src == '/')
+			src++;
+		if (!*src)
+			break;
+		comp = src;
+		while (*src && *src != '/')
+			src++;
+		comp_len = src - comp;
+		if (comp_len == 1 && comp[0] == '.')
+			continue;
+		if (comp_len == 2 && comp[0] == '.' && comp[1] == '.')
+			return -EINVAL;
+		if (len + !!len + comp_len >= dst_size)
+			return -ENAMETOOLONG;
+		if (len)
+			dst[len++] = '/';
+		memcpy(dst + len, comp, comp_len);
+		len += comp_len;
+	}
+	dst[len] = 0;
+	return 0;
+}
+
+static int archive_set_path(struct mkfs_archive *ar, const char *path)
+{
+	int ret;
+
+	ret = normalize_path(path, ar->path, sizeof(ar->path));
+	if (ret == -EINVAL)
+		error("archive member path contains '..': %s", path);
+	else if (ret < 0)
+		error("archive member path too long: %.64s...", path);
+	return ret;
+}
+
+static int archive_set_link(struct mkfs_archive *ar, const char *target,
+			    size_t len)
+{
+	if (len >= sizeof(ar->link_target)) {
+		error("link target too long for %s", ar->path);
+		return -ENAMETOOLONG;
+	}
+	memcpy(ar->link_target, target, len);
+	ar->link_target[len] = 0;
+	return 0;
+}
+
+static int archive_add_xattr(struct mkfs_archive *ar, const char *name,
+			     const char *value, size_t size)
+{
+	struct mkfs_archive_entry *entry = &ar->entry;
+	struct mkfs_archive_xattr *xattr;
+
+	if (entry->nr_xattrs == ar->nr_xattrs_alloc) {
+		int nr = max(8, ar->nr_xattrs_alloc * 2);
+
+		xattr = realloc(entry->xattrs, nr * sizeof(*xattr));
+		if (!xattr)
+			return -ENOMEM;
+		entry->xattrs = xattr;
+		ar->nr_xattrs_alloc = nr;
+	}
+	xattr = &entry->xattrs[entry->nr_xattrs];
+	xattr->name = strdup(name);
+	xattr->value = malloc(size ? size : 1);
+	if (!xattr->name || !xattr->value) {
+		free(xattr->name);
+		free(xattr->value);
+		return -ENOMEM;
+	}
+	memcpy(xattr->value, value, size);
+	xattr->size = size;
+	entry->nr_xattrs++;
+	return 0;
+}
+
+static void archive_free_xattrs(struct mkfs_archive *ar)
+{
+	struct mkfs_archive_entry *entry = &ar->entry;
+
+	for (int i = 0; i < entry->nr_xattrs; i++) {
+		free(entry->xattrs[i].name);
+		free(entry->xattrs[i].value);
+	}
+	entry->nr_xattrs = 0;
+}
+
+/*
+ * Parse a tar numeric field, either octal digits terminated by a space or NUL,
+ * or the base-256 encoding used by GNU tar for values that do not fit.
+ */
+static int parse_tar_number(const char *field, size_t len, u64 *ret)
+{
+	u64 val = 0;
+	size_t i = 0;
+
+	if ((u8)field[0] & 0x80) {
+		/* Negative numbers are not valid for any field we use */
+		if ((u8)field[0] & 0x40)
+			return -EINVAL;
+		val = (u8)field[0] & 0x3f;
+		for (i = 1; i < len; i++) {
+			if (val >> 56)
+				return -ERANGE;
+			val = (val << 8) | (u8)field[i];
+		}
+		*ret = val;
+		return 0;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+		if (val >> 61)
+			return -ERANGE;
+		val = val * 8 + field[i] - '0';
+	}
+	if (i < len && field[i] != ' ' && field[i] != 0)
+		return -EINVAL;
+	*ret = val;
+	return 0;
+}
+
+static int parse_cpio_number(const char *field, size_t len, int base, u64 *ret)
+{
+	u64 val = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		int digit;
+
+		if (field[i] >= '0' && field[i] <= '9')
+			digit = field[i] - '0';
+		else if (base == 16 && field[i] >= 'a' && field[i] <= 'f')
+			digit = field[i] - 'a' + 10;
+		else if (base == 16 && field[i] >= 'A' && field[i] <= 'F')
+			digit = field[i] - 'A' + 10;
+		else
+			return -EINVAL;
+		if (digit >= base)
+			return -EINVAL;
+		val = val * base + digit;
+	}
+	*ret = val;
+	return 0;
+}
+
+static bool tar_checksum_ok(const struct tar_header *hdr)
+{
+	const u8 *block = (const u8 *)hdr;
+	const size_t start = offsetof(struct tar_header, chksum);
+	unsigned int usum = 0;
+	int ssum = 0;
+	u64 stored;
+
+	if (parse_tar_number(hdr->chksum, sizeof(hdr->chksum), &stored))
+		return false;
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+		u8 c = block[i];
+
+		if (i >= start && i < start + sizeof(hdr->chksum))
+			c = ' ';
+		usum += c;
+		ssum += (signed char)c;
+	}
+	/* Some old implementations used signed char for the sum */
+	return stored == usum || stored == (u64)ssum;
+}
+
+static bool tar_block_is_zero(const char *block)
+{
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (block[i])
+			return false;
+	}
+	return true;
+}
+
+/* Read the contents of a GNU long name/link or pax header to a new string */
+static int tar_read_ext(struct mkfs_archive *ar, u64 size, char **ret)
+{
+	char *buf;
+	int err;
+
+	if (size > ARCHIVE_MAX_EXT_SIZE) {
+		error("tar extended header too large at offset %llu: %llu",
+		      ar->offset, size);
+		return -EINVAL;
+	}
+	buf = malloc(size + 1);
+	if (!buf)
+		return -ENOMEM;
+	err = archive_read(ar, buf, size);
+	if (!err)
+		err = archive_skip(ar, round_up(size, TAR_BLOCK_SIZE) - size);
+	if (err) {
+		free(buf);
+		return err;
+	}
+	buf[size] = 0;
+	*ret = buf;
+	return 0;
+}
+
+static int parse_pax_time(const char *value, s64 *ret)
+{
+	char *end;
+
+	errno = 0;
+	*ret = strtoll(value, &end, 10);
+	/* Fractional seconds are dropped, as for directories */
+	if (errno || end == value || (*end && *end != '.'))
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_pax_number(const char *value, u64 *ret)
+{
+	char *end;
+
+	if (!isdigit(*value))
+		return -EINVAL;
+	errno = 0;
+	*ret = strtoull(value, &end, 10);
+	if (errno || *end)
+		return -EINVAL;
+	return 0;
+}
+
+static int tar_pax_record(struct mkfs_archive *ar, const char *key,
+			  const char *value, size_t value_len)
+{
+	struct pax_values *pax = &ar->pax;
+	int ret = 0;
+
+	if (strcmp(key, "path") == 0) {
+		free(pax->path);
+		pax->path = strdup(value);
+		if (!pax->path)
+			return -ENOMEM;
+	} else if (strcmp(key, "linkpath") == 0) {
+		free(pax->link);
+		pax->link = strdup(value);
+		if (!pax->link)
+			return -ENOMEM;
+	} else if (strcmp(key, "size") == 0) {
+		ret = parse_pax_number(value, &pax->size);
+		pax->has_size = true;
+	} else if (strcmp(key, "uid") == 0) {
+		ret = parse_pax_number(value, &pax->uid);
+		pax->has_uid = true;
+	} else if (strcmp(key, "gid") == 0) {
+		ret = parse_pax_number(value, &pax->gid);
+		pax->has_gid = true;
+	} else if (strcmp(key, "mtime") == 0) {
+		ret = parse_pax_time(value, &pax->mtime);
+		pax->has_mtime = true;
+	} else if (strcmp(key, "atime") == 0) {
+		ret = parse_pax_time(value, &pax->atime);
+		pax->has_atime = true;
+	} else if (strcmp(key, "ctime") == 0) {
+		ret = parse_pax_time(value, &pax->ctime);
+		pax->has_ctime = true;
+	} else if (strcmp(key, "SCHILY.devmajor") == 0) {
+		ret = parse_pax_number(value, &pax->devmajor);
+		pax->has_devmajor = true;
+	} else if (strcmp(key, "SCHILY.devminor") == 0) {
+		ret = parse_pax_number(value, &pax->devminor);
+		pax->has_devminor = true;
+	} else if (strncmp(key, "SCHILY.xattr.", 13) == 0) {
+		ret = archive_add_xattr(ar, key + 13, value, value_len);
+		if (ret < 0)
+			return ret;
+	} else if (strncmp(key, "GNU.sparse.", 11) == 0) {
+		error("sparse files in tar archives are not supported");
+		return -EOPNOTSUPP;
+	}
+	if (ret < 0) {
+		error("invalid pax record %s=%s at offset %llu", key, value,
+		      ar->offset);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Parse records of the form "<length> <key>=<value>\n" */
+static int tar_parse_pax(struct mkfs_archive *ar, char *data, size_t size)
+{
+	char *cur = data;
+	char *end = data + size;
+
+	while (cur < end) {
+		char *record = cur;
+		char *record_end;
+		char *key;
+		char *eq;
+		u64 len = 0;
+		int ret;
+
+		/* Padding after the last record */
+		if (*cur == 0)
+			break;
+		while (cur < end && isdigit(*cur)) {
+			len = len * 10 + *cur - '0';
+			cur++;
+			if (len > size)
+				break;
+		}
+		if (cur >= end || *cur != ' ' || len == 0 ||
+		    len > (u64)(end - record))
+			goto invalid;
+		key = cur + 1;
+		record_end = record + len;
+		if (record_end[-1] != '\n')
+			goto invalid;
+		eq = memchr(key, '=', record_end - key);
+		if (!eq)
+			goto invalid;
+		*eq = 0;
+		record_end[-1] = 0;
+		ret = tar_pax_record(ar, key, eq + 1, record_end - 1 - (eq + 1));
+		if (ret < 0)
+			return ret;
+		cur = record_end;
+	}
+	return 0;
+
+invalid:
+	error("invalid pax extended header before offset %llu", ar->offset);
+	return -EINVAL;
+}
+
+static void tar_reset_ext(struct mkfs_archive *ar)
+{
+	free(ar->long_name);
+	free(ar->long_link);
+	free(ar->pax.path);
+	free(ar->pax.link);
+	ar->long_name = NULL;
+	ar->long_link = NULL;
+	memset(&ar->pax, 0, sizeof(ar->pax));
+}
+
+static int tar_fill_entry(struct mkfs_archive *ar, const struct tar_header *hdr,
+			  u64 size)
+{
+	struct mkfs_archive_entry *entry = &ar->entry;
+	struct stat *st = &entry->st;
+	struct pax_values *pax = &ar->pax;
+	const bool ustar = memcmp(hdr->magic, "ustar", 6) == 0;
+	const bool gnu = memcmp(hdr->magic, "ustar ", 6) == 0 &&
+			 memcmp(hdr->version, " ", 2) == 0;
+	char name[PATH_MAX];
+	const char *link;
+	mode_t type;
+	u64 mode, uid, gid, mtime, atime = 0, ctime = 0;
+	u64 devmajor = 0, devminor = 0;
+	size_t name_len;
+	int ret;
+
+	if (pax->path) {
+		snprintf(name, sizeof(name), "%s", pax->path);
+	} else if (ar->long_name) {
+		snprintf(name, sizeof(name), "%s", ar->long_name);
+	} else if (ustar && hdr->prefix[0]) {
+		snprintf(name, sizeof(name), "%.*s/%.*s",
+			 (int)strnlen(hdr->prefix, sizeof(hdr->prefix)),
+			 hdr->prefix,
+			 (int)strnlen(hdr->name, sizeof(hdr->name)), hdr->name);
+	} else {
+		snprintf(name, sizeof(name), "%.*s",
+			 (int)strnlen(hdr->name, sizeof(hdr->name)), hdr->name);
+	}
+	name_len = strlen(name);
+
+	ret = parse_tar_number(hdr->mode, sizeof(hdr->mode), &mode);
+	if (!ret)
+		ret = parse_tar_number(hdr->uid, sizeof(hdr->uid), &uid);
+	if (!ret)
+		ret = parse_tar_number(hdr->gid, sizeof(hdr->gid), &gid);
+	if (!ret)
+		ret = parse_tar_number(hdr->mtime, sizeof(hdr->mtime), &mtime);
+	if (!ret && gnu)
+		ret = parse_tar_number(hdr->gnu.atime, sizeof(hdr->gnu.atime), &atime);
+	if (!ret && gnu)
+		ret = parse_tar_number(hdr->gnu.ctime, sizeof(hdr->gnu.ctime), &ctime);
+	if (!ret && (hdr->typeflag == '3' || hdr->typeflag == '4')) {
+		ret = parse_tar_number(hdr->devmajor, sizeof(hdr->devmajor),
+				       &devmajor);
+		if (!ret)
+			ret = parse_tar_number(hdr->devminor,
+					       sizeof(hdr->devminor), &devminor);
+	}
+	if (ret < 0) {
+		error("invalid tar header for %s", name);
+		return -EINVAL;
+	}
+
+	entry->hardlink = false;
+	switch (hdr->typeflag) {
+	case '0':
+	case 0:
+	case '7':
+		/* Pre-POSIX archives mark directories only by the slash */
+		if (name_len && name[name_len - 1] == '/')
+			type = S_IFDIR;
+		else
+			type = S_IFREG;
+		break;
+	case '1':
+		entry->hardlink = true;
+		type = S_IFREG;
+		break;
+	case '2':
+		type = S_IFLNK;
+		break;
+	case '3':
+		type = S_IFCHR;
+		break;
+	case '4':
+		type = S_IFBLK;
+		break;
+	case '5':
+	/* GNU dumpdir, the data lists the directory contents */
+	case 'D':
+		type = S_IFDIR;
+		break;
+	case '6':
+		type = S_IFIFO;
+		break;
+	default:
+		warning("unknown tar entry type '%c' for %s, adding as regular file",
+			hdr->typeflag, name);
+		type = S_IFREG;
+		break;
+	}
+
+	ret = archive_set_path(ar, name);
+	if (ret < 0)
+		return ret;
+
+	if (pax->link)
+		link = pax->link;
+	else if (ar->long_link)
+		link = ar->long_link;
+	else
+		link = NULL;
+	if (link)
+		ret = archive_set_link(ar, link, strlen(link));
+	else
+		ret = archive_set_link(ar, hdr->linkname,
+				strnlen(hdr->linkname, sizeof(hdr->linkname)));
+	if (ret < 0)
+		return ret;
+	if (entry->hardlink) {
+		char target[PATH_MAX];
+
+		ret = normalize_path(ar->link_target, target, sizeof(target));
+		if (ret < 0) {
+			error("invalid hard link target for %s: %s", ar->path,
+			      ar->link_target);
+			return ret;
+		}
+		strcpy(ar->link_target, target);
+	}
+
+	if (pax->has_uid)
+		uid = pax->uid;
+	if (pax->has_gid)
+		gid = pax->gid;
+	if (pax->has_mtime)
+		mtime = pax->mtime;
+	if (pax->has_atime)
+		atime = pax->atime;
+	else if (!atime)
+		atime = mtime;
+	if (pax->has_ctime)
+		ctime = pax->ctime;
+	else if (!ctime)
+		ctime = mtime;
+	if (pax->has_devmajor)
+		devmajor = pax->devmajor;
+	if (pax->has_devminor)
+		devminor = pax->devminor;
+
+	memset(st, 0, sizeof(*st));
+	st->st_mode = type | (mode & 07777);
+	st->st_uid = uid;
+	st->st_gid = gid;
+	st->st_nlink = 1;
+	st->st_mtime = mtime;
+	st->st_atime = atime;
+	st->st_ctime = ctime;
+	if (S_ISCHR(type) || S_ISBLK(type))
+		st->st_rdev = makedev(devmajor, devminor);
+	if (S_ISREG(type) && !entry->hardlink)
+		st->st_size = size;
+	else if (S_ISLNK(type))
+		st->st_size = strlen(ar->link_target);
+
+	/* Only data of regular files is passed on, the rest is skipped */
+	ar->data_left = size;
+	ar->data_pad = round_up(size, TAR_BLOCK_SIZE) - size;
+	return 0;
+}
+
+static int tar_next(struct mkfs_archive *ar)
+{
+	struct tar_header hdr;
+	char *data;
+	u64 size;
+	ssize_t avail;
+	int ret;
+
+	while (true) {
+		avail = archive_fill(ar, TAR_BLOCK_SIZE);
+		if (avail < 0)
+			return avail;
+		/* Tolerate a missing end of archive marker */
+		if (avail == 0)
+			return 1;
+		if (avail < TAR_BLOCK_SIZE)
+			return archive_truncated(ar);
+		if (tar_block_is_zero(ar->buf + ar->pos)) {
+			archive_consume(ar, TAR_BLOCK_SIZE);
+			return 1;
+		}
+		memcpy(&hdr, ar->buf + ar->pos, TAR_BLOCK_SIZE);
+		if (!tar_checksum_ok(&hdr)) {
+			error("invalid tar header checksum at offset %llu",
+			      ar->offset);
+			return -EINVAL;
+		}
+		archive_consume(ar, TAR_BLOCK_SIZE);
+
+		if (parse_tar_number(hdr.size, sizeof(hdr.size), &size)) {
+			error("invalid tar entry size at offset %llu",
+			      ar->offset - TAR_BLOCK_SIZE);
+			return -EINVAL;
+		}
+
+		switch (hdr.typeflag) {
+		case 'L':
+			free(ar->long_name);
+			ar->long_name = NULL;
+			ret = tar_read_ext(ar, size, &ar->long_name);
+			if (ret < 0)
+				return ret;
+			continue;
+		case 'K':
+			free(ar->long_link);
+			ar->long_link = NULL;
+			ret = tar_read_ext(ar, size, &ar->long_link);
+			if (ret < 0)
+				return ret;
+			continue;
+		case 'x':
+			ret = tar_read_ext(ar, size, &data);
+			if (ret < 0)
+				return ret;
+			ret = tar_parse_pax(ar, data, size);
+			free(data);
+			if (ret < 0)
+				return ret;
+			continue;
+		/*
+		 * Global pax headers are only written with comments in
+		 * practice (e.g. by git archive), volume labels carry no
+		 * file.
+		 */
+		case 'g':
+		case 'V':
+			ret = archive_skip(ar, round_up(size, TAR_BLOCK_SIZE));
+			if (ret < 0)
+				return ret;
+			continue;
+		case 'S':
+		case 'M':
+			error("GNU sparse and multi-volume tar archives are not supported");
+			return -EOPNOTSUPP;
+		}
+
+		if (ar->pax.has_size)
+			size = ar->pax.size;
+		ret = tar_fill_entry(ar, &hdr, size);
+		tar_reset_ext(ar);
+		return ret;
+	}
+}
+
+static int cpio_fill_entry(struct mkfs_archive *ar, u64 mode, u64 uid, u64 gid,
+			   u64 nlink, u64 mtime, u64 size, u64 namesize,
+			   u32 name_pad)
+{
+	struct mkfs_archive_entry *entry = &ar->entry;
+	struct stat *st = &entry->st;
+	char name[PATH_MAX];
+	int ret;
+
+	if (namesize == 0 || namesize > PATH_MAX) {
+		error("invalid cpio name size at offset %llu: %llu", ar->offset,
+		      namesize);
+		return -EINVAL;
+	}
+	ret = archive_read(ar, name, namesize);
+	if (ret < 0)
+		return ret;
+	ret = archive_skip(ar, name_pad);
+	if (ret < 0)
+		return ret;
+	if (name[namesize - 1] != 0) {
+		error("cpio member name not terminated at offset %llu",
+		      ar->offset);
+		return -EINVAL;
+	}
+	if (strcmp(name, CPIO_TRAILER) == 0)
+		return 1;
+
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+	case S_IFDIR:
+	case S_IFLNK:
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		break;
+	default:
+		error("invalid file type in cpio archive for %s: 0%llo", name,
+		      mode);
+		return -EINVAL;
+	}
+
+	ret = archive_set_path(ar, name);
+	if (ret < 0)
+		return ret;
+
+	memset(st, 0, sizeof(*st));
+	st->st_mode = mode;
+	st->st_uid = uid;
+	st->st_gid = gid;
+	st->st_nlink = nlink;
+	st->st_mtime = mtime;
+	st->st_atime = mtime;
+	st->st_ctime = mtime;
+	entry->hardlink = false;
+	ar->link_target[0] = 0;
+
+	if (S_ISLNK(mode)) {
+		char target[PATH_MAX];
+
+		if (size >= PATH_MAX) {
+			error("symlink target too long for %s", ar->path);
+			return -ENAMETOOLONG;
+		}
+		ret = archive_read(ar, target, size);
+		if (ret < 0)
+			return ret;
+		ret = archive_set_link(ar, target, size);
+		if (ret < 0)
+			return ret;
+		st->st_size = size;
+		ar->data_left = 0;
+		return 0;
+	}
+	if (S_ISREG(mode))
+		st->st_size = size;
+	ar->data_left = size;
+	return 0;
+}
+
+static int cpio_newc_next(struct mkfs_archive *ar)
+{
+	char hdr[CPIO_NEWC_HDR_SIZE];
+	/*
+	 * ino, mode, uid, gid, nlink, mtime, filesize, devmajor, devminor,
+	 * rdevmajor, rdevminor, namesize, check
+	 */
+	u64 val[13];
+	u32 name_pad;
+	int ret;
+
+	ret = archive_read(ar, hdr, sizeof(hdr));
+	if (ret < 0)
+		return ret;
+	if (memcmp(hdr, "070701", 6) != 0 && memcmp(hdr, "070702", 6) != 0) {
+		error("invalid cpio header magic at offset %llu",
+		      ar->offset - sizeof(hdr));
+		return -EINVAL;
+	}
+	for (int i = 0; i < ARRAY_SIZE(val); i++) {
+		if (parse_cpio_number(hdr + 6 + i * 8, 8, 16, &val[i])) {
+			error("invalid cpio header at offset %llu",
+			      ar->offset - sizeof(hdr));
+			return -EINVAL;
+		}
+	}
+	/* The name and the data are padded to 4 bytes */
+	name_pad = round_up(CPIO_NEWC_HDR_SIZE + val[11], 4) -
+		   (CPIO_NEWC_HDR_SIZE + val[11]);
+	ret = cpio_fill_entry(ar, val[1], val[2], val[3], val[4], val[5],
+			      val[6], val[11], name_pad);
+	if (ret)
+		return ret;
+	ar->entry.st.st_ino = val[0];
+	ar->entry.st.st_dev = makedev(val[7], val[8]);
+	ar->entry.st.st_rdev = makedev(val[9], val[10]);
+	ar->data_pad = round_up(val[6], 4) - val[6];
+	return 0;
+}
+
+static int cpio_odc_next(struct mkfs_archive *ar)
+{
+	static const int widths[] = { 6, 6, 6, 6, 6, 6, 6, 11, 6, 11 };
+	char hdr[CPIO_ODC_HDR_SIZE];
+	/* dev, ino, mode, uid, gid, nlink, rdev, mtime, namesize, filesize */
+	u64 val[ARRAY_SIZE(widths)];
+	const char *field = hdr + 6;
+	int ret;
+
+	ret = archive_read(ar, hdr, sizeof(hdr));
+	if (ret < 0)
+		return ret;
+	if (memcmp(hdr, "070707", 6) != 0) {
+		error("invalid cpio header magic at offset %llu",
+		      ar->offset - sizeof(hdr));
+		return -EINVAL;
+	}
+	for (int i = 0; i < ARRAY_SIZE(widths); i++) {
+		if (parse_cpio_number(field, widths[i], 8, &val[i])) {
+			error("invalid cpio header at offset %llu",
+			      ar->offset - sizeof(hdr));
+			return -EINVAL;
+		}
+		field += widths[i];
+	}
+	ret = cpio_fill_entry(ar, val[2], val[3], val[4], val[5], val[7],
+			      val[9], val[8], 0);
+	if (ret)
+		return ret;
+	ar->entry.st.st_dev = val[0];
+	ar->entry.st.st_ino = val[1];
+	/* The old 16 bit encoding of device numbers */
+	ar->entry.st.st_rdev = makedev((val[6] >> 8) & 0xff, val[6] & 0xff);
+	ar->data_pad = 0;
+	return 0;
+}
+
+struct mkfs_archive *mkfs_archive_open(const char *filename)
+{
+	struct mkfs_archive *ar;
+	struct stat st;
+	ssize_t avail;
+	const u8 *magic;
+
+	ar = calloc(1, sizeof(*ar));
+	if (!ar) {
+		error_mem(NULL);
+		return NULL;
+	}
+	ar->filename = filename;
+	ar->buf = malloc(ARCHIVE_BUF_SIZE);
+	if (!ar->buf) {
+		error_mem(NULL);
+		goto fail;
+	}
+	ar->entry.path = ar->path;
+	ar->entry.link_target = ar->link_target;
+
+	if (strcmp(filename, "-") == 0) {
+		ar->fd = STDIN_FILENO;
+		ar->filename = "<stdin>";
+	} else {
+		ar->fd = open(filename, O_RDONLY);
+		if (ar->fd < 0) {
+			error("cannot open archive %s: %m", filename);
+			goto fail;
+		}
+	}
+	if (fstat(ar->fd, &st) < 0) {
+		error("cannot stat archive %s: %m", ar->filename);
+		goto fail;
+	}
+	ar->seekable = S_ISREG(st.st_mode);
+
+	avail = archive_fill(ar, TAR_BLOCK_SIZE);
+	if (avail < 0)
+		goto fail;
+	magic = (const u8 *)ar->buf;
+	if (avail >= CPIO_NEWC_HDR_SIZE &&
+	    (memcmp(magic, "070701", 6) == 0 || memcmp(magic, "070702", 6) == 0)) {
+		ar->format = ARCHIVE_CPIO_NEWC;
+	} else if (avail >= CPIO_ODC_HDR_SIZE && memcmp(magic, "070707", 6) == 0) {
+		ar->format = ARCHIVE_CPIO_ODC;
+	} else if (avail >= TAR_BLOCK_SIZE &&
+		   (memcmp(magic + offsetof(struct tar_header, magic), "ustar", 5) == 0 ||
+		    tar_checksum_ok((const struct tar_header *)magic) ||
+		    tar_block_is_zero(ar->buf))) {
+		ar->format = ARCHIVE_TAR;
+	} else if (avail >= 6 &&
+		   ((magic[0] == 0x1f && magic[1] == 0x8b) ||
+		    memcmp(magic, "BZh", 3) == 0 ||
+		    memcmp(magic, "\xfd" "7zXZ", 5) == 0 ||
+		    memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)) {
+		error("archive %s is compressed, decompress it to the standard input instead",
+		      ar->filename);
+		goto fail;
+	} else {
+		error("unknown archive format of %s, supported are tar and cpio (newc, odc)",
+		      ar->filename);
+		goto fail;
+	}
+	return ar;
+
+fail:
+	mkfs_archive_close(ar);
+	return NULL;
+}
+
+void mkfs_archive_close(struct mkfs_archive *ar)
+{
+	if (!ar)
+		return;
+	if (ar->fd > STDIN_FILENO)
+		close(ar->fd);
+	archive_free_xattrs(ar);
+	free(ar->entry.xattrs);
+	tar_reset_ext(ar);
+	free(ar->buf);
+	free(ar);
+}
+
+const char *mkfs_archive_format(const struct mkfs_archive *ar)
+{
+	switch (ar->format) {
+	case ARCHIVE_TAR:
+		return "tar";
+	case ARCHIVE_CPIO_NEWC:
+		return "cpio (newc)";
+	case ARCHIVE_CPIO_ODC:
+		return "cpio (odc)";
+	}
+	return "unknown";
+}
+
+/*
+ * Advance to the next member of the archive, skipping data of the previous one
+ * that has not been read.
+ *
+ * Return 0 and the entry in @entry_ret, 1 at the end of the archive or
+ * negative errno.
+ */
+int mkfs_archive_next(struct mkfs_archive *ar,
+		      struct mkfs_archive_entry **entry_ret)
+{
+	int ret = -EINVAL;
+
+	archive_free_xattrs(ar);
+	ret = archive_skip(ar, ar->data_left + ar->data_pad);
+	if (ret < 0)
+		return ret;
+	ar->data_left = 0;
+	ar->data_pad = 0;
+
+	switch (ar->format) {
+	case ARCHIVE_TAR:
+		ret = tar_next(ar);
+		break;
+	case ARCHIVE_CPIO_NEWC:
+		ret = cpio_newc_next(ar);
+		break;
+	case ARCHIVE_CPIO_ODC:
+		ret = cpio_odc_next(ar);
+		break;
+	}
+	if (ret == 0)
+		*entry_ret = &ar->entry;
+	return ret;
+}
+
+/* Read exactly @len bytes of the data of a regular file entry */
+int mkfs_archive_read_data(struct mkfs_archive *ar, void *buf, size_t len)
+{
+	int ret;
+
+	if (len > ar->data_left) {
+		error("read beyond the end of %s in the archive", ar->path);
+		return -EINVAL;
+	}
+	ret = archive_read(ar, buf, len);
+	if (ret < 0)
+		return ret;
+	ar->data_left -= len;
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Sequential reader of tar and cpio archives for mkfs --rootdir-archive
+ */
+
+#ifndef __BTRFS_MKFS_ARCHIVE_H__
+#define __BTRFS_MKFS_ARCHIVE_H__
+
+#include "kerncompat.h"
+#include <sys/stat.h>
+#include <stdbool.h>
+
+struct mkfs_archive;
+
+struct mkfs_archive_xattr {
+	char *name;
+	char *value;
+	size_t size;
+};
+
+/*
+ * One member of the archive, valid until the next call to
+ * mkfs_archive_next().
+ */
+struct mkfs_archive_entry {
+	/*
+	 * Path relative to the archive root, without leading "/" or "./" and
+	 * without the trailing slash. Empty for the root directory itself.
+	 */
+	char *path;
+	/* Target of a symbolic link, or the link source of a tar hard link. */
+	char *link_target;
+	/*
+	 * The entry is a tar hard link to @link_target. Cpio hard links are
+	 * reported as regular entries sharing st_dev and st_ino instead.
+	 */
+	bool hardlink;
+	/*
+	 * Only st_mode, st_uid, st_gid, st_size, st_rdev, the timestamps and,
+	 * for cpio, st_dev, st_ino and st_nlink are filled.
+	 */
+	struct stat st;
+	struct mkfs_archive_xattr *xattrs;
+	int nr_xattrs;
+};
+
+struct mkfs_archive *mkfs_archive_open(const char *filename);
+void mkfs_archive_close(struct mkfs_archive *archive);
+const char *mkfs_archive_format(const struct mkfs_archive *archive);
+int mkfs_archive_next(struct mkfs_archive *archive,
+		      struct mkfs_archive_entry **entry_ret);
+int mkfs_archive_read_data(struct mkfs_archive *archive, void *buf, size_t len);
+
+#endif
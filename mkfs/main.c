@@ -60,6 +60,7 @@
 #include "common/string-utils.h"
 #include "common/string-table.h"
 #include "common/root-tree-utils.h"
+#include "common/task-utils.h"
 #include "cmds/commands.h"
 #include "check/qgroup-verify.h"
 #include "mkfs/common.h"
@@ -83,9 +84,17 @@ struct prepare_device_progress {
 	char *file;
 	u64 dev_byte_count;
 	u64 byte_count;
+	/* Shared by all devices */
+	struct device_discard_progress *discard;
 	int ret;
 };
 
+struct discard_report {
+	struct task_info *info;
+	struct device_discard_progress *progress;
+	bool printed;
+};
+
 static int create_metadata_block_groups(struct btrfs_root *root, u64 incompat_flags,
 					struct mkfs_allocation *allocation,
 					u64 metadata_profile)
@@ -470,6 +479,7 @@ static const char * const mkfs_usage[] = {
 	"Creation:",
 	OPTLINE("-b|--byte-count SIZE", "set size of each device to SIZE (filesystem size is sum of all device sizes)"),
 	OPTLINE("-r|--rootdir DIR", "copy files from DIR to the image root directory, can be combined with --subvol"),
+	OPTLINE("--rootdir-archive FILE", "copy files from a tar or cpio archive FILE to the image root directory, '-' reads it from stdin"),
 	OPTLINE("--compress ALGO[:LEVEL]", "compress files by algorithm and level, ALGO can be 'no' (default), zstd, lzo, zlib"),
 	OPTLINE("", "Built-in:"),
 #if COMPRESSION_ZSTD
@@ -494,7 +504,8 @@ static const char * const mkfs_usage[] = {
 	OPTLINE("", "- nodatacow - disable data CoW, implies nodatasum for regular files"),
 	OPTLINE("", "- nodatasum - disable data checksum only"),
 	OPTLINE("--reflink", "(with --rootdir) write file data by cloning ranges"),
-	OPTLINE("--shrink", "(with --rootdir) shrink the filled filesystem to minimal size"),
+	OPTLINE("--dedup[=LIMIT]", "(with --rootdir or --rootdir-archive) share identical data extents, LIMIT is the memory used by the index (default: 64M)"),
+	OPTLINE("--shrink", "(with --rootdir or --rootdir-archive) shrink the filled filesystem to minimal size"),
 	OPTLINE("-K|--nodiscard", "do not perform whole device TRIM"),
 	OPTLINE("-f|--force", "force overwrite of existing filesystem"),
 	"",
@@ -515,26 +526,14 @@ static const struct cmd_struct mkfs_cmd = {
 
 static int zero_output_file(int out_fd, u64 size)
 {
-	int loop_num;
-	u64 location = 0;
-	char buf[SZ_4K];
-	int ret = 0, i;
-	ssize_t written;
+	const char zero = 0;
+	int ret;
 
-	memset(buf, 0, SZ_4K);
-
-	/* Only zero out the first 1M */
-	loop_num = SZ_1M / SZ_4K;
-	for (i = 0; i < loop_num; i++) {
-		written = pwrite(out_fd, buf, SZ_4K, location);
-		if (written != SZ_4K)
-			ret = -EIO;
-		location += SZ_4K;
-	}
+	/* Only zero out the first 1M, in one write */
+	ret = device_zero_blocks(out_fd, 0, SZ_1M, false);
 
 	/* Then enlarge the file to size */
-	written = pwrite(out_fd, buf, 1, size - 1);
-	if (written < 1)
+	if (pwrite(out_fd, &zero, 1, size - 1) < 1)
 		ret = -EIO;
 	return ret;
 }
@@ -1160,10 +1159,49 @@ static void *prepare_one_device(void *ctx)
 				(bconf.verbose ? PREP_DEVICE_VERBOSE : 0) |
 				(opt_zero_end ? PREP_DEVICE_ZERO_END : 0) |
 				(opt_discard ? PREP_DEVICE_DISCARD : 0) |
-				(opt_zoned ? PREP_DEVICE_ZONED : 0));
+				(opt_zoned ? PREP_DEVICE_ZONED : 0),
+				prepare_ctx->discard);
 	return NULL;
 }
 
+/* Thread callback printing the discard progress of all devices */
+static void *print_discard_progress(void *p)
+{
+	struct discard_report *report = p;
+
+	task_period_start(report->info, 1000 /* 1s */);
+	while (1) {
+		u64 total;
+		u64 done;
+
+		pthread_mutex_lock(&report->progress->mutex);
+		total = report->progress->total;
+		done = report->progress->done;
+		pthread_mutex_unlock(&report->progress->mutex);
+		if (total) {
+			printf("Discarding devices: %3llu%% (%s of %s)\r",
+			       done * 100 / total, pretty_size(done),
+			       pretty_size(total));
+			fflush(stdout);
+			report->printed = true;
+		}
+		task_period_wait(report->info);
+	}
+
+	return NULL;
+}
+
+static int after_discard_progress(void *p)
+{
+	struct discard_report *report = p;
+
+	if (report->printed) {
+		printf("\n");
+		fflush(stdout);
+	}
+	return 0;
+}
+
 static int parse_compression(const char *str, enum btrfs_compression_type *type,
 			     unsigned int *level)
 {
@@ -1515,6 +1553,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	int i;
 	bool ssd = false;
 	bool shrink_rootdir = false, do_reflink = false;
+	u64 dedup_limit = 0;
 	u64 source_dir_size = 0;
 	u64 min_dev_size;
 	u64 shrink_size;
@@ -1522,6 +1561,10 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	int saved_optind;
 	pthread_t *t_prepare = NULL;
 	struct prepare_device_progress *prepare_ctx = NULL;
+	struct device_discard_progress discard_progress = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct discard_report discard_report = { 0 };
 	struct mkfs_allocation allocation = { 0 };
 	struct btrfs_mkfs_config mkfs_cfg;
 	/* Options */
@@ -1544,6 +1587,8 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	char *label = NULL;
 	int nr_global_roots = sysconf(_SC_NPROCESSORS_ONLN);
 	char *source_dir = NULL;
+	char *source_archive = NULL;
+	bool has_rootdir;
 	struct rootdir_subvol *rds;
 	struct rootdir_inode_flags_entry *rif;
 	bool has_default_subvol = false;
@@ -1567,6 +1612,8 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			GETOPT_VAL_INODE_FLAGS,
 			GETOPT_VAL_COMPRESS,
 			GETOPT_VAL_REFLINK,
+			GETOPT_VAL_ROOTDIR_ARCHIVE,
+			GETOPT_VAL_DEDUP,
 		};
 		static const struct option long_options[] = {
 			{ "byte-count", required_argument, NULL, 'b' },
@@ -1597,6 +1644,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			{ "compress", required_argument, NULL,
 				GETOPT_VAL_COMPRESS },
 			{ "reflink", no_argument, NULL, GETOPT_VAL_REFLINK },
+			{ "dedup", optional_argument, NULL, GETOPT_VAL_DEDUP },
+			{ "rootdir-archive", required_argument, NULL,
+				GETOPT_VAL_ROOTDIR_ARCHIVE },
 #if EXPERIMENTAL
 			{ "param", required_argument, NULL, GETOPT_VAL_PARAM },
 			{ "num-global-roots", required_argument, NULL, GETOPT_VAL_GLOBAL_ROOTS },
@@ -1749,6 +1799,23 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			case GETOPT_VAL_REFLINK:
 				do_reflink = true;
 				break;
+			case GETOPT_VAL_DEDUP:
+				if (optarg) {
+					dedup_limit = arg_strtou64_with_suffix(optarg);
+					if (dedup_limit == 0) {
+						error("invalid deduplication index limit: %s",
+						      optarg);
+						ret = 1;
+						goto error;
+					}
+				} else {
+					dedup_limit = DEDUP_DEFAULT_LIMIT;
+				}
+				break;
+			case GETOPT_VAL_ROOTDIR_ARCHIVE:
+				free(source_archive);
+				source_archive = strdup(optarg);
+				break;
 			case GETOPT_VAL_HELP:
 			default:
 				usage(&mkfs_cmd, c != GETOPT_VAL_HELP);
@@ -1776,13 +1843,19 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 
 	opt_zoned = !!(features.incompat_flags & BTRFS_FEATURE_INCOMPAT_ZONED);
 
-	if (source_dir && device_count > 1) {
+	has_rootdir = source_dir || source_archive;
+	if (source_dir && source_archive) {
+		error("the options --rootdir and --rootdir-archive are mutually exclusive");
+		ret = 1;
+		goto error;
+	}
+	if (has_rootdir && device_count > 1) {
 		error("the option -r is limited to a single device");
 		ret = 1;
 		goto error;
 	}
-	if (shrink_rootdir && source_dir == NULL) {
-		error("the option --shrink must be used with --rootdir");
+	if (shrink_rootdir && !has_rootdir) {
+		error("the option --shrink must be used with --rootdir or --rootdir-archive");
 		ret = 1;
 		goto error;
 	}
@@ -1791,6 +1864,11 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		ret = 1;
 		goto error;
 	}
+	if (dedup_limit && !has_rootdir) {
+		error("the option --dedup must be used with --rootdir or --rootdir-archive");
+		ret = 1;
+		goto error;
+	}
 	if (!list_empty(&subvols) && source_dir == NULL) {
 		error("option --subvol must be used with --rootdir");
 		ret = 1;
@@ -1813,9 +1891,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 
 		free(source_dir);
 		source_dir = canonical;
-	} else {
+	} else if (!source_archive) {
 		if (compression != BTRFS_COMPRESS_NONE) {
-			error("--compression must be used with --rootdir");
+			error("--compression must be used with --rootdir or --rootdir-archive");
 			ret = 1;
 			goto error;
 		}
@@ -1865,7 +1943,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	for (i = 0; i < device_count; i++) {
 		file = argv[optind++];
 
-		if (source_dir && path_exists(file) == 0)
+		if (has_rootdir && path_exists(file) == 0)
 			ret = 0;
 		else if (path_is_block_device(file) == 1)
 			ret = test_dev_for_mkfs(file, force_overwrite);
@@ -1995,7 +2073,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	if (opt_zoned) {
 		const int blkid_version =  blkid_get_library_version(NULL, NULL);
 
-		if (source_dir) {
+		if (has_rootdir) {
 			error("the option -r and zoned mode are incompatible");
 			exit(1);
 		}
@@ -2038,7 +2116,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	 *
 	 * This must be done before minimal device size checks.
 	 */
-	if (source_dir) {
+	if (has_rootdir) {
 		int oflags = O_RDWR;
 		struct stat statbuf;
 		int fd;
@@ -2074,8 +2152,32 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			}
 			byte_count = round_down(byte_count, sectorsize);
 		}
-		source_dir_size = btrfs_mkfs_size_dir(source_dir, sectorsize,
-				min_dev_size, metadata_profile, data_profile);
+		if (source_dir) {
+			source_dir_size = btrfs_mkfs_size_dir(source_dir,
+					sectorsize, min_dev_size,
+					metadata_profile, data_profile);
+		} else {
+			ret = btrfs_mkfs_size_archive(source_archive, sectorsize,
+					min_dev_size, metadata_profile,
+					data_profile, &source_dir_size);
+			/*
+			 * The archive from a pipe can be read only once, the
+			 * size has to be known in advance.
+			 */
+			if (ret == -ESPIPE && byte_count) {
+				source_dir_size = byte_count;
+			} else if (ret == -ESPIPE) {
+				error("cannot estimate size of archive %s read from a pipe, please specify the size by --byte-count",
+				      source_archive);
+				close(fd);
+				ret = 1;
+				goto error;
+			} else if (ret < 0) {
+				close(fd);
+				ret = 1;
+				goto error;
+			}
+		}
 		UASSERT(IS_ALIGNED(source_dir_size, sectorsize));
 		if (byte_count < source_dir_size) {
 			if (S_ISREG(statbuf.st_mode)) {
@@ -2179,11 +2281,25 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * Discard of large devices can take long, report the progress if
+	 * anybody is watching.
+	 */
+	if (opt_discard && bconf.verbose && isatty(STDOUT_FILENO)) {
+		discard_report.progress = &discard_progress;
+		discard_report.info = task_init(print_discard_progress,
+						after_discard_progress,
+						&discard_report);
+		if (discard_report.info)
+			task_start(discard_report.info, NULL, NULL);
+	}
+
 	/* Start threads */
 	for (i = 0; i < device_count; i++) {
 		prepare_ctx[i].file = argv[optind + i - 1];
 		prepare_ctx[i].byte_count = byte_count;
 		prepare_ctx[i].dev_byte_count = byte_count;
+		prepare_ctx[i].discard = &discard_progress;
 		ret = pthread_create(&t_prepare[i], NULL, prepare_one_device,
 				     &prepare_ctx[i]);
 		if (ret) {
@@ -2197,6 +2313,11 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	/* Wait for threads */
 	for (i = 0; i < device_count; i++)
 		pthread_join(t_prepare[i], NULL);
+	if (discard_report.info) {
+		task_stop(discard_report.info);
+		task_deinit(discard_report.info);
+		discard_report.info = NULL;
+	}
 	ret = prepare_ctx[0].ret;
 
 	if (ret) {
@@ -2431,8 +2552,13 @@ raid_groups:
 		goto out;
 	}
 
-	if (source_dir) {
-		pr_verbose(LOG_DEFAULT, "Rootdir from:       %s\n", source_dir);
+	if (has_rootdir) {
+		if (source_dir)
+			pr_verbose(LOG_DEFAULT, "Rootdir from:       %s\n",
+				   source_dir);
+		else
+			pr_verbose(LOG_DEFAULT, "Rootdir archive:    %s\n",
+				   source_archive);
 
 		trans = btrfs_start_transaction(root, 1);
 		if (IS_ERR(trans)) {
@@ -2450,6 +2576,10 @@ raid_groups:
 				   pretty_size_mode(compression_level, UNITS_RAW) :
 				   "");
 
+		if (dedup_limit)
+			pr_verbose(LOG_DEFAULT, "  Dedup:            yes (index limit %s)\n",
+				   pretty_size(dedup_limit));
+
 		/* Print subvolumes now as btrfs_mkfs_fill_dir() deletes the list. */
 		list_for_each_entry(rds, &subvols, list) {
 			pr_verbose(LOG_DEFAULT, "  Subvolume (%s%s):  %s%s\n",
@@ -2464,10 +2594,16 @@ raid_groups:
 				   rif->inode_path);
 		}
 
-		ret = btrfs_mkfs_fill_dir(trans, source_dir, root,
-					  &subvols, &inode_flags_list,
-					  compression, compression_level,
-					  do_reflink);
+		if (source_dir)
+			ret = btrfs_mkfs_fill_dir(trans, source_dir, root,
+						  &subvols, &inode_flags_list,
+						  compression, compression_level,
+						  do_reflink, dedup_limit);
+		else
+			ret = btrfs_mkfs_fill_archive(trans, source_archive,
+						      root, compression,
+						      compression_level,
+						      dedup_limit);
 		if (ret) {
 			errno = -ret;
 			error("error while filling filesystem: %m");
@@ -2615,6 +2751,10 @@ out:
 	btrfs_close_all_devices();
 
 error:
+	if (discard_report.info) {
+		task_stop(discard_report.info);
+		task_deinit(discard_report.info);
+	}
 	if (prepare_ctx) {
 		for (i = 0; i < device_count; i++)
 			close(prepare_ctx[i].fd);
@@ -2623,6 +2763,7 @@ error:
 	free(prepare_ctx);
 	free(label);
 	free(source_dir);
+	free(source_archive);
 
 	while (!list_empty(&subvols)) {
 		struct rootdir_subvol *head;
@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/xattr.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -28,6 +29,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #if COMPRESSION_ZSTD
 #include <zstd.h>
 #include <zstd_errors.h>
@@ -46,14 +48,18 @@
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/file-item.h"
 #include "kernel-shared/free-space-tree.h"
+#include "crypto/hash.h"
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/utils.h"
+#include "common/units.h"
 #include "common/extent-tree-utils.h"
+#include "common/bulk-load.h"
 #include "common/root-tree-utils.h"
 #include "common/path-utils.h"
 #include "common/rbtree-utils.h"
 #include "mkfs/rootdir.h"
+#include "mkfs/archive.h"
 
 #define LZO_LEN 4
 
@@ -160,6 +166,27 @@ static u64 default_subvol_id;
 static enum btrfs_compression_type g_compression;
 static u64 g_compression_level;
 static bool g_do_reflink;
+static u64 g_dedup_limit;
+
+/*
+ * The items of the new inodes linked to one directory, and their directory
+ * entries. The inodes get increasing objectids, so the items are collected in
+ * memory and mostly appended to the end of the subvolume tree at once, see
+ * link_new_inode() and flush_new_inodes().
+ */
+#define NEW_INODES_MAX_SIZE	(SZ_8M)
+
+static struct {
+	struct btrfs_root *root;
+	/* The parent directory of the new inodes */
+	u64 dir;
+	u64 dir_flags;
+	u64 dir_size;
+	u64 next_index;
+	/* The inode being created, until finish_new_inode() */
+	u64 ino;
+	struct btrfs_bulk_items items;
+} new_inodes;
 
 static inline struct inode_entry *rootdir_path_last(struct rootdir_path *path)
 {
@@ -295,6 +322,148 @@ static void stat_to_inode_item(struct btrfs_inode_item *dst, const struct stat *
 	btrfs_set_stack_timespec_nsec(&dst->otime, 0);
 }
 
+static bool is_new_inode(const struct btrfs_root *root, u64 ino)
+{
+	return root == new_inodes.root && ino && ino == new_inodes.ino;
+}
+
+/*
+ * Add an item of @size bytes to the new inodes, return its zeroed data or NULL
+ * if out of memory.
+ */
+static void *add_new_item(u64 objectid, u8 type, u64 offset, u32 size)
+{
+	struct btrfs_key key = {
+		.objectid = objectid,
+		.type = type,
+		.offset = offset,
+	};
+
+	return btrfs_bulk_items_add(&new_inodes.items, &key, size);
+}
+
+static void *add_new_inode_item(u8 type, u64 offset, u32 size)
+{
+	return add_new_item(new_inodes.ino, type, offset, size);
+}
+
+/*
+ * Insert the collected items of the new inodes, and add the size of their
+ * directory entries to the parent directory.
+ */
+static int flush_new_inodes(struct btrfs_trans_handle *trans)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_inode_item *ii;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	int ret;
+
+	if (!new_inodes.root)
+		return 0;
+
+	UASSERT(!new_inodes.ino);
+	ret = btrfs_bulk_items_insert(trans, new_inodes.root, &new_inodes.items);
+	if (ret < 0)
+		goto out;
+
+	key.objectid = new_inodes.dir;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(trans, new_inodes.root, &key, &path, 0, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret < 0)
+		goto out;
+	leaf = path.nodes[0];
+	ii = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_inode_item);
+	btrfs_set_inode_size(leaf, ii,
+			     btrfs_inode_size(leaf, ii) + new_inodes.dir_size);
+	btrfs_mark_buffer_dirty(leaf);
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	new_inodes.root = NULL;
+	return ret;
+}
+
+static int insert_xattr(struct btrfs_trans_handle *trans,
+			struct btrfs_root *root, u64 ino, const char *name,
+			u16 name_len, const void *value, u16 value_len)
+{
+	struct btrfs_dir_item *di;
+
+	if (!is_new_inode(root, ino))
+		return btrfs_insert_xattr_item(trans, root, name, name_len,
+					       value, value_len, ino);
+
+	di = add_new_inode_item(BTRFS_XATTR_ITEM_KEY,
+				btrfs_name_hash(name, name_len),
+				sizeof(*di) + name_len + value_len);
+	if (!di)
+		return -ENOMEM;
+	btrfs_set_stack_dir_flags(di, BTRFS_FT_XATTR);
+	btrfs_set_stack_dir_name_len(di, name_len);
+	btrfs_set_stack_dir_data_len(di, value_len);
+	memcpy(di + 1, name, name_len);
+	memcpy((char *)(di + 1) + name_len, value, value_len);
+	return 0;
+}
+
+static int insert_inline_extent(struct btrfs_trans_handle *trans,
+				struct btrfs_root *root, u64 ino,
+				const char *buffer, size_t size,
+				enum btrfs_compression_type comp,
+				u64 ram_bytes)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_file_extent_item *fi;
+
+	if (!is_new_inode(root, ino))
+		return btrfs_insert_inline_extent(trans, root, ino, 0, buffer,
+						  size, comp, ram_bytes);
+
+	if (size > max(btrfs_symlink_max_size(fs_info),
+		       btrfs_data_inline_max_size(fs_info)))
+		return -EUCLEAN;
+
+	fi = add_new_inode_item(BTRFS_EXTENT_DATA_KEY, 0,
+				btrfs_file_extent_calc_inline_size(size));
+	if (!fi)
+		return -ENOMEM;
+	btrfs_set_stack_file_extent_generation(fi, trans->transid);
+	btrfs_set_stack_file_extent_type(fi, BTRFS_FILE_EXTENT_INLINE);
+	btrfs_set_stack_file_extent_ram_bytes(fi, ram_bytes);
+	btrfs_set_stack_file_extent_compression(fi, comp);
+	memcpy((char *)fi + BTRFS_FILE_EXTENT_INLINE_DATA_START, buffer, size);
+	return 0;
+}
+
+static int insert_file_extent(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 ino, u64 file_pos,
+			      struct btrfs_file_extent_item *stack_fi)
+{
+	struct btrfs_file_extent_item *fi;
+
+	if (!is_new_inode(root, ino))
+		return btrfs_insert_file_extent(trans, root, ino, file_pos,
+						stack_fi);
+
+	/* Same as btrfs_insert_file_extent() */
+	if (btrfs_stack_file_extent_disk_bytenr(stack_fi) == 0) {
+		if (btrfs_fs_incompat(trans->fs_info, NO_HOLES))
+			return 0;
+		btrfs_set_stack_file_extent_disk_num_bytes(stack_fi, 0);
+	}
+	btrfs_set_stack_file_extent_generation(stack_fi, trans->transid);
+
+	fi = add_new_inode_item(BTRFS_EXTENT_DATA_KEY, file_pos, sizeof(*fi));
+	if (!fi)
+		return -ENOMEM;
+	memcpy(fi, stack_fi, sizeof(*fi));
+	return 0;
+}
+
 static int add_xattr_item(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 objectid,
 			  const char *file_name)
@@ -330,9 +499,8 @@ static int add_xattr_item(struct btrfs_trans_handle *trans,
 			return ret;
 		}
 
-		ret = btrfs_insert_xattr_item(trans, root, cur_name,
-					      cur_name_len, cur_value,
-					      ret, objectid);
+		ret = insert_xattr(trans, root, objectid, cur_name,
+				   cur_name_len, cur_value, ret);
 		if (ret) {
 			errno = -ret;
 			error("inserting a xattr item failed for %s: %m",
@@ -345,38 +513,47 @@ static int add_xattr_item(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+static int insert_symlink_target(struct btrfs_trans_handle *trans,
+				 struct btrfs_root *root,
+				 struct btrfs_inode_item *inode_item,
+				 u64 objectid, const char *target,
+				 const char *path_name)
+{
+	u64 nbytes = strlen(target) + 1;
+	int ret;
+
+	ret = insert_inline_extent(trans, root, objectid, target, nbytes,
+				   BTRFS_COMPRESS_NONE, nbytes);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to insert inline extent for %s: %m", path_name);
+		return ret;
+	}
+	btrfs_set_stack_inode_nbytes(inode_item, nbytes);
+	return ret;
+}
+
 static int add_symbolic_link(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
 			     struct btrfs_inode_item *inode_item,
 			     u64 objectid, const char *path_name)
 {
-	u64 nbytes;
 	int ret;
 	char buf[PATH_MAX];
 
 	ret = readlink(path_name, buf, sizeof(buf));
 	if (ret <= 0) {
 		error("readlink failed for %s: %m", path_name);
-		goto fail;
+		return ret;
 	}
 	if (ret >= sizeof(buf)) {
 		error("symlink too long for %s", path_name);
-		ret = -1;
-		goto fail;
+		return -1;
 	}
 
 	buf[ret] = '\0'; /* readlink does not do it for us */
-	nbytes = ret + 1;
-	ret = btrfs_insert_inline_extent(trans, root, objectid, 0, buf, nbytes,
-					 BTRFS_COMPRESS_NONE, nbytes);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to insert inline extent for %s: %m", path_name);
-		goto fail;
-	}
-	btrfs_set_stack_inode_nbytes(inode_item, nbytes);
-fail:
-	return ret;
+	return insert_symlink_target(trans, root, inode_item, objectid, buf,
+				     path_name);
 }
 
 static int insert_reserved_file_extent(struct btrfs_trans_handle *trans,
@@ -411,8 +588,7 @@ static int insert_reserved_file_extent(struct btrfs_trans_handle *trans,
 	 * hole.  And hole extent has no size limit, no need to loop.
 	 */
 	if (disk_bytenr == 0)
-		return btrfs_insert_file_extent(trans, root, ino,
-					       file_pos, stack_fi);
+		return insert_file_extent(trans, root, ino, file_pos, stack_fi);
 
 	path = btrfs_alloc_path();
 	if (!path)
@@ -451,7 +627,7 @@ static int insert_reserved_file_extent(struct btrfs_trans_handle *trans,
 
 	btrfs_run_delayed_refs(trans, -1);
 
-	ret = btrfs_insert_file_extent(trans, root, ino, file_pos, stack_fi);
+	ret = insert_file_extent(trans, root, ino, file_pos, stack_fi);
 	if (ret)
 		goto fail;
 	btrfs_set_stack_inode_nbytes(inode,
@@ -697,13 +873,295 @@ out:
 
 struct source_descriptor {
 	int fd;
+	/* Sequential data source instead of @fd, --rootdir-archive */
+	struct mkfs_archive *archive;
 	char *buf;
 	u64 size;
 	const char *path_name;
 	char *comp_buf;
 	char *wrkmem;
+	/* End of the data range at the current position, holes are skipped */
+	u64 data_end;
+	/* End of the last file extent, for hole extents without NO_HOLES */
+	u64 extent_end;
+};
+
+static int read_source(const struct source_descriptor *source, char *buf,
+		       u64 len, u64 file_pos)
+{
+	u64 bytes_read = 0;
+
+	/* Archive data is always consumed in file order. */
+	if (source->archive)
+		return mkfs_archive_read_data(source->archive, buf, len);
+
+	while (bytes_read < len) {
+		ssize_t ret_read;
+
+		ret_read = pread(source->fd, buf + bytes_read, len - bytes_read,
+				 file_pos + bytes_read);
+		if (ret_read < 0) {
+			error("cannot read %s at offset %llu length %llu: %m",
+			      source->path_name, file_pos + bytes_read,
+			      len - bytes_read);
+			return -errno;
+		}
+		if (ret_read == 0) {
+			error("unexpected end of %s at offset %llu",
+			      source->path_name, file_pos + bytes_read);
+			return -EIO;
+		}
+		bytes_read += ret_read;
+	}
+	return 0;
+}
+
+/*
+ * Move @file_pos past a hole of a sparse source file to the next data and
+ * set the end of that data range. Returns 1 if there is no more data.
+ */
+static int seek_source_data(struct source_descriptor *source, u32 sectorsize,
+			    u64 *file_pos)
+{
+	off_t data, hole;
+
+	source->data_end = source->size;
+	if (source->archive)
+		return 0;
+
+	data = lseek(source->fd, *file_pos, SEEK_DATA);
+	if (data < 0) {
+		if (errno == ENXIO)
+			return 1;
+		/* Not supported, read everything */
+		if (errno == EINVAL || errno == EOPNOTSUPP)
+			return 0;
+		error("cannot seek data of %s at offset %llu: %m",
+		      source->path_name, *file_pos);
+		return -errno;
+	}
+	hole = lseek(source->fd, data, SEEK_HOLE);
+	if (hole < 0) {
+		error("cannot seek hole of %s at offset %llu: %m",
+		      source->path_name, (u64)data);
+		return -errno;
+	}
+
+	if (data >= source->size)
+		return 1;
+	*file_pos = max_t(u64, *file_pos, round_down(data, sectorsize));
+	source->data_end = min_t(u64, source->size, round_up(hole, sectorsize));
+	return 0;
+}
+
+/* The libc memcmp() is vectorized, compare the buffer with its own start */
+static bool buffer_is_zero(const char *buf, size_t len)
+{
+	const size_t head = min_t(size_t, len, 16);
+
+	for (size_t i = 0; i < head; i++) {
+		if (buf[i])
+			return false;
+	}
+	return len <= head || memcmp(buf, buf + head, len - head) == 0;
+}
+
+/*
+ * Without the NO_HOLES feature a hole extent must fill the range from the end
+ * of the previous extent to @file_pos.
+ */
+static int insert_hole_before(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 objectid,
+			      struct source_descriptor *source, u64 file_pos)
+{
+	struct btrfs_file_extent_item stack_fi = { 0 };
+	int ret;
+
+	if (file_pos <= source->extent_end)
+		return 0;
+
+	btrfs_set_stack_file_extent_type(&stack_fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_num_bytes(&stack_fi,
+					      file_pos - source->extent_end);
+	btrfs_set_stack_file_extent_ram_bytes(&stack_fi,
+					      file_pos - source->extent_end);
+	/* Nothing is inserted with NO_HOLES */
+	ret = insert_file_extent(trans, root, objectid, source->extent_end,
+				 &stack_fi);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to insert hole for %s: %m", source->path_name);
+		return ret;
+	}
+	source->extent_end = file_pos;
+	return 0;
+}
+
+/*
+ * Checksums of the data written so far that are not inserted yet, in runs of
+ * contiguous sectors. Data extents are allocated mostly but not always in
+ * increasing order, so the runs are sorted and merged before the insertion,
+ * see flush_data_csums().
+ */
+#define DATA_CSUMS_MAX_SIZE	(SZ_64M)
+
+struct data_csum_run {
+	u64 bytenr;
+	u32 nr_sectors;
+	u32 nr_alloc;
+	u8 *csums;
 };
 
+static struct {
+	struct data_csum_run *runs;
+	u32 nr;
+	u32 nr_alloc;
+	/* Total size of the checksums */
+	u64 size;
+} data_csums;
+
+static void release_data_csums(void)
+{
+	for (u32 i = 0; i < data_csums.nr; i++)
+		free(data_csums.runs[i].csums);
+	free(data_csums.runs);
+	memset(&data_csums, 0, sizeof(data_csums));
+}
+
+static int data_csum_run_compare(const void *a, const void *b)
+{
+	const struct data_csum_run *run1 = a;
+	const struct data_csum_run *run2 = b;
+
+	if (run1->bytenr < run2->bytenr)
+		return -1;
+	if (run1->bytenr > run2->bytenr)
+		return 1;
+	return 0;
+}
+
+/* Insert all the collected checksums, with the contiguous runs merged. */
+static int flush_data_csums(struct btrfs_trans_handle *trans)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	u32 sectorsize = fs_info->sectorsize;
+	u16 csum_size = fs_info->csum_size;
+	u32 i = 0;
+	int ret = 0;
+
+	qsort(data_csums.runs, data_csums.nr, sizeof(*data_csums.runs),
+	      data_csum_run_compare);
+
+	while (i < data_csums.nr) {
+		struct data_csum_run *first = &data_csums.runs[i];
+		u64 end = first->bytenr + (u64)first->nr_sectors * sectorsize;
+		u32 nr_sectors = first->nr_sectors;
+		u8 *csums = first->csums;
+		u8 *merged = NULL;
+		u32 next;
+
+		for (next = i + 1; next < data_csums.nr; next++) {
+			if (data_csums.runs[next].bytenr != end)
+				break;
+			nr_sectors += data_csums.runs[next].nr_sectors;
+			end += (u64)data_csums.runs[next].nr_sectors * sectorsize;
+		}
+
+		if (next > i + 1) {
+			size_t offset = 0;
+
+			merged = malloc((size_t)nr_sectors * csum_size);
+			if (!merged) {
+				ret = -ENOMEM;
+				break;
+			}
+			for (u32 k = i; k < next; k++) {
+				size_t size = (size_t)data_csums.runs[k].nr_sectors *
+					      csum_size;
+
+				memcpy(merged + offset, data_csums.runs[k].csums,
+				       size);
+				offset += size;
+			}
+			csums = merged;
+		}
+		ret = btrfs_insert_data_csums(trans, first->bytenr,
+					      BTRFS_EXTENT_CSUM_OBJECTID,
+					      fs_info->csum_type, csums,
+					      nr_sectors);
+		free(merged);
+		if (ret < 0)
+			break;
+		i = next;
+	}
+	release_data_csums();
+	return ret;
+}
+
+/*
+ * Add the checksums of the @len bytes of @buf written at @bytenr, extending
+ * the last run if the data follows it on disk.
+ */
+static int insert_data_csums(struct btrfs_trans_handle *trans, u64 bytenr,
+			     const char *buf, u64 len)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	u32 sectorsize = fs_info->sectorsize;
+	u16 csum_size = fs_info->csum_size;
+	u32 nr = len / sectorsize;
+	struct data_csum_run *run = NULL;
+	u8 *csums;
+
+	if (data_csums.nr) {
+		run = &data_csums.runs[data_csums.nr - 1];
+		if (run->bytenr + (u64)run->nr_sectors * sectorsize != bytenr)
+			run = NULL;
+	}
+
+	if (!run) {
+		if (data_csums.nr == data_csums.nr_alloc) {
+			u32 nr_alloc = max(data_csums.nr_alloc * 2, 64U);
+			struct data_csum_run *runs;
+
+			runs = realloc(data_csums.runs, nr_alloc * sizeof(*runs));
+			if (!runs)
+				return -ENOMEM;
+			data_csums.runs = runs;
+			data_csums.nr_alloc = nr_alloc;
+		}
+		run = &data_csums.runs[data_csums.nr++];
+		memset(run, 0, sizeof(*run));
+		run->bytenr = bytenr;
+	}
+
+	if (run->nr_sectors + nr > run->nr_alloc) {
+		u32 nr_alloc = max(run->nr_alloc * 2, run->nr_sectors + nr);
+
+		csums = realloc(run->csums, (size_t)nr_alloc * csum_size);
+		if (!csums)
+			return -ENOMEM;
+		run->csums = csums;
+		run->nr_alloc = nr_alloc;
+	}
+
+	csums = run->csums + (size_t)run->nr_sectors * csum_size;
+	for (u32 i = 0; i < nr; i++) {
+		u8 csum[BTRFS_CSUM_SIZE];
+
+		/* The whole BTRFS_CSUM_SIZE of @csum is written. */
+		btrfs_csum_data(fs_info->csum_type, (const u8 *)buf, csum,
+				sectorsize);
+		memcpy(csums + i * csum_size, csum, csum_size);
+		buf += sectorsize;
+	}
+	run->nr_sectors += nr;
+	data_csums.size += nr * csum_size;
+
+	if (data_csums.size >= DATA_CSUMS_MAX_SIZE)
+		return flush_data_csums(trans);
+	return 0;
+}
+
 static int do_reflink_write(struct btrfs_fs_info *info,
 			    const struct source_descriptor *source, u64 addr,
 			    u64 file_pos, u64 bytes, const void *buf)
@@ -780,51 +1238,256 @@ static int do_reflink_write(struct btrfs_fs_info *info,
 	return 0;
 }
 
-static int add_file_item_extent(struct btrfs_trans_handle *trans,
-				struct btrfs_root *root,
-				struct btrfs_inode_item *btrfs_inode,
-				u64 objectid,
-				const struct source_descriptor *source,
-				u64 file_pos)
+/*
+ * Data extents written so far, indexed by the hash of their uncompressed
+ * content, so the identical extents of other files can reference them
+ * instead of being written again.
+ *
+ * The memory used by the index is limited by @g_dedup_limit, once it is
+ * reached no new extents are recorded but the lookups still work.
+ */
+struct dedup_entry {
+	struct rb_node node;
+	u8 hash[CRYPTO_HASH_SIZE_MAX];
+	/* Unaligned length of the content. */
+	u64 len;
+
+	u64 disk_bytenr;
+	u64 disk_num_bytes;
+	u64 num_bytes;
+	u8 compression;
+};
+
+static struct rb_root dedup_root = RB_ROOT;
+
+static struct {
+	u64 nr_entries;
+	u64 nr_shared;
+	u64 bytes_shared;
+	bool full;
+} dedup_stats;
+
+static int dedup_compare(const u8 *hash1, u64 len1, const u8 *hash2, u64 len2)
 {
 	int ret;
-	u32 sectorsize = root->fs_info->sectorsize;
-	u64 bytes_read, first_block, to_read, to_write;
-	struct btrfs_key key;
-	struct btrfs_file_extent_item stack_fi = { 0 };
-	u64 buf_size;
-	char *write_buf;
-	bool do_comp = g_compression != BTRFS_COMPRESS_NONE;
-	bool datasum = true;
-	ssize_t comp_ret;
-	u64 flags = btrfs_stack_inode_flags(btrfs_inode);
 
-	if (g_do_reflink || flags & BTRFS_INODE_NOCOMPRESS)
-		do_comp = false;
-
-	if ((flags & BTRFS_INODE_NODATACOW) || (flags & BTRFS_INODE_NODATASUM)) {
-		datasum = false;
-		do_comp = false;
-	}
+	ret = memcmp(hash1, hash2, CRYPTO_HASH_SIZE_MAX);
+	if (ret)
+		return ret;
+	if (len1 < len2)
+		return -1;
+	if (len1 > len2)
+		return 1;
+	return 0;
+}
 
-	buf_size = do_comp ? BTRFS_MAX_COMPRESSED : MAX_EXTENT_SIZE;
-	to_read = min(file_pos + buf_size, source->size) - file_pos;
+static int dedup_compare_nodes(const struct rb_node *node1,
+			       const struct rb_node *node2)
+{
+	const struct dedup_entry *entry1;
+	const struct dedup_entry *entry2;
 
-	bytes_read = 0;
+	entry1 = rb_entry(node1, struct dedup_entry, node);
+	entry2 = rb_entry(node2, struct dedup_entry, node);
+	return dedup_compare(entry2->hash, entry2->len, entry1->hash, entry1->len);
+}
 
-	while (bytes_read < to_read) {
-		ssize_t ret_read;
+static int dedup_compare_keys(const struct rb_node *node, const void *key)
+{
+	const struct dedup_entry *entry = rb_entry(node, struct dedup_entry, node);
+	const struct dedup_entry *tmp = key;
 
-		ret_read = pread(source->fd, source->buf + bytes_read,
-				 to_read - bytes_read, file_pos + bytes_read);
-		if (ret_read < 0) {
-			error("cannot read %s at offset %llu length %llu: %m",
-			      source->path_name, file_pos + bytes_read,
-			      to_read - bytes_read);
-			return -errno;
-		}
+	return dedup_compare(tmp->hash, tmp->len, entry->hash, entry->len);
+}
 
-		bytes_read += ret_read;
+static struct dedup_entry *find_dedup_entry(const u8 *hash, u64 len)
+{
+	struct dedup_entry tmp = { .len = len };
+	struct rb_node *node;
+
+	memcpy(tmp.hash, hash, CRYPTO_HASH_SIZE_MAX);
+	node = rb_search(&dedup_root, &tmp, dedup_compare_keys, NULL);
+	if (node)
+		return rb_entry(node, struct dedup_entry, node);
+	return NULL;
+}
+
+static int add_dedup_entry(const u8 *hash, u64 len,
+			   const struct btrfs_file_extent_item *stack_fi)
+{
+	struct dedup_entry *entry;
+
+	if (dedup_stats.full)
+		return 0;
+	if ((dedup_stats.nr_entries + 1) * sizeof(*entry) > g_dedup_limit) {
+		warning("deduplication index is full after %llu extents, new extents will not be deduplicated",
+			dedup_stats.nr_entries);
+		dedup_stats.full = true;
+		return 0;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return -ENOMEM;
+	memcpy(entry->hash, hash, CRYPTO_HASH_SIZE_MAX);
+	entry->len = len;
+	entry->disk_bytenr = btrfs_stack_file_extent_disk_bytenr(stack_fi);
+	entry->disk_num_bytes = btrfs_stack_file_extent_disk_num_bytes(stack_fi);
+	entry->num_bytes = btrfs_stack_file_extent_num_bytes(stack_fi);
+	entry->compression = btrfs_stack_file_extent_compression(stack_fi);
+	if (rb_insert(&dedup_root, &entry->node, dedup_compare_nodes)) {
+		free(entry);
+		return 0;
+	}
+	dedup_stats.nr_entries++;
+	return 0;
+}
+
+static void free_one_dedup_entry(struct rb_node *node)
+{
+	free(rb_entry(node, struct dedup_entry, node));
+}
+
+static void dedup_init(u64 limit)
+{
+	g_dedup_limit = limit;
+	memset(&dedup_stats, 0, sizeof(dedup_stats));
+}
+
+static void dedup_finish(void)
+{
+	if (!g_dedup_limit)
+		return;
+
+	pr_verbose(LOG_DEFAULT, "  Deduplicated:     %llu extents, %s\n",
+		   dedup_stats.nr_shared,
+		   pretty_size(dedup_stats.bytes_shared));
+	pr_verbose(LOG_DEFAULT, "  Dedup index:      %llu extents, %s of %s%s\n",
+		   dedup_stats.nr_entries,
+		   pretty_size(dedup_stats.nr_entries * sizeof(struct dedup_entry)),
+		   pretty_size(g_dedup_limit),
+		   dedup_stats.full ? " (full)" : "");
+	rb_free_nodes(&dedup_root, free_one_dedup_entry);
+	g_dedup_limit = 0;
+}
+
+/*
+ * Reference an extent already written with the same content at @file_pos of
+ * the inode. The extent is already accounted and has checksums.
+ */
+static int insert_dedup_file_extent(struct btrfs_trans_handle *trans,
+				    struct btrfs_root *root, u64 ino,
+				    struct btrfs_inode_item *inode,
+				    u64 file_pos,
+				    const struct dedup_entry *entry)
+{
+	struct btrfs_file_extent_item stack_fi = { 0 };
+	int ret;
+
+	btrfs_set_stack_file_extent_type(&stack_fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_disk_bytenr(&stack_fi, entry->disk_bytenr);
+	btrfs_set_stack_file_extent_disk_num_bytes(&stack_fi, entry->disk_num_bytes);
+	btrfs_set_stack_file_extent_num_bytes(&stack_fi, entry->num_bytes);
+	btrfs_set_stack_file_extent_ram_bytes(&stack_fi, entry->num_bytes);
+	btrfs_set_stack_file_extent_compression(&stack_fi, entry->compression);
+
+	ret = insert_file_extent(trans, root, ino, file_pos, &stack_fi);
+	if (ret)
+		return ret;
+	btrfs_set_stack_inode_nbytes(inode,
+			btrfs_stack_inode_nbytes(inode) + entry->num_bytes);
+
+	ret = btrfs_inc_extent_ref(trans, entry->disk_bytenr,
+				   entry->disk_num_bytes, 0,
+				   root->root_key.objectid, ino, file_pos);
+	if (ret)
+		return ret;
+
+	dedup_stats.nr_shared++;
+	dedup_stats.bytes_shared += entry->disk_num_bytes;
+	return 0;
+}
+
+static int add_file_item_extent(struct btrfs_trans_handle *trans,
+				struct btrfs_root *root,
+				struct btrfs_inode_item *btrfs_inode,
+				u64 objectid,
+				struct source_descriptor *source,
+				u64 file_pos)
+{
+	int ret;
+	u32 sectorsize = root->fs_info->sectorsize;
+	u64 bytes_read, first_block, to_read, to_write;
+	struct btrfs_key key;
+	struct btrfs_file_extent_item stack_fi = { 0 };
+	u64 buf_size;
+	char *data;
+	char *write_buf;
+	bool do_comp = g_compression != BTRFS_COMPRESS_NONE;
+	bool datasum = true;
+	bool do_dedup = g_dedup_limit > 0;
+	u8 hash[CRYPTO_HASH_SIZE_MAX];
+	struct dedup_entry *dedup;
+	ssize_t comp_ret;
+	u64 flags = btrfs_stack_inode_flags(btrfs_inode);
+
+	if (g_do_reflink || flags & BTRFS_INODE_NOCOMPRESS)
+		do_comp = false;
+
+	/* Shared extents would be without checksums or not NOCOW. */
+	if ((flags & BTRFS_INODE_NODATACOW) || (flags & BTRFS_INODE_NODATASUM)) {
+		datasum = false;
+		do_comp = false;
+		do_dedup = false;
+	}
+
+	buf_size = do_comp ? BTRFS_MAX_COMPRESSED : MAX_EXTENT_SIZE;
+	to_read = min(file_pos + buf_size, source->data_end) - file_pos;
+
+	ret = read_source(source, source->buf, to_read, file_pos);
+	if (ret < 0)
+		return ret;
+	bytes_read = to_read;
+
+	/* Zeroed blocks become a hole. */
+	if (buffer_is_zero(source->buf, bytes_read))
+		return to_read;
+
+	/*
+	 * Without compression only the range between the first and last
+	 * sector that are not zero is written, the rest is left as a hole.
+	 * Compressed data can be extended after the first attempt, and zeros
+	 * compress well anyway.
+	 */
+	data = source->buf;
+	if (!do_comp) {
+		u64 end = round_up(bytes_read, sectorsize);
+
+		memset(data + bytes_read, 0, end - bytes_read);
+		while (buffer_is_zero(data, sectorsize))
+			data += sectorsize;
+		while (buffer_is_zero(source->buf + end - sectorsize, sectorsize))
+			end -= sectorsize;
+		file_pos += data - source->buf;
+		bytes_read = min(bytes_read, end) - (data - source->buf);
+	}
+
+	if (do_dedup) {
+		hash_blake2b((const u8 *)data, bytes_read, hash);
+		dedup = find_dedup_entry(hash, bytes_read);
+		if (dedup) {
+			ret = insert_hole_before(trans, root, objectid, source,
+						 file_pos);
+			if (ret < 0)
+				return ret;
+			ret = insert_dedup_file_extent(trans, root, objectid,
+						       btrfs_inode, file_pos,
+						       dedup);
+			if (ret < 0)
+				return ret;
+			source->extent_end = file_pos + dedup->num_bytes;
+			return to_read;
+		}
 	}
 
 	if (bytes_read <= sectorsize)
@@ -836,12 +1499,12 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 		switch (g_compression) {
 		case BTRFS_COMPRESS_ZLIB:
 			comp_ret = zlib_compress_extent(first_sector, sectorsize,
-							source->buf, bytes_read,
+							data, bytes_read,
 							source->comp_buf);
 			break;
 #if COMPRESSION_LZO
 		case BTRFS_COMPRESS_LZO:
-			comp_ret = lzo_compress_extent(sectorsize, source->buf,
+			comp_ret = lzo_compress_extent(sectorsize, data,
 						       bytes_read,
 						       source->comp_buf,
 						       source->wrkmem);
@@ -850,7 +1513,7 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 #if COMPRESSION_ZSTD
 		case BTRFS_COMPRESS_ZSTD:
 			comp_ret = zstd_compress_extent(first_sector, sectorsize,
-							source->buf, bytes_read,
+							data, bytes_read,
 							source->comp_buf);
 			break;
 #endif
@@ -874,24 +1537,34 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 			btrfs_set_stack_inode_flags(btrfs_inode, flags);
 
 			buf_size = MAX_EXTENT_SIZE;
-			to_read = min(file_pos + buf_size, source->size) - file_pos;
-
-			while (bytes_read < to_read) {
-				ssize_t ret_read;
-
-				ret_read = pread(source->fd,
-						 source->buf + bytes_read,
-						 to_read - bytes_read,
-						 file_pos + bytes_read);
-				if (ret_read < 0) {
-					error("cannot read %s at offset %llu length %llu: %m",
-					      source->path_name,
-					      file_pos + bytes_read,
-					      to_read - bytes_read);
-					return -errno;
-				}
+			to_read = min(file_pos + buf_size, source->data_end) - file_pos;
 
-				bytes_read += ret_read;
+			ret = read_source(source, source->buf + bytes_read,
+					  to_read - bytes_read,
+					  file_pos + bytes_read);
+			if (ret < 0)
+				return ret;
+			bytes_read = to_read;
+
+			if (do_dedup) {
+				hash_blake2b((const u8 *)data, bytes_read, hash);
+				dedup = find_dedup_entry(hash, bytes_read);
+				if (dedup) {
+					ret = insert_hole_before(trans, root,
+							objectid, source,
+							file_pos);
+					if (ret < 0)
+						return ret;
+					ret = insert_dedup_file_extent(trans,
+							root, objectid,
+							btrfs_inode, file_pos,
+							dedup);
+					if (ret < 0)
+						return ret;
+					source->extent_end = file_pos +
+							     dedup->num_bytes;
+					return to_read;
+				}
 			}
 		}
 	}
@@ -918,9 +1591,9 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 						       features);
 		}
 	} else {
-		to_write = round_up(to_read, sectorsize);
-		write_buf = source->buf;
-		memset(write_buf + to_read, 0, to_write - to_read);
+		to_write = round_up(bytes_read, sectorsize);
+		write_buf = data;
+		memset(write_buf + bytes_read, 0, to_write - bytes_read);
 	}
 
 	ret = btrfs_reserve_extent(trans, root, to_write, 0, 0,
@@ -932,7 +1605,7 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 
 	if (g_do_reflink) {
 		ret = do_reflink_write(root->fs_info, source, first_block, file_pos,
-				       to_read, write_buf);
+				       bytes_read, write_buf);
 	} else {
 		ret = write_data_to_disk(root->fs_info, write_buf, first_block, to_write);
 	}
@@ -943,29 +1616,34 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 	}
 
 	if (datasum) {
-		for (unsigned int i = 0; i < to_write / sectorsize; i++) {
-			ret = btrfs_csum_file_block(trans, first_block + (i * sectorsize),
-					BTRFS_EXTENT_CSUM_OBJECTID,
-					root->fs_info->csum_type,
-					write_buf + (i * sectorsize));
-			if (ret)
-				return ret;
-		}
+		ret = insert_data_csums(trans, first_block, write_buf, to_write);
+		if (ret)
+			return ret;
 	}
 
 	btrfs_set_stack_file_extent_type(&stack_fi, BTRFS_FILE_EXTENT_REG);
 	btrfs_set_stack_file_extent_disk_bytenr(&stack_fi, first_block);
 	btrfs_set_stack_file_extent_disk_num_bytes(&stack_fi, to_write);
-	btrfs_set_stack_file_extent_num_bytes(&stack_fi, round_up(to_read, sectorsize));
-	btrfs_set_stack_file_extent_ram_bytes(&stack_fi, round_up(to_read, sectorsize));
+	btrfs_set_stack_file_extent_num_bytes(&stack_fi, round_up(bytes_read, sectorsize));
+	btrfs_set_stack_file_extent_ram_bytes(&stack_fi, round_up(bytes_read, sectorsize));
 
 	if (do_comp)
 		btrfs_set_stack_file_extent_compression(&stack_fi, g_compression);
 
+	ret = insert_hole_before(trans, root, objectid, source, file_pos);
+	if (ret < 0)
+		return ret;
 	ret = insert_reserved_file_extent(trans, root, objectid, btrfs_inode,
 					  file_pos, &stack_fi);
 	if (ret)
 		return ret;
+	source->extent_end = file_pos + round_up(bytes_read, sectorsize);
+
+	if (do_dedup) {
+		ret = add_dedup_entry(hash, bytes_read, &stack_fi);
+		if (ret < 0)
+			return ret;
+	}
 
 	return to_read;
 }
@@ -1264,28 +1942,20 @@ int btrfs_mkfs_validate_inode_flags(const char *source_dir, struct list_head *in
 	return 0;
 }
 
-static int add_file_items(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root,
-			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
-			  const struct stat *st, const char *path_name)
+/*
+ * Insert @size bytes of file data read from @source, as an inline extent if
+ * it's small enough or as regular extents otherwise.
+ */
+static int add_file_data(struct btrfs_trans_handle *trans,
+			 struct btrfs_root *root,
+			 struct btrfs_inode_item *btrfs_inode, u64 objectid,
+			 u64 size, struct source_descriptor *source)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
 	int ret = -1;
-	ssize_t ret_read;
 	u32 sectorsize = fs_info->sectorsize;
 	u64 file_pos = 0;
 	char *buf = NULL, *comp_buf = NULL, *wrkmem = NULL;
-	struct source_descriptor source;
-	int fd;
-
-	if (st->st_size == 0)
-		return 0;
-
-	fd = open(path_name, O_RDONLY);
-	if (fd == -1) {
-		error("cannot open %s: %m", path_name);
-		return ret;
-	}
 
 	if (g_compression == BTRFS_COMPRESS_LZO) {
 #if COMPRESSION_LZO
@@ -1301,37 +1971,34 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 #endif
 	}
 
-	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) &&
-	    st->st_size < sectorsize) {
-		char *buffer = malloc(st->st_size);
+	if (size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) && size < sectorsize) {
+		char *buffer = malloc(size);
 
 		if (!buffer) {
 			ret = -ENOMEM;
 			goto end;
 		}
 
-		ret_read = pread(fd, buffer, st->st_size, 0);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %u length %zu: %m",
-			      path_name, 0, st->st_size);
+		ret = read_source(source, buffer, size, 0);
+		if (ret < 0) {
 			free(buffer);
 			goto end;
 		}
 
 		switch (g_compression) {
 		case BTRFS_COMPRESS_ZLIB:
-			ret = zlib_compress_inline_extent(buffer, st->st_size,
+			ret = zlib_compress_inline_extent(buffer, size,
 							  &comp_buf);
 			break;
 #if COMPRESSION_LZO
 		case BTRFS_COMPRESS_LZO:
-			ret = lzo_compress_inline_extent(buffer, st->st_size,
+			ret = lzo_compress_inline_extent(buffer, size,
 							 &comp_buf, wrkmem);
 			break;
 #endif
 #if COMPRESSION_ZSTD
 		case BTRFS_COMPRESS_ZSTD:
-			ret = zstd_compress_inline_extent(buffer, st->st_size,
+			ret = zstd_compress_inline_extent(buffer, size,
 							  &comp_buf);
 			break;
 #endif
@@ -1341,20 +2008,18 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 		}
 
 		if (ret < 0) {
-			ret = btrfs_insert_inline_extent(trans, root, objectid,
-							 0, buffer, st->st_size,
-							 BTRFS_COMPRESS_NONE,
-							 st->st_size);
+			ret = insert_inline_extent(trans, root, objectid,
+						   buffer, size,
+						   BTRFS_COMPRESS_NONE, size);
 		} else {
-			ret = btrfs_insert_inline_extent(trans, root, objectid,
-							 0, comp_buf, ret,
-							 g_compression,
-							 st->st_size);
+			ret = insert_inline_extent(trans, root, objectid,
+						   comp_buf, ret,
+						   g_compression, size);
 		}
 
 		free(buffer);
 		/* Update the inode nbytes for inline extents. */
-		btrfs_set_stack_inode_nbytes(btrfs_inode, st->st_size);
+		btrfs_set_stack_inode_nbytes(btrfs_inode, size);
 		goto end;
 	}
 
@@ -1412,27 +2077,60 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 		}
 	}
 
-	source.fd = fd;
-	source.buf = buf;
-	source.size = st->st_size;
-	source.path_name = path_name;
-	source.comp_buf = comp_buf;
-	source.wrkmem = wrkmem;
+	source->buf = buf;
+	source->size = size;
+	source->comp_buf = comp_buf;
+	source->wrkmem = wrkmem;
+	source->data_end = 0;
+	source->extent_end = 0;
+
+	while (file_pos < size) {
+		if (file_pos >= source->data_end) {
+			ret = seek_source_data(source, sectorsize, &file_pos);
+			if (ret < 0)
+				goto end;
+			if (ret > 0)
+				break;
+		}
 
-	while (file_pos < st->st_size) {
 		ret = add_file_item_extent(trans, root, btrfs_inode, objectid,
-					   &source, file_pos);
+					   source, file_pos);
 		if (ret < 0)
-			break;
+			goto end;
 
 		file_pos += ret;
 	}
+	ret = insert_hole_before(trans, root, objectid, source,
+				 round_up(size, sectorsize));
 
 end:
 	free(wrkmem);
 	free(comp_buf);
 	free(buf);
-	close(fd);
+	return ret;
+}
+
+static int add_file_items(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root,
+			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
+			  const struct stat *st, const char *path_name)
+{
+	struct source_descriptor source = { 0 };
+	int ret;
+
+	if (st->st_size == 0)
+		return 0;
+
+	source.fd = open(path_name, O_RDONLY);
+	if (source.fd == -1) {
+		error("cannot open %s: %m", path_name);
+		return -1;
+	}
+	source.path_name = path_name;
+
+	ret = add_file_data(trans, root, btrfs_inode, objectid, st->st_size,
+			    &source);
+	close(source.fd);
 	return ret;
 }
 
@@ -1565,6 +2263,12 @@ static int ftw_add_subvol(const char *full_path, const struct stat *st,
 
 	parent = rootdir_path_last(&current_path);
 
+	ret = flush_new_inodes(g_trans);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to insert new inodes: %m");
+		goto out;
+	}
 	ret = btrfs_link_subvolume(g_trans, parent->root, parent->ino,
 				   base_path, strlen(base_path), new_root);
 	if (ret) {
@@ -1631,6 +2335,161 @@ out:
 	return ret;
 }
 
+static int add_new_dir_item(u8 type, u64 offset, u64 ino, mode_t mode,
+			    const char *name, int name_len, u64 transid)
+{
+	struct btrfs_dir_item *di;
+	struct btrfs_key location = {
+		.objectid = ino,
+		.type = BTRFS_INODE_ITEM_KEY,
+		.offset = 0,
+	};
+
+	di = add_new_item(new_inodes.dir, type, offset, sizeof(*di) + name_len);
+	if (!di)
+		return -ENOMEM;
+	btrfs_cpu_key_to_disk(&di->location, &location);
+	btrfs_set_stack_dir_flags(di, ftype_to_btrfs_type(mode));
+	btrfs_set_stack_dir_name_len(di, name_len);
+	btrfs_set_stack_dir_transid(di, transid);
+	memcpy(di + 1, name, name_len);
+	return 0;
+}
+
+/*
+ * Link the new inode @ino as @name to the directory @parent_ino, and start
+ * collecting its own items. Like btrfs_add_link() this accounts the name in
+ * the size of the parent, and sets the nlink and the flags inherited from the
+ * parent in @inode_item. Names are unique in the source directory or archive,
+ * unlike btrfs_add_link() there's no check for conflicts.
+ */
+static int link_new_inode(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, u64 ino, u64 parent_ino,
+			  const char *name, int name_len, mode_t mode,
+			  struct btrfs_inode_item *inode_item)
+{
+	struct btrfs_inode_ref *ref;
+	u64 flags;
+	u64 index;
+	int ret;
+
+	if (root != new_inodes.root || parent_ino != new_inodes.dir ||
+	    new_inodes.items.size >= NEW_INODES_MAX_SIZE) {
+		struct btrfs_inode_item parent_item;
+
+		ret = flush_new_inodes(trans);
+		if (ret < 0)
+			return ret;
+		ret = read_inode_item(root, &parent_item, parent_ino);
+		if (ret < 0)
+			return ret;
+		ret = btrfs_find_free_dir_index(root, parent_ino,
+						&new_inodes.next_index);
+		if (ret < 0)
+			return ret;
+		new_inodes.root = root;
+		new_inodes.dir = parent_ino;
+		new_inodes.dir_flags = btrfs_stack_inode_flags(&parent_item);
+		new_inodes.dir_size = 0;
+	}
+
+	index = new_inodes.next_index++;
+	ret = add_new_dir_item(BTRFS_DIR_ITEM_KEY, btrfs_name_hash(name, name_len),
+			       ino, mode, name, name_len, trans->transid);
+	if (ret < 0)
+		return ret;
+	ret = add_new_dir_item(BTRFS_DIR_INDEX_KEY, index, ino, mode, name,
+			       name_len, trans->transid);
+	if (ret < 0)
+		return ret;
+	new_inodes.dir_size += name_len * 2;
+
+	/* Same as inherit_inode_flags() */
+	flags = btrfs_stack_inode_flags(inode_item);
+	if (new_inodes.dir_flags & BTRFS_INODE_NOCOMPRESS) {
+		flags &= ~BTRFS_INODE_COMPRESS;
+		flags |= BTRFS_INODE_NOCOMPRESS;
+	} else if (new_inodes.dir_flags & BTRFS_INODE_COMPRESS) {
+		flags &= ~BTRFS_INODE_NOCOMPRESS;
+		flags |= BTRFS_INODE_COMPRESS;
+	}
+	if (new_inodes.dir_flags & BTRFS_INODE_NODATACOW) {
+		flags |= BTRFS_INODE_NODATACOW;
+		if (S_ISREG(mode))
+			flags |= BTRFS_INODE_NODATASUM;
+	}
+	btrfs_set_stack_inode_flags(inode_item, flags);
+	btrfs_set_stack_inode_nlink(inode_item, 1);
+
+	new_inodes.ino = ino;
+	ref = add_new_inode_item(BTRFS_INODE_REF_KEY, parent_ino,
+				 sizeof(*ref) + name_len);
+	if (!ref)
+		return -ENOMEM;
+	btrfs_set_stack_inode_ref_index(ref, index);
+	btrfs_set_stack_inode_ref_name_len(ref, name_len);
+	memcpy(ref + 1, name, name_len);
+	return 0;
+}
+
+/*
+ * Write the final @inode_item of @ino. For the new inode it's added to the
+ * collected items, which are inserted by flush_new_inodes().
+ */
+static int finish_new_inode(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    const struct btrfs_inode_item *inode_item, u64 ino)
+{
+	struct btrfs_inode_item *item;
+
+	if (!is_new_inode(root, ino))
+		return update_inode_item(trans, root, inode_item, ino);
+
+	item = add_new_inode_item(BTRFS_INODE_ITEM_KEY, 0, sizeof(*item));
+	if (!item)
+		return -ENOMEM;
+	memcpy(item, inode_item, sizeof(*item));
+	new_inodes.ino = 0;
+	return 0;
+}
+
+/*
+ * Create a new inode from @st and link it as @name to the directory
+ * @parent_ino. The latest version of the inode item is returned in
+ * @inode_item, the inode is completed by finish_new_inode().
+ */
+static int create_inode(struct btrfs_trans_handle *trans,
+			struct btrfs_root *root, u64 parent_ino,
+			const char *name, int name_len, const struct stat *st,
+			const char *full_path, u64 *ino_ret,
+			struct btrfs_inode_item *inode_item)
+{
+	u64 ino;
+	int ret;
+
+	ret = btrfs_find_free_objectid(trans, root,
+				       BTRFS_FIRST_FREE_OBJECTID, &ino);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to find free objectid for file %s: %m", full_path);
+		return ret;
+	}
+	/* The new inodes are not in the tree yet, don't return @ino again. */
+	root->last_inode_alloc = ino + 1;
+	stat_to_inode_item(inode_item, st);
+	search_and_update_inode_flags(inode_item, st);
+
+	ret = link_new_inode(trans, root, ino, parent_ino, name, name_len,
+			     st->st_mode, inode_item);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to add link for inode %llu ('%s'): %m", ino, full_path);
+		return ret;
+	}
+	*ino_ret = ino;
+	return 0;
+}
+
 static int ftw_add_inode(const char *full_path, const struct stat *st,
 			 int typeflag, struct FTW *ftwbuf)
 {
@@ -1749,6 +2608,12 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 		 * boundary.
 		 */
 		if (found && found->root == root) {
+			ret = flush_new_inodes(g_trans);
+			if (ret < 0) {
+				errno = -ret;
+				error("failed to insert new inodes: %m");
+				return ret;
+			}
 			ret = btrfs_add_link(g_trans, root, found->btrfs_ino,
 					     parent->ino, full_path + ftwbuf->base,
 					     strlen(full_path) - ftwbuf->base,
@@ -1770,33 +2635,11 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 		}
 	}
 
-	ret = btrfs_find_free_objectid(g_trans, root,
-				       BTRFS_FIRST_FREE_OBJECTID, &ino);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to find free objectid for file %s: %m", full_path);
-		return ret;
-	}
-	stat_to_inode_item(&inode_item, st);
-	search_and_update_inode_flags(&inode_item, st);
-
-	ret = btrfs_insert_inode(g_trans, root, ino, &inode_item);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to insert inode item %llu for '%s': %m", ino, full_path);
-		return ret;
-	}
-
-	ret = btrfs_add_link(g_trans, root, ino, parent->ino,
-			     full_path + ftwbuf->base,
-			     strlen(full_path) - ftwbuf->base,
-			     ftype_to_btrfs_type(st->st_mode),
-			     NULL, 1, 0);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to add link for inode %llu ('%s'): %m", ino, full_path);
+	ret = create_inode(g_trans, root, parent->ino, full_path + ftwbuf->base,
+			   strlen(full_path) - ftwbuf->base, st, full_path,
+			   &ino, &inode_item);
+	if (ret < 0)
 		return ret;
-	}
 
 	/* Record this new hard link. */
 	if (have_hard_links) {
@@ -1810,19 +2653,6 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 		ret = 0;
 	}
 
-	/*
-	 * btrfs_add_link() has increased the nlink, and may even updated the
-	 * inode flags (inherited from the parent).
-	 * Read out the latest version of inode item.
-	 */
-	ret = read_inode_item(root, &inode_item, ino);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to read inode item for subvol %llu inode %llu ('%s'): %m",
-			btrfs_root_id(root), ino, full_path);
-		return ret;
-	}
-
 	ret = add_xattr_item(g_trans, root, ino, full_path);
 	if (ret < 0) {
 		errno = -ret;
@@ -1845,13 +2675,6 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 				ino, full_path);
 			return ret;
 		}
-		ret = update_inode_item(g_trans, root, &inode_item, ino);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to update inode item for inode %llu ('%s'): %m",
-				ino, full_path);
-			return ret;
-		}
 	} else if (S_ISLNK(st->st_mode)) {
 		ret = add_symbolic_link(g_trans, root, &inode_item, ino, full_path);
 		if (ret < 0) {
@@ -1860,13 +2683,13 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 				ino, full_path);
 			return ret;
 		}
-		ret = update_inode_item(g_trans, root, &inode_item, ino);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to update inode item for inode %llu ('%s'): %m",
-				ino, full_path);
-			return ret;
-		}
+	}
+	ret = finish_new_inode(g_trans, root, &inode_item, ino);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to update inode item for inode %llu ('%s'): %m",
+			ino, full_path);
+		return ret;
 	}
 	return 0;
 };
@@ -1912,21 +2735,10 @@ static int set_default_subvolume(struct btrfs_trans_handle *trans)
 	return 0;
 }
 
-int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir,
-			struct btrfs_root *root, struct list_head *subvols,
-			struct list_head *inode_flags_list,
-			enum btrfs_compression_type compression,
-			unsigned int compression_level, bool do_reflink)
+/* Validate the compression type and clamp the level to the supported range */
+static int check_compression(enum btrfs_compression_type compression,
+			     unsigned int *compression_level)
 {
-	int ret;
-	struct stat root_st;
-
-	ret = lstat(source_dir, &root_st);
-	if (ret) {
-		error("unable to lstat %s: %m", source_dir);
-		return -errno;
-	}
-
 	switch (compression) {
 	case BTRFS_COMPRESS_NONE:
                 break;
@@ -1938,26 +2750,48 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 		break;
 #endif
 	case BTRFS_COMPRESS_ZLIB:
-		if (compression_level > ZLIB_BTRFS_MAX_LEVEL)
-			compression_level = ZLIB_BTRFS_MAX_LEVEL;
-		else if (compression_level == 0)
-			compression_level = ZLIB_BTRFS_DEFAULT_LEVEL;
+		if (*compression_level > ZLIB_BTRFS_MAX_LEVEL)
+			*compression_level = ZLIB_BTRFS_MAX_LEVEL;
+		else if (*compression_level == 0)
+			*compression_level = ZLIB_BTRFS_DEFAULT_LEVEL;
 		break;
 	case BTRFS_COMPRESS_ZSTD:
 #if !COMPRESSION_ZSTD
 		error("zstd support not compiled in");
 		return -EINVAL;
 #else
-		if (compression_level > ZSTD_BTRFS_MAX_LEVEL)
-			compression_level = ZSTD_BTRFS_MAX_LEVEL;
-		else if (compression_level == 0)
-			compression_level = ZSTD_BTRFS_DEFAULT_LEVEL;
+		if (*compression_level > ZSTD_BTRFS_MAX_LEVEL)
+			*compression_level = ZSTD_BTRFS_MAX_LEVEL;
+		else if (*compression_level == 0)
+			*compression_level = ZSTD_BTRFS_DEFAULT_LEVEL;
 		break;
 #endif
 	default:
 		error("unsupported compression type");
 		return -EINVAL;
 	}
+	return 0;
+}
+
+int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir,
+			struct btrfs_root *root, struct list_head *subvols,
+			struct list_head *inode_flags_list,
+			enum btrfs_compression_type compression,
+			unsigned int compression_level, bool do_reflink,
+			u64 dedup_limit)
+{
+	int ret;
+	struct stat root_st;
+
+	ret = lstat(source_dir, &root_st);
+	if (ret) {
+		error("unable to lstat %s: %m", source_dir);
+		return -errno;
+	}
+
+	ret = check_compression(compression, &compression_level);
+	if (ret < 0)
+		return ret;
 
 	g_trans = trans;
 	g_subvols = subvols;
@@ -1965,12 +2799,13 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 	g_compression = compression;
 	g_compression_level = compression_level;
 	g_do_reflink = do_reflink;
+	dedup_init(dedup_limit);
 	INIT_LIST_HEAD(&current_path.inode_list);
 
 	ret = nftw(source_dir, ftw_add_inode, 32, FTW_PHYS);
 	if (ret) {
 		error("unable to traverse directory %s: %d", source_dir, ret);
-		return ret;
+		goto out;
 	}
 
 	while (current_path.level > 0)
@@ -1980,14 +2815,471 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 		ret = set_default_subvolume(trans);
 		if (ret < 0) {
 			error("error setting default subvolume: %d", ret);
-			return ret;
+			goto out;
 		}
 	}
 
 	rb_free_nodes(&hardlink_root, free_one_hardlink);
+	ret = flush_new_inodes(trans);
+	if (ret == 0)
+		ret = flush_data_csums(trans);
+out:
+	dedup_finish();
+	btrfs_bulk_items_release(&new_inodes.items);
+	new_inodes.root = NULL;
+	new_inodes.ino = 0;
+	release_data_csums();
+	return ret;
+}
+
+/*
+ * Inodes created from an archive, looked up by their path when adding the
+ * children of a directory and for tar hard links.
+ */
+struct archive_inode {
+	struct rb_node node;
+	u64 ino;
+	mode_t mode;
+	/*
+	 * A directory created for the members inside it before its own entry
+	 * appeared in the archive, if it does at all.
+	 */
+	bool implicit;
+	char path[];
+};
+
+static struct rb_root archive_inodes = RB_ROOT;
+
+static int archive_inode_compare_nodes(const struct rb_node *node1,
+				       const struct rb_node *node2)
+{
+	const struct archive_inode *entry1;
+	const struct archive_inode *entry2;
+
+	entry1 = rb_entry(node1, struct archive_inode, node);
+	entry2 = rb_entry(node2, struct archive_inode, node);
+	return strcmp(entry2->path, entry1->path);
+}
+
+static int archive_inode_compare_keys(const struct rb_node *node,
+				      const void *key)
+{
+	const struct archive_inode *entry;
+
+	entry = rb_entry(node, struct archive_inode, node);
+	return strcmp(key, entry->path);
+}
+
+static struct archive_inode *find_archive_inode(const char *path)
+{
+	struct rb_node *node;
+
+	node = rb_search(&archive_inodes, path, archive_inode_compare_keys, NULL);
+	if (node)
+		return rb_entry(node, struct archive_inode, node);
+	return NULL;
+}
+
+static struct archive_inode *add_archive_inode(const char *path, size_t len,
+					       u64 ino, mode_t mode,
+					       bool implicit)
+{
+	struct archive_inode *new;
+
+	new = malloc(sizeof(*new) + len + 1);
+	if (!new)
+		return NULL;
+	new->ino = ino;
+	new->mode = mode;
+	new->implicit = implicit;
+	memcpy(new->path, path, len);
+	new->path[len] = 0;
+	if (rb_insert(&archive_inodes, &new->node, archive_inode_compare_nodes)) {
+		free(new);
+		return NULL;
+	}
+	return new;
+}
+
+static void free_one_archive_inode(struct rb_node *node)
+{
+	free(rb_entry(node, struct archive_inode, node));
+}
+
+/* Apply ownership, mode and times of an archive entry to an existing directory */
+static int archive_update_dir(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 ino,
+			      const struct stat *st)
+{
+	struct btrfs_inode_item inode_item;
+	int ret;
+
+	ret = flush_new_inodes(trans);
+	if (ret < 0)
+		return ret;
+	/* Size and nlink have been updated by adding the links already. */
+	ret = read_inode_item(root, &inode_item, ino);
+	if (ret < 0)
+		return ret;
+	stat_to_inode_item(&inode_item, st);
+	return update_inode_item(trans, root, &inode_item, ino);
+}
+
+static int add_archive_xattrs(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 ino,
+			      const struct mkfs_archive_entry *entry)
+{
+	for (int i = 0; i < entry->nr_xattrs; i++) {
+		const struct mkfs_archive_xattr *xattr = &entry->xattrs[i];
+		size_t name_len = strlen(xattr->name);
+		int ret;
+
+		if (name_len > XATTR_NAME_MAX || xattr->size >= XATTR_SIZE_MAX) {
+			error("xattr %s too large for %s", xattr->name,
+			      entry->path);
+			return -E2BIG;
+		}
+		ret = insert_xattr(trans, root, ino, xattr->name, name_len,
+				   xattr->value, xattr->size);
+		if (ret < 0) {
+			errno = -ret;
+			error("inserting a xattr item failed for %s: %m",
+			      entry->path);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Return the parent directory of @path, its first @parent_len characters.
+ * Missing directories on the way are created like tar or cpio extraction
+ * would do.
+ */
+static struct archive_inode *archive_get_parent(struct btrfs_trans_handle *trans,
+						struct btrfs_root *root,
+						const char *path,
+						size_t parent_len)
+{
+	struct archive_inode *parent;
+	struct archive_inode *dir;
+	char dir_path[PATH_MAX];
+	struct stat st = {
+		.st_mode = S_IFDIR | 0755,
+		.st_nlink = 1,
+	};
+	size_t len = 0;
+
+	memcpy(dir_path, path, parent_len);
+	dir_path[parent_len] = 0;
+	parent = find_archive_inode(dir_path);
+	if (parent)
+		goto out;
+
+	st.st_atime = st.st_ctime = st.st_mtime = time(NULL);
+	parent = find_archive_inode("");
+	while (len < parent_len) {
+		struct btrfs_inode_item inode_item = { 0 };
+		const char *name = dir_path + len + !!len;
+		u64 ino;
+		int ret;
+
+		if (!S_ISDIR(parent->mode))
+			break;
+		len = strchrnul(name, '/') - dir_path;
+		dir_path[len] = 0;
+		dir = find_archive_inode(dir_path);
+		if (!dir) {
+			ret = create_inode(trans, root, parent->ino, name,
+					   dir_path + len - name, &st, dir_path,
+					   &ino, &inode_item);
+			if (ret < 0)
+				return ERR_PTR(ret);
+			ret = finish_new_inode(trans, root, &inode_item, ino);
+			if (ret < 0)
+				return ERR_PTR(ret);
+			dir = add_archive_inode(dir_path, len, ino, st.st_mode,
+						true);
+			if (!dir)
+				return ERR_PTR(-ENOMEM);
+		}
+		if (len < parent_len)
+			dir_path[len] = '/';
+		parent = dir;
+	}
+out:
+	if (!S_ISDIR(parent->mode)) {
+		error("parent of '%s' in the archive is not a directory", path);
+		return ERR_PTR(-ENOTDIR);
+	}
+	return parent;
+}
+
+static int archive_add_link(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    const struct archive_inode *parent,
+			    const char *name, u64 ino, mode_t mode,
+			    const char *path)
+{
+	int ret;
+
+	ret = flush_new_inodes(trans);
+	if (ret < 0)
+		return ret;
+	ret = btrfs_add_link(trans, root, ino, parent->ino, name, strlen(name),
+			     ftype_to_btrfs_type(mode), NULL, 1, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to add link for hard link ('%s'): %m", path);
+		return ret;
+	}
+	if (!add_archive_inode(path, strlen(path), ino, mode, false))
+		return -ENOMEM;
+	return 0;
+}
+
+static int add_archive_file_data(struct btrfs_trans_handle *trans,
+				 struct btrfs_root *root,
+				 struct btrfs_inode_item *inode_item, u64 ino,
+				 struct mkfs_archive *archive,
+				 const struct mkfs_archive_entry *entry)
+{
+	struct source_descriptor source = {
+		.fd = -1,
+		.archive = archive,
+		.path_name = entry->path,
+	};
+	int ret;
+
+	ret = add_file_data(trans, root, inode_item, ino, entry->st.st_size,
+			    &source);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to add file extents for inode %llu ('%s'): %m",
+		      ino, entry->path);
+	}
+	return ret;
+}
+
+/*
+ * Cpio stores hard links as members with the same device and inode numbers,
+ * the data is usually only stored with the last one.
+ */
+static int archive_add_cpio_hard_link(struct btrfs_trans_handle *trans,
+				      struct btrfs_root *root,
+				      const struct archive_inode *parent,
+				      const char *name,
+				      struct hardlink_entry *found,
+				      struct mkfs_archive *archive,
+				      const struct mkfs_archive_entry *entry)
+{
+	const struct stat *st = &entry->st;
+	struct btrfs_inode_item inode_item;
+	int ret;
+
+	ret = archive_add_link(trans, root, parent, name, found->btrfs_ino,
+			       st->st_mode, entry->path);
+	if (ret < 0)
+		return ret;
+
+	if (S_ISREG(st->st_mode) && st->st_size) {
+		ret = read_inode_item(root, &inode_item, found->btrfs_ino);
+		if (ret < 0)
+			return ret;
+		if (btrfs_stack_inode_size(&inode_item) == 0) {
+			btrfs_set_stack_inode_size(&inode_item, st->st_size);
+			ret = add_archive_file_data(trans, root, &inode_item,
+						    found->btrfs_ino, archive,
+						    entry);
+			if (ret < 0)
+				return ret;
+			ret = update_inode_item(trans, root, &inode_item,
+						found->btrfs_ino);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	found->found_nlink++;
+	if (found->found_nlink >= found->st_nlink) {
+		rb_erase(&found->node, &hardlink_root);
+		free(found);
+	}
 	return 0;
 }
 
+static int archive_add_entry(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root,
+			     struct mkfs_archive *archive,
+			     const struct mkfs_archive_entry *entry)
+{
+	const struct stat *st = &entry->st;
+	const char *path = entry->path;
+	const bool have_hard_links = (!S_ISDIR(st->st_mode) && st->st_nlink > 1);
+	struct btrfs_inode_item inode_item = { 0 };
+	struct archive_inode *parent;
+	struct archive_inode *ai;
+	const char *name;
+	size_t parent_len;
+	u64 ino;
+	int ret;
+
+	ai = find_archive_inode(path);
+	if (ai) {
+		/* The root or a directory already created for its members */
+		if (ai->implicit && S_ISDIR(st->st_mode) && !entry->hardlink) {
+			ai->implicit = false;
+			ret = archive_update_dir(trans, root, ai->ino, st);
+			if (ret < 0) {
+				errno = -ret;
+				error("failed to update inode item for '%s': %m",
+				      path[0] ? path : ".");
+				return ret;
+			}
+			return add_archive_xattrs(trans, root, ai->ino, entry);
+		}
+		error("duplicate member in the archive: %s", path[0] ? path : ".");
+		return -EEXIST;
+	}
+
+	name = strrchr(path, '/');
+	if (name) {
+		parent_len = name - path;
+		name++;
+	} else {
+		parent_len = 0;
+		name = path;
+	}
+	parent = archive_get_parent(trans, root, path, parent_len);
+	if (IS_ERR(parent))
+		return PTR_ERR(parent);
+
+	if (entry->hardlink) {
+		ai = find_archive_inode(entry->link_target);
+		if (!ai || S_ISDIR(ai->mode)) {
+			error("hard link target of '%s' not found in the archive: %s",
+			      path, entry->link_target);
+			return -ENOENT;
+		}
+		return archive_add_link(trans, root, parent, name, ai->ino,
+					ai->mode, path);
+	}
+
+	if (have_hard_links) {
+		struct hardlink_entry *found;
+
+		found = find_hard_link(root, st);
+		if (found)
+			return archive_add_cpio_hard_link(trans, root, parent,
+							  name, found, archive,
+							  entry);
+	}
+
+	ret = create_inode(trans, root, parent->ino, name, strlen(name), st,
+			   path, &ino, &inode_item);
+	if (ret < 0)
+		return ret;
+	if (!add_archive_inode(path, strlen(path), ino, st->st_mode, false))
+		return -ENOMEM;
+
+	if (have_hard_links) {
+		ret = add_hard_link(root, ino, st);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to add hard link record for '%s': %m", path);
+			return ret;
+		}
+	}
+
+	/* The kernel dev_t encoding, with 20 bits for the minor number */
+	if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+		btrfs_set_stack_inode_rdev(&inode_item,
+					   ((u64)major(st->st_rdev) << 20) |
+					   minor(st->st_rdev));
+
+	ret = add_archive_xattrs(trans, root, ino, entry);
+	if (ret < 0)
+		return ret;
+
+	if (S_ISREG(st->st_mode) && st->st_size) {
+		ret = add_archive_file_data(trans, root, &inode_item, ino,
+					    archive, entry);
+		if (ret < 0)
+			return ret;
+	} else if (S_ISLNK(st->st_mode)) {
+		ret = insert_symlink_target(trans, root, &inode_item, ino,
+					    entry->link_target, path);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = finish_new_inode(trans, root, &inode_item, ino);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to update inode item for inode %llu ('%s'): %m",
+		      ino, path);
+	}
+	return ret;
+}
+
+/*
+ * Populate the toplevel subvolume from a tar or cpio archive, "-" reads it
+ * from the standard input. The archive is read only once, sequentially.
+ */
+int btrfs_mkfs_fill_archive(struct btrfs_trans_handle *trans,
+			    const char *filename, struct btrfs_root *root,
+			    enum btrfs_compression_type compression,
+			    unsigned int compression_level, u64 dedup_limit)
+{
+	struct mkfs_archive *archive;
+	struct mkfs_archive_entry *entry;
+	LIST_HEAD(no_inode_flags);
+	int ret;
+
+	ret = check_compression(compression, &compression_level);
+	if (ret < 0)
+		return ret;
+
+	archive = mkfs_archive_open(filename);
+	if (!archive)
+		return -EINVAL;
+
+	g_trans = trans;
+	g_inode_flags_list = &no_inode_flags;
+	g_compression = compression;
+	g_compression_level = compression_level;
+	g_do_reflink = false;
+	dedup_init(dedup_limit);
+
+	if (!add_archive_inode("", 0, btrfs_root_dirid(&root->root_item),
+			       S_IFDIR, true)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while ((ret = mkfs_archive_next(archive, &entry)) == 0) {
+		ret = archive_add_entry(trans, root, archive, entry);
+		if (ret < 0)
+			break;
+	}
+	if (ret > 0)
+		ret = 0;
+	if (ret == 0)
+		ret = flush_new_inodes(trans);
+	if (ret == 0)
+		ret = flush_data_csums(trans);
+out:
+	dedup_finish();
+	btrfs_bulk_items_release(&new_inodes.items);
+	new_inodes.root = NULL;
+	new_inodes.ino = 0;
+	release_data_csums();
+	rb_free_nodes(&archive_inodes, free_one_archive_inode);
+	rb_free_nodes(&hardlink_root, free_one_hardlink);
+	mkfs_archive_close(archive);
+	return ret;
+}
+
 static int ftw_add_entry_size(const char *fpath, const struct stat *st,
 			      int type, struct FTW *ftwbuf)
 {
@@ -2005,15 +3297,15 @@ static int ftw_add_entry_size(const char *fpath, const struct stat *st,
 	return 0;
 }
 
-u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
-			u64 meta_profile, u64 data_profile)
+static u64 size_from_estimate(u64 nr_inode, u64 data_size, u32 sectorsize,
+			      u64 min_dev_size, u64 meta_profile,
+			      u64 data_profile)
 {
 	u64 total_size = 0;
-	int ret;
 
-	u64 meta_size = 0;		/* Based on @ftw_meta_nr_inode */
+	u64 meta_size = 0;		/* Based on @nr_inode */
 	u64 meta_chunk_size = 0;	/* Based on @meta_size */
-	u64 data_chunk_size = 0;	/* Based on @ftw_data_size */
+	u64 data_chunk_size = 0;	/* Based on @data_size */
 
 	u64 meta_threshold = SZ_8M;
 	u64 data_threshold = SZ_8M;
@@ -2021,21 +3313,6 @@ u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 	float data_multiplier = 1;
 	float meta_multiplier = 1;
 
-	fs_block_size = sectorsize;
-	ftw_data_size = 0;
-	ftw_meta_nr_inode = 0;
-
-	/*
-	 * Symbolic link is not followed when creating files, so no need to
-	 * follow them here.
-	 */
-	ret = nftw(dir_name, ftw_add_entry_size, 10, FTW_PHYS);
-	if (ret < 0) {
-		error("ftw subdir walk of %s failed: %m", dir_name);
-		exit(1);
-	}
-
-
 	/*
 	 * Maximum metadata usage for every inode, which will be PATH_MAX
 	 * for the following items:
@@ -2051,8 +3328,7 @@ u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 	 * upper limit is 1M, instead of 128M in kernel.
 	 * This can bump meta usage easily.
 	 */
-	meta_size = ftw_meta_nr_inode * (PATH_MAX * 3 + sectorsize) +
-		    ftw_data_size / 8;
+	meta_size = nr_inode * (PATH_MAX * 3 + sectorsize) + data_size / 8;
 
 	/* Minimal chunk size from btrfs_alloc_chunk(). */
 	if (meta_profile & BTRFS_BLOCK_GROUP_DUP) {
@@ -2072,14 +3348,79 @@ u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 	if (meta_size > meta_threshold)
 		meta_chunk_size = (round_up(meta_size, meta_threshold) -
 				   meta_threshold) * meta_multiplier;
-	if (ftw_data_size > data_threshold)
-		data_chunk_size = (round_up(ftw_data_size, data_threshold) -
+	if (data_size > data_threshold)
+		data_chunk_size = (round_up(data_size, data_threshold) -
 				   data_threshold) * data_multiplier;
 
 	total_size = data_chunk_size + meta_chunk_size + min_dev_size;
 	return total_size;
 }
 
+u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
+			u64 meta_profile, u64 data_profile)
+{
+	int ret;
+
+	fs_block_size = sectorsize;
+	ftw_data_size = 0;
+	ftw_meta_nr_inode = 0;
+
+	/*
+	 * Symbolic link is not followed when creating files, so no need to
+	 * follow them here.
+	 */
+	ret = nftw(dir_name, ftw_add_entry_size, 10, FTW_PHYS);
+	if (ret < 0) {
+		error("ftw subdir walk of %s failed: %m", dir_name);
+		exit(1);
+	}
+
+	return size_from_estimate(ftw_meta_nr_inode, ftw_data_size, sectorsize,
+				  min_dev_size, meta_profile, data_profile);
+}
+
+/*
+ * Estimate the size like btrfs_mkfs_size_dir() does, from the member headers
+ * of the archive. This needs an extra pass over the archive, so it's possible
+ * only for regular files, -ESPIPE is returned otherwise.
+ */
+int btrfs_mkfs_size_archive(const char *filename, u32 sectorsize,
+			    u64 min_dev_size, u64 meta_profile,
+			    u64 data_profile, u64 *size_ret)
+{
+	struct mkfs_archive *archive;
+	struct mkfs_archive_entry *entry;
+	struct stat st;
+	u64 nr_inode = 0;
+	u64 data_size = 0;
+	int ret;
+
+	if (strcmp(filename, "-") == 0)
+		return -ESPIPE;
+	if (stat(filename, &st) < 0) {
+		error("cannot stat archive %s: %m", filename);
+		return -errno;
+	}
+	if (!S_ISREG(st.st_mode))
+		return -ESPIPE;
+
+	archive = mkfs_archive_open(filename);
+	if (!archive)
+		return -EINVAL;
+	while ((ret = mkfs_archive_next(archive, &entry)) == 0) {
+		if (S_ISREG(entry->st.st_mode))
+			data_size += round_up(entry->st.st_size, sectorsize);
+		nr_inode++;
+	}
+	mkfs_archive_close(archive);
+	if (ret < 0)
+		return ret;
+
+	*size_ret = size_from_estimate(nr_inode, data_size, sectorsize,
+				       min_dev_size, meta_profile, data_profile);
+	return 0;
+}
+
 /*
  * Get the end position of the last device extent for given @devid;
  * @size_ret is exclusive (means it should be aligned to sectorsize)
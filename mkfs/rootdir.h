@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <limits.h>
 #include "kernel-lib/list.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/compression.h"
 
 #define ZLIB_BTRFS_DEFAULT_LEVEL		3
@@ -34,6 +35,9 @@
 #define ZSTD_BTRFS_DEFAULT_LEVEL		3
 #define ZSTD_BTRFS_MAX_LEVEL			15
 
+/* Memory limit of the extent index for --dedup */
+#define DEDUP_DEFAULT_LIMIT			SZ_64M
+
 struct btrfs_fs_info;
 struct btrfs_root;
 
@@ -69,9 +73,17 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 			struct btrfs_root *root, struct list_head *subvols,
 			struct list_head *inode_flags_list,
 			enum btrfs_compression_type compression,
-			unsigned int compression_level, bool do_reflink);
+			unsigned int compression_level, bool do_reflink,
+			u64 dedup_limit);
 u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 			u64 meta_profile, u64 data_profile);
+int btrfs_mkfs_fill_archive(struct btrfs_trans_handle *trans,
+			    const char *filename, struct btrfs_root *root,
+			    enum btrfs_compression_type compression,
+			    unsigned int compression_level, u64 dedup_limit);
+int btrfs_mkfs_size_archive(const char *filename, u32 sectorsize,
+			    u64 min_dev_size, u64 meta_profile,
+			    u64 data_profile, u64 *size_ret);
 int btrfs_mkfs_shrink_fs(struct btrfs_fs_info *fs_info, u64 *new_size_ret,
 			 bool shrink_file_size);
 
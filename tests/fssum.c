@@ -37,10 +37,17 @@
 #include <assert.h>
 #include <time.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "crypto/sha.h"
+#include "common/cpu-utils.h"
 
 #define CS_SIZE 32
 #define CHUNKS	128
+/* Size of the reads in permissive mode */
+#define BUF_SIZE	(1024 * 1024)
+/* The offsets of the data chunks are part of the checksum in strict mode */
+#define STRICT_CHUNK	65536
+#define MAX_JOBS	256
 
 #ifndef SEEK_DATA
 #define SEEK_DATA 3
@@ -59,7 +66,34 @@ typedef struct _sum {
 	unsigned char	out[CS_SIZE];
 } sum_t;
 
-typedef int (*sum_file_data_t)(int fd, sum_t *dst);
+typedef int (*sum_file_data_t)(int fd, sum_t *dst, char *buffer);
+
+/*
+ * Data of a regular file hashed by a worker thread, the result is combined in
+ * the directory order by sum() so the output does not depend on the number
+ * of jobs.
+ */
+struct sum_job {
+	struct sum_job *next;
+	int dirfd;
+	const char *name;
+	sum_t cs;
+	/* Errno of a failed open */
+	int open_err;
+	/* Result of the data checksum and errno if it failed */
+	int ret;
+	int read_err;
+	int done;
+};
+
+struct sum_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct sum_job *head;
+	struct sum_job *tail;
+	int stop;
+};
 
 int gen_manifest = 0;
 int in_manifest = 0;
@@ -67,6 +101,13 @@ char *checksum = NULL;
 struct excludes *excludes;
 int n_excludes = 0;
 int verbose = 0;
+int nr_jobs = 1;
+sum_file_data_t sum_file_data;
+struct sum_queue queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
 FILE *out_fp;
 FILE *in_fp;
 
@@ -157,6 +198,7 @@ usage(void)
 	fprintf(stderr, "    -n           : reset all flags\n");
 	fprintf(stderr, "    -N           : set all flags\n");
 	fprintf(stderr, "    -x path      : exclude path when building checksum (multiple ok)\n");
+	fprintf(stderr, "    -j <jobs>    : hash file data in <jobs> threads, output is the same\n");
 	fprintf(stderr, "    -h           : this help\n\n");
 	fprintf(stderr, "The default field mask is ugoamCdtES. If the checksum/manifest is read from a\n");
 	fprintf(stderr, "file, the mask is taken from there and the values given on the command line\n");
@@ -164,7 +206,7 @@ usage(void)
 	exit(-1);
 }
 
-static char buf[65536];
+static char buf[BUF_SIZE];
 
 static void *
 alloc(size_t sz)
@@ -329,23 +371,23 @@ out:
 }
 
 static int
-sum_file_data_permissive(int fd, sum_t *dst)
+sum_file_data_permissive(int fd, sum_t *dst, char *buffer)
 {
 	int ret;
 
 	while (1) {
-		ret = read(fd, buf, sizeof(buf));
+		ret = read(fd, buffer, BUF_SIZE);
 		if (ret < 0)
 			return -errno;
-		sum_add(dst, buf, ret);
-		if (ret < sizeof(buf))
+		sum_add(dst, buffer, ret);
+		if (ret < BUF_SIZE)
 			break;
 	}
 	return 0;
 }
 
 static int
-sum_file_data_strict(int fd, sum_t *dst)
+sum_file_data_strict(int fd, sum_t *dst, char *buffer)
 {
 	int ret;
 	off_t pos;
@@ -358,7 +400,7 @@ sum_file_data_strict(int fd, sum_t *dst)
 		pos = lseek(fd, pos, SEEK_DATA);
 		if (pos == (off_t)-1)
 			return errno == ENXIO ? 0 : -2;
-		ret = read(fd, buf, sizeof(buf));
+		ret = read(fd, buffer, STRICT_CHUNK);
 		assert(ret); /* eof found by lseek */
 		if (ret <= 0)
 			return ret;
@@ -367,7 +409,7 @@ sum_file_data_strict(int fd, sum_t *dst)
 				"adding to sum at file offset %llu, %d bytes\n",
 				(unsigned long long)pos, ret);
 		sum_add_u64(dst, (uint64_t)pos);
-		sum_add(dst, buf, ret);
+		sum_add(dst, buffer, ret);
 		pos += ret;
 	}
 }
@@ -512,6 +554,123 @@ malformed:
 		excess_file(fn);
 }
 
+static int
+is_excluded(const char *path)
+{
+	int excl;
+
+	for (excl = 0; excl < n_excludes; ++excl) {
+		if (strncmp(excludes[excl].path, path, excludes[excl].len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static void *
+sum_worker(void *arg)
+{
+	char *buffer = alloc(BUF_SIZE);
+	struct sum_job *job;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&queue.lock);
+		while (!queue.head && !queue.stop)
+			pthread_cond_wait(&queue.work_cond, &queue.lock);
+		job = queue.head;
+		if (!job) {
+			pthread_mutex_unlock(&queue.lock);
+			break;
+		}
+		queue.head = job->next;
+		if (!queue.head)
+			queue.tail = NULL;
+		pthread_mutex_unlock(&queue.lock);
+
+		sum_init(&job->cs);
+		fd = openat(job->dirfd, job->name, 0);
+		if (fd == -1) {
+			job->open_err = errno;
+		} else {
+			job->ret = sum_file_data(fd, &job->cs, buffer);
+			if (job->ret < 0)
+				job->read_err = errno;
+			close(fd);
+		}
+
+		pthread_mutex_lock(&queue.lock);
+		job->done = 1;
+		pthread_cond_broadcast(&queue.done_cond);
+		pthread_mutex_unlock(&queue.lock);
+	}
+	free(buffer);
+
+	return NULL;
+}
+
+static void
+wait_job(struct sum_job *job)
+{
+	pthread_mutex_lock(&queue.lock);
+	while (!job->done)
+		pthread_cond_wait(&queue.done_cond, &queue.lock);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+ * Queue data of all regular files of the directory for the workers before
+ * the entries are processed in order, so the files are hashed while the
+ * preceding entries and subdirectories are being walked.
+ */
+static struct sum_job **
+queue_dir_jobs(int dirfd, dev_t dev, char **namelist, int entries,
+	       char *path_in)
+{
+	struct sum_job **jobs;
+	int i;
+
+	if (nr_jobs <= 1 || !flags[FLAG_DATA] || !entries)
+		return NULL;
+
+	jobs = alloc(entries * sizeof(*jobs));
+	for (i = 0; i < entries; ++i) {
+		struct sum_job *job;
+		struct stat st;
+		char *path;
+		int excl;
+
+		jobs[i] = NULL;
+		path = alloc(strlen(path_in) + strlen(namelist[i]) + 2);
+		sprintf(path, "%s/%s", path_in, namelist[i]);
+		excl = is_excluded(path);
+		free(path);
+		if (excl)
+			continue;
+		/* Errors are reported when the entry is processed */
+		if (fstatat(dirfd, namelist[i], &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (!S_ISREG(st.st_mode) || st.st_dev != dev)
+			continue;
+
+		job = alloc(sizeof(*job));
+		memset(job, 0, sizeof(*job));
+		job->dirfd = dirfd;
+		job->name = namelist[i];
+		jobs[i] = job;
+
+		pthread_mutex_lock(&queue.lock);
+		if (queue.tail)
+			queue.tail->next = job;
+		else
+			queue.head = job;
+		queue.tail = job;
+		pthread_cond_signal(&queue.work_cond);
+		pthread_mutex_unlock(&queue.lock);
+	}
+
+	return jobs;
+}
+
 static void
 sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 {
@@ -523,10 +682,8 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 	int i;
 	int ret;
 	int fd;
-	int excl;
 	int error = 0;
-	sum_file_data_t sum_file_data = flags[FLAG_STRUCTURE] ?
-			sum_file_data_strict : sum_file_data_permissive;
+	struct sum_job **jobs = NULL;
 	struct stat dir_st;
 
 	if (fstat(dirfd, &dir_st)) {
@@ -563,7 +720,9 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 		++entries;
 	}
 	qsort(namelist, entries, sizeof(*namelist), namecmp);
+	jobs = queue_dir_jobs(dirfd, dir_st.st_dev, namelist, entries, path_in);
 	for (i = 0; i < entries; ++i) {
+		struct sum_job *job = jobs ? jobs[i] : NULL;
 		struct stat st;
 		sum_t cs;
 		sum_t meta;
@@ -573,11 +732,8 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 		sum_init(&meta);
 		path = alloc(strlen(path_in) + strlen(namelist[i]) + 3);
 		sprintf(path, "%s/%s", path_in, namelist[i]);
-		for (excl = 0; excl < n_excludes; ++excl) {
-			if (strncmp(excludes[excl].path, path,
-			    excludes[excl].len) == 0)
-				goto next;
-		}
+		if (is_excluded(path))
+			goto next;
 
 		ret = fchdir(dirfd);
 		if (ret == -1) {
@@ -653,6 +809,28 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 				if (verbose)
 					fprintf(stderr, "file %s\n",
 						namelist[i]);
+				if (job) {
+					wait_job(job);
+					if (job->open_err && flags[FLAG_OPEN_ERROR]) {
+						sum_add_u64(&meta, job->open_err);
+					} else if (job->open_err) {
+						errno = job->open_err;
+						fprintf(stderr,
+							"open failed for %s/%s: %m\n",
+							path_prefix, path);
+						exit(-1);
+					} else if (job->ret < 0) {
+						errno = job->read_err;
+						fprintf(stderr,
+							"read failed for "
+							"%s/%s: %m\n",
+							path_prefix, path);
+						exit(-1);
+					} else {
+						cs = job->cs;
+					}
+					goto done;
+				}
 				fd = openat(dirfd, namelist[i], 0);
 				if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
 					sum_add_u64(&meta, errno);
@@ -663,7 +841,7 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 					exit(-1);
 				}
 				if (fd != -1) {
-					ret = sum_file_data(fd, &cs);
+					ret = sum_file_data(fd, &cs, buf);
 					if (ret < 0) {
 						fprintf(stderr,
 							"read failed for "
@@ -685,6 +863,7 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 			sum_add_u64(&cs, major(st.st_rdev));
 			sum_add_u64(&cs, minor(st.st_rdev));
 		}
+done:
 		sum_fini(&cs);
 		sum_fini(&meta);
 		if (gen_manifest || in_manifest) {
@@ -713,6 +892,16 @@ next:
 	}
 
 free_namelist:
+	if (jobs) {
+		/* Entries could have changed type since the jobs were queued */
+		for (i = 0; i < entries; i++) {
+			if (!jobs[i])
+				continue;
+			wait_job(jobs[i]);
+			free(jobs[i]);
+		}
+		free(jobs);
+	}
 	closedir(d);
 	for (i = 0; i < entries; i++)
 		free(namelist[i]);
@@ -737,7 +926,8 @@ main(int argc, char *argv[])
 	int plen;
 	int elen;
 	int n_flags = 0;
-	const char *allopts = "heEfuUgGoOaAmMcCdDtTsSnNw:r:vx:";
+	pthread_t *threads = NULL;
+	const char *allopts = "heEfuUgGoOaAmMcCdDtTsSnNw:r:vx:j:";
 
 	out_fp = stdout;
 	while ((c = getopt(argc, argv, allopts)) != EOF) {
@@ -806,6 +996,15 @@ main(int argc, char *argv[])
 		case 'v':
 			++verbose;
 			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			if (nr_jobs < 1 || nr_jobs > MAX_JOBS) {
+				fprintf(stderr,
+					"number of jobs must be 1 to %d\n",
+					MAX_JOBS);
+				exit(-1);
+			}
+			break;
 		case 'h':
 		case '?':
 			usage();
@@ -880,10 +1079,36 @@ main(int argc, char *argv[])
 	if (gen_manifest)
 		fprintf(out_fp, "Flags: %s\n", flagstring);
 
+	cpu_detect_flags();
+	sha256_init_accel();
+	sum_file_data = flags[FLAG_STRUCTURE] ?
+			sum_file_data_strict : sum_file_data_permissive;
+	if (nr_jobs > 1) {
+		threads = alloc(nr_jobs * sizeof(*threads));
+		for (i = 0; i < nr_jobs; ++i) {
+			ret = pthread_create(&threads[i], NULL, sum_worker, NULL);
+			if (ret) {
+				errno = ret;
+				fprintf(stderr, "failed to create thread: %m\n");
+				exit(-1);
+			}
+		}
+	}
+
 	sum_init(&cs);
 	sum(fd, 1, &cs, path, "");
 	sum_fini(&cs);
 
+	if (threads) {
+		pthread_mutex_lock(&queue.lock);
+		queue.stop = 1;
+		pthread_cond_broadcast(&queue.work_cond);
+		pthread_mutex_unlock(&queue.lock);
+		for (i = 0; i < nr_jobs; ++i)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+
 	close(fd);
 	if (in_manifest)
 		check_manifest("", "", "", 1);
@@ -135,6 +135,32 @@ static void test5_uuid()
 	fmt_end(&fctx);
 }
 
+/* Stream of one-line objects (NDJSON), with nested list and map */
+static void test6_oneline()
+{
+	static const struct rowspec rows1[] = {
+		{ .key = "objectid", .fmt = "%llu", .out_text = "objectid", .out_json = "objectid" },
+		{ .key = "name", .fmt = "str", .out_text = "name", .out_json = "name" },
+		{ .key = "refs", .fmt = "list", .out_text = "refs", .out_json = "refs" },
+		ROWSPEC_END
+	};
+	struct format_ctx fctx;
+
+	for (int i = 0; i < 3; i++) {
+		fmt_start_line(&fctx, rows1);
+		fmt_print(&fctx, "objectid", 256ULL + i);
+		fmt_print(&fctx, "name", "file\twith \"quotes\"");
+		fmt_print(&fctx, "refs");
+		for (int j = 0; j < i; j++) {
+			fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&fctx, "objectid", (unsigned long long)j);
+			fmt_print_end_group(&fctx, NULL);
+		}
+		fmt_print_end_group(&fctx, "refs");
+		fmt_end_line(&fctx);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int testno;
@@ -145,6 +171,7 @@ int main(int argc, char **argv)
 		test3_escape,
 		test4_unquoted_bool,
 		test5_uuid,
+		test6_oneline,
 	};
 	const int testmax = ARRAY_SIZE(tests) - 1;
 
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Receive of paths selected from an index leaves the subvolume writable and
+# without received UUID, an incremental stream must not be applied on top of it
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+here=$(pwd)
+_mktemp_local full.stream
+_mktemp_local full.index
+_mktemp_local incr.stream
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+run_check $SUDO_HELPER mkdir "$TEST_MNT/subv/dir1" "$TEST_MNT/subv/dir2"
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/dir1/file1" bs=64K count=1
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/dir2/file2" bs=64K count=1
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" "$TEST_MNT/snap1"
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/dir2/file3" bs=64K count=1
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" "$TEST_MNT/snap2"
+
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$here/full.stream" "$TEST_MNT/snap1"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$here/incr.stream" -p "$TEST_MNT/snap1" "$TEST_MNT/snap2"
+run_check "$TOP/btrfs" send-stream index "$here/full.stream" "$here/full.index"
+
+run_check $SUDO_HELPER mkdir "$TEST_MNT/recv"
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$here/full.stream" \
+	--index "$here/full.index" --select dir1 "$TEST_MNT/recv"
+run_check $SUDO_HELPER test -f "$TEST_MNT/recv/snap1/dir1/file1"
+if $SUDO_HELPER test -e "$TEST_MNT/recv/snap1/dir2/file2"; then
+	_fail "file not selected was received"
+fi
+
+if ! run_check_stdout $SUDO_HELPER "$TOP/btrfs" subvolume show "$TEST_MNT/recv/snap1" |
+     grep -q "Received UUID:.*-$"; then
+	_fail "received UUID set on partially received subvolume"
+fi
+if ! run_check_stdout $SUDO_HELPER "$TOP/btrfs" property get "$TEST_MNT/recv/snap1" ro |
+     grep -q "ro=false"; then
+	_fail "partially received subvolume is read-only"
+fi
+
+run_mustfail "incremental stream received on top of a partial receive" \
+	$SUDO_HELPER "$TOP/btrfs" receive -f "$here/incr.stream" "$TEST_MNT/recv"
+
+run_check_umount_test_dev
+rm -f -- "$here/full.stream" "$here/full.index" "$here/incr.stream"
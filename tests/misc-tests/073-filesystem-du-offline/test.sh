@@ -0,0 +1,61 @@
+#!/bin/bash
+# Verify the usage of subvolumes printed by "btrfs filesystem du --offline",
+# data shared by deduplication and across subvolumes, and an extent split in
+# one file that is not shared
+#
+# The image split-extent.img contains a 64KiB file 'plain' and a 64KiB file
+# 'split' whose only extent is referenced by two file extent items, the ranges
+# [0, 16KiB) and [32KiB, 64KiB), as after punching a hole into it.
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+# Compare Total, Exclusive and Set shared of the row with name $2 in output $1
+check_usage()
+{
+	local out="$1"
+	local name="$2"
+	local expected="$3 $4 $5"
+	local found
+
+	found=$(echo "$out" | awk -v name="$name" '$4 == name { print $1, $2, $3 }')
+	if [ "$found" != "$expected" ]; then
+		_fail "unexpected usage of $name: '$found', expected '$expected'"
+	fi
+}
+
+tmp=$(_mktemp_dir du-offline)
+
+run_check mkdir -p "$tmp/src/sub"
+run_check dd if=/dev/urandom of="$tmp/src/file" bs=64K count=2
+run_check cp "$tmp/src/file" "$tmp/src/copy"
+run_check cp "$tmp/src/file" "$tmp/src/sub/copy"
+run_check dd if=/dev/urandom of="$tmp/src/sub/unique" bs=64K count=1
+run_check dd if=/dev/urandom of="$tmp/src/unique" bs=32K count=1
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" --subvol sub \
+	--dedup "$TEST_DEV"
+run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+
+out=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" filesystem du --offline --raw "$TEST_DEV")
+# Toplevel: file, copy (both the same 128KiB extent) and unique
+check_usage "$out" "<FS_TREE>" 294912 32768 131072
+# Subvolume: copy of the same extent and unique
+check_usage "$out" "sub" 196608 65536 131072
+# The whole filesystem, the shared extent is counted once
+check_usage "$out" "$TEST_DEV" 491520 98304 131072
+
+image=$(extract_image "./split-extent.img")
+run_check "$TOP/btrfs" check "$image"
+out=$(run_check_stdout "$TOP/btrfs" filesystem du --offline --raw "$image")
+# 48KiB of 'split' and 64KiB of 'plain', all exclusive
+check_usage "$out" "<FS_TREE>" 114688 114688 0
+check_usage "$out" "$image" 114688 114688 0
+
+rm -f -- "$image"
+rm -rf -- "$tmp"
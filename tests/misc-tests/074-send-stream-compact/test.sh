@@ -0,0 +1,62 @@
+#!/bin/bash
+# Verify the commands of a send stream rewritten by "btrfs send-stream compact"
+#
+# The stream compact.stream.xz creates a subvolume with three inodes:
+# - 'file' with three adjacent writes of 4KiB, a write overlapping the first
+#   two, a truncate in the middle of the second write and repeated chown,
+#   chmod and utimes
+# - 'small' with sixteen adjacent writes of 100 bytes
+# - 'dir' with repeated chmod and utimes
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs
+
+stream=$(extract_image "./compact.stream.xz")
+_mktemp_local compact.out
+_mktemp_local compact.stream
+_mktemp_local compact2.stream
+
+run_check_stdout "$TOP/btrfs" send-stream compact "$stream" compact.stream > compact.out
+cat > compact.expected <<EXPECTED
+Input:   45 commands, 19.33KiB
+Output:  20 commands, 12.34KiB
+Removed: 25 commands (55.6%), 7.00KiB (36.2%)
+Writes:  1 dropped, 1 shortened, 16 merged
+Clones:  0 merged
+Dropped: 2 chmod, 1 chown, 5 utimes
+EXPECTED
+run_check diff -u compact.expected compact.out
+
+# The writes to 'file' beyond the truncate are dropped or shortened and the
+# first two merged, the overlapping write must stay after them
+run_check_stdout "$TOP/btrfs" receive --dump -f compact.stream |
+	sed -e 's/  */ /g' > compact.out
+cat > compact.expected <<EXPECTED
+subvol ./subv uuid=00010203-0405-0607-0809-0a0b0c0d0e0f transid=7
+mkfile ./subv/o257-7-0
+rename ./subv/o257-7-0 dest=./subv/file
+write ./subv/file offset=0 len=6144
+write ./subv/file offset=2048 len=4096
+truncate ./subv/file size=6144
+chown ./subv/file gid=1000 uid=1000
+chmod ./subv/file mode=600
+utimes ./subv/file atime=1970-01-01T00:16:43+0000 mtime=1970-01-01T00:16:43+0000 ctime=1970-01-01T00:16:43+0000
+mkfile ./subv/o258-7-0
+rename ./subv/o258-7-0 dest=./subv/small
+write ./subv/small offset=0 len=1600
+chmod ./subv/small mode=644
+utimes ./subv/small atime=1970-01-01T00:16:45+0000 mtime=1970-01-01T00:16:45+0000 ctime=1970-01-01T00:16:45+0000
+mkdir ./subv/o259-7-0
+rename ./subv/o259-7-0 dest=./subv/dir
+chmod ./subv/dir mode=700
+utimes ./subv/dir atime=1970-01-01T00:16:47+0000 mtime=1970-01-01T00:16:47+0000 ctime=1970-01-01T00:16:47+0000
+utimes ./subv/ atime=1970-01-01T00:16:48+0000 mtime=1970-01-01T00:16:48+0000 ctime=1970-01-01T00:16:48+0000
+EXPECTED
+run_check diff -u compact.expected compact.out
+
+# Nothing left to compact, the stream must be copied unchanged
+run_check "$TOP/btrfs" send-stream compact compact.stream compact2.stream
+run_check cmp compact.stream compact2.stream
+
+rm -f -- "$stream" compact.out compact.expected compact.stream compact2.stream
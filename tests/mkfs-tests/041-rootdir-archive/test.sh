@@ -0,0 +1,68 @@
+#!/bin/bash
+# Test "mkfs.btrfs --rootdir-archive" with a tar archive read from a file and
+# from the standard input, and with newc and odc cpio archives, the result must
+# match the source directory.
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_global_prereq tar
+check_global_prereq bsdtar
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir-archive)
+
+run_check mkdir -p "$tmp/src/dir/subdir"
+run_check touch "$tmp/src/empty"
+echo "inline" > "$tmp/src/inline"
+run_check dd if=/dev/urandom of="$tmp/src/dir/file" bs=1M count=3
+run_check dd if=/dev/zero of="$tmp/src/dir/subdir/zeros" bs=1K count=300
+run_check ln "$tmp/src/dir/file" "$tmp/src/hardlink"
+run_check ln -s dir/file "$tmp/src/symlink"
+run_check mkfifo "$tmp/src/fifo"
+run_check chmod 750 "$tmp/src/dir"
+# Longer than the 100 bytes of the name field in the tar header
+long=$(printf 'x%.0s' {1..200})
+run_check touch "$tmp/src/dir/$long"
+# Names and data of all lengths modulo 4, padded in the cpio newc format
+for name in p pa pad padd; do
+	echo -n "$name" > "$tmp/src/$name"
+done
+
+run_check tar -C "$tmp/src" --format=pax -cf "$tmp/archive.tar" .
+run_check bsdtar -C "$tmp/src" --format newc -cf "$tmp/archive.newc" .
+run_check bsdtar -C "$tmp/src" --format odc -cf "$tmp/archive.odc" .
+
+check_image()
+{
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+	run_check_mount_test_dev
+	run_check $SUDO_HELPER diff -r --no-dereference "$tmp/src" "$TEST_MNT"
+	nr_hardlink=$(run_check_stdout $SUDO_HELPER stat -c "%h" "$TEST_MNT/hardlink")
+	if [ "$nr_hardlink" -ne 2 ]; then
+		_fail "hard link number incorrect, has ${nr_hardlink} expect 2"
+	fi
+	mode=$(run_check_stdout $SUDO_HELPER stat -c "%a" "$TEST_MNT/dir")
+	if [ "$mode" != "750" ]; then
+		_fail "directory mode incorrect, has ${mode} expect 750"
+	fi
+	run_check_umount_test_dev
+}
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir-archive "$tmp/archive.tar" "$TEST_DEV"
+check_image
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir-archive - "$TEST_DEV" < "$tmp/archive.tar"
+check_image
+
+# The data of hard links is stored only with the last link in newc and with
+# each of them in odc
+for format in newc odc; do
+	run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir-archive "$tmp/archive.$format" "$TEST_DEV"
+	check_image
+done
+
+rm -rf -- "$tmp"
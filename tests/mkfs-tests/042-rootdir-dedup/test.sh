@@ -0,0 +1,57 @@
+#!/bin/bash
+# Test "mkfs.btrfs --rootdir --dedup", identical data must be stored only once
+# and the files must still match the source directory.
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir-dedup)
+
+run_check mkdir -p "$tmp/src/dir"
+run_check dd if=/dev/urandom of="$tmp/src/file" bs=1M count=4
+run_check cp "$tmp/src/file" "$tmp/src/dir/copy1"
+run_check cp "$tmp/src/file" "$tmp/src/dir/copy2"
+# Same first extents, different tail
+run_check cp "$tmp/src/file" "$tmp/src/dir/append"
+echo "tail" >> "$tmp/src/dir/append"
+
+bytes_used()
+{
+	run_check_stdout $SUDO_HELPER "$TOP/btrfs" inspect-internal dump-super "$TEST_DEV" |
+		awk '/^bytes_used/ { print $2 }'
+}
+
+check_image()
+{
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+	run_check_mount_test_dev
+	run_check $SUDO_HELPER diff -r "$tmp/src" "$TEST_MNT"
+	run_check_umount_test_dev
+}
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" "$TEST_DEV"
+check_image
+used_plain=$(bytes_used)
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" --dedup "$TEST_DEV"
+check_image
+used_dedup=$(bytes_used)
+
+# Four copies of 4MiB without deduplication, one with it
+if [ $((used_plain - used_dedup)) -lt $((12 * 1024 * 1024)) ]; then
+	_fail "data not deduplicated, used ${used_dedup} without dedup ${used_plain}"
+fi
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" --dedup --compress zlib "$TEST_DEV"
+check_image
+
+# Index too small for all extents, the rest is written as usual
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" --dedup=256 "$TEST_DEV"
+check_image
+
+rm -rf -- "$tmp"
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Test "mkfs.btrfs --rootdir" with sparse and zero filled files, the holes and
+# zeroed blocks must not be stored, with and without the no-holes feature.
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir-sparse)
+
+run_check mkdir -p "$tmp/src"
+run_check truncate -s 512M "$tmp/src/sparse"
+run_check dd if=/dev/urandom of="$tmp/src/sparse" bs=4K count=3 seek=1000 conv=notrunc
+run_check dd if=/dev/urandom of="$tmp/src/sparse" bs=1 count=100 seek=$((512 * 1024 * 1024 - 50)) conv=notrunc
+run_check truncate -s 8M "$tmp/src/hole"
+run_check dd if=/dev/zero of="$tmp/src/zeros" bs=1M count=4
+# Zeroed sectors around data, not aligned to the sector size
+run_check dd if=/dev/urandom of="$tmp/src/mixed" bs=1 count=7000 seek=10000
+run_check dd if=/dev/zero of="$tmp/src/mixed" bs=1 count=9000 seek=17000 conv=notrunc
+
+check_image()
+{
+	local used
+
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+	used=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" inspect-internal dump-super "$TEST_DEV" |
+		awk '/^bytes_used/ { print $2 }')
+	if [ "$used" -gt $((8 * 1024 * 1024)) ]; then
+		_fail "holes or zeros stored, bytes used ${used}"
+	fi
+	run_check_mount_test_dev
+	run_check $SUDO_HELPER cmp "$tmp/src/sparse" "$TEST_MNT/sparse"
+	run_check $SUDO_HELPER cmp "$tmp/src/hole" "$TEST_MNT/hole"
+	run_check $SUDO_HELPER cmp "$tmp/src/zeros" "$TEST_MNT/zeros"
+	run_check $SUDO_HELPER cmp "$tmp/src/mixed" "$TEST_MNT/mixed"
+	run_check_umount_test_dev
+}
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" "$TEST_DEV"
+check_image
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f -O ^no-holes --rootdir "$tmp/src" "$TEST_DEV"
+check_image
+
+run_check $SUDO_HELPER "$TOP/mkfs.btrfs" -f --compress zlib --rootdir "$tmp/src" "$TEST_DEV"
+check_image
+
+rm -rf -- "$tmp"
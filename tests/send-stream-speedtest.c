@@ -0,0 +1,314 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Benchmark parsing of a recorded send stream
+ *
+ * Usage:
+ *
+ * $ ./send-stream-speedtest [-n iterations] <stream file>
+ *
+ * The stream (possibly several concatenated ones) is parsed the given number
+ * of times, once with callbacks that do nothing and once with the callbacks
+ * of 'btrfs receive --dump' printing to /dev/null.
+ */
+
+#include "kerncompat.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common/send-stream.h"
+#include "common/messages.h"
+#include "common/utils.h"
+#include "common/cpu-utils.h"
+#include "crypto/hash.h"
+#include "cmds/receive-dump.h"
+
+/* Results are printed here, stdout is redirected for the dump test */
+static FILE *report;
+static u64 nr_cmds;
+static u64 nr_data_bytes;
+/* Number of commands in the stream, counted by the first test */
+static u64 stream_cmds;
+
+static int null_subvol(const char *path, const u8 *uuid, u64 ctransid,
+		       void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			 const u8 *parent_uuid, u64 parent_ctransid,
+			 void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_path(const char *path, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_path2(const char *path, const char *path2, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_write(const char *path, const void *data, u64 offset, u64 len,
+		      void *user)
+{
+	nr_cmds++;
+	nr_data_bytes += len;
+	return 0;
+}
+
+static int null_clone(const char *path, u64 offset, u64 len,
+		      const u8 *clone_uuid, u64 clone_ctransid,
+		      const char *clone_path, u64 clone_offset, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_set_xattr(const char *path, const char *name, const void *data,
+			  int len, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_remove_xattr(const char *path, const char *name, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_path_u64(const char *path, u64 value, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_utimes(const char *path, struct timespec *at,
+		       struct timespec *mt, struct timespec *ct, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_update_extent(const char *path, u64 offset, u64 len,
+			      void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_encoded_write(const char *path, const void *data, u64 offset,
+			      u64 len, u64 unencoded_file_len,
+			      u64 unencoded_len, u64 unencoded_offset,
+			      u32 compression, u32 encryption, void *user)
+{
+	nr_cmds++;
+	nr_data_bytes += len;
+	return 0;
+}
+
+static int null_fallocate(const char *path, int mode, u64 offset, u64 len,
+			  void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int null_enable_verity(const char *path, u8 algorithm, u32 block_size,
+			      int salt_len, char *salt, int sig_len, char *sig,
+			      void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static struct btrfs_send_ops null_send_ops = {
+	.subvol = null_subvol,
+	.snapshot = null_snapshot,
+	.mkfile = null_path,
+	.mkdir = null_path,
+	.mknod = null_mknod,
+	.mkfifo = null_path,
+	.mksock = null_path,
+	.symlink = null_path2,
+	.rename = null_path2,
+	.link = null_path2,
+	.unlink = null_path,
+	.rmdir = null_path,
+	.write = null_write,
+	.clone = null_clone,
+	.set_xattr = null_set_xattr,
+	.remove_xattr = null_remove_xattr,
+	.truncate = null_path_u64,
+	.chmod = null_path_u64,
+	.chown = null_chown,
+	.utimes = null_utimes,
+	.update_extent = null_update_extent,
+	.encoded_write = null_encoded_write,
+	.fallocate = null_fallocate,
+	.fileattr = null_path_u64,
+	.enable_verity = null_enable_verity,
+};
+
+/* Process all streams in the file like receive does */
+static int parse_stream(const char *filename, struct btrfs_send_ops *ops,
+			void *user)
+{
+	struct btrfs_send_reader *reader;
+	int fd;
+	int ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		error("cannot open %s: %m", filename);
+		return -errno;
+	}
+	reader = btrfs_send_reader_alloc(fd);
+	if (!reader) {
+		ret = -errno;
+		error_mem("send stream reader");
+		goto out;
+	}
+	do {
+		ret = btrfs_read_and_process_send_stream(reader, ops, user, 0, 1);
+	} while (ret == 0);
+	if (ret == -ENODATA)
+		ret = 0;
+	btrfs_send_reader_free(reader);
+out:
+	close(fd);
+	return ret;
+}
+
+static int run_test(const char *name, const char *filename, int iterations,
+		    struct btrfs_send_ops *ops, void *user, u64 size)
+{
+	u64 start;
+	u64 elapsed;
+	int ret = 0;
+
+	start = get_monotonic_ns();
+	for (int iter = 0; iter < iterations && !ret; iter++)
+		ret = parse_stream(filename, ops, user);
+	elapsed = get_monotonic_ns() - start;
+	if (ret < 0)
+		return ret;
+
+	fprintf(report, "%-8s: %10.1f MiB/s", name,
+		(double)size * iterations / SZ_1M / (elapsed / 1000000000.0));
+	if (stream_cmds)
+		fprintf(report, " %8.1f ns/cmd",
+			(double)elapsed / iterations / stream_cmds);
+	fprintf(report, " %12.3f ms total\n", elapsed / 1000000.0);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct btrfs_dump_send_args dump_args = {
+		.root_path = ".",
+		.full_subvol_path = ".",
+	};
+	const char *filename;
+	struct stat st;
+	int iterations = 10;
+	int ret;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] <stream>\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || iterations < 1) {
+		fprintf(stderr, "usage: %s [-n iterations] <stream>\n", argv[0]);
+		return 1;
+	}
+	filename = argv[optind];
+	if (stat(filename, &st) < 0) {
+		error("cannot stat %s: %m", filename);
+		return 1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		error("not a regular file: %s", filename);
+		return 1;
+	}
+
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	if (!report) {
+		error("cannot duplicate stdout: %m");
+		return 1;
+	}
+	setvbuf(report, NULL, _IOLBF, 0);
+	cpu_detect_flags();
+	hash_init_accel();
+
+	ret = parse_stream(filename, &null_send_ops, NULL);
+	if (ret < 0)
+		goto out;
+	stream_cmds = nr_cmds;
+	fprintf(report, "stream: %llu bytes, %llu commands, %llu data bytes, iterations: %d\n",
+		(unsigned long long)st.st_size, nr_cmds, nr_data_bytes,
+		iterations);
+
+	ret = run_test("null", filename, iterations, &null_send_ops, NULL,
+		       st.st_size);
+	if (ret < 0)
+		goto out;
+
+	if (!freopen("/dev/null", "w", stdout)) {
+		error("cannot redirect output to /dev/null: %m");
+		ret = -errno;
+		goto out;
+	}
+	ret = run_test("dump", filename, iterations, &btrfs_print_send_ops,
+		       &dump_args, st.st_size);
+out:
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot parse %s: %m", filename);
+	}
+	return !!ret;
+}
@@ -0,0 +1,214 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Benchmark leaf validation by tree-checker on leaves of a real filesystem
+ *
+ * Usage:
+ *
+ * $ ./tree-checker-speedtest [-n iterations] <image or device>
+ *
+ * All leaves of all trees are read to memory first, then each is validated
+ * the given number of times, with and without the item data checks.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/tree-checker.h"
+#include "common/messages.h"
+#include "common/utils.h"
+
+static struct extent_buffer **leaves;
+static int nr_leaves;
+static u64 nr_items;
+
+static int add_leaf(struct extent_buffer *eb)
+{
+	struct extent_buffer **tmp;
+
+	tmp = realloc(leaves, (nr_leaves + 1) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	leaves = tmp;
+	extent_buffer_get(eb);
+	leaves[nr_leaves++] = eb;
+	nr_items += btrfs_header_nritems(eb);
+	return 0;
+}
+
+static int collect_leaves(struct extent_buffer *eb)
+{
+	const u32 nr = btrfs_header_nritems(eb);
+
+	if (btrfs_is_leaf(eb))
+		return add_leaf(eb);
+
+	for (int i = 0; i < nr; i++) {
+		struct btrfs_tree_parent_check check = {
+			.owner_root = btrfs_header_owner(eb),
+			.transid = btrfs_node_ptr_generation(eb, i),
+			.level = btrfs_header_level(eb) - 1,
+		};
+		struct extent_buffer *next;
+		int ret = 0;
+
+		next = read_tree_block(eb->fs_info, btrfs_node_blockptr(eb, i),
+				       &check);
+		if (extent_buffer_uptodate(next))
+			ret = collect_leaves(next);
+		free_extent_buffer(next);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int collect_all_leaves(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_root *tree_root = fs_info->tree_root;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	ret = collect_leaves(tree_root->node);
+	if (ret < 0)
+		return ret;
+	ret = collect_leaves(fs_info->chunk_root->node);
+	if (ret < 0)
+		return ret;
+
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		return ret;
+	while (1) {
+		struct btrfs_tree_parent_check check = { 0 };
+		struct btrfs_root_item ri;
+		struct extent_buffer *leaf = path.nodes[0];
+		struct extent_buffer *eb;
+		int slot = path.slots[0];
+
+		if (slot >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret != 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		path.slots[0]++;
+		if (key.type != BTRFS_ROOT_ITEM_KEY)
+			continue;
+
+		read_extent_buffer(leaf, &ri, btrfs_item_ptr_offset(leaf, slot),
+				   sizeof(ri));
+		check.owner_root = key.objectid;
+		eb = read_tree_block(fs_info, btrfs_root_bytenr(&ri), &check);
+		if (extent_buffer_uptodate(eb))
+			ret = collect_leaves(eb);
+		free_extent_buffer(eb);
+		if (ret < 0)
+			break;
+	}
+	btrfs_release_path(&path);
+	return ret < 0 ? ret : 0;
+}
+
+static void run_test(const char *name, int iterations, bool item_data)
+{
+	u64 start;
+	u64 elapsed;
+	int errors = 0;
+
+	for (int i = 0; i < nr_leaves; i++) {
+		if (item_data)
+			btrfs_set_header_flag(leaves[i], BTRFS_HEADER_FLAG_WRITTEN);
+		else
+			btrfs_clear_header_flag(leaves[i], BTRFS_HEADER_FLAG_WRITTEN);
+	}
+
+	start = get_monotonic_ns();
+	for (int iter = 0; iter < iterations; iter++)
+		for (int i = 0; i < nr_leaves; i++)
+			if (__btrfs_check_leaf(leaves[i]) != BTRFS_TREE_BLOCK_CLEAN)
+				errors++;
+	elapsed = get_monotonic_ns() - start;
+
+	printf("%-12s: %10.1f ns/leaf %8.2f ns/item %12.3f ms total",
+	       name, (double)elapsed / iterations / nr_leaves,
+	       (double)elapsed / iterations / nr_items, elapsed / 1000000.0);
+	if (errors)
+		printf(" (%d errors)", errors);
+	putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+	struct open_ctree_args oca = { 0 };
+	struct btrfs_fs_info *fs_info;
+	int iterations = 100;
+	int ret;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] <device>\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || iterations < 1) {
+		fprintf(stderr, "usage: %s [-n iterations] <device>\n", argv[0]);
+		return 1;
+	}
+
+	oca.filename = argv[optind];
+	oca.flags = OPEN_CTREE_PARTIAL | OPEN_CTREE_NO_BLOCK_GROUPS;
+	fs_info = open_ctree_fs_info(&oca);
+	if (!fs_info) {
+		error("cannot open %s", argv[optind]);
+		return 1;
+	}
+
+	ret = collect_all_leaves(fs_info);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read leaves: %m");
+		goto out;
+	}
+	printf("leaves: %d items: %llu iterations: %d\n", nr_leaves, nr_items,
+	       iterations);
+
+	run_test("structure", iterations, false);
+	run_test("full", iterations, true);
+
+out:
+	for (int i = 0; i < nr_leaves; i++)
+		free_extent_buffer(leaves[i]);
+	free(leaves);
+	close_ctree_fs_info(fs_info);
+	return !!ret;
+}